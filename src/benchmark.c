@@ -0,0 +1,717 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "benchmark.h"
+#include "bvh.h"
+#include "culling.h"
+#include "jobs.h"
+#include "light-grid.h"
+#include "maths.h"
+#include "scene-graph.h"
+
+#define CULL_BENCH_ITERATIONS 20
+#define CULL_BENCH_EXTENT 200.0f
+#define SCENE_BENCH_ITERATIONS 100
+#define SCENE_BENCH_GROUPS 100
+#define SCENE_BENCH_GROUP_SIZE 1000
+#define BVH_BENCH_RAYS 100000
+#define BVH_BENCH_CHECKED_RAYS 100
+#define BVH_BENCH_MOVED 1000
+#define JOB_BENCH_ITEMS (1 << 20)
+#define JOB_BENCH_ITERATIONS 10
+#define JOB_BENCH_SMALL_JOBS 65536
+#define JOB_BENCH_TREE_DEPTH 14
+#define LIGHT_BENCH_ITERATIONS 20
+#define LIGHT_BENCH_RADIUS 8.0f
+#define LIGHT_BENCH_SAMPLES 100000
+
+typedef struct _Benchmark {
+	const char *name;
+	int (*run)();
+} Benchmark;
+
+static double nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static uint32_t getCpuCount() {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? count : 1;
+}
+
+static float randomRange(float min, float max) {
+	return min + (max - min) * (rand() / (float) RAND_MAX);
+}
+
+typedef uint32_t (*CullFunction)(const Frustum* const,
+	const InstanceBounds* const, uint32_t, uint32_t, uint32_t*);
+
+static double timeCull(CullFunction function, const Frustum* const frustum,
+	const InstanceBounds* const bounds, uint32_t *visible,
+	uint32_t *visibleCount) {
+
+	double start = nowMs();
+	for (int i = 0; i < CULL_BENCH_ITERATIONS; ++i) {
+		*visibleCount = function(frustum, bounds, 0, bounds->count, visible);
+	}
+	return (nowMs() - start) / CULL_BENCH_ITERATIONS;
+}
+
+// Unit cubes scattered randomly over a cube of CULL_BENCH_EXTENT
+static int createRandomBounds(InstanceBounds *bounds, uint32_t count) {
+	InstanceData *instances = malloc(count * sizeof(InstanceData));
+	if (!instances) {
+		fprintf(stderr, "Failed to allocate benchmark instances.\n");
+		return 0;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		identityMatrix(instances[i].model);
+		translateMatrix(instances[i].model,
+			randomRange(-CULL_BENCH_EXTENT, CULL_BENCH_EXTENT),
+			randomRange(-CULL_BENCH_EXTENT, CULL_BENCH_EXTENT),
+			randomRange(-CULL_BENCH_EXTENT, CULL_BENCH_EXTENT));
+	}
+
+	const float center[] = { 0.0f, 0.0f, 0.0f };
+	int result = createInstanceBounds(bounds, instances, count, center, 0.87f);
+	free(instances);
+	return result;
+}
+
+// Camera at the origin looking into a field of randomly placed objects
+static void getBenchmarkCamera(float *view, float *proj) {
+	const float eye[] = { 0.0f, 0.0f, 0.0f };
+	eulerView(view, eye, 0.0f, 90.0f);
+	identityMatrix(proj);
+	perspectiveMatrix(proj, 45.0f, 4.0f / 3.0f, 0.1f, 1000.0f);
+}
+
+static void getBenchmarkFrustum(Frustum *frustum) {
+	float view[16], proj[16], viewProj[16];
+	getBenchmarkCamera(view, proj);
+	multMatrix(viewProj, view, proj);
+	extractFrustumPlanes(frustum, viewProj);
+}
+
+static int benchmarkCulling() {
+	const uint32_t counts[] = { 10000, 100000, 1000000 };
+	uint32_t cpuCount = getCpuCount();
+
+	Frustum frustum;
+	getBenchmarkFrustum(&frustum);
+	srand(1);
+	printf("Frustum culling, %d iterations, %u CPUs\n", CULL_BENCH_ITERATIONS,
+		cpuCount);
+	printf("%10s %10s %12s %12s %8s %12s\n", "instances", "visible",
+		"scalar ms", "simd ms", "threads", "parallel ms");
+
+	for (size_t c = 0; c < sizeof(counts) / sizeof(uint32_t); ++c) {
+		uint32_t count = counts[c];
+		uint32_t *visible = malloc(count * sizeof(uint32_t));
+		if (!visible) {
+			fprintf(stderr, "Failed to allocate visible instances.\n");
+			return 0;
+		}
+		InstanceBounds bounds;
+		if (!createRandomBounds(&bounds, count)) {
+			free(visible);
+			return 0;
+		}
+
+		uint32_t scalarVisible, simdVisible;
+		double scalarMs = timeCull(cullInstancesScalar, &frustum, &bounds,
+			visible, &scalarVisible);
+		double simdMs = timeCull(cullInstances, &frustum, &bounds, visible,
+			&simdVisible);
+		if (scalarVisible != simdVisible) {
+			fprintf(stderr, "SIMD and scalar results differ: %u != %u\n",
+				simdVisible, scalarVisible);
+			destroyInstanceBounds(&bounds);
+			free(visible);
+			return 0;
+		}
+
+		for (uint32_t threads = 1; threads <= cpuCount; threads *= 2) {
+			JobSystem jobSystem;
+			if (!createJobSystem(&jobSystem, threads - 1)) {
+				destroyInstanceBounds(&bounds);
+				free(visible);
+				return 0;
+			}
+			uint32_t parallelVisible = 0;
+			double start = nowMs();
+			for (int i = 0; i < CULL_BENCH_ITERATIONS; ++i) {
+				parallelVisible = cullInstancesParallel(&frustum, &bounds,
+					visible, &jobSystem);
+			}
+			double parallelMs = (nowMs() - start) / CULL_BENCH_ITERATIONS;
+			destroyJobSystem(&jobSystem);
+			if (parallelVisible != scalarVisible) {
+				fprintf(stderr, "Parallel and scalar results differ: %u != %u\n",
+					parallelVisible, scalarVisible);
+				destroyInstanceBounds(&bounds);
+				free(visible);
+				return 0;
+			}
+			if (threads == 1) {
+				printf("%10u %10u %12.4f %12.4f %8u %12.4f\n", count,
+					scalarVisible, scalarMs, simdMs, threads, parallelMs);
+			} else {
+				printf("%10s %10s %12s %12s %8u %12.4f\n", "", "", "", "",
+					threads, parallelMs);
+			}
+		}
+
+		destroyInstanceBounds(&bounds);
+		free(visible);
+	}
+	return 1;
+}
+
+// Updates a two-level hierarchy after moving a few leaves, a few groups
+// and the root
+static int benchmarkSceneGraph() {
+	const uint32_t movedCounts[] = { 1, 16, 256 };
+	uint32_t nodeCount = 1 + SCENE_BENCH_GROUPS * (1 + SCENE_BENCH_GROUP_SIZE);
+	SceneGraph scene;
+	if (!createSceneGraph(&scene, nodeCount)) {
+		return 0;
+	}
+
+	float local[16];
+	identityMatrix(local);
+	uint32_t root = addSceneNode(&scene, SCENE_NO_NODE, local);
+	for (uint32_t g = 0; g < SCENE_BENCH_GROUPS; ++g) {
+		identityMatrix(local);
+		translateMatrix(local, g * 10.0f, 0.0f, 0.0f);
+		uint32_t group = addSceneNode(&scene, root, local);
+		for (uint32_t i = 0; i < SCENE_BENCH_GROUP_SIZE; ++i) {
+			identityMatrix(local);
+			translateMatrix(local, 0.0f, i * 1.5f, 0.0f);
+			addSceneNode(&scene, group, local);
+		}
+	}
+	updateSceneGraph(&scene);
+
+	srand(1);
+	printf("Scene graph update, %u nodes, %d iterations\n", nodeCount,
+		SCENE_BENCH_ITERATIONS);
+	printf("%10s %10s %12s %12s\n", "moved", "kind", "changed", "update ms");
+	for (size_t m = 0; m < sizeof(movedCounts) / sizeof(uint32_t); ++m) {
+		for (int groups = 0; groups < 2; ++groups) {
+			uint32_t changed = 0;
+			double start = nowMs();
+			for (int i = 0; i < SCENE_BENCH_ITERATIONS; ++i) {
+				for (uint32_t j = 0; j < movedCounts[m]; ++j) {
+					uint32_t group = rand() % SCENE_BENCH_GROUPS;
+					uint32_t node = 1 + group * (1 + SCENE_BENCH_GROUP_SIZE);
+					if (!groups) {
+						node += 1 + rand() % SCENE_BENCH_GROUP_SIZE;
+					}
+					rotateSceneNode(&scene, node, 1.0f, 0.0f, 1.0f, 0.0f);
+				}
+				changed = updateSceneGraph(&scene);
+			}
+			printf("%10u %10s %12u %12.4f\n", movedCounts[m],
+				groups ? "groups" : "leaves", changed,
+				(nowMs() - start) / SCENE_BENCH_ITERATIONS);
+		}
+	}
+
+	double start = nowMs();
+	for (int i = 0; i < SCENE_BENCH_ITERATIONS; ++i) {
+		rotateSceneNode(&scene, root, 1.0f, 0.0f, 1.0f, 0.0f);
+		updateSceneGraph(&scene);
+	}
+	printf("%10u %10s %12u %12.4f\n", 1, "root", scene.changedCount,
+		(nowMs() - start) / SCENE_BENCH_ITERATIONS);
+
+	destroySceneGraph(&scene);
+	return 1;
+}
+
+static uint32_t intersectRayLinear(const InstanceBounds* const bounds,
+	const float* const direction) {
+
+	uint32_t hit = BVH_NO_HIT;
+	float closest = 1e30f;
+	for (uint32_t i = 0; i < bounds->count; ++i) {
+		float center[] = { bounds->centerX[i], bounds->centerY[i],
+			bounds->centerZ[i] };
+		float b = -(direction[0] * center[0] + direction[1] * center[1]
+			+ direction[2] * center[2]);
+		float c = center[0] * center[0] + center[1] * center[1]
+			+ center[2] * center[2] - bounds->radius[i] * bounds->radius[i];
+		float discriminant = b * b - c;
+		if (discriminant >= 0.0f) {
+			float t = -b - sqrtf(discriminant);
+			if (t < 0.0f) {
+				t = -b + sqrtf(discriminant);
+			}
+			if (t >= 0.0f && t < closest) {
+				closest = t;
+				hit = i;
+			}
+		}
+	}
+	return hit;
+}
+
+// Builds, queries and refits a BVH over the culling benchmark's field
+static int benchmarkBvh() {
+	const uint32_t counts[] = { 100000, 1000000 };
+	uint32_t cpuCount = getCpuCount();
+	Frustum frustum;
+	getBenchmarkFrustum(&frustum);
+	srand(1);
+	printf("BVH over random spheres, %u CPUs\n", cpuCount);
+
+	for (size_t c = 0; c < sizeof(counts) / sizeof(uint32_t); ++c) {
+		uint32_t count = counts[c];
+		uint32_t *results = malloc(count * sizeof(uint32_t));
+		float *directions = malloc(BVH_BENCH_RAYS * 3 * sizeof(float));
+		InstanceBounds bounds;
+		if (!results || !directions || !createRandomBounds(&bounds, count)) {
+			free(results);
+			free(directions);
+			return 0;
+		}
+
+		printf("%u instances\n%10s %12s %10s %10s\n", count, "threads",
+			"build ms", "nodes", "SAH cost");
+		Bvh bvh;
+		for (uint32_t threads = 1; threads <= cpuCount; threads *= 2) {
+			JobSystem buildJobs;
+			if (!createJobSystem(&buildJobs, threads - 1)) {
+				destroyInstanceBounds(&bounds);
+				free(results);
+				free(directions);
+				return 0;
+			}
+			double start = nowMs();
+			int built = createBvh(&bvh, bounds.centerX, bounds.centerY,
+				bounds.centerZ, bounds.radius, count, &buildJobs);
+			double buildMs = nowMs() - start;
+			if (built) {
+				printf("%10u %12.4f %10u %10.2f\n", threads, buildMs,
+					bvh.tree.nodeCount, bvh.tree.cost);
+				destroyBvh(&bvh);
+			}
+			destroyJobSystem(&buildJobs);
+			if (!built) {
+				destroyInstanceBounds(&bounds);
+				free(results);
+				free(directions);
+				return 0;
+			}
+		}
+
+		// Refits may start a rebuild, so this BVH keeps its job system
+		JobSystem jobSystem;
+		if (!createJobSystem(&jobSystem, cpuCount - 1)) {
+			destroyInstanceBounds(&bounds);
+			free(results);
+			free(directions);
+			return 0;
+		}
+		if (!createBvh(&bvh, bounds.centerX, bounds.centerY, bounds.centerZ,
+				bounds.radius, count, &jobSystem)) {
+			destroyJobSystem(&jobSystem);
+			destroyInstanceBounds(&bounds);
+			free(results);
+			free(directions);
+			return 0;
+		}
+		uint32_t linearVisible = 0, bvhVisible = 0;
+		double start = nowMs();
+		for (int i = 0; i < CULL_BENCH_ITERATIONS; ++i) {
+			linearVisible = cullInstancesParallel(&frustum, &bounds, results,
+				&jobSystem);
+		}
+		double linearMs = (nowMs() - start) / CULL_BENCH_ITERATIONS;
+		start = nowMs();
+		for (int i = 0; i < CULL_BENCH_ITERATIONS; ++i) {
+			bvhVisible = queryBvhFrustum(&bvh, frustum.planes[0], results);
+		}
+		double bvhMs = (nowMs() - start) / CULL_BENCH_ITERATIONS;
+		if (bvhVisible != linearVisible) {
+			fprintf(stderr, "BVH and linear culling differ: %u != %u\n",
+				bvhVisible, linearVisible);
+		}
+		uint32_t parallelVisible = 0;
+		start = nowMs();
+		for (int i = 0; i < CULL_BENCH_ITERATIONS; ++i) {
+			parallelVisible = queryBvhFrustumParallel(&bvh,
+				frustum.planes[0], results);
+		}
+		double parallelMs = (nowMs() - start) / CULL_BENCH_ITERATIONS;
+		if (parallelVisible != bvhVisible) {
+			fprintf(stderr, "Parallel and serial BVH culling differ: "
+				"%u != %u\n", parallelVisible, bvhVisible);
+		}
+		printf("Frustum: %u visible, linear %.4f ms, BVH %.4f ms, parallel "
+			"BVH %.4f ms\n", bvhVisible, linearMs, bvhMs, parallelMs);
+
+		// Rays from the center of the field, checked against a brute
+		// force search for the first few
+		for (uint32_t r = 0; r < BVH_BENCH_RAYS; ++r) {
+			float *direction = &directions[r * 3];
+			float length = 0.0f;
+			while (length < 1e-3f) {
+				for (int a = 0; a < 3; ++a) {
+					direction[a] = randomRange(-1.0f, 1.0f);
+				}
+				length = sqrtf(direction[0] * direction[0]
+					+ direction[1] * direction[1]
+					+ direction[2] * direction[2]);
+			}
+			for (int a = 0; a < 3; ++a) {
+				direction[a] /= length;
+			}
+		}
+		const float origin[] = { 0.0f, 0.0f, 0.0f };
+		uint32_t hits = 0;
+		start = nowMs();
+		for (uint32_t r = 0; r < BVH_BENCH_RAYS; ++r) {
+			float distance;
+			hits += intersectBvhRay(&bvh, origin, &directions[r * 3],
+				&distance) != BVH_NO_HIT;
+		}
+		double rayMs = nowMs() - start;
+		for (uint32_t r = 0; r < BVH_BENCH_CHECKED_RAYS; ++r) {
+			float distance;
+			uint32_t hit = intersectBvhRay(&bvh, origin, &directions[r * 3],
+				&distance);
+			uint32_t expected = intersectRayLinear(&bounds,
+				&directions[r * 3]);
+			if (hit != expected) {
+				fprintf(stderr, "BVH and linear ray hits differ: %u != %u\n",
+					hit, expected);
+			}
+		}
+		printf("Rays: %u of %d hit, %.4f us per ray\n", hits,
+			BVH_BENCH_RAYS, rayMs * 1000.0 / BVH_BENCH_RAYS);
+
+		// Nudge a few instances per frame and refit
+		uint32_t moved[BVH_BENCH_MOVED];
+		start = nowMs();
+		for (int i = 0; i < CULL_BENCH_ITERATIONS; ++i) {
+			for (uint32_t m = 0; m < BVH_BENCH_MOVED; ++m) {
+				moved[m] = rand() % count;
+				bounds.centerX[moved[m]] += randomRange(-1.0f, 1.0f);
+				bounds.centerY[moved[m]] += randomRange(-1.0f, 1.0f);
+			}
+			refitBvh(&bvh, moved, BVH_BENCH_MOVED);
+		}
+		printf("Refit: %u moved, %.4f ms\n", BVH_BENCH_MOVED,
+			(nowMs() - start) / CULL_BENCH_ITERATIONS);
+
+		destroyBvh(&bvh);
+		destroyJobSystem(&jobSystem);
+		destroyInstanceBounds(&bounds);
+		free(results);
+		free(directions);
+	}
+	return 1;
+}
+
+typedef struct _JobBench {
+	float *results;
+	uint32_t *visits;
+	int unbalanced;
+} JobBench;
+
+// Spawns two subtrees and waits for them, the way a job depends on the
+// jobs it submits. Leaves count themselves.
+typedef struct _JobTreeNode {
+	JobSystem *jobSystem;
+	atomic_uint *leafCount;
+	uint32_t depth;
+} JobTreeNode;
+
+static float jobBenchWork(uint32_t i, uint32_t steps) {
+	float x = i;
+	for (uint32_t k = 0; k < steps; ++k) {
+		x = sqrtf(x + k);
+	}
+	return x;
+}
+
+// Unbalanced items cost more the later they are, so even splits leave the
+// first workers idle unless they steal
+static void jobBenchFor(void *data, uint32_t first, uint32_t count) {
+	JobBench *bench = data;
+	for (uint32_t i = first; i < first + count; ++i) {
+		uint32_t steps = bench->unbalanced ? 1 + i * 32 / JOB_BENCH_ITEMS : 8;
+		bench->results[i] = jobBenchWork(i, steps);
+		++bench->visits[i];
+	}
+}
+
+static void countJob(void *data) {
+	atomic_fetch_add_explicit((atomic_uint*) data, 1, memory_order_relaxed);
+}
+
+static void jobTree(void *data) {
+	JobTreeNode *node = data;
+	if (!node->depth) {
+		atomic_fetch_add(node->leafCount, 1);
+		return;
+	}
+	JobTreeNode children[2];
+	Job jobs[2];
+	JobCounter counter = { 0 };
+	for (int i = 0; i < 2; ++i) {
+		children[i] = (JobTreeNode) { node->jobSystem, node->leafCount,
+			node->depth - 1 };
+		jobs[i] = (Job) { jobTree, &children[i], &counter };
+	}
+	submitJobs(node->jobSystem, jobs, 2);
+	waitForJobs(node->jobSystem, &counter);
+}
+
+// Checks each item ran exactly once and computed what a serial loop does
+static int checkJobBench(const JobBench* const bench, const char* const name) {
+	for (uint32_t i = 0; i < JOB_BENCH_ITEMS; ++i) {
+		uint32_t steps = bench->unbalanced ? 1 + i * 32 / JOB_BENCH_ITEMS : 8;
+		if (bench->visits[i] != JOB_BENCH_ITERATIONS
+			|| bench->results[i] != jobBenchWork(i, steps)) {
+			fprintf(stderr, "%s parallel for failed at item %u.\n", name, i);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int runJobBench(JobSystem *jobSystem, JobBench *bench,
+	const char* const name, double *ms) {
+
+	memset(bench->visits, 0, JOB_BENCH_ITEMS * sizeof(uint32_t));
+	double start = nowMs();
+	for (int i = 0; i < JOB_BENCH_ITERATIONS; ++i) {
+		parallelFor(jobSystem, JOB_BENCH_ITEMS, 1024, jobBenchFor, bench);
+	}
+	*ms = (nowMs() - start) / JOB_BENCH_ITERATIONS;
+	return checkJobBench(bench, name);
+}
+
+// Times parallel fors with even and uneven items, many tiny jobs, and a
+// tree of nested jobs, checking the results of each
+static int benchmarkJobs() {
+	uint32_t cpuCount = getCpuCount();
+	JobBench bench = { malloc(JOB_BENCH_ITEMS * sizeof(float)),
+		malloc(JOB_BENCH_ITEMS * sizeof(uint32_t)), 0 };
+	Job *smallJobs = malloc(JOB_BENCH_SMALL_JOBS * sizeof(Job));
+	if (!bench.results || !bench.visits || !smallJobs) {
+		fprintf(stderr, "Failed to allocate job benchmark.\n");
+		free(bench.results);
+		free(bench.visits);
+		free(smallJobs);
+		return 0;
+	}
+
+	printf("Job system, %u items, %d iterations, %u CPUs\n", JOB_BENCH_ITEMS,
+		JOB_BENCH_ITERATIONS, cpuCount);
+	printf("%8s %12s %12s %12s %12s\n", "threads", "for ms", "uneven ms",
+		"us per job", "tree ms");
+	int success = 1;
+	for (uint32_t threads = 1; threads <= cpuCount && success; threads *= 2) {
+		JobSystem jobSystem;
+		if (!createJobSystem(&jobSystem, threads - 1)) {
+			success = 0;
+			break;
+		}
+
+		double forMs, unevenMs;
+		bench.unbalanced = 0;
+		success = runJobBench(&jobSystem, &bench, "Even", &forMs);
+		bench.unbalanced = 1;
+		success = success
+			&& runJobBench(&jobSystem, &bench, "Uneven", &unevenMs);
+
+		atomic_uint count = 0;
+		JobCounter counter = { 0 };
+		for (uint32_t i = 0; i < JOB_BENCH_SMALL_JOBS; ++i) {
+			smallJobs[i] = (Job) { countJob, &count, &counter };
+		}
+		double start = nowMs();
+		submitJobs(&jobSystem, smallJobs, JOB_BENCH_SMALL_JOBS);
+		waitForJobs(&jobSystem, &counter);
+		double jobUs = (nowMs() - start) * 1000.0 / JOB_BENCH_SMALL_JOBS;
+		if (atomic_load(&count) != JOB_BENCH_SMALL_JOBS) {
+			fprintf(stderr, "Ran %u of %d small jobs.\n", atomic_load(&count),
+				JOB_BENCH_SMALL_JOBS);
+			success = 0;
+		}
+
+		atomic_uint leafCount = 0;
+		JobTreeNode root = { &jobSystem, &leafCount, JOB_BENCH_TREE_DEPTH };
+		Job rootJob = { jobTree, &root, &counter };
+		start = nowMs();
+		submitJobs(&jobSystem, &rootJob, 1);
+		waitForJobs(&jobSystem, &counter);
+		double treeMs = nowMs() - start;
+		if (atomic_load(&leafCount) != 1u << JOB_BENCH_TREE_DEPTH) {
+			fprintf(stderr, "Ran %u of %u leaf jobs.\n",
+				atomic_load(&leafCount), 1u << JOB_BENCH_TREE_DEPTH);
+			success = 0;
+		}
+
+		destroyJobSystem(&jobSystem);
+		printf("%8u %12.4f %12.4f %12.4f %12.4f\n", threads, forMs, unevenMs,
+			jobUs, treeMs);
+	}
+
+	free(bench.results);
+	free(bench.visits);
+	free(smallJobs);
+	return success;
+}
+
+// Checks that random points in the view frustum find every light covering
+// them in their cluster, computing the cluster the way shader.frag does.
+// Returns the average number of lights listed per point, or -1 if a light
+// is missing.
+static double checkLightGrid(const LightGrid* const grid, uint32_t lightCount,
+	const float* const proj) {
+
+	float scale[4];
+	uint32_t counts[4];
+	getLightGridParams(scale, counts, 2.0f, 2.0f);
+	uint64_t listed = 0;
+	for (uint32_t s = 0; s < LIGHT_BENCH_SAMPLES; ++s) {
+		// Pixel coordinates of a 2x2 viewport, flipped like NDC y is
+		float pixel[2] = { randomRange(0.0f, 1.999f),
+			randomRange(0.0f, 1.999f) };
+		float depth = randomRange(0.1f, CULL_BENCH_EXTENT);
+		float x = (pixel[0] - 1.0f) * depth / proj[0];
+		float y = (pixel[1] - 1.0f) * depth / proj[5];
+		uint32_t slice = MIN((uint32_t) MAX(floorf(logf(depth) * scale[2]
+			+ scale[3]), 0.0f), counts[2] - 1);
+		uint32_t cluster = (slice * counts[1] + (uint32_t) (pixel[1]
+			* scale[1])) * counts[0] + (uint32_t) (pixel[0] * scale[0]);
+		const uint32_t* const list = &grid->indices[grid->clusters[cluster][0]];
+		uint32_t listCount = grid->clusters[cluster][1];
+		listed += listCount;
+
+		for (uint32_t i = 0; i < lightCount; ++i) {
+			float dx = grid->viewX[i] - x, dy = grid->viewY[i] - y;
+			float dz = grid->depth[i] - depth;
+			if (dx * dx + dy * dy + dz * dz > grid->radiusSquared[i]) {
+				continue;
+			}
+			uint32_t j = 0;
+			while (j < listCount && list[j] != i) {
+				++j;
+			}
+			if (j == listCount) {
+				fprintf(stderr, "Light %u missing from cluster %u.\n", i,
+					cluster);
+				return -1.0;
+			}
+		}
+	}
+	return listed / (double) LIGHT_BENCH_SAMPLES;
+}
+
+// Point lights scattered over the benchmark field. Shading a pixel costs
+// the lights listed in its cluster, rather than every light.
+static int benchmarkLights() {
+	const uint32_t counts[] = { 64, 256, 1024, 4096 };
+	uint32_t cpuCount = getCpuCount();
+	float view[16], proj[16];
+	getBenchmarkCamera(view, proj);
+	JobSystem jobSystem;
+	PointLight *lights = malloc(counts[3] * sizeof(PointLight));
+	LightGrid grid;
+	if (!lights || !createJobSystem(&jobSystem, cpuCount - 1)) {
+		fprintf(stderr, "Failed to allocate benchmark lights.\n");
+		free(lights);
+		return 0;
+	}
+	if (!createLightGrid(&grid, counts[3])) {
+		free(lights);
+		destroyJobSystem(&jobSystem);
+		return 0;
+	}
+
+	srand(1);
+	printf("Light grid, %ux%ux%u clusters, %d iterations, %u CPUs\n",
+		LIGHT_GRID_X, LIGHT_GRID_Y, LIGHT_GRID_Z, LIGHT_BENCH_ITERATIONS,
+		cpuCount);
+	printf("%10s %12s %12s %12s\n", "lights", "build ms", "entries",
+		"per pixel");
+	int success = 1;
+	for (size_t c = 0; c < sizeof(counts) / sizeof(uint32_t) && success;
+		 ++c) {
+		for (uint32_t i = 0; i < counts[c]; ++i) {
+			lights[i] = (PointLight) {
+				{ randomRange(-CULL_BENCH_EXTENT, CULL_BENCH_EXTENT),
+				  randomRange(-CULL_BENCH_EXTENT, CULL_BENCH_EXTENT),
+				  randomRange(-CULL_BENCH_EXTENT, CULL_BENCH_EXTENT) },
+				LIGHT_BENCH_RADIUS, { 1.0f, 1.0f, 1.0f, 1.0f } };
+		}
+		double start = nowMs();
+		for (int i = 0; i < LIGHT_BENCH_ITERATIONS; ++i) {
+			buildLightGrid(&grid, lights, counts[c], view, proj, &jobSystem);
+		}
+		double buildMs = (nowMs() - start) / LIGHT_BENCH_ITERATIONS;
+		double perPixel = checkLightGrid(&grid, counts[c], proj);
+		success = perPixel >= 0.0;
+		printf("%10u %12.4f %12u %12.2f\n", counts[c], buildMs,
+			grid.indexCount, perPixel);
+	}
+
+	destroyLightGrid(&grid);
+	destroyJobSystem(&jobSystem);
+	free(lights);
+	return success;
+}
+
+static const Benchmark BENCHMARKS[] = {
+	{ "culling", benchmarkCulling },
+	{ "scene", benchmarkSceneGraph },
+	{ "bvh", benchmarkBvh },
+	{ "jobs", benchmarkJobs },
+	{ "lights", benchmarkLights }
+};
+
+int runBenchmark(const char* const name) {
+	size_t count = sizeof(BENCHMARKS) / sizeof(Benchmark);
+	for (size_t i = 0; i < count; ++i) {
+		if (!strcmp(BENCHMARKS[i].name, name)) {
+			return BENCHMARKS[i].run();
+		}
+	}
+
+	fprintf(stderr, "Unknown benchmark: %s\nAvailable benchmarks:", name);
+	for (size_t i = 0; i < count; ++i) {
+		fprintf(stderr, " %s", BENCHMARKS[i].name);
+	}
+	fprintf(stderr, "\n");
+	return 0;
+}
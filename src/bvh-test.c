@@ -0,0 +1,190 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bvh.h"
+
+// Worker counts each check runs with, 0 leaving the rebuild to updateBvh()
+static const uint32_t workerCounts[] = { 0, 1, 3 };
+
+#define SPHERE_COUNT 4096
+#define REBUILD_TIMEOUT_S 10
+
+typedef struct _Spheres {
+	float centerX[SPHERE_COUNT], centerY[SPHERE_COUNT],
+		centerZ[SPHERE_COUNT], radius[SPHERE_COUNT];
+} Spheres;
+
+// Small spheres on a 16 x 16 x 16 grid
+static void placeOnGrid(Spheres *spheres) {
+	for (uint32_t i = 0; i < SPHERE_COUNT; ++i) {
+		spheres->centerX[i] = i % 16;
+		spheres->centerY[i] = i / 16 % 16;
+		spheres->centerZ[i] = i / 256;
+		spheres->radius[i] = 0.25f;
+	}
+}
+
+// Swaps sphere positions across the grid, so every leaf ends up spanning
+// most of it
+static void scramble(Spheres *spheres, uint32_t *changed) {
+	srand(1);
+	for (uint32_t i = 0; i < SPHERE_COUNT; ++i) {
+		uint32_t j = rand() % SPHERE_COUNT;
+		float x = spheres->centerX[i], y = spheres->centerY[i],
+			z = spheres->centerZ[i];
+		spheres->centerX[i] = spheres->centerX[j];
+		spheres->centerY[i] = spheres->centerY[j];
+		spheres->centerZ[i] = spheres->centerZ[j];
+		spheres->centerX[j] = x;
+		spheres->centerY[j] = y;
+		spheres->centerZ[j] = z;
+		changed[i] = i;
+	}
+}
+
+// A small box around each sphere's center must find it, and only it
+static int checkQueries(const Bvh* const bvh, const Spheres* const spheres) {
+	uint32_t results[SPHERE_COUNT];
+	for (uint32_t i = 0; i < SPHERE_COUNT; i += 97) {
+		float x = spheres->centerX[i], y = spheres->centerY[i],
+			z = spheres->centerZ[i];
+		float planes[24] = {
+			1.0f, 0.0f, 0.0f, 0.1f - x, -1.0f, 0.0f, 0.0f, x + 0.1f,
+			0.0f, 1.0f, 0.0f, 0.1f - y, 0.0f, -1.0f, 0.0f, y + 0.1f,
+			0.0f, 0.0f, 1.0f, 0.1f - z, 0.0f, 0.0f, -1.0f, z + 0.1f
+		};
+		uint32_t count = queryBvhFrustum(bvh, planes, results);
+		if (count != 1 || results[0] != i) {
+			fprintf(stderr, "Box query around %u found %u spheres.\n", i,
+				count);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int testRebuild(JobSystem *jobSystem, Spheres *spheres) {
+	placeOnGrid(spheres);
+	Bvh bvh;
+	if (!createBvh(&bvh, spheres->centerX, spheres->centerY,
+			spheres->centerZ, spheres->radius, SPHERE_COUNT, jobSystem)) {
+		return 0;
+	}
+	float builtCost = bvh.builtCost;
+
+	uint32_t changed[SPHERE_COUNT];
+	scramble(spheres, changed);
+	refitBvh(&bvh, changed, SPHERE_COUNT);
+	int success = checkQueries(&bvh, spheres);
+	if (!bvh.rebuilding) {
+		fprintf(stderr, "Cost rose from %f to %f without a rebuild.\n",
+			builtCost, bvh.tree.cost);
+		success = 0;
+	}
+
+	// Without workers the first update must finish it
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	updateBvh(&bvh);
+	while (bvh.rebuilding && getJobThreadCount(jobSystem) > 1) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - start.tv_sec > REBUILD_TIMEOUT_S) {
+			break;
+		}
+		sched_yield();
+		updateBvh(&bvh);
+	}
+	if (bvh.rebuilding) {
+		fprintf(stderr, "Rebuild did not finish with %u workers.\n",
+			getJobThreadCount(jobSystem) - 1);
+		success = 0;
+	} else if (bvh.tree.cost > builtCost * BVH_REBUILD_RATIO) {
+		fprintf(stderr, "Rebuilt tree costs %f against %f built.\n",
+			bvh.tree.cost, builtCost);
+		success = 0;
+	}
+	success = success && checkQueries(&bvh, spheres);
+	destroyBvh(&bvh);
+	return success;
+}
+
+// Boxes of the grid, some with a slanted plane, must come out of the
+// parallel query exactly as they do from the serial one
+static int testParallelFrustum(JobSystem *jobSystem, Spheres *spheres) {
+	placeOnGrid(spheres);
+	Bvh bvh;
+	if (!createBvh(&bvh, spheres->centerX, spheres->centerY,
+			spheres->centerZ, spheres->radius, SPHERE_COUNT, jobSystem)) {
+		return 0;
+	}
+	static uint32_t expected[SPHERE_COUNT], results[SPHERE_COUNT];
+	int success = 1;
+	for (uint32_t f = 0; f < 16 && success; ++f) {
+		float low = f % 4 * 2.0f, high = 16.0f - f / 4 * 3.0f;
+		float slant = f % 3 ? 0.0f : 1.0f;
+		float planes[24] = {
+			1.0f, 0.0f, 0.0f, -low, -1.0f, 0.0f, 0.0f, high,
+			0.0f, 1.0f, slant, -low, 0.0f, -1.0f, 0.0f, high,
+			0.0f, 0.0f, 1.0f, -low, 0.0f, 0.0f, -1.0f, high
+		};
+		uint32_t expectedCount = queryBvhFrustum(&bvh, planes, expected);
+		uint32_t count = queryBvhFrustumParallel(&bvh, planes, results);
+		success = count == expectedCount;
+		for (uint32_t i = 0; i < count && success; ++i) {
+			success = results[i] == expected[i];
+		}
+		if (!success) {
+			fprintf(stderr, "Parallel frustum query %u found %u spheres "
+				"against %u.\n", f, count, expectedCount);
+		}
+	}
+	destroyBvh(&bvh);
+	return success;
+}
+
+int main(void) {
+	Spheres *spheres = malloc(sizeof(Spheres));
+	if (!spheres) {
+		fprintf(stderr, "Failed to allocate test spheres.\n");
+		return 1;
+	}
+	int success = 1;
+	for (uint32_t w = 0; w < sizeof(workerCounts) / sizeof(workerCounts[0]);
+		++w) {
+		JobSystem jobSystem;
+		if (!createJobSystem(&jobSystem, workerCounts[w])) {
+			fprintf(stderr, "Failed to create a job system with %u workers.\n",
+				workerCounts[w]);
+			free(spheres);
+			return 1;
+		}
+		int passed = testRebuild(&jobSystem, spheres)
+			&& testParallelFrustum(&jobSystem, spheres);
+		destroyJobSystem(&jobSystem);
+		printf("%s with %u workers\n", passed ? "PASS" : "FAIL",
+			workerCounts[w]);
+		success = success && passed;
+	}
+	free(spheres);
+	return success ? 0 : 1;
+}
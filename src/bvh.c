@@ -0,0 +1,821 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bvh.h"
+#include "maths.h"
+
+typedef struct _BvhSpheres {
+	const float *centerX, *centerY, *centerZ, *radius;
+} BvhSpheres;
+
+// Builds partition copies of the spheres rather than indices, so the
+// passes over a range read contiguous memory
+typedef struct _BvhRef {
+	float center[3], radius;
+	uint32_t index;
+} BvhRef;
+
+typedef struct _BvhBin {
+	float min[3], max[3];
+	uint32_t count;
+} BvhBin;
+
+// Subtree deferred by the top of a parallel build. Its nodes are built
+// into a private array and appended to the tree afterwards, with the
+// subtree root replacing the placeholder node.
+typedef struct _BvhJob {
+	BvhRef *refs;
+	uint32_t placeholder, first, count, depth;
+	BvhNode *nodes;
+	uint32_t nodeCount;
+} BvhJob;
+
+typedef struct _BvhFrustumQuery {
+	const Bvh *bvh;
+	const float *planes;
+	const uint32_t *subtrees;
+	uint32_t *results, *counts;
+} BvhFrustumQuery;
+
+typedef struct _BvhBuilder {
+	BvhRef *refs;
+	BvhNode *nodes;
+	uint32_t nodeCount;
+
+	// Ranges of at most jobSize primitives are deferred as jobs when set
+	uint32_t jobSize;
+	BvhJob *jobs;
+	uint32_t jobCount, jobCapacity;
+	int failed;
+} BvhBuilder;
+
+static void resetBounds(float *min, float *max) {
+	for (int c = 0; c < 3; ++c) {
+		min[c] = FLT_MAX;
+		max[c] = -FLT_MAX;
+	}
+}
+
+static void growBounds(float *min, float *max, const float* const otherMin,
+	const float* const otherMax) {
+
+	for (int c = 0; c < 3; ++c) {
+		min[c] = MIN(min[c], otherMin[c]);
+		max[c] = MAX(max[c], otherMax[c]);
+	}
+}
+
+static void growSphereBounds(float *min, float *max,
+	const float* const center, float radius) {
+
+	for (int c = 0; c < 3; ++c) {
+		min[c] = MIN(min[c], center[c] - radius);
+		max[c] = MAX(max[c], center[c] + radius);
+	}
+}
+
+static float getHalfArea(const float* const min, const float* const max) {
+	float x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+	if (x < 0.0f || y < 0.0f || z < 0.0f) {
+		return 0.0f;
+	}
+	return x * y + y * z + z * x;
+}
+
+static void computeLeafBounds(BvhNode *node, const uint32_t* const primitives,
+	const BvhSpheres* const spheres) {
+
+	resetBounds(node->min, node->max);
+	for (uint32_t i = node->first; i < node->first + node->count; ++i) {
+		uint32_t p = primitives[i];
+		float center[3] = { spheres->centerX[p], spheres->centerY[p],
+			spheres->centerZ[p] };
+		growSphereBounds(node->min, node->max, center, spheres->radius[p]);
+	}
+}
+
+// Picks the cheapest of the binned SAH splits along the three axes.
+// Returns 0 if keeping the range as a leaf is cheaper.
+static int findSplit(const BvhRef* const refs, const BvhNode* const node,
+	const float* const centroidMin, const float* const centroidMax,
+	int *splitAxis, float *splitPosition) {
+
+	// Small ranges get fewer bins, as clearing and sweeping them would
+	// dominate the build near the leaves
+	int binCount = MIN(node->count, BVH_BIN_COUNT);
+	BvhBin bins[3][BVH_BIN_COUNT];
+	float scales[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		float extent = centroidMax[axis] - centroidMin[axis];
+		scales[axis] = extent > 0.0f ? binCount / extent : 0.0f;
+		for (int b = 0; b < binCount; ++b) {
+			resetBounds(bins[axis][b].min, bins[axis][b].max);
+			bins[axis][b].count = 0;
+		}
+	}
+	for (uint32_t i = node->first; i < node->first + node->count; ++i) {
+		const BvhRef* const ref = &refs[i];
+		for (int axis = 0; axis < 3; ++axis) {
+			int b = MIN((int) ((ref->center[axis] - centroidMin[axis])
+				* scales[axis]), binCount - 1);
+			growSphereBounds(bins[axis][b].min, bins[axis][b].max,
+				ref->center, ref->radius);
+			++bins[axis][b].count;
+		}
+	}
+
+	float nodeArea = getHalfArea(node->min, node->max);
+	float bestCost = node->count * BVH_INTERSECTION_COST;
+	int found = 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		if (scales[axis] == 0.0f) {
+			continue;
+		}
+
+		// Sweep from the right to get the cost of each right side, then
+		// from the left to combine it with the left side
+		float rightAreas[BVH_BIN_COUNT];
+		uint32_t rightCounts[BVH_BIN_COUNT];
+		float min[3], max[3];
+		resetBounds(min, max);
+		uint32_t count = 0;
+		for (int b = binCount - 1; b > 0; --b) {
+			growBounds(min, max, bins[axis][b].min, bins[axis][b].max);
+			count += bins[axis][b].count;
+			rightAreas[b] = getHalfArea(min, max);
+			rightCounts[b] = count;
+		}
+		resetBounds(min, max);
+		count = 0;
+		for (int b = 0; b < binCount - 1; ++b) {
+			growBounds(min, max, bins[axis][b].min, bins[axis][b].max);
+			count += bins[axis][b].count;
+			if (!count || !rightCounts[b + 1]) {
+				continue;
+			}
+			float cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST
+				* (getHalfArea(min, max) * count + rightAreas[b + 1]
+					* rightCounts[b + 1]) / nodeArea;
+			if (cost < bestCost) {
+				bestCost = cost;
+				*splitAxis = axis;
+				*splitPosition = centroidMin[axis] + (b + 1) / scales[axis];
+				found = 1;
+			}
+		}
+	}
+	return found;
+}
+
+// Splits the range in place and returns the size of the left part, or 0
+// to make the node a leaf
+static uint32_t partitionRefs(BvhRef *refs, const BvhNode* const node,
+	const float* const centroidMin, const float* const centroidMax) {
+
+	int axis = 0;
+	float position = 0.0f;
+	if (node->count <= 1 || !findSplit(refs, node, centroidMin, centroidMax,
+			&axis, &position)) {
+		// Large ranges of coincident spheres are halved instead
+		return node->count > BVH_MAX_LEAF_SIZE ? node->count / 2 : 0;
+	}
+
+	uint32_t left = node->first, right = node->first + node->count;
+	while (left < right) {
+		if (refs[left].center[axis] < position) {
+			++left;
+		} else {
+			BvhRef swap = refs[left];
+			refs[left] = refs[--right];
+			refs[right] = swap;
+		}
+	}
+	return left - node->first;
+}
+
+static void buildNode(BvhBuilder *builder, uint32_t index, uint32_t depth) {
+	BvhNode *node = &builder->nodes[index];
+	float centroidMin[3], centroidMax[3];
+	resetBounds(node->min, node->max);
+	resetBounds(centroidMin, centroidMax);
+	for (uint32_t i = node->first; i < node->first + node->count; ++i) {
+		const BvhRef* const ref = &builder->refs[i];
+		growSphereBounds(node->min, node->max, ref->center, ref->radius);
+		growBounds(centroidMin, centroidMax, ref->center, ref->center);
+	}
+	if (depth >= BVH_MAX_DEPTH) {
+		return;
+	}
+
+	if (builder->jobSize && node->count <= builder->jobSize) {
+		if (builder->jobCount == builder->jobCapacity) {
+			uint32_t capacity = MAX(builder->jobCapacity * 2, 16);
+			BvhJob *jobs = realloc(builder->jobs, capacity * sizeof(BvhJob));
+			if (!jobs) {
+				builder->failed = 1;
+				return;
+			}
+			builder->jobs = jobs;
+			builder->jobCapacity = capacity;
+		}
+		builder->jobs[builder->jobCount++] = (BvhJob) { builder->refs,
+			index, node->first, node->count, depth, NULL, 0 };
+		return;
+	}
+
+	uint32_t leftCount = partitionRefs(builder->refs, node, centroidMin,
+		centroidMax);
+	if (!leftCount || leftCount == node->count) {
+		return;
+	}
+
+	uint32_t left = builder->nodeCount;
+	builder->nodeCount += 2;
+	builder->nodes[left] = (BvhNode) { .first = node->first,
+		.count = leftCount };
+	builder->nodes[left + 1] = (BvhNode) { .first = node->first + leftCount,
+		.count = node->count - leftCount };
+	node->first = left;
+	node->count = 0;
+
+	buildNode(builder, left, depth + 1);
+	buildNode(builder, left + 1, depth + 1);
+}
+
+static void buildSubtrees(void *data, uint32_t first, uint32_t count) {
+	BvhJob *jobs = data;
+	for (uint32_t j = first; j < first + count; ++j) {
+		BvhJob *job = &jobs[j];
+		job->nodes = malloc((2 * job->count - 1) * sizeof(BvhNode));
+		if (!job->nodes) {
+			continue;
+		}
+		BvhBuilder builder = { job->refs, job->nodes, 1, 0, NULL, 0, 0, 0 };
+		job->nodes[0] = (BvhNode) { .first = job->first,
+			.count = job->count };
+		buildNode(&builder, 0, job->depth);
+		job->nodeCount = builder.nodeCount;
+	}
+}
+
+// Builds the deferred subtrees on the job system, one per batch at most,
+// and appends them
+static int runBuildJobs(BvhBuilder *builder, JobSystem *jobSystem) {
+	parallelFor(jobSystem, builder->jobCount, 1, buildSubtrees,
+		builder->jobs);
+
+	int result = 1;
+	for (uint32_t j = 0; j < builder->jobCount; ++j) {
+		BvhJob *job = &builder->jobs[j];
+		if (!job->nodes) {
+			result = 0;
+			continue;
+		}
+
+		// Local node k > 0 lands at base + k - 1
+		uint32_t base = builder->nodeCount;
+		for (uint32_t k = 0; k < job->nodeCount; ++k) {
+			BvhNode node = job->nodes[k];
+			if (!node.count) {
+				node.first += base - 1;
+			}
+			builder->nodes[k ? base + k - 1 : job->placeholder] = node;
+		}
+		builder->nodeCount += job->nodeCount - 1;
+		free(job->nodes);
+	}
+	return result;
+}
+
+static void freeBvhTree(BvhTree *tree) {
+	free(tree->nodes);
+	free(tree->primitives);
+	free(tree->parents);
+	free(tree->leaves);
+	memset(tree, 0, sizeof(BvhTree));
+}
+
+static float computeTreeCost(const BvhTree* const tree) {
+	float rootArea = getHalfArea(tree->nodes[0].min, tree->nodes[0].max);
+	if (rootArea <= 0.0f) {
+		return 0.0f;
+	}
+	float cost = 0.0f;
+	for (uint32_t i = 0; i < tree->nodeCount; ++i) {
+		const BvhNode* const node = &tree->nodes[i];
+		cost += getHalfArea(node->min, node->max) * (node->count
+			? node->count * BVH_INTERSECTION_COST : BVH_TRAVERSAL_COST);
+	}
+	return cost / rootArea;
+}
+
+static int buildBvhTree(BvhTree *tree, const BvhSpheres* const spheres,
+	uint32_t count, JobSystem *jobSystem) {
+
+	memset(tree, 0, sizeof(BvhTree));
+	tree->nodes = malloc((2 * count - 1) * sizeof(BvhNode));
+	tree->primitives = malloc(count * sizeof(uint32_t));
+	tree->parents = malloc((2 * count - 1) * sizeof(uint32_t));
+	tree->leaves = malloc(count * sizeof(uint32_t));
+	BvhRef *refs = malloc(count * sizeof(BvhRef));
+	if (!tree->nodes || !tree->primitives || !tree->parents
+		|| !tree->leaves || !refs) {
+
+		fprintf(stderr, "Failed to allocate BVH of %u primitives.\n", count);
+		free(refs);
+		freeBvhTree(tree);
+		return 0;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		refs[i] = (BvhRef) { { spheres->centerX[i], spheres->centerY[i],
+			spheres->centerZ[i] }, spheres->radius[i], i };
+	}
+
+	// Parallel builds split the top of the tree on this thread, leaving
+	// a few subtrees per thread
+	BvhBuilder builder = { refs, tree->nodes, 1, 0, NULL, 0, 0, 0 };
+	uint32_t threadCount = jobSystem ? getJobThreadCount(jobSystem) : 1;
+	if (threadCount > 1 && count >= BVH_PARALLEL_MIN_PRIMITIVES) {
+		builder.jobSize = MAX(count / (threadCount * 4),
+			BVH_PARALLEL_MIN_PRIMITIVES / 4);
+	}
+	tree->nodes[0] = (BvhNode) { .first = 0, .count = count };
+	buildNode(&builder, 0, 0);
+	int built = !builder.failed && (!builder.jobCount
+		|| runBuildJobs(&builder, jobSystem));
+	free(builder.jobs);
+	for (uint32_t i = 0; i < count; ++i) {
+		tree->primitives[i] = refs[i].index;
+	}
+	free(refs);
+	if (!built) {
+		fprintf(stderr, "Failed to build BVH of %u primitives.\n", count);
+		freeBvhTree(tree);
+		return 0;
+	}
+	tree->nodeCount = builder.nodeCount;
+
+	tree->parents[0] = BVH_NO_HIT;
+	for (uint32_t i = 0; i < tree->nodeCount; ++i) {
+		const BvhNode* const node = &tree->nodes[i];
+		if (node->count) {
+			for (uint32_t p = node->first; p < node->first + node->count;
+				 ++p) {
+				tree->leaves[tree->primitives[p]] = i;
+			}
+		} else {
+			tree->parents[node->first] = i;
+			tree->parents[node->first + 1] = i;
+		}
+	}
+	tree->cost = computeTreeCost(tree);
+	return 1;
+}
+
+static void getSpheres(const Bvh* const bvh, BvhSpheres *spheres) {
+	*spheres = (BvhSpheres) { bvh->centerX, bvh->centerY, bvh->centerZ,
+		bvh->radius };
+}
+
+static void mergeChildBounds(BvhNode *nodes, uint32_t index) {
+	BvhNode *node = &nodes[index];
+	memcpy(node->min, nodes[node->first].min, sizeof(node->min));
+	memcpy(node->max, nodes[node->first].max, sizeof(node->max));
+	growBounds(node->min, node->max, nodes[node->first + 1].min,
+		nodes[node->first + 1].max);
+}
+
+// Children come after their parents, so a reverse pass sees every child
+// before its parent
+static void refitAll(BvhTree *tree, const BvhSpheres* const spheres) {
+	for (uint32_t i = tree->nodeCount; i-- > 0;) {
+		if (tree->nodes[i].count) {
+			computeLeafBounds(&tree->nodes[i], tree->primitives, spheres);
+		} else {
+			mergeChildBounds(tree->nodes, i);
+		}
+	}
+}
+
+int createBvh(Bvh *bvh, const float* const centerX,
+	const float* const centerY, const float* const centerZ,
+	const float* const radius, uint32_t count, JobSystem *jobSystem) {
+
+	memset(bvh, 0, sizeof(Bvh));
+	if (!count) {
+		fprintf(stderr, "Can't build a BVH without primitives.\n");
+		return 0;
+	}
+	bvh->centerX = centerX;
+	bvh->centerY = centerY;
+	bvh->centerZ = centerZ;
+	bvh->radius = radius;
+	bvh->primitiveCount = count;
+	bvh->jobSystem = jobSystem;
+
+	BvhSpheres spheres;
+	getSpheres(bvh, &spheres);
+	if (!buildBvhTree(&bvh->tree, &spheres, count, jobSystem)) {
+		return 0;
+	}
+	bvh->builtCost = bvh->tree.cost;
+	return 1;
+}
+
+// Builds serially, since jobs submitted from this thread would run inline
+// anyway and the rebuild is meant to stay off the workers the frame needs
+static void* rebuildThread(void *args) {
+	Bvh *bvh = args;
+	uint32_t count = bvh->primitiveCount;
+	BvhSpheres spheres = { bvh->snapshot, &bvh->snapshot[count],
+		&bvh->snapshot[2 * count], &bvh->snapshot[3 * count] };
+	int built = buildBvhTree(&bvh->pending, &spheres, count, NULL);
+	atomic_store_explicit(&bvh->rebuildResult, built ? 1 : -1,
+		memory_order_release);
+	return NULL;
+}
+
+// The rebuild works on a copy of the spheres, since the caller keeps
+// moving them while it runs. Without workers, or a thread, it is left to
+// the next updateBvh().
+static void startRebuild(Bvh *bvh) {
+	bvh->rebuilding = 1;
+	bvh->rebuildThreaded = 0;
+	atomic_store(&bvh->rebuildResult, 0);
+	if (getJobThreadCount(bvh->jobSystem) < 2) {
+		return;
+	}
+
+	uint32_t count = bvh->primitiveCount;
+	if (!bvh->snapshot) {
+		bvh->snapshot = malloc(4 * count * sizeof(float));
+		if (!bvh->snapshot) {
+			return;
+		}
+	}
+	memcpy(bvh->snapshot, bvh->centerX, count * sizeof(float));
+	memcpy(&bvh->snapshot[count], bvh->centerY, count * sizeof(float));
+	memcpy(&bvh->snapshot[2 * count], bvh->centerZ, count * sizeof(float));
+	memcpy(&bvh->snapshot[3 * count], bvh->radius, count * sizeof(float));
+	bvh->rebuildThreaded = !pthread_create(&bvh->rebuildThread, NULL,
+		rebuildThread, bvh);
+}
+
+static void checkTreeCost(Bvh *bvh) {
+	bvh->tree.cost = computeTreeCost(&bvh->tree);
+	bvh->changedSinceCheck = 0;
+	if (!bvh->rebuilding
+		&& bvh->tree.cost > bvh->builtCost * BVH_REBUILD_RATIO) {
+		startRebuild(bvh);
+	}
+}
+
+void refitBvh(Bvh *bvh, const uint32_t* const changed, uint32_t count) {
+	BvhSpheres spheres;
+	getSpheres(bvh, &spheres);
+	BvhTree *tree = &bvh->tree;
+	if (count > tree->nodeCount / 8) {
+		refitAll(tree, &spheres);
+		checkTreeCost(bvh);
+		return;
+	}
+
+	// Walk up from each leaf until the bounds stop changing
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t index = tree->leaves[changed[i]];
+		computeLeafBounds(&tree->nodes[index], tree->primitives, &spheres);
+		for (index = tree->parents[index]; index != BVH_NO_HIT;
+			 index = tree->parents[index]) {
+
+			BvhNode *node = &tree->nodes[index];
+			BvhNode previous = *node;
+			mergeChildBounds(tree->nodes, index);
+			if (!memcmp(previous.min, node->min, sizeof(node->min))
+				&& !memcmp(previous.max, node->max, sizeof(node->max))) {
+				break;
+			}
+		}
+	}
+
+	// The cost is only sampled once a good part of the scene has moved
+	bvh->changedSinceCheck += count;
+	if (bvh->changedSinceCheck > bvh->primitiveCount / 8) {
+		checkTreeCost(bvh);
+	}
+}
+
+void updateBvh(Bvh *bvh) {
+	if (!bvh->rebuilding) {
+		return;
+	}
+	if (!bvh->rebuildThreaded) {
+		BvhSpheres spheres;
+		getSpheres(bvh, &spheres);
+		atomic_store(&bvh->rebuildResult, buildBvhTree(&bvh->pending,
+			&spheres, bvh->primitiveCount, bvh->jobSystem) ? 1 : -1);
+	}
+	int result = atomic_load_explicit(&bvh->rebuildResult,
+		memory_order_acquire);
+	if (!result) {
+		return;
+	}
+	if (bvh->rebuildThreaded) {
+		pthread_join(bvh->rebuildThread, NULL);
+	}
+	bvh->rebuilding = 0;
+	if (result < 0) {
+		return;
+	}
+
+	// Refit to whatever moved since the snapshot was taken. The cost of
+	// the fresh build stays the reference, so a tree that degraded while
+	// it was rebuilt gets rebuilt again.
+	freeBvhTree(&bvh->tree);
+	bvh->tree = bvh->pending;
+	bvh->builtCost = bvh->pending.cost;
+	memset(&bvh->pending, 0, sizeof(BvhTree));
+	BvhSpheres spheres;
+	getSpheres(bvh, &spheres);
+	refitAll(&bvh->tree, &spheres);
+	bvh->tree.cost = computeTreeCost(&bvh->tree);
+	bvh->changedSinceCheck = 0;
+}
+
+// Finds the primitives under a node through its leftmost and rightmost
+// leaves, as every subtree covers a contiguous primitive range
+static void getSubtreeRange(const BvhNode* const nodes, uint32_t index,
+	uint32_t *first, uint32_t *end) {
+
+	uint32_t left = index, right = index;
+	while (!nodes[left].count) {
+		left = nodes[left].first;
+	}
+	while (!nodes[right].count) {
+		right = nodes[right].first + 1;
+	}
+	*first = nodes[left].first;
+	*end = nodes[right].first + nodes[right].count;
+}
+
+static uint32_t queryFrustumSubtree(const Bvh* const bvh,
+	const float* const planes, uint32_t root, uint32_t *results) {
+
+	const BvhTree* const tree = &bvh->tree;
+	uint32_t stack[BVH_MAX_DEPTH + 1];
+	uint8_t masks[BVH_MAX_DEPTH + 1];
+	uint32_t stackSize = 1, resultCount = 0;
+	stack[0] = root;
+	masks[0] = 0x3f;
+	while (stackSize) {
+		--stackSize;
+		const BvhNode* const node = &tree->nodes[stack[stackSize]];
+		uint8_t mask = masks[stackSize];
+
+		// Drop the planes the box is fully inside of
+		int outside = 0;
+		for (int p = 0; p < 6 && !outside; ++p) {
+			if (!(mask & (1 << p))) {
+				continue;
+			}
+			const float* const plane = &planes[p * 4];
+			float far = plane[3], near = plane[3];
+			for (int c = 0; c < 3; ++c) {
+				far += plane[c] * (plane[c] > 0.0f ? node->max[c]
+					: node->min[c]);
+				near += plane[c] * (plane[c] > 0.0f ? node->min[c]
+					: node->max[c]);
+			}
+			outside = far < 0.0f;
+			if (near >= 0.0f) {
+				mask &= ~(1 << p);
+			}
+		}
+		if (outside) {
+			continue;
+		}
+
+		if (!mask) {
+			uint32_t first, end;
+			getSubtreeRange(tree->nodes, stack[stackSize], &first, &end);
+			memcpy(&results[resultCount], &tree->primitives[first],
+				(end - first) * sizeof(uint32_t));
+			resultCount += end - first;
+		} else if (node->count) {
+			for (uint32_t i = node->first; i < node->first + node->count;
+				 ++i) {
+				uint32_t p = tree->primitives[i];
+				int inside = 1;
+				for (int j = 0; j < 6 && inside; ++j) {
+					const float* const plane = &planes[j * 4];
+					inside = !(mask & (1 << j)) || plane[0] * bvh->centerX[p]
+						+ plane[1] * bvh->centerY[p]
+						+ plane[2] * bvh->centerZ[p] + plane[3]
+						>= -bvh->radius[p];
+				}
+				if (inside) {
+					results[resultCount++] = p;
+				}
+			}
+		} else {
+			stack[stackSize] = node->first + 1;
+			masks[stackSize++] = mask;
+			stack[stackSize] = node->first;
+			masks[stackSize++] = mask;
+		}
+	}
+	return resultCount;
+}
+
+uint32_t queryBvhFrustum(const Bvh* const bvh, const float* const planes,
+	uint32_t *results) {
+	return queryFrustumSubtree(bvh, planes, 0, results);
+}
+
+static void queryFrustumSubtrees(void *data, uint32_t first,
+	uint32_t count) {
+
+	BvhFrustumQuery *query = data;
+	for (uint32_t i = first; i < first + count; ++i) {
+		uint32_t start, end;
+		getSubtreeRange(query->bvh->tree.nodes, query->subtrees[i], &start,
+			&end);
+		query->counts[i] = queryFrustumSubtree(query->bvh, query->planes,
+			query->subtrees[i], &query->results[start]);
+	}
+}
+
+// Splits the top of the tree a level at a time, which keeps the subtrees
+// in the order a serial query visits them. Starting below the root only
+// repeats plane tests the root would have dropped, so the results match.
+uint32_t queryBvhFrustumParallel(const Bvh* const bvh,
+	const float* const planes, uint32_t *results) {
+
+	const BvhNode* const nodes = bvh->tree.nodes;
+	uint32_t target = MIN(getJobThreadCount(bvh->jobSystem) * 4,
+		BVH_MAX_QUERY_SUBTREES);
+	uint32_t subtrees[BVH_MAX_QUERY_SUBTREES], counts[BVH_MAX_QUERY_SUBTREES];
+	uint32_t subtreeCount = 1;
+	subtrees[0] = 0;
+	while (subtreeCount < target) {
+		uint32_t split = subtreeCount;
+		for (uint32_t i = 0; i < subtreeCount; ++i) {
+			split += !nodes[subtrees[i]].count;
+		}
+		if (split == subtreeCount || split > BVH_MAX_QUERY_SUBTREES) {
+			break;
+		}
+		// Walk backwards so each child pair lands after what precedes it
+		for (uint32_t i = subtreeCount, j = split; i-- > 0;) {
+			const BvhNode* const node = &nodes[subtrees[i]];
+			if (node->count) {
+				subtrees[--j] = subtrees[i];
+			} else {
+				subtrees[--j] = node->first + 1;
+				subtrees[--j] = node->first;
+			}
+		}
+		subtreeCount = split;
+	}
+	if (subtreeCount == 1) {
+		return queryFrustumSubtree(bvh, planes, 0, results);
+	}
+
+	BvhFrustumQuery query = { bvh, planes, subtrees, results, counts };
+	parallelFor(bvh->jobSystem, subtreeCount, 1, queryFrustumSubtrees,
+		&query);
+
+	// Subtree ranges ascend, so compacting never overwrites results yet to
+	// be moved
+	uint32_t resultCount = 0;
+	for (uint32_t i = 0; i < subtreeCount; ++i) {
+		uint32_t start, end;
+		getSubtreeRange(nodes, subtrees[i], &start, &end);
+		memmove(&results[resultCount], &results[start],
+			counts[i] * sizeof(uint32_t));
+		resultCount += counts[i];
+	}
+	return resultCount;
+}
+
+// Distance along the ray to where it enters the box, or FLT_MAX
+static float intersectBox(const BvhNode* const node,
+	const float* const origin, const float* const inverseDirection) {
+
+	float near = 0.0f, far = FLT_MAX;
+	for (int c = 0; c < 3; ++c) {
+		float t0 = (node->min[c] - origin[c]) * inverseDirection[c];
+		float t1 = (node->max[c] - origin[c]) * inverseDirection[c];
+		near = MAX(near, MIN(t0, t1));
+		far = MIN(far, MAX(t0, t1));
+	}
+	return near <= far ? near : FLT_MAX;
+}
+
+uint32_t intersectBvhRay(const Bvh* const bvh, const float* const origin,
+	const float* const direction, float *distance) {
+
+	const BvhTree* const tree = &bvh->tree;
+	float inverseDirection[3];
+	for (int c = 0; c < 3; ++c) {
+		// Infinities make the slab test work for axis-aligned rays
+		inverseDirection[c] = 1.0f / direction[c];
+	}
+	float a = direction[0] * direction[0] + direction[1] * direction[1]
+		+ direction[2] * direction[2];
+	if (a <= 0.0f) {
+		return BVH_NO_HIT;
+	}
+
+	uint32_t stack[BVH_MAX_DEPTH + 1];
+	float entries[BVH_MAX_DEPTH + 1];
+	uint32_t stackSize = 1, hit = BVH_NO_HIT;
+	float closest = FLT_MAX;
+	stack[0] = 0;
+	entries[0] = intersectBox(&tree->nodes[0], origin, inverseDirection);
+	while (stackSize) {
+		--stackSize;
+		if (entries[stackSize] >= closest) {
+			continue;
+		}
+		const BvhNode* const node = &tree->nodes[stack[stackSize]];
+		if (!node->count) {
+			// Visit the nearer child first to shrink closest early
+			uint32_t near = node->first, far = node->first + 1;
+			float nearEntry = intersectBox(&tree->nodes[near], origin,
+				inverseDirection);
+			float farEntry = intersectBox(&tree->nodes[far], origin,
+				inverseDirection);
+			if (farEntry < nearEntry) {
+				uint32_t swap = near;
+				near = far;
+				far = swap;
+				float swapEntry = nearEntry;
+				nearEntry = farEntry;
+				farEntry = swapEntry;
+			}
+			stack[stackSize] = far;
+			entries[stackSize++] = farEntry;
+			stack[stackSize] = near;
+			entries[stackSize++] = nearEntry;
+			continue;
+		}
+
+		for (uint32_t i = node->first; i < node->first + node->count; ++i) {
+			uint32_t p = tree->primitives[i];
+			float offset[3] = { origin[0] - bvh->centerX[p],
+				origin[1] - bvh->centerY[p], origin[2] - bvh->centerZ[p] };
+			float b = direction[0] * offset[0] + direction[1] * offset[1]
+				+ direction[2] * offset[2];
+			float c = offset[0] * offset[0] + offset[1] * offset[1]
+				+ offset[2] * offset[2] - bvh->radius[p] * bvh->radius[p];
+			float discriminant = b * b - a * c;
+			if (discriminant < 0.0f) {
+				continue;
+			}
+			// Rays starting inside a sphere hit it where they leave
+			float root = sqrtf(discriminant);
+			float t = (-b - root) / a;
+			if (t < 0.0f) {
+				t = (-b + root) / a;
+			}
+			if (t >= 0.0f && t < closest) {
+				closest = t;
+				hit = p;
+			}
+		}
+	}
+	if (hit != BVH_NO_HIT) {
+		*distance = closest;
+	}
+	return hit;
+}
+
+void destroyBvh(Bvh *bvh) {
+	if (bvh->rebuilding && bvh->rebuildThreaded) {
+		pthread_join(bvh->rebuildThread, NULL);
+	}
+	freeBvhTree(&bvh->tree);
+	freeBvhTree(&bvh->pending);
+	free(bvh->snapshot);
+	memset(bvh, 0, sizeof(Bvh));
+}
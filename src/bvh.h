@@ -0,0 +1,112 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "jobs.h"
+
+#define BVH_BIN_COUNT 16
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_MAX_DEPTH 64
+#define BVH_NO_HIT UINT32_MAX
+
+// Subtrees with fewer primitives than this are built by a single job
+#define BVH_PARALLEL_MIN_PRIMITIVES 16384
+
+// Upper bound on the subtrees a parallel query is split into
+#define BVH_MAX_QUERY_SUBTREES 64
+
+// SAH costs of visiting a node and testing a primitive
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECTION_COST 1.0f
+
+// A background rebuild starts once refitting makes the SAH cost this much
+// worse than right after the last build
+#define BVH_REBUILD_RATIO 1.5f
+
+// Interior nodes have their two children at first and first + 1 and a
+// count of 0. Leaves hold primitives [first, first + count) of the tree's
+// primitive list. Children always come after their parent.
+typedef struct _BvhNode {
+	float min[3], max[3];
+	uint32_t first, count;
+} BvhNode;
+
+typedef struct _BvhTree {
+	BvhNode *nodes;
+	uint32_t nodeCount;
+	uint32_t *primitives, *parents, *leaves; // leaves: leaf of each primitive
+	float cost;
+} BvhTree;
+
+// Hierarchy over bounding spheres stored as structure-of-arrays by the
+// caller, who keeps them up to date and calls refitBvh() when they change
+typedef struct _Bvh {
+	BvhTree tree;
+	const float *centerX, *centerY, *centerZ, *radius;
+	uint32_t primitiveCount;
+	JobSystem *jobSystem;
+	float builtCost;
+	uint32_t changedSinceCheck;
+
+	// The rebuild runs on its own thread, and updateBvh() swaps the rebuilt
+	// tree in once rebuildResult is set, to 1 or -1 if the build failed.
+	// Without job workers there is no spare core, so updateBvh() rebuilds
+	// right away instead.
+	BvhTree pending;
+	float *snapshot;
+	pthread_t rebuildThread;
+	atomic_int rebuildResult;
+	int rebuilding, rebuildThreaded;
+} Bvh;
+
+// Builds on the job system, which must outlive the BVH and be owned by the
+// thread that refits it
+int createBvh(Bvh *bvh, const float* const centerX,
+	const float* const centerY, const float* const centerZ,
+	const float* const radius, uint32_t count, JobSystem *jobSystem);
+
+// Refits the nodes above the listed primitives to their current spheres,
+// and starts a background rebuild if the tree degraded too much
+void refitBvh(Bvh *bvh, const uint32_t* const changed, uint32_t count);
+
+// Swaps in a finished background rebuild, or runs a pending one when the
+// job system has no workers. Call once per frame.
+void updateBvh(Bvh *bvh);
+
+// Writes the primitives whose sphere is on the inner side of all six
+// planes (ax + by + cz + d >= -radius), given as 24 consecutive floats, to
+// results. Returns the number written.
+uint32_t queryBvhFrustum(const Bvh* const bvh, const float* const planes,
+	uint32_t *results);
+
+// Same results in the same order, with the top subtrees queried in
+// parallel on the BVH's job system. results must have room for every
+// primitive, as each subtree writes into its own range of it.
+uint32_t queryBvhFrustumParallel(const Bvh* const bvh,
+	const float* const planes, uint32_t *results);
+
+// Closest primitive hit by the ray, or BVH_NO_HIT. The direction need not
+// be normalized; distance is in units of its length.
+uint32_t intersectBvhRay(const Bvh* const bvh, const float* const origin,
+	const float* const direction, float *distance);
+
+void destroyBvh(Bvh *bvh);
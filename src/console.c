@@ -28,6 +28,40 @@ static void printVec3(const float* const vec) {
 	printf("{ %ff, %ff, %ff }\n\n", vec[0], vec[1], vec[2]);
 }
 
+static void printStats(const FrameStats* const stats) {
+	printf("Instances: %u visible of %u (%.1f%% culled)\n",
+		   stats->visibleInstances, stats->instanceCount, stats->instanceCount
+		   ? 100.0 * (stats->instanceCount - stats->visibleInstances)
+		   / stats->instanceCount : 0.0);
+	if (stats->meshletCount) {
+		printf("Meshlets: %u visible of %u (%.1f%% culled)\n",
+			   stats->visibleMeshlets, stats->meshletCount,
+			   100.0 * (stats->meshletCount - stats->visibleMeshlets)
+			   / stats->meshletCount);
+	}
+	if (stats->cullingMode == CULLING_OCCLUSION) {
+		printf("Occlusion: %u drawn early, %u drawn late, %u occluded\n",
+			   stats->visibleInstances - stats->lateInstances,
+			   stats->lateInstances, stats->occludedInstances);
+	}
+	printf("Triangles: %llu submitted\n",
+		   (unsigned long long) stats->triangleCount);
+	printf("Culling: %f ms\n", stats->cullMs);
+	printf("Recording: %u draws in %f ms, up to %u threads\n",
+		   stats->drawCount, stats->recordMs, stats->recordThreadCount);
+	printf("Depth prepass: %s\n", stats->depthPrepass ? "on" : "off");
+	printf("GPU: %f ms at %ux%u, %s shading\n", stats->gpuMs,
+		   stats->renderWidth, stats->renderHeight,
+		   stats->shadingMode == SHADING_DEFERRED ? "deferred" : "forward");
+	printf("Post-processing: %s, frames end %f ms apart on the GPU\n",
+		   stats->asyncCompute ? "async compute" : "serial",
+		   stats->gpuIntervalMs);
+	printf("Lights: %u in %u cluster entries, grid built in %f ms\n",
+		   stats->lightCount, stats->lightEntries, stats->lightGridMs);
+	printf("Shadows: %u dynamic casters, static casters drawn %u times\n\n",
+		   stats->dynamicCasters, stats->shadowCacheRenders);
+}
+
 static void setAmbient(UBOAttributes *attributes, float r, float g, float b) {
 	attributes->sceneAttributes.ambientColor[0] = r;
 	attributes->sceneAttributes.ambientColor[1] = g;
@@ -78,7 +112,9 @@ static void printHelp() {
 		   "  eye [x] [y] [z]\t\tSet the eye/camera position.\n"
 		   "  lightPos [x] [y] [z]\t\tSet the light position.\n"
 		   "  lightColor [r] [g] [b]\tSet the light color.\n"
+		   "  prepass [0|1]\t\t\tTurn the depth prepass off or on.\n"
 		   "  fps\t\t\t\tDisplay the current framerate.\n"
+		   "  stats\t\t\t\tDisplay statistics for the last frame.\n"
 		   "  quit\t\t\t\tQuit the program.\n"
 		   "  help\t\t\t\tDisplay this help.\n\n");
 }
@@ -151,9 +187,19 @@ static int parseLine(char* line, ConsoleArgs *consoleArgs) {
 		}
 		VALIDATE_ARG_COUNT(i, 3);
 		setLightColor(consoleArgs->uboAttributes, args[0], args[1], args[2]);
+	} else if (!strcasecmp("prepass", cmd)) {
+		if (i == 0) {
+			printf("%d\n\n", consoleArgs->uboAttributes->depthPrepass);
+			return 0;
+		}
+		VALIDATE_ARG_COUNT(i, 1);
+		consoleArgs->uboAttributes->depthPrepass = args[0] != 0.0f;
 	} else if (!strcasecmp("fps", cmd)) {
 		VALIDATE_ARG_COUNT(i, 0);
 		printf("FPS: %f\n\n", *consoleArgs->framerate);
+	} else if (!strcasecmp("stats", cmd)) {
+		VALIDATE_ARG_COUNT(i, 0);
+		printStats(consoleArgs->stats);
 	} else if (!strcasecmp("quit", cmd)) {
 		VALIDATE_ARG_COUNT(i, 0);
 		glfwSetWindowShouldClose(consoleArgs->window, 1);
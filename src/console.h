@@ -25,6 +25,7 @@ typedef struct _ConsoleArgs {
 	UBOAttributes *uboAttributes;
 	GLFWwindow *window;
 	double *framerate;
+	const FrameStats *stats;
 } ConsoleArgs;
 
 void* consoleLoop(void *args);
@@ -0,0 +1,419 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "culling.h"
+#include "maths.h"
+#include "mesh.h"
+
+#define SIMD_ALIGNMENT 32
+#define PADDING_RADIUS -1e30f
+
+typedef struct _CullJob {
+	const Frustum *frustum;
+	const InstanceBounds *bounds;
+	uint32_t first, count, visibleCount;
+	uint32_t *visible;
+} CullJob;
+
+void extractFrustumPlanes(Frustum *frustum, const float* const viewProj) {
+	// Rows of the column-major matrix
+	float rows[4][4];
+	for (int r = 0; r < 4; ++r) {
+		for (int c = 0; c < 4; ++c) {
+			rows[r][c] = viewProj[c * 4 + r];
+		}
+	}
+
+	for (int i = 0; i < 4; ++i) {
+		frustum->planes[0][i] = rows[3][i] + rows[0][i]; // Left
+		frustum->planes[1][i] = rows[3][i] - rows[0][i]; // Right
+		frustum->planes[2][i] = rows[3][i] + rows[1][i]; // Bottom
+		frustum->planes[3][i] = rows[3][i] - rows[1][i]; // Top
+		frustum->planes[4][i] = rows[3][i] + rows[2][i]; // Near
+		frustum->planes[5][i] = rows[3][i] - rows[2][i]; // Far
+	}
+
+	for (int p = 0; p < 6; ++p) {
+		float *plane = frustum->planes[p];
+		float length = sqrtf(plane[0] * plane[0] + plane[1] * plane[1]
+			+ plane[2] * plane[2]);
+		if (length > 0.0f) {
+			for (int i = 0; i < 4; ++i) {
+				plane[i] /= length;
+			}
+		}
+	}
+}
+
+static void computeInstanceBounds(InstanceBounds *bounds, uint32_t index,
+	const float* const m, const float* const meshCenter, float meshRadius) {
+
+	bounds->centerX[index] = m[0] * meshCenter[0] + m[4] * meshCenter[1]
+		+ m[8] * meshCenter[2] + m[12];
+	bounds->centerY[index] = m[1] * meshCenter[0] + m[5] * meshCenter[1]
+		+ m[9] * meshCenter[2] + m[13];
+	bounds->centerZ[index] = m[2] * meshCenter[0] + m[6] * meshCenter[1]
+		+ m[10] * meshCenter[2] + m[14];
+
+	// Scale the radius by the largest axis scale of the instance
+	float scale = 0.0f;
+	for (int axis = 0; axis < 3; ++axis) {
+		const float* const column = &m[axis * 4];
+		scale = MAX(scale, column[0] * column[0] + column[1] * column[1]
+			+ column[2] * column[2]);
+	}
+	bounds->radius[index] = meshRadius * sqrtf(scale);
+}
+
+int createInstanceBounds(InstanceBounds *bounds,
+	const InstanceData* const instances, uint32_t count,
+	const float* const meshCenter, float meshRadius) {
+
+	memset(bounds, 0, sizeof(InstanceBounds));
+	bounds->count = count;
+	bounds->paddedCount = (count + 7) & ~7u;
+	size_t size = bounds->paddedCount * sizeof(float);
+	bounds->centerX = aligned_alloc(SIMD_ALIGNMENT, size);
+	bounds->centerY = aligned_alloc(SIMD_ALIGNMENT, size);
+	bounds->centerZ = aligned_alloc(SIMD_ALIGNMENT, size);
+	bounds->radius = aligned_alloc(SIMD_ALIGNMENT, size);
+	if (!bounds->centerX || !bounds->centerY || !bounds->centerZ
+		|| !bounds->radius) {
+
+		fprintf(stderr, "Failed to allocate instance bounds.\n");
+		destroyInstanceBounds(bounds);
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < count; ++i) {
+		computeInstanceBounds(bounds, i, instances[i].model, meshCenter,
+			meshRadius);
+	}
+	for (uint32_t i = count; i < bounds->paddedCount; ++i) {
+		bounds->centerX[i] = bounds->centerY[i] = bounds->centerZ[i] = 0.0f;
+		bounds->radius[i] = PADDING_RADIUS;
+	}
+	return 1;
+}
+
+void updateInstanceBounds(InstanceBounds *bounds,
+	const InstanceData* const instances, const uint32_t* const indices,
+	uint32_t count, const float* const meshCenter, float meshRadius) {
+
+	for (uint32_t i = 0; i < count; ++i) {
+		computeInstanceBounds(bounds, indices[i], instances[indices[i]].model,
+			meshCenter, meshRadius);
+	}
+}
+
+void destroyInstanceBounds(InstanceBounds *bounds) {
+	free(bounds->centerX);
+	free(bounds->centerY);
+	free(bounds->centerZ);
+	free(bounds->radius);
+	memset(bounds, 0, sizeof(InstanceBounds));
+}
+
+uint32_t cullInstancesScalar(const Frustum* const frustum,
+	const InstanceBounds* const bounds, uint32_t first, uint32_t count,
+	uint32_t *visible) {
+
+	uint32_t visibleCount = 0;
+	for (uint32_t i = first; i < first + count; ++i) {
+		int inside = 1;
+		for (int p = 0; p < 6 && inside; ++p) {
+			const float* const plane = frustum->planes[p];
+			float distance = plane[0] * bounds->centerX[i]
+				+ plane[1] * bounds->centerY[i]
+				+ plane[2] * bounds->centerZ[i] + plane[3];
+			inside = distance >= -bounds->radius[i];
+		}
+		if (inside) {
+			visible[visibleCount++] = i;
+		}
+	}
+	return visibleCount;
+}
+
+// Appends the indices of the set bits of mask, starting at base
+static uint32_t writeVisible(uint32_t *visible, uint32_t mask, uint32_t base) {
+	uint32_t written = 0;
+	while (mask) {
+		visible[written++] = base + __builtin_ctz(mask);
+		mask &= mask - 1;
+	}
+	return written;
+}
+
+uint32_t cullInstances(const Frustum* const frustum,
+	const InstanceBounds* const bounds, uint32_t first, uint32_t count,
+	uint32_t *visible) {
+
+#if defined(__AVX__) || defined(__SSE2__)
+#if defined(__AVX__)
+	const uint32_t width = 8;
+#else
+	const uint32_t width = 4;
+#endif
+	// SIMD groups must start on an aligned boundary; peel the rest
+	uint32_t visibleCount = 0;
+	uint32_t alignedFirst = (first + width - 1) & ~(width - 1);
+	uint32_t end = first + count;
+	if (alignedFirst >= end) {
+		return cullInstancesScalar(frustum, bounds, first, count, visible);
+	}
+	visibleCount += cullInstancesScalar(frustum, bounds, first,
+		alignedFirst - first, visible);
+	uint32_t alignedEnd = alignedFirst + ((end - alignedFirst) & ~(width - 1));
+
+#if defined(__AVX__)
+	__m256 planes[6][4];
+	for (int p = 0; p < 6; ++p) {
+		for (int j = 0; j < 4; ++j) {
+			planes[p][j] = _mm256_set1_ps(frustum->planes[p][j]);
+		}
+	}
+	for (uint32_t i = alignedFirst; i < alignedEnd; i += 8) {
+		__m256 x = _mm256_load_ps(&bounds->centerX[i]);
+		__m256 y = _mm256_load_ps(&bounds->centerY[i]);
+		__m256 z = _mm256_load_ps(&bounds->centerZ[i]);
+		__m256 negRadius = _mm256_sub_ps(_mm256_setzero_ps(),
+			_mm256_load_ps(&bounds->radius[i]));
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (int p = 0; p < 6; ++p) {
+			__m256 distance = _mm256_add_ps(
+				_mm256_add_ps(_mm256_mul_ps(planes[p][0], x),
+					_mm256_mul_ps(planes[p][1], y)),
+				_mm256_add_ps(_mm256_mul_ps(planes[p][2], z), planes[p][3]));
+			inside = _mm256_and_ps(inside,
+				_mm256_cmp_ps(distance, negRadius, _CMP_GE_OQ));
+		}
+		visibleCount += writeVisible(&visible[visibleCount],
+			_mm256_movemask_ps(inside), i);
+	}
+#else
+	__m128 planes[6][4];
+	for (int p = 0; p < 6; ++p) {
+		for (int j = 0; j < 4; ++j) {
+			planes[p][j] = _mm_set1_ps(frustum->planes[p][j]);
+		}
+	}
+	for (uint32_t i = alignedFirst; i < alignedEnd; i += 4) {
+		__m128 x = _mm_load_ps(&bounds->centerX[i]);
+		__m128 y = _mm_load_ps(&bounds->centerY[i]);
+		__m128 z = _mm_load_ps(&bounds->centerZ[i]);
+		__m128 negRadius = _mm_sub_ps(_mm_setzero_ps(),
+			_mm_load_ps(&bounds->radius[i]));
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int p = 0; p < 6; ++p) {
+			__m128 distance = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(planes[p][0], x),
+					_mm_mul_ps(planes[p][1], y)),
+				_mm_add_ps(_mm_mul_ps(planes[p][2], z), planes[p][3]));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negRadius));
+		}
+		visibleCount += writeVisible(&visible[visibleCount],
+			_mm_movemask_ps(inside), i);
+	}
+#endif
+
+	visibleCount += cullInstancesScalar(frustum, bounds, alignedEnd,
+		end - alignedEnd, &visible[visibleCount]);
+	return visibleCount;
+#else
+	return cullInstancesScalar(frustum, bounds, first, count, visible);
+#endif
+}
+
+static void cullJob(void *data) {
+	CullJob *job = data;
+	job->visibleCount = cullInstances(job->frustum, job->bounds, job->first,
+		job->count, job->visible);
+}
+
+uint32_t cullInstancesParallel(const Frustum* const frustum,
+	const InstanceBounds* const bounds, uint32_t *visible,
+	JobSystem *jobSystem) {
+
+	uint32_t jobCount = MIN(getJobThreadCount(jobSystem),
+		bounds->count / CULL_INSTANCES_PER_THREAD);
+	jobCount = MIN(jobCount, JOB_MAX_BATCHES);
+	if (jobCount <= 1) {
+		return cullInstances(frustum, bounds, 0, bounds->count, visible);
+	}
+
+	// Each job writes into the part of the output matching its input
+	// range, so no synchronization is needed until the compaction
+	CullJob cullJobs[JOB_MAX_BATCHES];
+	Job jobs[JOB_MAX_BATCHES];
+	JobCounter counter = { 0 };
+	uint32_t chunk = (bounds->count / jobCount + 7) & ~7u;
+	for (uint32_t t = 0; t < jobCount; ++t) {
+		uint32_t first = MIN(t * chunk, bounds->count);
+		cullJobs[t] = (CullJob) { frustum, bounds, first,
+			t == jobCount - 1 ? bounds->count - first
+				: MIN(chunk, bounds->count - first),
+			0, &visible[first] };
+		jobs[t] = (Job) { cullJob, &cullJobs[t], &counter };
+	}
+	submitJobs(jobSystem, jobs, jobCount);
+	waitForJobs(jobSystem, &counter);
+
+	uint32_t visibleCount = cullJobs[0].visibleCount;
+	for (uint32_t t = 1; t < jobCount; ++t) {
+		memmove(&visible[visibleCount], cullJobs[t].visible,
+			cullJobs[t].visibleCount * sizeof(uint32_t));
+		visibleCount += cullJobs[t].visibleCount;
+	}
+	return visibleCount;
+}
+
+int createCuller(Culler *culler, const InstanceData* const instances,
+	uint32_t count, const Mesh* const mesh, JobSystem *jobSystem) {
+
+	float center[3], radius;
+	getMeshBoundingSphere(mesh, center, &radius);
+
+	memcpy(culler->meshCenter, center, sizeof(center));
+	culler->meshRadius = radius;
+	culler->lodCount = mesh->lodCount;
+	for (uint32_t i = 0; i < mesh->lodCount; ++i) {
+		culler->lodErrors[i] = radius > 0.0f ? mesh->lods[i].error / radius
+			: 0.0f;
+	}
+	culler->visible = malloc(count * sizeof(uint32_t));
+	culler->lodVisible = malloc(count * mesh->lodCount * sizeof(uint32_t));
+	culler->instanceLods = calloc(count, sizeof(uint8_t));
+	if (!culler->visible || !culler->lodVisible || !culler->instanceLods) {
+		fprintf(stderr, "Failed to allocate visible instance list.\n");
+		destroyCuller(culler);
+		return 0;
+	}
+	if (!createInstanceBounds(&culler->bounds, instances, count, center,
+							  radius)
+		|| !createBvh(&culler->bvh, culler->bounds.centerX,
+			culler->bounds.centerY, culler->bounds.centerZ,
+			culler->bounds.radius, count, jobSystem)) {
+		destroyCuller(culler);
+		return 0;
+	}
+	return 1;
+}
+
+// Sorts the visible instances into per-LOD lists by the size of each
+// LOD's error on screen
+static void selectLods(Culler *culler, const float* const modelView,
+	float pixelScale, uint32_t visibleCount) {
+
+	memset(culler->lodVisibleCounts, 0, sizeof(culler->lodVisibleCounts));
+	const InstanceBounds* const bounds = &culler->bounds;
+	for (uint32_t i = 0; i < visibleCount; ++i) {
+		uint32_t index = culler->visible[i];
+		float x = bounds->centerX[index], y = bounds->centerY[index],
+			z = bounds->centerZ[index];
+		float viewPos[3];
+		for (int c = 0; c < 3; ++c) {
+			viewPos[c] = modelView[c] * x + modelView[4 + c] * y
+				+ modelView[8 + c] * z + modelView[12 + c];
+		}
+		float distance = sqrtf(viewPos[0] * viewPos[0]
+			+ viewPos[1] * viewPos[1] + viewPos[2] * viewPos[2]);
+
+		// Pixels per unit of relative error; the camera inside the
+		// bounds always gets full detail
+		uint32_t lod = 0;
+		if (distance > bounds->radius[index]) {
+			float scale = bounds->radius[index] * pixelScale / distance;
+			uint32_t current = culler->instanceLods[index];
+			if (culler->lodErrors[current] * scale > LOD_PIXEL_ERROR) {
+				// Too coarse: refine to the coarsest fine enough LOD
+				lod = current;
+				while (lod > 0
+					&& culler->lodErrors[lod] * scale > LOD_PIXEL_ERROR) {
+					--lod;
+				}
+			} else {
+				// Only coarsen past the hysteresis band
+				lod = current;
+				while (lod + 1 < culler->lodCount
+					&& culler->lodErrors[lod + 1] * scale
+					<= LOD_PIXEL_ERROR * (1.0f - LOD_HYSTERESIS)) {
+					++lod;
+				}
+			}
+		}
+		culler->instanceLods[index] = lod;
+		culler->lodVisible[lod * bounds->count
+			+ culler->lodVisibleCounts[lod]++] = index;
+	}
+}
+
+void updateCuller(Culler *culler, const InstanceData* const instances,
+	const uint32_t* const changed, uint32_t changedCount) {
+
+	updateInstanceBounds(&culler->bounds, instances, changed, changedCount,
+		culler->meshCenter, culler->meshRadius);
+	updateBvh(&culler->bvh);
+	refitBvh(&culler->bvh, changed, changedCount);
+}
+
+uint32_t cullScene(Culler *culler, const MVPMatrices* const mvp,
+	float viewportHeight) {
+	// The global model matrix is folded into the frustum, so the instance
+	// bounds never need to be transformed
+	float modelView[16], modelViewProj[16];
+	multMatrix(modelView, mvp->model, mvp->view);
+	multMatrix(modelViewProj, modelView, mvp->proj);
+
+	// The hierarchy skips whole groups of instances outside the frustum,
+	// which beats the linear pass unless most of the scene is visible.
+	// Large scenes split it into subtrees for the job system.
+	Frustum frustum;
+	extractFrustumPlanes(&frustum, modelViewProj);
+	updateBvh(&culler->bvh);
+	uint32_t visibleCount = culler->bounds.count < CULL_INSTANCES_PER_THREAD
+		? queryBvhFrustum(&culler->bvh, frustum.planes[0], culler->visible)
+		: queryBvhFrustumParallel(&culler->bvh, frustum.planes[0],
+			culler->visible);
+
+	// The projection's y scale maps view space to half the viewport
+	selectLods(culler, modelView, fabsf(mvp->proj[5]) * viewportHeight
+		* 0.5f, visibleCount);
+	return visibleCount;
+}
+
+void destroyCuller(Culler *culler) {
+	destroyBvh(&culler->bvh);
+	destroyInstanceBounds(&culler->bounds);
+	free(culler->visible);
+	free(culler->lodVisible);
+	free(culler->instanceLods);
+	culler->visible = NULL;
+	culler->lodVisible = NULL;
+	culler->instanceLods = NULL;
+}
@@ -0,0 +1,104 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "bvh.h"
+#include "jobs.h"
+#include "vulkan-types.h"
+
+// Instances per job below which culling stays single threaded
+#define CULL_INSTANCES_PER_THREAD 65536
+
+// Coarsest LOD whose error projects to at most this many pixels is drawn.
+// Switching to a coarser LOD needs the error to be LOD_HYSTERESIS smaller,
+// so instances near a threshold don't pop back and forth.
+#define LOD_PIXEL_ERROR 1.0f
+#define LOD_HYSTERESIS 0.25f
+
+typedef struct _Frustum {
+	float planes[6][4];
+} Frustum;
+
+// Instance bounding spheres stored as structure-of-arrays. Arrays are
+// padded to a multiple of 8 with spheres that never pass the test.
+typedef struct _InstanceBounds {
+	float *centerX, *centerY, *centerZ, *radius;
+	uint32_t count, paddedCount;
+} InstanceBounds;
+
+// Visible instances are sorted into lodCount lists of bounds.count entries
+// in lodVisible, one per LOD of the mesh. The BVH indexes the bounds for
+// culling and for picking.
+typedef struct _Culler {
+	InstanceBounds bounds;
+	Bvh bvh;
+	uint32_t *visible;
+	float meshCenter[3], meshRadius;
+	float lodErrors[MAX_MESH_LODS]; // Relative to the mesh radius
+	uint32_t lodCount, lodVisibleCounts[MAX_MESH_LODS];
+	uint32_t *lodVisible;
+	uint8_t *instanceLods;
+} Culler;
+
+// Extracts normalized planes from a column-major view-projection matrix
+void extractFrustumPlanes(Frustum *frustum, const float* const viewProj);
+
+int createInstanceBounds(InstanceBounds *bounds,
+	const InstanceData* const instances, uint32_t count,
+	const float* const meshCenter, float meshRadius);
+
+// Recomputes the bounds of the listed instances after their model
+// matrices changed
+void updateInstanceBounds(InstanceBounds *bounds,
+	const InstanceData* const instances, const uint32_t* const indices,
+	uint32_t count, const float* const meshCenter, float meshRadius);
+
+void destroyInstanceBounds(InstanceBounds *bounds);
+
+// Tests instances [first, first + count) and writes the indices of the
+// visible ones to visible. Returns the number written.
+uint32_t cullInstancesScalar(const Frustum* const frustum,
+	const InstanceBounds* const bounds, uint32_t first, uint32_t count,
+	uint32_t *visible);
+uint32_t cullInstances(const Frustum* const frustum,
+	const InstanceBounds* const bounds, uint32_t first, uint32_t count,
+	uint32_t *visible);
+
+// Splits the instances into one job per thread of the job system and
+// compacts the result
+uint32_t cullInstancesParallel(const Frustum* const frustum,
+	const InstanceBounds* const bounds, uint32_t *visible,
+	JobSystem *jobSystem);
+
+// The BVH is built and, for large scenes, queried on the job system
+int createCuller(Culler *culler, const InstanceData* const instances,
+	uint32_t count, const Mesh* const mesh, JobSystem *jobSystem);
+
+// Updates the bounds and the BVH of the instances that moved
+void updateCuller(Culler *culler, const InstanceData* const instances,
+	const uint32_t* const changed, uint32_t changedCount);
+
+// Culls against the frustum of the given model, view and projection and
+// selects the LOD of the visible instances for a viewport of the given
+// height. Returns the number of visible instances.
+uint32_t cullScene(Culler *culler, const MVPMatrices* const mvp,
+	float viewportHeight);
+
+void destroyCuller(Culler *culler);
@@ -0,0 +1,112 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "destruction-queue.h"
+
+void initDestructionQueue(DestructionQueue *queue, VkDevice device,
+						  QueueScheduler *scheduler) {
+
+	memset(queue, 0, sizeof(DestructionQueue));
+	queue->device = device;
+	queue->scheduler = scheduler;
+}
+
+static void destroyObject(VkDevice device, DestructionType type,
+						  DestroyedObject object) {
+	switch (type) {
+	case DESTROY_BUFFER:
+		vkDestroyBuffer(device, object.buffer, NULL);
+		break;
+	case DESTROY_IMAGE:
+		vkDestroyImage(device, object.image, NULL);
+		break;
+	case DESTROY_IMAGE_VIEW:
+		vkDestroyImageView(device, object.view, NULL);
+		break;
+	case DESTROY_SAMPLER:
+		vkDestroySampler(device, object.sampler, NULL);
+		break;
+	case DESTROY_FRAMEBUFFER:
+		vkDestroyFramebuffer(device, object.framebuffer, NULL);
+		break;
+	case DESTROY_PIPELINE:
+		vkDestroyPipeline(device, object.pipeline, NULL);
+		break;
+	case DESTROY_MEMORY:
+		vkFreeMemory(device, object.memory, NULL);
+		break;
+	case DESTROY_COMMAND_BUFFER:
+		vkFreeCommandBuffers(device, object.commandBuffer.pool, 1,
+			&object.commandBuffer.buffer);
+		break;
+	}
+}
+
+// Grows by doubling, like draw lists, so a steady stream of uploads stops
+// allocating
+int deferDestruction(DestructionQueue *queue, DestructionType type,
+					 DestroyedObject object, QueuePoint lastUse) {
+
+	if (isQueuePointDone(queue->scheduler, lastUse)) {
+		destroyObject(queue->device, type, object);
+		return 1;
+	}
+	if (queue->count == queue->capacity) {
+		uint32_t capacity = queue->capacity ? queue->capacity * 2 : 16;
+		DeferredDestruction *items = realloc(queue->items,
+			capacity * sizeof(DeferredDestruction));
+		if (!items) {
+			fprintf(stderr, "Failed to grow destruction queue to %u "
+				"objects.\n", capacity);
+			waitForQueuePoint(queue->scheduler, lastUse);
+			destroyObject(queue->device, type, object);
+			return 0;
+		}
+		queue->items = items;
+		queue->capacity = capacity;
+	}
+	queue->items[queue->count++] = (DeferredDestruction) { type, object,
+		lastUse };
+	return 1;
+}
+
+void destroyRetiredObjects(DestructionQueue *queue) {
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < queue->count; ++i) {
+		DeferredDestruction *item = &queue->items[i];
+		if (isQueuePointDone(queue->scheduler, item->lastUse)) {
+			destroyObject(queue->device, item->type, item->object);
+		} else {
+			queue->items[kept++] = *item;
+		}
+	}
+	queue->count = kept;
+}
+
+void destroyDestructionQueue(DestructionQueue *queue) {
+	for (uint32_t i = 0; i < queue->count; ++i) {
+		destroyObject(queue->device, queue->items[i].type,
+			queue->items[i].object);
+	}
+	free(queue->items);
+	queue->items = NULL;
+	queue->count = queue->capacity = 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include "queue-scheduler.h"
+
+typedef enum _DestructionType {
+	DESTROY_BUFFER,
+	DESTROY_IMAGE,
+	DESTROY_IMAGE_VIEW,
+	DESTROY_SAMPLER,
+	DESTROY_FRAMEBUFFER,
+	DESTROY_PIPELINE,
+	DESTROY_MEMORY,
+	DESTROY_COMMAND_BUFFER
+} DestructionType;
+
+typedef union _DestroyedObject {
+	VkBuffer buffer;
+	VkImage image;
+	VkImageView view;
+	VkSampler sampler;
+	VkFramebuffer framebuffer;
+	VkPipeline pipeline;
+	VkDeviceMemory memory;
+	struct {
+		VkCommandPool pool;
+		VkCommandBuffer buffer;
+	} commandBuffer;
+} DestroyedObject;
+
+typedef struct _DeferredDestruction {
+	DestructionType type;
+	DestroyedObject object;
+	QueuePoint lastUse;
+} DeferredDestruction;
+
+// Objects still in use by submitted work, destroyed once the point of
+// their last use retires. Points on different queues retire out of order,
+// so every collection checks all of them.
+typedef struct _DestructionQueue {
+	VkDevice device;
+	QueueScheduler *scheduler;
+	DeferredDestruction *items;
+	uint32_t count, capacity;
+} DestructionQueue;
+
+void initDestructionQueue(DestructionQueue *queue, VkDevice device,
+						  QueueScheduler *scheduler);
+
+// Destroys the object right away if the point already retired. Returns 0
+// if it can't be queued, after waiting for the point and destroying it.
+int deferDestruction(DestructionQueue *queue, DestructionType type,
+					 DestroyedObject object, QueuePoint lastUse);
+
+// Meant to be called once per frame
+void destroyRetiredObjects(DestructionQueue *queue);
+
+// Destroys everything queued, so the device must be idle
+void destroyDestructionQueue(DestructionQueue *queue);
@@ -0,0 +1,72 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "draw-list.h"
+
+int createDrawList(DrawList *list, uint32_t capacity) {
+	list->count = 0;
+	list->capacity = capacity;
+	list->items = malloc(capacity * sizeof(DrawItem));
+	if (!list->items) {
+		fprintf(stderr, "Failed to allocate draw list of %u items.\n",
+			capacity);
+		list->capacity = 0;
+		return 0;
+	}
+	return 1;
+}
+
+void clearDrawList(DrawList *list) {
+	list->count = 0;
+}
+
+int addIndirectDraw(DrawList *list, const Mesh* const mesh,
+	uint32_t indirectCommand) {
+
+	DrawItem item = {};
+	item.format = mesh->format;
+	item.bounds = &mesh->bounds;
+	item.indirectCommand = indirectCommand;
+	return addDraw(list, &item);
+}
+
+// Grows by doubling, so a list refilled every frame stops allocating once
+// it has seen its largest frame
+int addDraw(DrawList *list, const DrawItem* const item) {
+	if (list->count == list->capacity) {
+		uint32_t capacity = list->capacity ? list->capacity * 2 : 16;
+		DrawItem *items = realloc(list->items, capacity * sizeof(DrawItem));
+		if (!items) {
+			fprintf(stderr, "Failed to grow draw list to %u items.\n",
+				capacity);
+			return 0;
+		}
+		list->items = items;
+		list->capacity = capacity;
+	}
+	list->items[list->count++] = *item;
+	return 1;
+}
+
+void destroyDrawList(DrawList *list) {
+	free(list->items);
+	memset(list, 0, sizeof(DrawList));
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "vulkan-types.h"
+
+// Draws of the indirect command at index indirectCommand. Direct draws use
+// the arguments in the item instead.
+#define DRAW_DIRECT UINT32_MAX
+
+// One indexed draw from the geometry pool of a vertex format. firstIndex
+// and vertexOffset are within the pool, and firstInstance selects entries
+// of the visible instance stream.
+typedef struct _DrawItem {
+	VertexFormat format;
+	const MeshBounds *bounds;
+	uint32_t indirectCommand;
+	uint32_t indexCount, instanceCount, firstIndex, firstInstance;
+	int32_t vertexOffset;
+} DrawItem;
+
+// Draws recorded into the next frame. Refilled every frame; adjacent items
+// with the same format and bounds share their pipeline and buffer binds.
+typedef struct _DrawList {
+	DrawItem *items;
+	uint32_t count, capacity;
+} DrawList;
+
+int createDrawList(DrawList *list, uint32_t capacity);
+
+void clearDrawList(DrawList *list);
+
+int addIndirectDraw(DrawList *list, const Mesh* const mesh,
+	uint32_t indirectCommand);
+
+int addDraw(DrawList *list, const DrawItem* const item);
+
+void destroyDrawList(DrawList *list);
@@ -71,6 +71,43 @@ static uint16_t getKeyboardControlsState(GLFWwindow* window) {
 	return controlsMask;
 }
 
+// Casts a ray from the eye through the cursor and returns the node of the
+// closest instance it hits, or the model node over empty space
+static uint32_t pickModelNode(GLFWwindow *window,
+	const UBOAttributes* const uboAttributes, double cursorX,
+	double cursorY) {
+
+	int width, height;
+	glfwGetWindowSize(window, &width, &height);
+	if (!uboAttributes->bvh || width <= 0 || height <= 0) {
+		return uboAttributes->modelNode;
+	}
+
+	// View space direction to the cursor at a depth of 1. The projection
+	// flips y for Vulkan, and so does the cursor position.
+	const float* const view = uboAttributes->mvp.view;
+	const float* const proj = uboAttributes->mvp.proj;
+	float viewDirection[3] = {
+		(2.0f * cursorX / width - 1.0f) / proj[0],
+		(2.0f * cursorY / height - 1.0f) / proj[5],
+		-1.0f
+	};
+
+	// The view rotation is orthonormal, so its transpose takes the
+	// direction back to world space
+	float direction[3];
+	for (int c = 0; c < 3; ++c) {
+		direction[c] = view[c * 4] * viewDirection[0]
+			+ view[c * 4 + 1] * viewDirection[1]
+			+ view[c * 4 + 2] * viewDirection[2];
+	}
+	float distance;
+	uint32_t instance = intersectBvhRay(uboAttributes->bvh,
+		uboAttributes->sceneAttributes.eyePos, direction, &distance);
+	return instance == BVH_NO_HIT ? uboAttributes->modelNode
+		: uboAttributes->firstInstanceNode + instance;
+}
+
 static void getMouseControlsState(GLFWwindow *window, double *x, double *y,
 								  uint16_t *controlsMask) {
 
@@ -98,9 +135,21 @@ void applyUBOControls(GLFWwindow *window, UBOAttributes *uboAttributes) {
 		uboAttributes->yaw -= deltaX;
 		uboAttributes->pitch += deltaY;
 	}
-	if (controlsMask & CONTROL_ROTATE_MODEL) {
-		rotateMatrix(uboAttributes->mvp.model, -deltaY * 2.0f, 0.0f, 0.0f, 1.0f);
-		rotateMatrix(uboAttributes->mvp.model, deltaX * 2.0f, 0.0f, 1.0f, 0.0f);
+	if (!(controlsMask & CONTROL_ROTATE_MODEL)) {
+		uboAttributes->pickedNode = SCENE_NO_NODE;
+	} else if (uboAttributes->pickedNode == SCENE_NO_NODE) {
+		// The node under the cursor when the button goes down is
+		// rotated for the whole drag
+		uboAttributes->pickedNode = pickModelNode(window, uboAttributes,
+			cursorX, cursorY);
+	}
+	if (uboAttributes->pickedNode != SCENE_NO_NODE
+		&& uboAttributes->sceneGraph && (deltaX != 0.0 || deltaY != 0.0)) {
+
+		rotateSceneNode(uboAttributes->sceneGraph, uboAttributes->pickedNode,
+			-deltaY * 2.0f, 0.0f, 0.0f, 1.0f);
+		rotateSceneNode(uboAttributes->sceneGraph, uboAttributes->pickedNode,
+			deltaX * 2.0f, 0.0f, 1.0f, 0.0f);
 	}
 	glfwGetCursorPos(window, &uboAttributes->lastCursorX,
 		&uboAttributes->lastCursorY);
@@ -0,0 +1,82 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "instances.h"
+#include "maths.h"
+
+InstanceData* createInstanceGrid(uint32_t count, float spacing) {
+	InstanceData *instances = malloc(count * sizeof(InstanceData));
+	if (!instances) {
+		fprintf(stderr, "Failed to allocate %u instances.\n", count);
+		return NULL;
+	}
+
+	uint32_t side = (uint32_t) ceilf(cbrtf(count));
+	while (side * side * side < count) {
+		++side;
+	}
+	float offset = (side - 1) * spacing * 0.5f;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t x = i % side;
+		uint32_t y = (i / side) % side;
+		uint32_t z = i / (side * side);
+
+		identityMatrix(instances[i].model);
+		translateMatrix(instances[i].model, x * spacing - offset,
+			y * spacing - offset, z * spacing - offset);
+		instances[i].material = i % MATERIAL_COUNT;
+		instances[i].padding[0] = 0;
+		instances[i].padding[1] = 0;
+		instances[i].padding[2] = 0;
+	}
+	return instances;
+}
+
+PointLight* createLightField(uint32_t count, float extent, float radius) {
+	PointLight *lights = malloc(MAX(count, 1) * sizeof(PointLight));
+	if (!lights) {
+		fprintf(stderr, "Failed to allocate %u lights.\n", count);
+		return NULL;
+	}
+
+	// Fixed seed, so runs light the scene the same way
+	srand(1);
+	for (uint32_t i = 0; i < count; ++i) {
+		for (int j = 0; j < 3; ++j) {
+			lights[i].position[j] = ((float) rand() / RAND_MAX * 2.0f - 1.0f)
+				* extent;
+			lights[i].color[j] = 0.25f + (float) rand() / RAND_MAX;
+		}
+		lights[i].radius = radius;
+		lights[i].color[3] = 1.0f;
+	}
+	return lights;
+}
+
+void orbitLights(PointLight *lights, uint32_t count, float angle) {
+	float c = cosf(angle), s = sinf(angle);
+	for (uint32_t i = 0; i < count; ++i) {
+		float x = lights[i].position[0], z = lights[i].position[2];
+		lights[i].position[0] = c * x + s * z;
+		lights[i].position[2] = c * z - s * x;
+	}
+}
@@ -0,0 +1,34 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "vulkan-types.h"
+
+// Number of distinct materials instances cycle through; matches the tint
+// table in shader.frag
+#define MATERIAL_COUNT 4
+
+// Lays out count instances on a cubic grid centered on the origin
+InstanceData* createInstanceGrid(uint32_t count, float spacing);
+
+// Scatters count lights of the given radius and random colors through a
+// cube of half size extent centered on the origin
+PointLight* createLightField(uint32_t count, float extent, float radius);
+
+// Turns the lights about the y axis by angle radians
+void orbitLights(PointLight *lights, uint32_t count, float angle);
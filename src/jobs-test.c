@@ -0,0 +1,243 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "jobs.h"
+
+// Worker counts each check runs with, 0 leaving every job to the caller
+static const uint32_t workerCounts[] = { 0, 1, 3 };
+
+#define TREE_DEPTH 10
+#define STEAL_JOBS 64
+#define STEAL_TIMEOUT_S 10
+
+typedef struct _TestItem {
+	atomic_uint visits;
+	atomic_int onWorker;
+} TestItem;
+
+typedef struct _TreeNode {
+	JobSystem *jobSystem;
+	atomic_uint *leafCount;
+	uint32_t depth;
+} TreeNode;
+
+static pthread_t mainThread;
+
+static void visitItem(void *data) {
+	TestItem *item = data;
+	atomic_fetch_add(&item->visits, 1);
+	if (!pthread_equal(pthread_self(), mainThread)) {
+		atomic_store(&item->onWorker, 1);
+	}
+}
+
+static void visitRange(void *data, uint32_t first, uint32_t count) {
+	TestItem *items = data;
+	for (uint32_t i = first; i < first + count; ++i) {
+		atomic_fetch_add(&items[i].visits, 1);
+	}
+}
+
+static void runTree(void *data) {
+	TreeNode *node = data;
+	if (!node->depth) {
+		atomic_fetch_add(node->leafCount, 1);
+		return;
+	}
+	TreeNode children[2];
+	Job jobs[2];
+	JobCounter counter = { 0 };
+	for (int i = 0; i < 2; ++i) {
+		children[i] = (TreeNode) { node->jobSystem, node->leafCount,
+			node->depth - 1 };
+		jobs[i] = (Job) { runTree, &children[i], &counter };
+	}
+	submitJobs(node->jobSystem, jobs, 2);
+	waitForJobs(node->jobSystem, &counter);
+}
+
+static int checkVisits(TestItem *items, uint32_t count, const char* const name) {
+	for (uint32_t i = 0; i < count; ++i) {
+		if (atomic_load(&items[i].visits) != 1) {
+			fprintf(stderr, "%s: job %u ran %u times.\n", name, i,
+				atomic_load(&items[i].visits));
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void makeJobs(Job *jobs, TestItem *items, uint32_t count,
+	JobCounter *counter) {
+	for (uint32_t i = 0; i < count; ++i) {
+		atomic_init(&items[i].visits, 0);
+		atomic_init(&items[i].onWorker, 0);
+		jobs[i] = (Job) { visitItem, &items[i], counter };
+	}
+}
+
+// Overfills the caller's deque, whose extra jobs must run right away
+static int testDequeOverflow(JobSystem *jobSystem) {
+	const uint32_t count = 2 * JOB_DEQUE_CAPACITY + 1;
+	Job *jobs = malloc(count * sizeof(Job));
+	TestItem *items = malloc(count * sizeof(TestItem));
+	if (!jobs || !items) {
+		free(jobs);
+		free(items);
+		fprintf(stderr, "Failed to allocate deque test jobs.\n");
+		return 0;
+	}
+	JobCounter counter = { 0 };
+	makeJobs(jobs, items, count, &counter);
+	submitJobs(jobSystem, jobs, count);
+	waitForJobs(jobSystem, &counter);
+	int success = areJobsDone(&counter)
+		&& checkVisits(items, count, "Deque overflow");
+	free(jobs);
+	free(items);
+	return success;
+}
+
+// Waits without running jobs, so only the workers can finish them
+static int testSteal(JobSystem *jobSystem) {
+	Job jobs[STEAL_JOBS];
+	TestItem items[STEAL_JOBS];
+	JobCounter counter = { 0 };
+	makeJobs(jobs, items, STEAL_JOBS, &counter);
+	submitJobs(jobSystem, jobs, STEAL_JOBS);
+
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!areJobsDone(&counter)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - start.tv_sec > STEAL_TIMEOUT_S) {
+			fprintf(stderr, "Steal: workers left %u jobs queued.\n",
+				atomic_load(&counter.count));
+			// The jobs point into this frame, so finish them before returning
+			waitForJobs(jobSystem, &counter);
+			return 0;
+		}
+		sched_yield();
+	}
+	for (uint32_t i = 0; i < STEAL_JOBS; ++i) {
+		if (!atomic_load(&items[i].onWorker)) {
+			fprintf(stderr, "Steal: job %u ran on the waiting thread.\n", i);
+			return 0;
+		}
+	}
+	return checkVisits(items, STEAL_JOBS, "Steal");
+}
+
+// Without workers the caller pops its newest jobs first, so waiting on the
+// later batch must stop before running the earlier one
+static int testCounters(JobSystem *jobSystem) {
+	enum { FIRST = 16, SECOND = 8 };
+	Job jobs[FIRST + SECOND];
+	TestItem items[FIRST + SECOND];
+	JobCounter first = { 0 }, second = { 0 };
+	if (!areJobsDone(&first)) {
+		fprintf(stderr, "Counters: unused counter is not done.\n");
+		return 0;
+	}
+	makeJobs(jobs, items, FIRST, &first);
+	makeJobs(jobs + FIRST, items + FIRST, SECOND, &second);
+	submitJobs(jobSystem, jobs, FIRST);
+	submitJobs(jobSystem, jobs + FIRST, SECOND);
+
+	int success = 1;
+	if (atomic_load(&first.count) != FIRST
+		|| atomic_load(&second.count) != SECOND) {
+		fprintf(stderr, "Counters: counted %u and %u jobs.\n",
+			atomic_load(&first.count), atomic_load(&second.count));
+		success = 0;
+	}
+	waitForJobs(jobSystem, &second);
+	if (!areJobsDone(&second) || areJobsDone(&first)) {
+		fprintf(stderr, "Counters: waiting ran the wrong batch.\n");
+		success = 0;
+	}
+	waitForJobs(jobSystem, &first);
+	return success && areJobsDone(&first)
+		&& checkVisits(items, FIRST + SECOND, "Counters");
+}
+
+// Jobs waiting on their own children must not deadlock the pool
+static int testNestedWait(JobSystem *jobSystem) {
+	atomic_uint leafCount = 0;
+	JobCounter counter = { 0 };
+	TreeNode root = { jobSystem, &leafCount, TREE_DEPTH };
+	Job rootJob = { runTree, &root, &counter };
+	submitJobs(jobSystem, &rootJob, 1);
+	waitForJobs(jobSystem, &counter);
+	if (atomic_load(&leafCount) != 1u << TREE_DEPTH) {
+		fprintf(stderr, "Nested wait: ran %u of %u leaf jobs.\n",
+			atomic_load(&leafCount), 1u << TREE_DEPTH);
+		return 0;
+	}
+	return 1;
+}
+
+static int testParallelFor(JobSystem *jobSystem) {
+	// Empty, smaller than a batch, uneven, and more than the batch limit
+	static const uint32_t counts[] = { 0, 3, 1001, JOB_MAX_BATCHES * 8 + 5 };
+	TestItem *items = malloc(counts[3] * sizeof(TestItem));
+	if (!items) {
+		fprintf(stderr, "Failed to allocate parallel for items.\n");
+		return 0;
+	}
+	int success = 1;
+	for (uint32_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+		for (uint32_t i = 0; i < counts[c]; ++i) {
+			atomic_init(&items[i].visits, 0);
+		}
+		parallelFor(jobSystem, counts[c], 4, visitRange, items);
+		success = success && checkVisits(items, counts[c], "Parallel for");
+	}
+	free(items);
+	return success;
+}
+
+int main(void) {
+	mainThread = pthread_self();
+	int success = 1;
+	for (uint32_t w = 0; w < sizeof(workerCounts) / sizeof(workerCounts[0]);
+		++w) {
+		JobSystem jobSystem;
+		if (!createJobSystem(&jobSystem, workerCounts[w])) {
+			fprintf(stderr, "Failed to create a job system with %u workers.\n",
+				workerCounts[w]);
+			return 1;
+		}
+		int passed = testDequeOverflow(&jobSystem)
+			&& (!workerCounts[w] || testSteal(&jobSystem))
+			&& (workerCounts[w] || testCounters(&jobSystem))
+			&& testNestedWait(&jobSystem)
+			&& testParallelFor(&jobSystem);
+		destroyJobSystem(&jobSystem);
+		printf("%s with %u workers\n", passed ? "PASS" : "FAIL",
+			workerCounts[w]);
+		success = success && passed;
+	}
+	return success ? 0 : 1;
+}
@@ -0,0 +1,288 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jobs.h"
+#include "maths.h"
+
+typedef struct _ForBatch {
+	void (*function)(void *data, uint32_t first, uint32_t count);
+	void *data;
+	uint32_t first, count;
+} ForBatch;
+
+// Deque of the current thread, if it belongs to a job system
+static _Thread_local const JobSystem *localSystem;
+static _Thread_local uint32_t localIndex;
+
+// Owner only. Fails when the deque is full.
+static int pushJob(JobDeque *deque, Job *job) {
+	int64_t bottom = atomic_load_explicit(&deque->bottom,
+		memory_order_relaxed);
+	int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	if (bottom - top >= JOB_DEQUE_CAPACITY) {
+		return 0;
+	}
+	atomic_store_explicit(&deque->jobs[bottom & (JOB_DEQUE_CAPACITY - 1)],
+		job, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+	return 1;
+}
+
+// Owner only. Takes the most recently pushed job, racing thieves for the
+// last one.
+static Job* popJob(JobDeque *deque) {
+	int64_t bottom = atomic_load_explicit(&deque->bottom,
+		memory_order_relaxed) - 1;
+	atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+	if (top > bottom) {
+		atomic_store_explicit(&deque->bottom, bottom + 1,
+			memory_order_relaxed);
+		return NULL;
+	}
+
+	Job *job = atomic_load_explicit(
+		&deque->jobs[bottom & (JOB_DEQUE_CAPACITY - 1)],
+		memory_order_relaxed);
+	if (top == bottom) {
+		if (!atomic_compare_exchange_strong_explicit(&deque->top, &top,
+				top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+			job = NULL;
+		}
+		atomic_store_explicit(&deque->bottom, bottom + 1,
+			memory_order_relaxed);
+	}
+	return job;
+}
+
+// Any thread. Takes the oldest job, or NULL if empty or lost to another.
+static Job* stealJob(JobDeque *deque) {
+	int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t bottom = atomic_load_explicit(&deque->bottom,
+		memory_order_acquire);
+	if (top >= bottom) {
+		return NULL;
+	}
+
+	Job *job = atomic_load_explicit(
+		&deque->jobs[top & (JOB_DEQUE_CAPACITY - 1)], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+			memory_order_seq_cst, memory_order_relaxed)) {
+		return NULL;
+	}
+	return job;
+}
+
+static void runJob(Job *job) {
+	JobCounter *counter = job->counter;
+	job->function(job->data);
+	// The job may be freed by a waiter as soon as the counter is released
+	atomic_fetch_sub_explicit(&counter->count, 1, memory_order_release);
+}
+
+// Pops from the thread's own deque first, then steals from the others
+// starting with its neighbour, so thieves spread over the victims
+static Job* findJob(JobSystem *system, uint32_t index) {
+	Job *job = popJob(&system->deques[index]);
+	for (uint32_t i = 1; !job && i <= system->workerCount; ++i) {
+		job = stealJob(&system->deques[(index + i)
+			% (system->workerCount + 1)]);
+	}
+	if (job) {
+		atomic_fetch_sub(&system->queuedJobs, 1);
+	}
+	return job;
+}
+
+static void* workerLoop(void *args) {
+	JobWorker *worker = args;
+	JobSystem *system = worker->system;
+	uint32_t index = worker->index;
+	localSystem = system;
+	localIndex = index;
+
+	while (!atomic_load(&system->shutdown)) {
+		Job *job = findJob(system, index);
+		if (job) {
+			runJob(job);
+			continue;
+		}
+
+		// Sleep until a job is queued. The count is checked under the
+		// mutex that submitters take to wake sleepers, so no wakeup is lost.
+		pthread_mutex_lock(&system->sleepMutex);
+		atomic_fetch_add(&system->sleepingWorkers, 1);
+		while (!atomic_load(&system->queuedJobs)
+			&& !atomic_load(&system->shutdown)) {
+			pthread_cond_wait(&system->wakeCondition, &system->sleepMutex);
+		}
+		atomic_fetch_sub(&system->sleepingWorkers, 1);
+		pthread_mutex_unlock(&system->sleepMutex);
+	}
+	return NULL;
+}
+
+static void stopWorkers(JobSystem *system, uint32_t count) {
+	pthread_mutex_lock(&system->sleepMutex);
+	atomic_store(&system->shutdown, 1);
+	pthread_cond_broadcast(&system->wakeCondition);
+	pthread_mutex_unlock(&system->sleepMutex);
+	for (uint32_t i = 0; i < count; ++i) {
+		pthread_join(system->workers[i].thread, NULL);
+	}
+}
+
+int createJobSystem(JobSystem *system, uint32_t workerCount) {
+	memset(system, 0, sizeof(JobSystem));
+	system->workerCount = workerCount;
+	system->deques = aligned_alloc(64, (workerCount + 1) * sizeof(JobDeque));
+	system->workers = malloc(MAX(workerCount, 1) * sizeof(JobWorker));
+	if (!system->deques || !system->workers
+		|| pthread_mutex_init(&system->sleepMutex, NULL)) {
+		fprintf(stderr, "Failed to allocate job system.\n");
+		free(system->deques);
+		free(system->workers);
+		return 0;
+	}
+	pthread_cond_init(&system->wakeCondition, NULL);
+	for (uint32_t i = 0; i <= workerCount; ++i) {
+		atomic_init(&system->deques[i].top, 0);
+		atomic_init(&system->deques[i].bottom, 0);
+	}
+	localSystem = system;
+	localIndex = 0;
+
+	for (uint32_t i = 0; i < workerCount; ++i) {
+		system->workers[i].system = system;
+		system->workers[i].index = i + 1;
+		if (pthread_create(&system->workers[i].thread, NULL, workerLoop,
+						   &system->workers[i])) {
+			fprintf(stderr, "Failed to create job worker %u.\n", i);
+			stopWorkers(system, i);
+			destroyJobSystem(system);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+uint32_t getJobThreadCount(const JobSystem* const system) {
+	return system->workerCount + 1;
+}
+
+void submitJobs(JobSystem *system, Job *jobs, uint32_t count) {
+	for (uint32_t i = 0; i < count; ++i) {
+		atomic_fetch_add_explicit(&jobs[i].counter->count, 1,
+			memory_order_relaxed);
+	}
+	if (localSystem != system) {
+		for (uint32_t i = 0; i < count; ++i) {
+			runJob(&jobs[i]);
+		}
+		return;
+	}
+
+	// Counted before they are pushed so thieves never take the count below
+	// zero. Jobs that don't fit in the deque run right away.
+	atomic_fetch_add(&system->queuedJobs, count);
+	uint32_t queued = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (pushJob(&system->deques[localIndex], &jobs[i])) {
+			++queued;
+		} else {
+			atomic_fetch_sub(&system->queuedJobs, 1);
+			runJob(&jobs[i]);
+		}
+	}
+	if (queued && atomic_load(&system->sleepingWorkers)) {
+		pthread_mutex_lock(&system->sleepMutex);
+		pthread_cond_broadcast(&system->wakeCondition);
+		pthread_mutex_unlock(&system->sleepMutex);
+	}
+}
+
+int areJobsDone(const JobCounter* const counter) {
+	return !atomic_load_explicit(&counter->count, memory_order_acquire);
+}
+
+void waitForJobs(JobSystem *system, const JobCounter* const counter) {
+	while (atomic_load_explicit(&counter->count, memory_order_acquire)) {
+		Job *job = localSystem == system ? findJob(system, localIndex)
+			: NULL;
+		if (job) {
+			runJob(job);
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+static void runForBatch(void *data) {
+	ForBatch *batch = data;
+	batch->function(batch->data, batch->first, batch->count);
+}
+
+void parallelFor(JobSystem *system, uint32_t count, uint32_t minBatch,
+	void (*function)(void *data, uint32_t first, uint32_t count),
+	void *data) {
+
+	// A few batches per thread let stealing even out uneven batches
+	uint32_t batchCount = MIN(getJobThreadCount(system) * 4,
+		count / MAX(minBatch, 1));
+	batchCount = MIN(batchCount, JOB_MAX_BATCHES);
+	if (batchCount <= 1) {
+		if (count) {
+			function(data, 0, count);
+		}
+		return;
+	}
+
+	ForBatch batches[JOB_MAX_BATCHES];
+	Job jobs[JOB_MAX_BATCHES];
+	JobCounter counter = { 0 };
+	uint32_t batchSize = count / batchCount, remainder = count % batchCount;
+	uint32_t first = 0;
+	for (uint32_t i = 0; i < batchCount; ++i) {
+		uint32_t size = batchSize + (i < remainder);
+		batches[i] = (ForBatch) { function, data, first, size };
+		jobs[i] = (Job) { runForBatch, &batches[i], &counter };
+		first += size;
+	}
+	submitJobs(system, jobs, batchCount);
+	waitForJobs(system, &counter);
+}
+
+void destroyJobSystem(JobSystem *system) {
+	if (!atomic_load(&system->shutdown)) {
+		stopWorkers(system, system->workerCount);
+	}
+	if (localSystem == system) {
+		localSystem = NULL;
+	}
+	pthread_mutex_destroy(&system->sleepMutex);
+	pthread_cond_destroy(&system->wakeCondition);
+	free(system->deques);
+	free(system->workers);
+}
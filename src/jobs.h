@@ -0,0 +1,95 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Jobs each worker can queue before further jobs run right away instead.
+// Must be a power of two.
+#define JOB_DEQUE_CAPACITY 4096
+
+// Upper bound on the batches a parallel for is split into
+#define JOB_MAX_BATCHES 256
+
+typedef void (*JobFunction)(void *data);
+
+// Counts the unfinished jobs submitted with it
+typedef struct _JobCounter {
+	atomic_uint count;
+} JobCounter;
+
+// Owned by the submitter, and must stay valid until its counter reaches 0
+typedef struct _Job {
+	JobFunction function;
+	void *data;
+	JobCounter *counter;
+} Job;
+
+// Chase-Lev work-stealing deque. Its owner pushes and pops jobs at the
+// bottom, other workers steal them from the top. The ends sit on separate
+// cache lines since thieves and the owner write them concurrently.
+typedef struct _JobDeque {
+	_Alignas(64) _Atomic int64_t top;
+	_Alignas(64) _Atomic int64_t bottom;
+	_Atomic(Job*) jobs[JOB_DEQUE_CAPACITY];
+} JobDeque;
+
+typedef struct _JobWorker {
+	struct _JobSystem *system;
+	uint32_t index; // Of its deque
+	pthread_t thread;
+} JobWorker;
+
+// A fixed pool of workerCount threads. The thread that created the system
+// also owns a deque and runs jobs while it waits for them. Jobs submitted
+// from any other thread run right away on that thread.
+typedef struct _JobSystem {
+	JobDeque *deques; // workerCount + 1, the creating thread's first
+	JobWorker *workers;
+	uint32_t workerCount;
+	atomic_uint queuedJobs, sleepingWorkers;
+	atomic_int shutdown;
+	pthread_mutex_t sleepMutex;
+	pthread_cond_t wakeCondition;
+} JobSystem;
+
+int createJobSystem(JobSystem *system, uint32_t workerCount);
+
+// Threads jobs can run on, including the creating thread
+uint32_t getJobThreadCount(const JobSystem* const system);
+
+// Queues the jobs after adding them to their counters. Jobs may submit
+// and wait for further jobs.
+void submitJobs(JobSystem *system, Job *jobs, uint32_t count);
+
+// Whether the counted jobs all finished, for polling without waiting
+int areJobsDone(const JobCounter* const counter);
+
+// Runs queued jobs until the counter reaches 0, so waiting from inside a
+// job makes it depend on the counted jobs without blocking a worker
+void waitForJobs(JobSystem *system, const JobCounter* const counter);
+
+// Calls function(data, first, count) over consecutive ranges covering
+// [0, count), in batches of at least minBatch, and waits for all of them
+void parallelFor(JobSystem *system, uint32_t count, uint32_t minBatch,
+	void (*function)(void *data, uint32_t first, uint32_t count),
+	void *data);
+
+void destroyJobSystem(JobSystem *system);
@@ -0,0 +1,279 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "light-grid.h"
+#include "maths.h"
+
+#define SIMD_ALIGNMENT 16
+#define PADDING_RADIUS_SQUARED -1.0f
+
+// Far bound of the last slice, finite so tile bounds stay finite too
+#define LIGHT_GRID_MAX_DEPTH 1e30f
+
+static float getSliceDepth(uint32_t slice) {
+	if (!slice) {
+		return 0.0f;
+	} else if (slice >= LIGHT_GRID_Z) {
+		return LIGHT_GRID_MAX_DEPTH;
+	}
+	return LIGHT_GRID_NEAR * powf(LIGHT_GRID_FAR / LIGHT_GRID_NEAR,
+		(slice - 1) / (float) (LIGHT_GRID_Z - 2));
+}
+
+static uint32_t getDepthSlice(float depth) {
+	if (depth < LIGHT_GRID_NEAR) {
+		return 0;
+	}
+	float slice = 1.0f + logf(depth / LIGHT_GRID_NEAR) * (LIGHT_GRID_Z - 2)
+		/ logf(LIGHT_GRID_FAR / LIGHT_GRID_NEAR);
+	return MIN((uint32_t) slice, LIGHT_GRID_Z - 1);
+}
+
+int createLightGrid(LightGrid *grid, uint32_t maxLights) {
+	memset(grid, 0, sizeof(LightGrid));
+	grid->lightCapacity = (maxLights + 3) & ~3u;
+	size_t lightSize = grid->lightCapacity * sizeof(float);
+	grid->clusters = malloc(LIGHT_GRID_CLUSTERS * sizeof(uint32_t[2]));
+	grid->indices = malloc(LIGHT_GRID_MAX_INDICES * sizeof(uint32_t));
+	grid->viewX = malloc(lightSize);
+	grid->viewY = malloc(lightSize);
+	grid->depth = malloc(lightSize);
+	grid->radiusSquared = malloc(lightSize);
+	grid->sliceRanges = malloc(grid->lightCapacity * sizeof(uint8_t[2]));
+	grid->sliceLights = aligned_alloc(SIMD_ALIGNMENT,
+		LIGHT_GRID_Z * 4 * lightSize);
+	grid->sliceLightIndices = malloc(LIGHT_GRID_Z * grid->lightCapacity
+		* sizeof(uint32_t));
+	if (!grid->clusters || !grid->indices || !grid->viewX || !grid->viewY
+		|| !grid->depth || !grid->radiusSquared || !grid->sliceRanges
+		|| !grid->sliceLights || !grid->sliceLightIndices) {
+
+		fprintf(stderr, "Failed to allocate light grid.\n");
+		destroyLightGrid(grid);
+		return 0;
+	}
+	memset(grid->clusters, 0, LIGHT_GRID_CLUSTERS * sizeof(uint32_t[2]));
+	return 1;
+}
+
+void getLightGridParams(float *scale, uint32_t *counts, float width,
+	float height) {
+
+	scale[0] = LIGHT_GRID_X / width;
+	scale[1] = LIGHT_GRID_Y / height;
+	scale[2] = (LIGHT_GRID_Z - 2) / logf(LIGHT_GRID_FAR / LIGHT_GRID_NEAR);
+	scale[3] = 1.0f - logf(LIGHT_GRID_NEAR) * scale[2];
+	counts[0] = LIGHT_GRID_X;
+	counts[1] = LIGHT_GRID_Y;
+	counts[2] = LIGHT_GRID_Z;
+	counts[3] = 0;
+}
+
+// Bounds of the part of a tile's frustum between two depths, in view space
+// with depth along the viewing direction
+static void getClusterBounds(const LightGrid* const grid, uint32_t x,
+	uint32_t y, float nearDepth, float farDepth, float *min, float *max) {
+
+	float ndc[2][2] = {
+		{ -1.0f + 2.0f * x / LIGHT_GRID_X,
+		  -1.0f + 2.0f * (x + 1) / LIGHT_GRID_X },
+		{ -1.0f + 2.0f * y / LIGHT_GRID_Y,
+		  -1.0f + 2.0f * (y + 1) / LIGHT_GRID_Y }
+	};
+	for (int axis = 0; axis < 2; ++axis) {
+		min[axis] = INFINITY;
+		max[axis] = -INFINITY;
+		for (int edge = 0; edge < 2; ++edge) {
+			float nearValue = ndc[axis][edge] * nearDepth
+				/ grid->projScale[axis];
+			float farValue = ndc[axis][edge] * farDepth
+				/ grid->projScale[axis];
+			min[axis] = MIN(min[axis], MIN(nearValue, farValue));
+			max[axis] = MAX(max[axis], MAX(nearValue, farValue));
+		}
+	}
+	min[2] = nearDepth;
+	max[2] = farDepth;
+}
+
+// Appends the lights of the slice overlapping the cluster bounds to
+// indices, up to capacity. Returns the number appended.
+static uint32_t cullClusterLights(const float* const lightX,
+	const float* const lightY, const float* const lightDepth,
+	const float* const lightRadiusSquared, const uint32_t* const lightIndices,
+	uint32_t count, const float* const min, const float* const max,
+	uint32_t *indices, uint32_t capacity) {
+
+	uint32_t written = 0;
+#if defined(__SSE2__)
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 minX = _mm_set1_ps(min[0]), maxX = _mm_set1_ps(max[0]);
+	const __m128 minY = _mm_set1_ps(min[1]), maxY = _mm_set1_ps(max[1]);
+	const __m128 minZ = _mm_set1_ps(min[2]), maxZ = _mm_set1_ps(max[2]);
+	for (uint32_t i = 0; i < count; i += 4) {
+		// Distance from the box along each axis, zero inside it
+		__m128 value = _mm_load_ps(&lightX[i]);
+		__m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minX, value),
+			_mm_sub_ps(value, maxX)), zero);
+		value = _mm_load_ps(&lightY[i]);
+		__m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minY, value),
+			_mm_sub_ps(value, maxY)), zero);
+		value = _mm_load_ps(&lightDepth[i]);
+		__m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minZ, value),
+			_mm_sub_ps(value, maxZ)), zero);
+		__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx),
+			_mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		int mask = _mm_movemask_ps(_mm_cmple_ps(distance,
+			_mm_load_ps(&lightRadiusSquared[i])));
+		for (; mask && written < capacity; mask &= mask - 1) {
+			indices[written++] = lightIndices[i + __builtin_ctz(mask)];
+		}
+	}
+#else
+	for (uint32_t i = 0; i < count && written < capacity; ++i) {
+		float dx = MAX(MAX(min[0] - lightX[i], lightX[i] - max[0]), 0.0f);
+		float dy = MAX(MAX(min[1] - lightY[i], lightY[i] - max[1]), 0.0f);
+		float dz = MAX(MAX(min[2] - lightDepth[i], lightDepth[i] - max[2]),
+			0.0f);
+		if (dx * dx + dy * dy + dz * dz <= lightRadiusSquared[i]) {
+			indices[written++] = lightIndices[i];
+		}
+	}
+#endif
+	return written;
+}
+
+typedef struct _LightGridBuild {
+	LightGrid *grid;
+	uint32_t lightCount;
+} LightGridBuild;
+
+// Gathers the lights whose depth range overlaps each slice, then tests them
+// against every cluster of the slice. Slices write disjoint parts of the
+// grid, so they can be built concurrently.
+static void buildSlices(void *data, uint32_t first, uint32_t count) {
+	const LightGridBuild* const build = data;
+	LightGrid *grid = build->grid;
+	uint32_t capacity = grid->lightCapacity;
+	for (uint32_t z = first; z < first + count; ++z) {
+		float *lightX = &grid->sliceLights[z * 4 * capacity];
+		float *lightY = &lightX[capacity];
+		float *lightDepth = &lightY[capacity];
+		float *lightRadiusSquared = &lightDepth[capacity];
+		uint32_t *lightIndices = &grid->sliceLightIndices[z * capacity];
+		uint32_t sliceLightCount = 0;
+		for (uint32_t i = 0; i < build->lightCount; ++i) {
+			if (grid->sliceRanges[i][0] <= z && z <= grid->sliceRanges[i][1]) {
+				lightX[sliceLightCount] = grid->viewX[i];
+				lightY[sliceLightCount] = grid->viewY[i];
+				lightDepth[sliceLightCount] = grid->depth[i];
+				lightRadiusSquared[sliceLightCount] = grid->radiusSquared[i];
+				lightIndices[sliceLightCount++] = i;
+			}
+		}
+		uint32_t paddedCount = (sliceLightCount + 3) & ~3u;
+		for (uint32_t i = sliceLightCount; i < paddedCount; ++i) {
+			lightX[i] = lightY[i] = lightDepth[i] = 0.0f;
+			lightRadiusSquared[i] = PADDING_RADIUS_SQUARED;
+		}
+
+		float nearDepth = getSliceDepth(z), farDepth = getSliceDepth(z + 1);
+		uint32_t sliceStart = z * LIGHT_GRID_SLICE_INDICES;
+		uint32_t written = 0;
+		for (uint32_t y = 0; y < LIGHT_GRID_Y; ++y) {
+			for (uint32_t x = 0; x < LIGHT_GRID_X; ++x) {
+				uint32_t cluster = (z * LIGHT_GRID_Y + y) * LIGHT_GRID_X + x;
+				float min[3], max[3];
+				getClusterBounds(grid, x, y, nearDepth, farDepth, min, max);
+				uint32_t clusterCount = cullClusterLights(lightX, lightY,
+					lightDepth, lightRadiusSquared, lightIndices, paddedCount,
+					min, max, &grid->indices[sliceStart + written],
+					LIGHT_GRID_SLICE_INDICES - written);
+				grid->clusters[cluster][0] = sliceStart + written;
+				grid->clusters[cluster][1] = clusterCount;
+				written += clusterCount;
+			}
+		}
+		grid->sliceIndexCounts[z] = written;
+	}
+}
+
+void buildLightGrid(LightGrid *grid, const PointLight* const lights,
+	uint32_t count, const float* const view, const float* const proj,
+	JobSystem *jobSystem) {
+
+	count = MIN(count, grid->lightCapacity);
+	grid->projScale[0] = proj[0];
+	grid->projScale[1] = proj[5];
+	for (uint32_t i = 0; i < count; ++i) {
+		const float* const p = lights[i].position;
+		float radius = lights[i].radius;
+		grid->viewX[i] = view[0] * p[0] + view[4] * p[1] + view[8] * p[2]
+			+ view[12];
+		grid->viewY[i] = view[1] * p[0] + view[5] * p[1] + view[9] * p[2]
+			+ view[13];
+		grid->depth[i] = -(view[2] * p[0] + view[6] * p[1] + view[10] * p[2]
+			+ view[14]);
+		grid->radiusSquared[i] = radius * radius;
+
+		// Lights entirely behind the camera get an empty range
+		float depth = grid->depth[i];
+		grid->sliceRanges[i][0] = depth + radius < 0.0f ? 1
+			: getDepthSlice(depth - radius);
+		grid->sliceRanges[i][1] = depth + radius < 0.0f ? 0
+			: getDepthSlice(depth + radius);
+	}
+
+	LightGridBuild build = { grid, count };
+	parallelFor(jobSystem, LIGHT_GRID_Z, 1, buildSlices, &build);
+
+	// Close the gaps between slices, moving every list towards the start
+	uint32_t offset = 0;
+	for (uint32_t z = 0; z < LIGHT_GRID_Z; ++z) {
+		uint32_t sliceStart = z * LIGHT_GRID_SLICE_INDICES;
+		memmove(&grid->indices[offset], &grid->indices[sliceStart],
+			grid->sliceIndexCounts[z] * sizeof(uint32_t));
+		uint32_t *cluster = grid->clusters[z * LIGHT_GRID_X * LIGHT_GRID_Y];
+		for (uint32_t i = 0; i < LIGHT_GRID_X * LIGHT_GRID_Y; ++i) {
+			cluster[i * 2] -= sliceStart - offset;
+		}
+		offset += grid->sliceIndexCounts[z];
+	}
+	grid->indexCount = offset;
+}
+
+void destroyLightGrid(LightGrid *grid) {
+	free(grid->clusters);
+	free(grid->indices);
+	free(grid->viewX);
+	free(grid->viewY);
+	free(grid->depth);
+	free(grid->radiusSquared);
+	free(grid->sliceRanges);
+	free(grid->sliceLights);
+	free(grid->sliceLightIndices);
+	memset(grid, 0, sizeof(LightGrid));
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "jobs.h"
+#include "vulkan-types.h"
+
+// Froxels: screen tiles by exponential depth slices. Slice 0 covers depths
+// up to LIGHT_GRID_NEAR and the last one everything beyond LIGHT_GRID_FAR.
+#define LIGHT_GRID_X 16
+#define LIGHT_GRID_Y 9
+#define LIGHT_GRID_Z 24
+#define LIGHT_GRID_CLUSTERS (LIGHT_GRID_X * LIGHT_GRID_Y * LIGHT_GRID_Z)
+#define LIGHT_GRID_NEAR 0.5f
+#define LIGHT_GRID_FAR 500.0f
+
+// Light list entries each slice can hold. Lights beyond that are dropped
+// from the slice's clusters.
+#define LIGHT_GRID_SLICE_INDICES (LIGHT_GRID_X * LIGHT_GRID_Y * 64)
+#define LIGHT_GRID_MAX_INDICES (LIGHT_GRID_SLICE_INDICES * LIGHT_GRID_Z)
+
+// Cluster (z * LIGHT_GRID_Y + y) * LIGHT_GRID_X + x lists the lights
+// touching it as clusters[i][1] light indices from indices[clusters[i][0]].
+// Lights are kept as view space structure-of-arrays, padded to a multiple
+// of 4 with lights that touch nothing.
+typedef struct _LightGrid {
+	uint32_t (*clusters)[2];
+	uint32_t *indices;
+	uint32_t indexCount, lightCapacity;
+	float *viewX, *viewY, *depth, *radiusSquared;
+	uint8_t (*sliceRanges)[2];
+	float *sliceLights; // 4 padded arrays per slice
+	uint32_t *sliceLightIndices;
+	uint32_t sliceIndexCounts[LIGHT_GRID_Z];
+	float projScale[2];
+} LightGrid;
+
+int createLightGrid(LightGrid *grid, uint32_t maxLights);
+
+// Writes what shader.frag needs to find the cluster of a fragment: tiles
+// per pixel in x and y, and the scale and bias turning the log of the view
+// depth into a slice. counts gets the cluster counts along each axis.
+void getLightGridParams(float *scale, uint32_t *counts, float width,
+	float height);
+
+// Lists the lights overlapping each cluster, splitting the slices across
+// the job system
+void buildLightGrid(LightGrid *grid, const PointLight* const lights,
+	uint32_t count, const float* const view, const float* const proj,
+	JobSystem *jobSystem);
+
+void destroyLightGrid(LightGrid *grid);
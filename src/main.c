@@ -18,19 +18,41 @@
 #include <GLFW/glfw3.h>
 
 #include <getopt.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "benchmark.h"
 #include "console.h"
+#include "culling.h"
+#include "draw-list.h"
 #include "glfw-controls.h"
+#include "instances.h"
+#include "jobs.h"
+#include "light-grid.h"
+#include "maths.h"
+#include "mesh.h"
+#include "mesh-optimizer.h"
+#include "mesh-simplifier.h"
+#include "meshlets.h"
+#include "render-scale.h"
+#include "scene-graph.h"
+#include "shadow-cache.h"
 #include "vulkan-draw.h"
 #include "vulkan-lifecycle.h"
 
 #define DEFAULT_WIDTH 1024
 #define DEFAULT_HEIGHT 768
+#define SPHERE_RINGS 48
+#define SPHERE_SEGMENTS 96
+#define INSTANCE_SPACING 1.5f
+#define LIGHT_FIELD_RADIUS 8.0f
+#define SCENE_LIGHT_RADIUS 100.0f
+#define LIGHT_ORBIT_SPEED 0.2f // Radians per second
 
 static void printHelp() {
 	printf("Usage: hello-vulkan [options]\n\n"
@@ -42,12 +64,91 @@ static void printHelp() {
 		   " -i, --interactive\tLaunch in interactive mode.\n"
 		   " -r, --framerate\tDisplay framerate every second. Ignored in\n"
 		   "\t\t\tinteractive mode.\n"
-		   " -?, --help\t\tDisplay this help.\n", DEFAULT_WIDTH, DEFAULT_HEIGHT);
+		   " -m, --mesh <name>\tMesh to display: cube or sphere. Default is\n"
+		   "\t\t\tcube.\n"
+		   " -c, --compact\t\tUse the compact vertex format for meshes.\n"
+		   " -o, --optimize\t\tOptimize meshes for the vertex cache and\n"
+		   "\t\t\toverdraw at load time and print statistics.\n"
+		   " -l, --lods		Generate simplified LODs of meshes at load\n"
+		   "\t\t\ttime, selected per instance when culling on\n"
+		   "\t\t\tthe CPU.\n"
+		   " -n, --instances <n>\tDraw n instances of the mesh on a\n"
+		   "\t\t\tgrid. Default is 1.\n"
+		   " -u, --culling <mode>\tInstance culling: none, cpu, gpu,\n"
+		   "\t\t\tmeshlets or occlusion. Default is cpu.\n"
+		   " -g, --lights <n>\tAdd n point lights orbiting through the\n"
+		   "\t\t\tinstances, shaded through a clustered light\n"
+		   "\t\t\tgrid. Default is 0.\n"
+		   " -d, --direct\t\tDraw each visible instance with its own draw\n"
+		   "\t\t\tcall instead of instancing. Only with culling\n"
+		   "\t\t\ton the CPU or none.\n"
+		   " -p, --prepass\t\tStart with the depth prepass on. The\n"
+		   "\t\t\tinteractive console's prepass command\n"
+		   "\t\t\ttoggles it.\n"
+		   " -e, --deferred\t\tWrite a G-buffer in the draw passes and light\n"
+		   "\t\t\teach pixel once in a fullscreen pass, instead\n"
+		   "\t\t\tof shading every drawn fragment.\n"
+		   " -x, --async-compute\tRun bloom and tonemapping on a compute\n"
+		   "\t\t\tqueue, overlapping the next frame's culling\n"
+		   "\t\t\tand shadows.\n"
+		   " -a, --adaptive-resolution <ms>\n"
+		   "\t\t\tScale the rendering resolution between 50%%\n"
+		   "\t\t\tand 100%% to keep the GPU frame time within\n"
+		   "\t\t\tms. Not with occlusion culling.\n"
+		   " -t, --record-threads <n>\n"
+		   "\t\t\tThreads recording command buffers, up to %d.\n"
+		   "\t\t\tDefault is the number of CPUs.\n"
+		   " -s, --record-scaling\tPrint the time to record one draw per\n"
+		   "\t\t\tinstance with 1 to n recording threads and exit.\n"
+		   " -b, --benchmark <name>\tRun a CPU benchmark and exit: culling,\n"
+		   "\t\t\tscene, bvh, jobs\n"
+		   "\t\t\tor lights.\n"
+		   " -?, --help\t\tDisplay this help.\n", DEFAULT_WIDTH, DEFAULT_HEIGHT,
+		   MAX_RECORD_THREADS);
 	exit(0);
 }
 
+// Builds a root node, rotated by the mouse, with one child per instance.
+// Instance i is node i + 1.
+static int createScene(SceneGraph *scene, const InstanceData* const instances,
+					   uint32_t instanceCount, uint32_t *rootNode) {
+
+	if (!createSceneGraph(scene, instanceCount + 1)) {
+		return 0;
+	}
+	float identity[16];
+	identityMatrix(identity);
+	*rootNode = addSceneNode(scene, SCENE_NO_NODE, identity);
+	for (uint32_t i = 0; i < instanceCount; ++i) {
+		addSceneNode(scene, *rootNode, instances[i].model);
+	}
+	updateSceneGraph(scene);
+	return 1;
+}
+
+// Copies the world matrices the last scene update changed into the
+// instances and lists the instances, in increasing order
+static uint32_t syncInstances(const SceneGraph* const scene,
+							  InstanceData *instances, uint32_t *changed) {
+	uint32_t changedCount = 0;
+	for (uint32_t i = 0; i < scene->changedCount; ++i) {
+		uint32_t node = scene->changedNodes[i];
+		if (node) {
+			memcpy(instances[node - 1].model, &scene->worldMatrices[node * 16],
+				sizeof(instances[node - 1].model));
+			changed[changedCount++] = node - 1;
+		}
+	}
+	return changedCount;
+}
+
 static void parseArgs(int argc, char* const *argv, int *width, int *height,
-			   int *fullscreen, int *noVsync, int *interactive, int *framerate) {
+			   int *fullscreen, int *noVsync, int *interactive, int *framerate,
+			   int *sphere, int *compact, int *optimize, int *lods,
+			   uint32_t *instanceCount, CullingMode *culling, int *direct,
+			   int *prepass, ShadingMode *shading, int *asyncCompute,
+			   float *gpuBudgetMs, uint32_t *recordThreads,
+			   int *recordScaling, uint32_t *lightCount) {
 
 	char c;
 	static struct option longOptions[] = {
@@ -57,10 +158,25 @@ static void parseArgs(int argc, char* const *argv, int *width, int *height,
 		{ "novsync", no_argument, NULL, 'v' },
 		{ "interactive", no_argument, NULL, 'i' },
 		{ "framerate", no_argument, NULL, 'r' },
+		{ "mesh", required_argument, NULL, 'm' },
+		{ "compact", no_argument, NULL, 'c' },
+		{ "optimize", no_argument, NULL, 'o' },
+		{ "lods", no_argument, NULL, 'l' },
+		{ "instances", required_argument, NULL, 'n' },
+		{ "culling", required_argument, NULL, 'u' },
+		{ "lights", required_argument, NULL, 'g' },
+		{ "direct", no_argument, NULL, 'd' },
+		{ "prepass", no_argument, NULL, 'p' },
+		{ "deferred", no_argument, NULL, 'e' },
+		{ "async-compute", no_argument, NULL, 'x' },
+		{ "adaptive-resolution", required_argument, NULL, 'a' },
+		{ "record-threads", required_argument, NULL, 't' },
+		{ "record-scaling", no_argument, NULL, 's' },
+		{ "benchmark", required_argument, NULL, 'b' },
 		{ "help", no_argument, NULL, '?' }
 	};
 
-	while ((c = getopt_long(argc, argv, "w:h:fvir?", longOptions, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "w:h:fvirm:coln:u:g:dpexa:t:sb:?", longOptions, NULL)) != -1) {
 		switch(c) {
 			case 'w':
 				*width = atoi(optarg);
@@ -88,6 +204,83 @@ static void parseArgs(int argc, char* const *argv, int *width, int *height,
 			case 'r':
 				*framerate = 1;
 				break;
+			case 'm':
+				if (!strcmp(optarg, "sphere")) {
+					*sphere = 1;
+				} else if (strcmp(optarg, "cube")) {
+					fprintf(stderr, "Invalid mesh: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'c':
+				*compact = 1;
+				break;
+			case 'o':
+				*optimize = 1;
+				break;
+			case 'l':
+				*lods = 1;
+				break;
+			case 'n':
+				*instanceCount = strtoul(optarg, NULL, 10);
+				if (!*instanceCount) {
+					fprintf(stderr, "Invalid instance count: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'u':
+				if (!strcmp(optarg, "none")) {
+					*culling = CULLING_NONE;
+				} else if (!strcmp(optarg, "cpu")) {
+					*culling = CULLING_CPU;
+				} else if (!strcmp(optarg, "gpu")) {
+					*culling = CULLING_GPU;
+				} else if (!strcmp(optarg, "meshlets")) {
+					*culling = CULLING_MESHLETS;
+				} else if (!strcmp(optarg, "occlusion")) {
+					*culling = CULLING_OCCLUSION;
+				} else {
+					fprintf(stderr, "Invalid culling mode: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'g':
+				*lightCount = strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				*direct = 1;
+				break;
+			case 'p':
+				*prepass = 1;
+				break;
+			case 'e':
+				*shading = SHADING_DEFERRED;
+				break;
+			case 'x':
+				*asyncCompute = 1;
+				break;
+			case 'a':
+				*gpuBudgetMs = strtof(optarg, NULL);
+				if (*gpuBudgetMs <= 0.0f) {
+					fprintf(stderr, "Invalid GPU frame time budget: %s\n",
+						optarg);
+					exit(1);
+				}
+				break;
+			case 't':
+				*recordThreads = strtoul(optarg, NULL, 10);
+				if (!*recordThreads || *recordThreads > MAX_RECORD_THREADS) {
+					fprintf(stderr, "Invalid recording thread count: %s\n",
+						optarg);
+					exit(1);
+				}
+				break;
+			case 's':
+				*recordScaling = 1;
+				break;
+			case 'b':
+				exit(runBenchmark(optarg) ? 0 : 1);
+				break;
 			case '?':
 				printHelp();
 				break;
@@ -97,13 +290,108 @@ static void parseArgs(int argc, char* const *argv, int *width, int *height,
 
 int main(int argc, char **argv) {
 	int width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT, fullscreen = 0,
-		noVsync = 0, interactive = 0, enableFramerate = 0;
+		noVsync = 0, interactive = 0, enableFramerate = 0, sphere = 0,
+		compact = 0, optimize = 0, lods = 0, direct = 0, prepass = 0,
+		recordScaling = 0, asyncCompute = 0;
+	CullingMode culling = CULLING_CPU;
+	ShadingMode shading = SHADING_FORWARD;
+	uint32_t instanceCount = 1, recordThreads = 0, extraLights = 0;
+	float gpuBudgetMs = 0.0f;
 	unsigned long long nframes = 0;
 	double framerate;
 	struct timeval tv, start;
 
 	parseArgs(argc, argv, &width, &height, &fullscreen, &noVsync, &interactive,
-		&enableFramerate);
+		&enableFramerate, &sphere, &compact, &optimize, &lods, &instanceCount,
+		&culling, &direct, &prepass, &shading, &asyncCompute, &gpuBudgetMs,
+		&recordThreads, &recordScaling, &extraLights);
+	if (direct && culling != CULLING_NONE && culling != CULLING_CPU) {
+		fprintf(stderr, "Direct draws need culling on the CPU or none.\n");
+		return 1;
+	}
+
+	// The depth pyramid is built from the whole depth image
+	if (gpuBudgetMs > 0.0f && culling == CULLING_OCCLUSION) {
+		fprintf(stderr, "Adaptive resolution doesn't work with occlusion "
+			"culling.\n");
+		return 1;
+	}
+
+	// Load scene meshes, choosing the vertex format for each
+	Mesh mesh;
+	int meshLoaded = sphere
+		? createSphereMesh(&mesh, SPHERE_RINGS, SPHERE_SEGMENTS)
+		: createCubeMesh(&mesh);
+	if (!meshLoaded || (optimize && !optimizeMesh(&mesh, 1))
+		|| (lods && !buildMeshLods(&mesh))
+		|| (culling == CULLING_MESHLETS && !buildMeshlets(&mesh))
+		|| (compact && !packMesh(&mesh))) {
+		fprintf(stderr, "Mesh loading failed.\n");
+		return 1;
+	}
+	InstanceData *instances = createInstanceGrid(instanceCount,
+		INSTANCE_SPACING);
+	if (!instances) {
+		destroyMesh(&mesh);
+		return 1;
+	}
+	SceneGraph scene;
+	uint32_t rootNode;
+	uint32_t *changedInstances = malloc(instanceCount * sizeof(uint32_t));
+	if (!changedInstances
+		|| !createScene(&scene, instances, instanceCount, &rootNode)) {
+		destroyMesh(&mesh);
+		free(instances);
+		free(changedInstances);
+		return 1;
+	}
+	// One worker per CPU besides the main thread, which also runs jobs
+	long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+	JobSystem jobSystem;
+	if (!createJobSystem(&jobSystem, cpuCount > 1 ? cpuCount - 1 : 0)) {
+		destroyMesh(&mesh);
+		free(instances);
+		free(changedInstances);
+		destroySceneGraph(&scene);
+		return 1;
+	}
+
+	// The culler's BVH also serves picking, so it exists in every mode
+	Culler culler = {};
+	if (!createCuller(&culler, instances, instanceCount, &mesh,
+					  &jobSystem)) {
+		destroyMesh(&mesh);
+		free(instances);
+		free(changedInstances);
+		destroySceneGraph(&scene);
+		destroyJobSystem(&jobSystem);
+		return 1;
+	}
+
+	// Light 0 is the scene light, the others orbit through the instances
+	uint32_t lightCount = extraLights + 1;
+	float lightExtent = cbrtf(instanceCount) * INSTANCE_SPACING * 0.5f
+		+ LIGHT_FIELD_RADIUS * 0.5f;
+	PointLight *lights = createLightField(lightCount, lightExtent,
+		LIGHT_FIELD_RADIUS);
+	LightGrid lightGrid = {};
+	ShadowCache shadowCache = {};
+	if (!lights || !createLightGrid(&lightGrid, lightCount)
+		|| !createShadowCache(&shadowCache, instanceCount)) {
+		destroyMesh(&mesh);
+		free(instances);
+		free(changedInstances);
+		destroySceneGraph(&scene);
+		destroyCuller(&culler);
+		destroyJobSystem(&jobSystem);
+		free(lights);
+		destroyLightGrid(&lightGrid);
+		destroyShadowCache(&shadowCache);
+		return 1;
+	}
+	FrameStats stats = { culling, instanceCount, instanceCount,
+		instanceCount * mesh.meshletCount, instanceCount * mesh.meshletCount,
+		0, 0, (uint64_t) instanceCount * (mesh.lods[0].indexCount / 3), 0.0 };
 
 	// Initialize GLFW
 	glfwInit();
@@ -122,15 +410,65 @@ int main(int argc, char **argv) {
 
 	// Initialize Vulkan
 	VkContext context = {};
-	if (!initVulkan(window, &context, !noVsync)) {
+	if (!initVulkan(window, &context, &mesh, instances, instanceCount,
+					culling, shading, asyncCompute, !noVsync, &jobSystem,
+					recordThreads ? recordThreads
+					: getJobThreadCount(&jobSystem), lightCount)) {
 		fprintf(stderr, "Vulkan initialization failed.\n");
 		destroyVulkan(&context);
+		destroyMesh(&mesh);
+		free(instances);
+		free(changedInstances);
+		destroySceneGraph(&scene);
+		destroyCuller(&culler);
+		destroyJobSystem(&jobSystem);
+		free(lights);
+		destroyLightGrid(&lightGrid);
+		destroyShadowCache(&shadowCache);
 		return 1;
 	};
 	UBOAttributes uboAttributes = initializeUBOAttributes(width, height);
+	uboAttributes.sceneGraph = &scene;
+	uboAttributes.modelNode = rootNode;
+	uboAttributes.firstInstanceNode = rootNode + 1;
+	uboAttributes.bvh = &culler.bvh;
+	uboAttributes.depthPrepass = prepass;
+	stats.recordThreadCount = context.recordThreadCount;
+	stats.shadingMode = shading;
+	stats.asyncCompute = context.asyncCompute;
+	stats.lightCount = lightCount;
+	if (gpuBudgetMs > 0.0f && !context.timestampPool) {
+		fprintf(stderr, "GPU timestamps aren't supported; the resolution "
+			"stays fixed.\n");
+	}
+	RenderScaler renderScaler;
+	initRenderScaler(&renderScaler, context.timestampPool ? gpuBudgetMs
+		: 0.0f);
+	DrawList drawList = {};
+	if (!createDrawList(&drawList, 16)) {
+		destroyVulkan(&context);
+		destroyMesh(&mesh);
+		free(instances);
+		free(changedInstances);
+		destroySceneGraph(&scene);
+		destroyCuller(&culler);
+		destroyJobSystem(&jobSystem);
+		free(lights);
+		destroyLightGrid(&lightGrid);
+		destroyShadowCache(&shadowCache);
+		return 1;
+	}
+
+	// Skips the main loop once the report is printed
+	int status = 0;
+	if (recordScaling) {
+		addInstanceDraws(&context, &drawList, NULL);
+		status = !reportRecordScaling(&context, &drawList);
+		glfwSetWindowShouldClose(window, GLFW_TRUE);
+	}
 
 	// Set up the console, if applicable
-	ConsoleArgs args = { &uboAttributes, window, &framerate };
+	ConsoleArgs args = { &uboAttributes, window, &framerate, &stats };
 	if (interactive) {
 		pthread_t thread;
 		pthread_create(&thread, NULL, consoleLoop, &args);
@@ -139,12 +477,111 @@ int main(int argc, char **argv) {
 	// Record start time for framerate calculation
 	gettimeofday(&start, NULL);
 	int lastSec = start.tv_sec;
+	double lastTime = glfwGetTime();
+	int framebufferWidth, framebufferHeight;
+	glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
 
 	// Main loop
 	while(!glfwWindowShouldClose(window)) {
 		glfwPollEvents();
+
+		// Nothing is drawn while the window is minimized, and a resize only
+		// recreates the swap chain and its attachments
+		int newWidth, newHeight;
+		glfwGetFramebufferSize(window, &newWidth, &newHeight);
+		if (!newWidth || !newHeight) {
+			glfwWaitEvents();
+			continue;
+		}
+		if (context.swapChainOutOfDate || newWidth != framebufferWidth
+			|| newHeight != framebufferHeight) {
+
+			if (!resizeSwapChain(window, &context)) {
+				fprintf(stderr, "Failed to resize the swap chain.\n");
+				status = 1;
+				break;
+			}
+			framebufferWidth = newWidth;
+			framebufferHeight = newHeight;
+			setRenderScale(&context, renderScaler.scale);
+			resizeUBOAttributes(&uboAttributes, context.renderExtent.width,
+				context.renderExtent.height);
+		}
 		updateUniformBuffer(window, &uboAttributes, &context);
-		drawFrame(&context);
+
+		// The scene light follows the attributes the console edits
+		double time = glfwGetTime();
+		orbitLights(&lights[1], lightCount - 1,
+			(time - lastTime) * LIGHT_ORBIT_SPEED);
+		lastTime = time;
+		memcpy(lights[0].position, uboAttributes.sceneAttributes.lightPos,
+			sizeof(lights[0].position));
+		memcpy(lights[0].color, uboAttributes.sceneAttributes.lightColor,
+			sizeof(lights[0].color));
+		lights[0].radius = SCENE_LIGHT_RADIUS;
+		gettimeofday(&tv, NULL);
+		double gridStart = tv.tv_sec * 1000.0 + tv.tv_usec * 0.001;
+		buildLightGrid(&lightGrid, lights, lightCount, uboAttributes.mvp.view,
+			uboAttributes.mvp.proj, &jobSystem);
+		updateLights(&context, lights, lightCount, &lightGrid);
+		gettimeofday(&tv, NULL);
+		stats.lightGridMs = tv.tv_sec * 1000.0 + tv.tv_usec * 0.001 - gridStart;
+		stats.lightEntries = lightGrid.indexCount;
+
+		// Only instances under nodes that moved are uploaded
+		uint32_t changedCount = updateSceneGraph(&scene)
+			? syncInstances(&scene, instances, changedInstances) : 0;
+		if (changedCount) {
+			updateInstances(&context, changedInstances, changedCount);
+			updateCuller(&culler, instances, changedInstances, changedCount);
+		}
+		updateShadowCache(&shadowCache, uboAttributes.sceneAttributes.lightPos,
+			changedInstances, changedCount);
+		updateShadowCasters(&context, &shadowCache);
+		stats.dynamicCasters = shadowCache.dynamicCount;
+		stats.shadowCacheRenders += shadowCache.staticDirty;
+		if (culling == CULLING_CPU) {
+			gettimeofday(&tv, NULL);
+			double cullStart = tv.tv_sec * 1000.0 + tv.tv_usec * 0.001;
+			stats.visibleInstances = cullScene(&culler, &uboAttributes.mvp,
+				context.extent.height);
+			updateVisibleInstances(&context, culler.lodVisible,
+				culler.lodVisibleCounts);
+			stats.triangleCount = 0;
+			for (uint32_t i = 0; i < mesh.lodCount; ++i) {
+				stats.triangleCount += (uint64_t) culler.lodVisibleCounts[i]
+					* (mesh.lods[i].indexCount / 3);
+			}
+			gettimeofday(&tv, NULL);
+			stats.cullMs = tv.tv_sec * 1000.0 + tv.tv_usec * 0.001 - cullStart;
+		}
+		clearDrawList(&drawList);
+		if (direct) {
+			addInstanceDraws(&context, &drawList,
+				culling == CULLING_CPU ? culler.lodVisibleCounts : NULL);
+		} else {
+			addSceneDraws(&context, &drawList);
+		}
+		context.depthPrepass = uboAttributes.depthPrepass;
+		stats.depthPrepass = context.depthPrepass;
+		drawFrame(&context, &drawList);
+		stats.drawCount = drawList.count;
+		stats.recordMs = context.recordMs;
+
+		// The next frame renders at the scale this one's GPU time calls
+		// for, with clusters still covering the rendered pixels
+		setRenderScale(&context, updateRenderScale(&renderScaler,
+			context.gpuMs));
+		getLightGridParams(uboAttributes.sceneAttributes.clusterScale,
+			uboAttributes.sceneAttributes.clusterCounts,
+			context.renderExtent.width, context.renderExtent.height);
+		stats.gpuMs = context.gpuMs;
+		stats.gpuIntervalMs = context.gpuIntervalMs;
+		stats.renderWidth = context.renderExtent.width;
+		stats.renderHeight = context.renderExtent.height;
+		if (culling != CULLING_NONE && culling != CULLING_CPU) {
+			readCullStats(&context, &stats);
+		}
 
 		if (enableFramerate || interactive) {
 			++nframes;
@@ -167,9 +604,19 @@ int main(int argc, char **argv) {
 	}
 
 	// Clean up
+	destroyDrawList(&drawList);
 	destroyVulkan(&context);
+	destroyMesh(&mesh);
+	free(instances);
+	free(changedInstances);
+	destroySceneGraph(&scene);
+	destroyCuller(&culler);
+	destroyJobSystem(&jobSystem);
+	free(lights);
+	destroyLightGrid(&lightGrid);
+	destroyShadowCache(&shadowCache);
 	glfwDestroyWindow(window);
 	glfwTerminate();
-	return 0;
+	return status;
 }
 
@@ -0,0 +1,400 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "maths.h"
+#include "mesh-optimizer.h"
+
+// Forsyth scoring parameters
+#define CACHE_DECAY_POWER 1.5f
+#define LAST_TRI_SCORE 0.75f
+#define VALENCE_BOOST_SCALE 2.0f
+#define VALENCE_BOOST_POWER 0.5f
+
+typedef struct _Cluster {
+	uint32_t start, count;
+	float sortKey;
+} Cluster;
+
+VertexCacheStats analyzeVertexCache(const uint32_t* const indices,
+	uint32_t indexCount, uint32_t vertexCount) {
+
+	VertexCacheStats stats = { 0.0f, 0.0f };
+	uint32_t triangleCount = indexCount / 3;
+	if (!triangleCount || !vertexCount) {
+		return stats;
+	}
+
+	// Timestamp per vertex of when it entered the FIFO
+	uint32_t *cacheTime = calloc(vertexCount, sizeof(uint32_t));
+	if (!cacheTime) {
+		return stats;
+	}
+	uint32_t time = VERTEX_CACHE_SIZE + 1, misses = 0;
+	for (uint32_t i = 0; i < indexCount; ++i) {
+		uint32_t index = indices[i];
+		if (time - cacheTime[index] > VERTEX_CACHE_SIZE) {
+			cacheTime[index] = time++;
+			++misses;
+		}
+	}
+	free(cacheTime);
+
+	stats.acmr = (float) misses / triangleCount;
+	stats.atvr = (float) misses / vertexCount;
+	return stats;
+}
+
+static float vertexScore(int cachePosition, uint32_t remainingTriangles) {
+	if (!remainingTriangles) {
+		return -1.0f;
+	}
+
+	float score = 0.0f;
+	if (cachePosition >= 0) {
+		if (cachePosition < 3) {
+			// The last triangle's vertices get a fixed score so that the
+			// strip-like order doesn't dominate
+			score = LAST_TRI_SCORE;
+		} else {
+			float scaler = 1.0f / (VERTEX_CACHE_SIZE - 3);
+			score = powf(1.0f - (cachePosition - 3) * scaler,
+				CACHE_DECAY_POWER);
+		}
+	}
+	score += VALENCE_BOOST_SCALE * powf(remainingTriangles,
+		-VALENCE_BOOST_POWER);
+	return score;
+}
+
+int optimizeVertexCache(uint32_t *indices, uint32_t indexCount,
+	uint32_t vertexCount) {
+
+	uint32_t triangleCount = indexCount / 3;
+	if (!triangleCount) {
+		return 1;
+	}
+
+	uint32_t *remaining = calloc(vertexCount, sizeof(uint32_t));
+	uint32_t *offsets = malloc((vertexCount + 1) * sizeof(uint32_t));
+	uint32_t *adjacency = malloc(indexCount * sizeof(uint32_t));
+	float *vertexScores = malloc(vertexCount * sizeof(float));
+	float *triangleScores = malloc(triangleCount * sizeof(float));
+	uint8_t *emitted = calloc(triangleCount, sizeof(uint8_t));
+	uint32_t *output = malloc(indexCount * sizeof(uint32_t));
+	if (!remaining || !offsets || !adjacency || !vertexScores
+		|| !triangleScores || !emitted || !output) {
+
+		fprintf(stderr, "Failed to allocate vertex cache optimizer state.\n");
+		free(remaining);
+		free(offsets);
+		free(adjacency);
+		free(vertexScores);
+		free(triangleScores);
+		free(emitted);
+		free(output);
+		return 0;
+	}
+
+	// Build vertex to triangle adjacency
+	for (uint32_t i = 0; i < indexCount; ++i) {
+		++remaining[indices[i]];
+	}
+	offsets[0] = 0;
+	for (uint32_t i = 0; i < vertexCount; ++i) {
+		offsets[i + 1] = offsets[i] + remaining[i];
+	}
+	memset(remaining, 0, vertexCount * sizeof(uint32_t));
+	for (uint32_t i = 0; i < indexCount; ++i) {
+		uint32_t vertex = indices[i];
+		adjacency[offsets[vertex] + remaining[vertex]++] = i / 3;
+	}
+
+	for (uint32_t i = 0; i < vertexCount; ++i) {
+		vertexScores[i] = vertexScore(-1, remaining[i]);
+	}
+	for (uint32_t i = 0; i < triangleCount; ++i) {
+		triangleScores[i] = vertexScores[indices[i * 3]]
+			+ vertexScores[indices[i * 3 + 1]]
+			+ vertexScores[indices[i * 3 + 2]];
+	}
+
+	// The cache holds three extra entries for the vertices pushed out
+	// by the newest triangle
+	uint32_t cache[VERTEX_CACHE_SIZE + 3], cacheCount = 0;
+	uint32_t fallbackCursor = 0;
+	int64_t bestTriangle = -1;
+	float bestScore = -1.0f;
+	for (uint32_t i = 0; i < triangleCount; ++i) {
+		if (triangleScores[i] > bestScore) {
+			bestScore = triangleScores[i];
+			bestTriangle = i;
+		}
+	}
+
+	for (uint32_t outputTriangle = 0; outputTriangle < triangleCount;
+		++outputTriangle) {
+
+		if (bestTriangle < 0) {
+			// Nothing in the cache is adjacent to anything left
+			while (emitted[fallbackCursor]) {
+				++fallbackCursor;
+			}
+			bestTriangle = fallbackCursor;
+		}
+
+		uint32_t triangle = bestTriangle;
+		const uint32_t* const triangleIndices = &indices[triangle * 3];
+		memcpy(&output[outputTriangle * 3], triangleIndices,
+			3 * sizeof(uint32_t));
+		emitted[triangle] = 1;
+
+		// Remove the triangle from its vertices' adjacency
+		for (int j = 0; j < 3; ++j) {
+			uint32_t vertex = triangleIndices[j];
+			uint32_t *list = &adjacency[offsets[vertex]];
+			for (uint32_t k = 0; k < remaining[vertex]; ++k) {
+				if (list[k] == triangle) {
+					list[k] = list[remaining[vertex] - 1];
+					break;
+				}
+			}
+			--remaining[vertex];
+		}
+
+		// Move the triangle's vertices to the front of the LRU cache
+		uint32_t newCache[VERTEX_CACHE_SIZE + 3], newCacheCount = 0;
+		for (int j = 0; j < 3; ++j) {
+			newCache[newCacheCount++] = triangleIndices[j];
+		}
+		for (uint32_t j = 0; j < cacheCount; ++j) {
+			uint32_t vertex = cache[j];
+			if (vertex != triangleIndices[0] && vertex != triangleIndices[1]
+				&& vertex != triangleIndices[2]) {
+
+				newCache[newCacheCount++] = vertex;
+			}
+		}
+
+		// Rescore everything that was touched and find the next best
+		// triangle among those adjacent to the cache
+		bestTriangle = -1;
+		bestScore = -1.0f;
+		for (uint32_t j = 0; j < newCacheCount; ++j) {
+			uint32_t vertex = newCache[j];
+			int position = j < VERTEX_CACHE_SIZE ? (int) j : -1;
+			float oldScore = vertexScores[vertex];
+			vertexScores[vertex] = vertexScore(position, remaining[vertex]);
+			float delta = vertexScores[vertex] - oldScore;
+
+			const uint32_t* const list = &adjacency[offsets[vertex]];
+			for (uint32_t k = 0; k < remaining[vertex]; ++k) {
+				uint32_t adjacent = list[k];
+				triangleScores[adjacent] += delta;
+				if (triangleScores[adjacent] > bestScore) {
+					bestScore = triangleScores[adjacent];
+					bestTriangle = adjacent;
+				}
+			}
+		}
+
+		cacheCount = MIN(newCacheCount, VERTEX_CACHE_SIZE);
+		memcpy(cache, newCache, cacheCount * sizeof(uint32_t));
+	}
+
+	memcpy(indices, output, indexCount * sizeof(uint32_t));
+
+	free(remaining);
+	free(offsets);
+	free(adjacency);
+	free(vertexScores);
+	free(triangleScores);
+	free(emitted);
+	free(output);
+	return 1;
+}
+
+static int compareClusters(const void *a, const void *b) {
+	float keyA = ((const Cluster*) a)->sortKey;
+	float keyB = ((const Cluster*) b)->sortKey;
+	return keyA < keyB ? 1 : keyA > keyB ? -1 : 0;
+}
+
+int optimizeOverdraw(uint32_t *indices, uint32_t indexCount,
+	const Vertex* const vertices, uint32_t vertexCount) {
+
+	uint32_t triangleCount = indexCount / 3;
+	if (!triangleCount) {
+		return 1;
+	}
+
+	uint32_t *cacheTime = calloc(vertexCount, sizeof(uint32_t));
+	Cluster *clusters = malloc(triangleCount * sizeof(Cluster));
+	uint32_t *output = malloc(indexCount * sizeof(uint32_t));
+	if (!cacheTime || !clusters || !output) {
+		fprintf(stderr, "Failed to allocate overdraw optimizer state.\n");
+		free(cacheTime);
+		free(clusters);
+		free(output);
+		return 0;
+	}
+
+	// Split at hard boundaries, where a triangle misses the cache on all
+	// three vertices. Reordering at these points keeps the ACMR intact.
+	uint32_t clusterCount = 0, time = VERTEX_CACHE_SIZE + 1;
+	for (uint32_t i = 0; i < triangleCount; ++i) {
+		int misses = 0;
+		for (int j = 0; j < 3; ++j) {
+			uint32_t index = indices[i * 3 + j];
+			if (time - cacheTime[index] > VERTEX_CACHE_SIZE) {
+				cacheTime[index] = time++;
+				++misses;
+			}
+		}
+		if (misses == 3 || clusterCount == 0) {
+			clusters[clusterCount].start = i;
+			clusters[clusterCount].count = 0;
+			++clusterCount;
+		}
+		++clusters[clusterCount - 1].count;
+	}
+
+	float meshCentroid[3] = { 0.0f, 0.0f, 0.0f };
+	for (uint32_t i = 0; i < vertexCount; ++i) {
+		meshCentroid[0] += vertices[i].pos[0] / vertexCount;
+		meshCentroid[1] += vertices[i].pos[1] / vertexCount;
+		meshCentroid[2] += vertices[i].pos[2] / vertexCount;
+	}
+
+	// Clusters facing away from the mesh center are likely to occlude the
+	// rest, so they sort first
+	for (uint32_t c = 0; c < clusterCount; ++c) {
+		float centroid[3] = { 0.0f, 0.0f, 0.0f };
+		float normal[3] = { 0.0f, 0.0f, 0.0f };
+		float totalArea = 0.0f;
+		for (uint32_t t = clusters[c].start;
+			t < clusters[c].start + clusters[c].count; ++t) {
+
+			const float* const p0 = vertices[indices[t * 3]].pos;
+			const float* const p1 = vertices[indices[t * 3 + 1]].pos;
+			const float* const p2 = vertices[indices[t * 3 + 2]].pos;
+			float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+			float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+			float n[3] = {
+				e1[1] * e2[2] - e1[2] * e2[1],
+				e1[2] * e2[0] - e1[0] * e2[2],
+				e1[0] * e2[1] - e1[1] * e2[0]
+			};
+			float area = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			for (int j = 0; j < 3; ++j) {
+				centroid[j] += (p0[j] + p1[j] + p2[j]) / 3.0f * area;
+				normal[j] += n[j];
+			}
+			totalArea += area;
+		}
+
+		float sortKey = 0.0f;
+		float normalLength = sqrtf(normal[0] * normal[0]
+			+ normal[1] * normal[1] + normal[2] * normal[2]);
+		if (totalArea > 0.0f && normalLength > 0.0f) {
+			for (int j = 0; j < 3; ++j) {
+				sortKey += (centroid[j] / totalArea - meshCentroid[j])
+					* normal[j] / normalLength;
+			}
+		}
+		clusters[c].sortKey = sortKey;
+	}
+
+	qsort(clusters, clusterCount, sizeof(Cluster), compareClusters);
+
+	uint32_t *ptr = output;
+	for (uint32_t c = 0; c < clusterCount; ++c) {
+		memcpy(ptr, &indices[clusters[c].start * 3],
+			clusters[c].count * 3 * sizeof(uint32_t));
+		ptr += clusters[c].count * 3;
+	}
+	memcpy(indices, output, indexCount * sizeof(uint32_t));
+
+	free(cacheTime);
+	free(clusters);
+	free(output);
+	return 1;
+}
+
+int optimizeVertexFetch(Mesh *mesh) {
+	uint32_t *remap = malloc(mesh->vertexCount * sizeof(uint32_t));
+	Vertex *vertices = malloc(mesh->vertexCount * sizeof(Vertex));
+	if (!remap || !vertices) {
+		fprintf(stderr, "Failed to allocate vertex fetch optimizer state.\n");
+		free(remap);
+		free(vertices);
+		return 0;
+	}
+	memset(remap, 0xff, mesh->vertexCount * sizeof(uint32_t));
+
+	uint32_t next = 0;
+	for (uint32_t i = 0; i < mesh->indexCount; ++i) {
+		uint32_t index = mesh->indices[i];
+		if (remap[index] == UINT32_MAX) {
+			remap[index] = next;
+			vertices[next++] = mesh->vertices[index];
+		}
+		mesh->indices[i] = remap[index];
+	}
+
+	// Unreferenced vertices go last
+	for (uint32_t i = 0; i < mesh->vertexCount; ++i) {
+		if (remap[i] == UINT32_MAX) {
+			vertices[next++] = mesh->vertices[i];
+		}
+	}
+
+	free(mesh->vertices);
+	mesh->vertices = vertices;
+	free(remap);
+	return 1;
+}
+
+int optimizeMesh(Mesh *mesh, int overdraw) {
+	VertexCacheStats before = analyzeVertexCache(mesh->indices,
+		mesh->indexCount, mesh->vertexCount);
+
+	if (!optimizeVertexCache(mesh->indices, mesh->indexCount,
+							 mesh->vertexCount)) {
+		return 0;
+	}
+	if (overdraw && !optimizeOverdraw(mesh->indices, mesh->indexCount,
+									  mesh->vertices, mesh->vertexCount)) {
+		return 0;
+	}
+	if (!optimizeVertexFetch(mesh)) {
+		return 0;
+	}
+
+	VertexCacheStats after = analyzeVertexCache(mesh->indices,
+		mesh->indexCount, mesh->vertexCount);
+	printf("Mesh optimization (%u vertices, %u triangles, FIFO %d):\n"
+		   "  ACMR: %f -> %f\n"
+		   "  ATVR: %f -> %f\n", mesh->vertexCount, mesh->indexCount / 3,
+		   VERTEX_CACHE_SIZE, before.acmr, after.acmr, before.atvr,
+		   after.atvr);
+	return 1;
+}
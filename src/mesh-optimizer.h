@@ -0,0 +1,46 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "vulkan-types.h"
+
+// Size of the simulated FIFO post-transform cache
+#define VERTEX_CACHE_SIZE 32
+
+typedef struct _VertexCacheStats {
+	float acmr; // Average cache miss ratio: transformed vertices per triangle
+	float atvr; // Average transform to vertex ratio: 1.0 is optimal
+} VertexCacheStats;
+
+VertexCacheStats analyzeVertexCache(const uint32_t* const indices,
+	uint32_t indexCount, uint32_t vertexCount);
+
+// Reorders triangles for the post-transform cache (Forsyth)
+int optimizeVertexCache(uint32_t *indices, uint32_t indexCount,
+	uint32_t vertexCount);
+
+// Reorders clusters of a cache-optimized index buffer so outward-facing
+// clusters are drawn first
+int optimizeOverdraw(uint32_t *indices, uint32_t indexCount,
+	const Vertex* const vertices, uint32_t vertexCount);
+
+// Reorders vertices into first-use order and remaps the indices
+int optimizeVertexFetch(Mesh *mesh);
+
+// Runs all passes on the mesh and prints the cache statistics
+int optimizeMesh(Mesh *mesh, int overdraw);
@@ -0,0 +1,485 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "maths.h"
+#include "mesh-optimizer.h"
+#include "mesh-simplifier.h"
+
+#define EMPTY_SLOT UINT32_MAX
+#define EMPTY_EDGE UINT64_MAX
+
+// Collapses may not turn a triangle's normal by more than about 75 degrees
+#define MIN_NORMAL_DOT 0.25f
+
+// Symmetric 4x4 matrix of the sum of squared distances to a set of planes,
+// weighted by triangle area. The weight is kept to normalize the error.
+typedef struct _Quadric {
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+	double weight;
+} Quadric;
+
+typedef struct _Collapse {
+	uint32_t source, target;
+	float cost;
+} Collapse;
+
+static void addTriangleQuadric(Quadric *quadric, const float* const p0,
+	const float* const p1, const float* const p2) {
+
+	double e1[3], e2[3], normal[3];
+	for (int c = 0; c < 3; ++c) {
+		e1[c] = p1[c] - p0[c];
+		e2[c] = p2[c] - p0[c];
+	}
+	normal[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	normal[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	normal[2] = e1[0] * e2[1] - e1[1] * e2[0];
+	double length = sqrt(normal[0] * normal[0] + normal[1] * normal[1]
+		+ normal[2] * normal[2]);
+	if (length == 0.0) {
+		return;
+	}
+
+	double a = normal[0] / length, b = normal[1] / length,
+		c = normal[2] / length;
+	double d = -(a * p0[0] + b * p0[1] + c * p0[2]);
+	double area = length * 0.5;
+	quadric->a2 += area * a * a;
+	quadric->ab += area * a * b;
+	quadric->ac += area * a * c;
+	quadric->ad += area * a * d;
+	quadric->b2 += area * b * b;
+	quadric->bc += area * b * c;
+	quadric->bd += area * b * d;
+	quadric->c2 += area * c * c;
+	quadric->cd += area * c * d;
+	quadric->d2 += area * d * d;
+	quadric->weight += area;
+}
+
+static void addQuadric(Quadric *result, const Quadric* const quadric) {
+	result->a2 += quadric->a2;
+	result->ab += quadric->ab;
+	result->ac += quadric->ac;
+	result->ad += quadric->ad;
+	result->b2 += quadric->b2;
+	result->bc += quadric->bc;
+	result->bd += quadric->bd;
+	result->c2 += quadric->c2;
+	result->cd += quadric->cd;
+	result->d2 += quadric->d2;
+	result->weight += quadric->weight;
+}
+
+// Mean squared distance of the point to the planes
+static float quadricError(const Quadric* const quadric,
+	const float* const point) {
+
+	double x = point[0], y = point[1], z = point[2];
+	double error = quadric->a2 * x * x + quadric->b2 * y * y
+		+ quadric->c2 * z * z + quadric->d2
+		+ 2.0 * (quadric->ab * x * y + quadric->ac * x * z
+			+ quadric->bc * y * z + quadric->ad * x + quadric->bd * y
+			+ quadric->cd * z);
+	return quadric->weight > 0.0 ? fabs(error) / quadric->weight : 0.0f;
+}
+
+static uint32_t hashUint(uint32_t value) {
+	// MurmurHash3 finalizer
+	value ^= value >> 16;
+	value *= 0x85ebca6b;
+	value ^= value >> 13;
+	value *= 0xc2b2ae35;
+	value ^= value >> 16;
+	return value;
+}
+
+static uint32_t hashPosition(const float* const pos) {
+	uint32_t bits[3];
+	memcpy(bits, pos, sizeof(bits));
+	return hashUint(bits[0] ^ hashUint(bits[1] ^ hashUint(bits[2])));
+}
+
+static uint32_t tableSize(uint32_t count) {
+	uint32_t size = 1;
+	while (size < count * 2) {
+		size <<= 1;
+	}
+	return size;
+}
+
+// Maps every vertex to the first vertex with the same position, so that
+// vertices split along attribute seams share their quadric
+static int buildPositionRemap(uint32_t *remap, const Vertex* const vertices,
+	uint32_t vertexCount) {
+
+	uint32_t size = tableSize(vertexCount);
+	uint32_t *table = malloc(size * sizeof(uint32_t));
+	if (!table) {
+		return 0;
+	}
+	memset(table, 0xff, size * sizeof(uint32_t));
+
+	for (uint32_t i = 0; i < vertexCount; ++i) {
+		uint32_t slot = hashPosition(vertices[i].pos) & (size - 1);
+		while (table[slot] != EMPTY_SLOT && memcmp(vertices[table[slot]].pos,
+			vertices[i].pos, sizeof(vertices[i].pos))) {
+
+			slot = (slot + 1) & (size - 1);
+		}
+		if (table[slot] == EMPTY_SLOT) {
+			table[slot] = i;
+		}
+		remap[i] = table[slot];
+	}
+	free(table);
+	return 1;
+}
+
+static uint64_t edgeKey(uint32_t a, uint32_t b) {
+	return (uint64_t) a << 32 | b;
+}
+
+static uint32_t findEdge(const uint64_t* const table, uint32_t size,
+	uint64_t key) {
+
+	uint32_t slot = hashUint((uint32_t) key ^ hashUint(key >> 32))
+		& (size - 1);
+	while (table[slot] != EMPTY_EDGE && table[slot] != key) {
+		slot = (slot + 1) & (size - 1);
+	}
+	return slot;
+}
+
+// Locks vertices whose position is on an open edge or is shared by
+// several vertices, as collapsing them would tear the surface or its
+// attributes
+static int lockBoundaryVertices(unsigned char *locked,
+	const uint32_t* const indices, uint32_t indexCount,
+	const uint32_t* const positionRemap, uint32_t vertexCount) {
+
+	uint32_t *positionVertices = calloc(vertexCount, sizeof(uint32_t));
+	uint32_t size = tableSize(indexCount);
+	uint64_t *edges = malloc(size * sizeof(uint64_t));
+	if (!positionVertices || !edges) {
+		free(positionVertices);
+		free(edges);
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < vertexCount; ++i) {
+		++positionVertices[positionRemap[i]];
+	}
+	for (uint32_t i = 0; i < vertexCount; ++i) {
+		locked[i] = positionVertices[positionRemap[i]] > 1;
+	}
+
+	memset(edges, 0xff, size * sizeof(uint64_t));
+	for (uint32_t i = 0; i < indexCount; ++i) {
+		uint32_t a = positionRemap[indices[i]];
+		uint32_t b = positionRemap[indices[i - i % 3 + (i + 1) % 3]];
+		uint64_t key = edgeKey(a, b);
+		edges[findEdge(edges, size, key)] = key;
+	}
+	for (uint32_t i = 0; i < indexCount; ++i) {
+		uint32_t v0 = indices[i], v1 = indices[i - i % 3 + (i + 1) % 3];
+		uint64_t key = edgeKey(positionRemap[v1], positionRemap[v0]);
+		if (edges[findEdge(edges, size, key)] == EMPTY_EDGE) {
+			locked[v0] = locked[v1] = 1;
+		}
+	}
+
+	free(positionVertices);
+	free(edges);
+	return 1;
+}
+
+static void triangleNormal(float *normal, const float* const p0,
+	const float* const p1, const float* const p2) {
+
+	float e1[3], e2[3];
+	for (int c = 0; c < 3; ++c) {
+		e1[c] = p1[c] - p0[c];
+		e2[c] = p2[c] - p0[c];
+	}
+	normal[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	normal[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	normal[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+// Whether moving source onto target keeps the orientation of the
+// triangles around source that survive the collapse. Counts the triangles
+// that collapse in removed.
+static int isCollapseValid(const uint32_t* const indices,
+	const uint32_t* const offsets, const uint32_t* const adjacency,
+	const Vertex* const vertices, uint32_t source, uint32_t target,
+	uint32_t *removed) {
+
+	*removed = 0;
+	for (uint32_t i = offsets[source]; i < offsets[source + 1]; ++i) {
+		const uint32_t* const triangle = &indices[adjacency[i] * 3];
+		if (triangle[0] == target || triangle[1] == target
+			|| triangle[2] == target) {
+
+			++*removed;
+			continue;
+		}
+
+		const float *moved[3];
+		for (int c = 0; c < 3; ++c) {
+			moved[c] = vertices[triangle[c] == source ? target
+				: triangle[c]].pos;
+		}
+		float before[3], after[3];
+		triangleNormal(before, vertices[triangle[0]].pos,
+			vertices[triangle[1]].pos, vertices[triangle[2]].pos);
+		triangleNormal(after, moved[0], moved[1], moved[2]);
+		float dot = before[0] * after[0] + before[1] * after[1]
+			+ before[2] * after[2];
+		float lengths = sqrtf((before[0] * before[0] + before[1] * before[1]
+			+ before[2] * before[2]) * (after[0] * after[0]
+			+ after[1] * after[1] + after[2] * after[2]));
+		if (dot <= MIN_NORMAL_DOT * lengths) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int compareCollapses(const void *a, const void *b) {
+	float costA = ((const Collapse*) a)->cost;
+	float costB = ((const Collapse*) b)->cost;
+	return (costA > costB) - (costA < costB);
+}
+
+// Builds the list of triangles using each vertex
+static void buildAdjacency(uint32_t *offsets, uint32_t *adjacency,
+	const uint32_t* const indices, uint32_t indexCount,
+	uint32_t vertexCount) {
+
+	memset(offsets, 0, (vertexCount + 1) * sizeof(uint32_t));
+	for (uint32_t i = 0; i < indexCount; ++i) {
+		++offsets[indices[i] + 1];
+	}
+	for (uint32_t i = 0; i < vertexCount; ++i) {
+		offsets[i + 1] += offsets[i];
+	}
+	for (uint32_t i = 0; i < indexCount; ++i) {
+		adjacency[offsets[indices[i]]++] = i / 3;
+	}
+	for (uint32_t i = vertexCount; i > 0; --i) {
+		offsets[i] = offsets[i - 1];
+	}
+	offsets[0] = 0;
+}
+
+int simplifyMesh(uint32_t *destination, const uint32_t* const indices,
+	uint32_t indexCount, const Vertex* const vertices, uint32_t vertexCount,
+	uint32_t targetIndexCount, uint32_t *resultCount, float *error) {
+
+	uint32_t *current = malloc(indexCount * sizeof(uint32_t));
+	uint32_t *positionRemap = malloc(vertexCount * sizeof(uint32_t));
+	uint32_t *remap = malloc(vertexCount * sizeof(uint32_t));
+	uint32_t *offsets = malloc((vertexCount + 1) * sizeof(uint32_t));
+	uint32_t *adjacency = malloc(indexCount * sizeof(uint32_t));
+	unsigned char *locked = malloc(vertexCount);
+	unsigned char *touched = malloc(vertexCount);
+	Quadric *quadrics = calloc(vertexCount, sizeof(Quadric));
+	Collapse *collapses = malloc(indexCount * 2 * sizeof(Collapse));
+	if (!current || !positionRemap || !remap || !offsets || !adjacency
+		|| !locked || !touched || !quadrics || !collapses
+		|| !buildPositionRemap(positionRemap, vertices, vertexCount)
+		|| !lockBoundaryVertices(locked, indices, indexCount, positionRemap,
+			vertexCount)) {
+
+		fprintf(stderr, "Failed to allocate mesh simplifier state.\n");
+		free(current);
+		free(positionRemap);
+		free(remap);
+		free(offsets);
+		free(adjacency);
+		free(locked);
+		free(touched);
+		free(quadrics);
+		free(collapses);
+		return 0;
+	}
+
+	memcpy(current, indices, indexCount * sizeof(uint32_t));
+	for (uint32_t i = 0; i < indexCount; i += 3) {
+		const uint32_t* const triangle = &indices[i];
+		Quadric quadric = {};
+		addTriangleQuadric(&quadric, vertices[triangle[0]].pos,
+			vertices[triangle[1]].pos, vertices[triangle[2]].pos);
+		for (int c = 0; c < 3; ++c) {
+			addQuadric(&quadrics[positionRemap[triangle[c]]], &quadric);
+		}
+	}
+
+	// Each pass collapses the cheapest edges that don't share triangles,
+	// then removes the triangles that became degenerate
+	float maxCost = 0.0f;
+	uint32_t currentCount = indexCount;
+	while (currentCount > targetIndexCount) {
+		buildAdjacency(offsets, adjacency, current, currentCount,
+			vertexCount);
+
+		uint32_t collapseCount = 0;
+		for (uint32_t i = 0; i < currentCount; ++i) {
+			uint32_t a = current[i], b = current[i - i % 3 + (i + 1) % 3];
+			for (int direction = 0; direction < 2; ++direction) {
+				uint32_t source = direction ? b : a;
+				uint32_t target = direction ? a : b;
+				if (locked[source]) {
+					continue;
+				}
+				Quadric quadric = quadrics[positionRemap[source]];
+				addQuadric(&quadric, &quadrics[positionRemap[target]]);
+				collapses[collapseCount++] = (Collapse) { source, target,
+					quadricError(&quadric, vertices[target].pos) };
+			}
+		}
+		qsort(collapses, collapseCount, sizeof(Collapse), compareCollapses);
+
+		for (uint32_t i = 0; i < vertexCount; ++i) {
+			remap[i] = i;
+		}
+		memset(touched, 0, vertexCount);
+		uint32_t triangleCount = currentCount / 3;
+		uint32_t targetTriangles = targetIndexCount / 3;
+		uint32_t collapsed = 0;
+		for (uint32_t i = 0; i < collapseCount
+			&& triangleCount > targetTriangles; ++i) {
+
+			const Collapse* const collapse = &collapses[i];
+			uint32_t removed;
+			if (touched[collapse->source] || touched[collapse->target]
+				|| !isCollapseValid(current, offsets, adjacency, vertices,
+					collapse->source, collapse->target, &removed)) {
+				continue;
+			}
+
+			// The triangles around source change, so none of their
+			// vertices can collapse again until the next pass
+			for (uint32_t j = offsets[collapse->source];
+				j < offsets[collapse->source + 1]; ++j) {
+
+				const uint32_t* const triangle = &current[adjacency[j] * 3];
+				touched[triangle[0]] = touched[triangle[1]] =
+					touched[triangle[2]] = 1;
+			}
+			remap[collapse->source] = collapse->target;
+			addQuadric(&quadrics[positionRemap[collapse->target]],
+				&quadrics[positionRemap[collapse->source]]);
+			maxCost = MAX(maxCost, collapse->cost);
+			triangleCount -= MIN(removed, triangleCount);
+			++collapsed;
+		}
+		if (!collapsed) {
+			break;
+		}
+
+		uint32_t written = 0;
+		for (uint32_t i = 0; i < currentCount; i += 3) {
+			uint32_t a = remap[current[i]], b = remap[current[i + 1]],
+				c = remap[current[i + 2]];
+			if (a != b && b != c && c != a) {
+				current[written++] = a;
+				current[written++] = b;
+				current[written++] = c;
+			}
+		}
+		currentCount = written;
+	}
+
+	memcpy(destination, current, currentCount * sizeof(uint32_t));
+	*resultCount = currentCount;
+	*error = sqrtf(maxCost);
+
+	free(current);
+	free(positionRemap);
+	free(remap);
+	free(offsets);
+	free(adjacency);
+	free(locked);
+	free(touched);
+	free(quadrics);
+	free(collapses);
+	return 1;
+}
+
+int buildMeshLods(Mesh *mesh) {
+	const MeshLod* const base = &mesh->lods[0];
+	uint32_t *scratch = malloc(base->indexCount * sizeof(uint32_t));
+	if (!scratch) {
+		fprintf(stderr, "Failed to allocate LOD buffer.\n");
+		return 0;
+	}
+
+	// Each LOD simplifies the one before it, so errors add up
+	printf("LOD 0: %u triangles\n", base->indexCount / 3);
+	mesh->lodCount = 1;
+	while (mesh->lodCount < MAX_MESH_LODS) {
+		const MeshLod previous = mesh->lods[mesh->lodCount - 1];
+		uint32_t resultCount;
+		float error;
+		if (!simplifyMesh(scratch, &mesh->indices[previous.firstIndex],
+						  previous.indexCount, mesh->vertices,
+						  mesh->vertexCount, (uint32_t) (previous.indexCount
+						  * LOD_TRIANGLE_RATIO) / 3 * 3, &resultCount,
+						  &error)) {
+			free(scratch);
+			return 0;
+		}
+		if (!resultCount
+			|| resultCount > previous.indexCount * LOD_MIN_REDUCTION) {
+			break;
+		}
+
+		uint32_t *indices = realloc(mesh->indices,
+			(mesh->indexCount + resultCount) * sizeof(uint32_t));
+		if (!indices) {
+			fprintf(stderr, "Failed to allocate LOD indices.\n");
+			free(scratch);
+			return 0;
+		}
+		mesh->indices = indices;
+		memcpy(&mesh->indices[mesh->indexCount], scratch,
+			resultCount * sizeof(uint32_t));
+		if (!optimizeVertexCache(&mesh->indices[mesh->indexCount],
+								 resultCount, mesh->vertexCount)) {
+			free(scratch);
+			return 0;
+		}
+
+		MeshLod *lod = &mesh->lods[mesh->lodCount++];
+		lod->firstIndex = mesh->indexCount;
+		lod->indexCount = resultCount;
+		lod->error = previous.error + error;
+		mesh->indexCount += resultCount;
+		printf("LOD %u: %u triangles (%.1f%% of LOD 0), error %f\n",
+			   mesh->lodCount - 1, resultCount / 3,
+			   100.0f * resultCount / base->indexCount, lod->error);
+	}
+	free(scratch);
+	return 1;
+}
@@ -0,0 +1,38 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "vulkan-types.h"
+
+// LODs below this fraction of the triangles of the previous one are kept;
+// simplification stops once it can't get there
+#define LOD_TRIANGLE_RATIO 0.5f
+#define LOD_MIN_REDUCTION 0.8f
+
+// Simplifies indices down to about targetIndexCount by collapsing edges in
+// order of quadric error. Vertices are never moved, and vertices on
+// borders or attribute seams are kept. Writes the result to destination
+// and its index count to resultCount; error receives the largest deviation
+// from the input surface, in mesh units.
+int simplifyMesh(uint32_t *destination, const uint32_t* const indices,
+	uint32_t indexCount, const Vertex* const vertices, uint32_t vertexCount,
+	uint32_t targetIndexCount, uint32_t *resultCount, float *error);
+
+// Appends up to MAX_MESH_LODS - 1 simplified LODs to the index buffer,
+// each optimized for the vertex cache, and prints their statistics
+int buildMeshLods(Mesh *mesh);
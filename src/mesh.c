@@ -0,0 +1,334 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "maths.h"
+#include "mesh.h"
+#include "scene.h"
+
+#define SNORM16_MAX 32767.0f
+
+int createCubeMesh(Mesh *mesh) {
+	memset(mesh, 0, sizeof(Mesh));
+	mesh->format = VERTEX_FORMAT_FULL;
+	mesh->vertexCount = sizeof(CUBE_VERTICES) / sizeof(Vertex);
+	mesh->indexCount = sizeof(CUBE_INDICES) / sizeof(uint16_t);
+	mesh->vertices = malloc(sizeof(CUBE_VERTICES));
+	mesh->indices = malloc(mesh->indexCount * sizeof(uint32_t));
+	if (!mesh->vertices || !mesh->indices) {
+		fprintf(stderr, "Failed to allocate cube mesh.\n");
+		destroyMesh(mesh);
+		return 0;
+	}
+	memcpy(mesh->vertices, CUBE_VERTICES, sizeof(CUBE_VERTICES));
+	for (uint32_t i = 0; i < mesh->indexCount; ++i) {
+		mesh->indices[i] = CUBE_INDICES[i];
+	}
+	mesh->lods[0].indexCount = mesh->indexCount;
+	mesh->lodCount = 1;
+	return 1;
+}
+
+int createSphereMesh(Mesh *mesh, uint32_t rings, uint32_t segments) {
+	memset(mesh, 0, sizeof(Mesh));
+	if (rings < 2 || segments < 3) {
+		fprintf(stderr, "Invalid sphere tessellation: %u x %u\n", rings,
+			segments);
+		return 0;
+	}
+
+	mesh->format = VERTEX_FORMAT_FULL;
+	mesh->vertexCount = (rings + 1) * (segments + 1);
+	mesh->indexCount = (rings - 1) * segments * 6;
+	mesh->vertices = malloc(mesh->vertexCount * sizeof(Vertex));
+	mesh->indices = malloc(mesh->indexCount * sizeof(uint32_t));
+	if (!mesh->vertices || !mesh->indices) {
+		fprintf(stderr, "Failed to allocate sphere mesh.\n");
+		destroyMesh(mesh);
+		return 0;
+	}
+
+	Vertex *vertex = mesh->vertices;
+	for (uint32_t r = 0; r <= rings; ++r) {
+		float theta = M_PI * r / rings;
+		float sinTheta = sinf(theta), cosTheta = cosf(theta);
+		for (uint32_t s = 0; s <= segments; ++s, ++vertex) {
+			float phi = 2.0f * M_PI * s / segments;
+			float sinPhi = sinf(phi), cosPhi = cosf(phi);
+
+			vertex->normal[0] = sinTheta * cosPhi;
+			vertex->normal[1] = cosTheta;
+			vertex->normal[2] = sinTheta * sinPhi;
+			vertex->pos[0] = vertex->normal[0] * 0.5f;
+			vertex->pos[1] = vertex->normal[1] * 0.5f;
+			vertex->pos[2] = vertex->normal[2] * 0.5f;
+
+			// Tangent follows u (phi), bitangent follows v (theta)
+			vertex->tangent[0] = -sinPhi;
+			vertex->tangent[1] = 0.0f;
+			vertex->tangent[2] = cosPhi;
+			vertex->bitangent[0] = cosTheta * cosPhi;
+			vertex->bitangent[1] = -sinTheta;
+			vertex->bitangent[2] = cosTheta * sinPhi;
+
+			vertex->texCoord[0] = 4.0f * s / segments;
+			vertex->texCoord[1] = 2.0f * r / rings;
+		}
+	}
+
+	// Counter-clockwise when seen from outside; the degenerate triangle of
+	// each quad touching a pole is dropped
+	uint32_t *index = mesh->indices;
+	for (uint32_t r = 0; r < rings; ++r) {
+		for (uint32_t s = 0; s < segments; ++s) {
+			uint32_t a = r * (segments + 1) + s;
+			uint32_t b = a + segments + 1;
+			uint32_t c = b + 1;
+			uint32_t d = a + 1;
+			if (r != 0) {
+				*index++ = a;
+				*index++ = d;
+				*index++ = b;
+			}
+			if (r != rings - 1) {
+				*index++ = d;
+				*index++ = c;
+				*index++ = b;
+			}
+		}
+	}
+	mesh->lods[0].indexCount = mesh->indexCount;
+	mesh->lodCount = 1;
+	return 1;
+}
+
+static int16_t toSnorm16(float value) {
+	value = MAX(-1.0f, MIN(1.0f, value));
+	return (int16_t) roundf(value * SNORM16_MAX);
+}
+
+static uint16_t toHalf(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	uint16_t sign = (bits >> 16) & 0x8000;
+	int32_t exponent = ((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (exponent <= 0) {
+		// Denormal or zero
+		if (exponent < -10) {
+			return sign;
+		}
+		mantissa |= 0x800000;
+		uint32_t shift = 14 - exponent;
+		uint32_t halfMantissa = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1) {
+			++halfMantissa;
+		}
+		return sign | halfMantissa;
+	} else if (exponent >= 31) {
+		// Overflow, infinity and NaN
+		return sign | 0x7c00 | (mantissa && exponent == 143 ? 0x200 : 0);
+	}
+
+	uint16_t half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) {
+		++half; // Round to nearest; may carry into the exponent
+	}
+	return half;
+}
+
+static void normalize3(float *v) {
+	float mag = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+	if (mag > 0.0f) {
+		v[0] /= mag;
+		v[1] /= mag;
+		v[2] /= mag;
+	}
+}
+
+static void cross3(float *result, const float* const a, const float* const b) {
+	result[0] = a[1] * b[2] - a[2] * b[1];
+	result[1] = a[2] * b[0] - a[0] * b[2];
+	result[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static float dot3(const float* const a, const float* const b) {
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// Encodes the tangent frame of a vertex as a quaternion. The frame is
+// orthonormalized around the normal, and the handedness of the original
+// bitangent is stored in the sign of w.
+static void encodeQTangent(int16_t *result, const Vertex* const vertex) {
+	float t[3], b[3], n[3];
+	memcpy(n, vertex->normal, sizeof(n));
+	normalize3(n);
+	float tDotN = dot3(vertex->tangent, n);
+	for (int i = 0; i < 3; ++i) {
+		t[i] = vertex->tangent[i] - n[i] * tDotN;
+	}
+	normalize3(t);
+	cross3(b, n, t);
+	float handedness = dot3(b, vertex->bitangent) < 0.0f ? -1.0f : 1.0f;
+
+	// Rotation matrix with columns t, b, n; m[row][col]
+	float m00 = t[0], m01 = b[0], m02 = n[0];
+	float m10 = t[1], m11 = b[1], m12 = n[1];
+	float m20 = t[2], m21 = b[2], m22 = n[2];
+	float q[4], s;
+	float trace = m00 + m11 + m22;
+	if (trace > 0.0f) {
+		s = sqrtf(trace + 1.0f) * 2.0f;
+		q[0] = (m21 - m12) / s;
+		q[1] = (m02 - m20) / s;
+		q[2] = (m10 - m01) / s;
+		q[3] = 0.25f * s;
+	} else if (m00 > m11 && m00 > m22) {
+		s = sqrtf(1.0f + m00 - m11 - m22) * 2.0f;
+		q[0] = 0.25f * s;
+		q[1] = (m01 + m10) / s;
+		q[2] = (m02 + m20) / s;
+		q[3] = (m21 - m12) / s;
+	} else if (m11 > m22) {
+		s = sqrtf(1.0f + m11 - m00 - m22) * 2.0f;
+		q[0] = (m01 + m10) / s;
+		q[1] = 0.25f * s;
+		q[2] = (m12 + m21) / s;
+		q[3] = (m02 - m20) / s;
+	} else {
+		s = sqrtf(1.0f + m22 - m00 - m11) * 2.0f;
+		q[0] = (m02 + m20) / s;
+		q[1] = (m12 + m21) / s;
+		q[2] = 0.25f * s;
+		q[3] = (m10 - m01) / s;
+	}
+
+	// q and -q are the same rotation, so force w positive and keep it away
+	// from zero, otherwise a negative handedness would be lost to rounding
+	if (q[3] < 0.0f) {
+		for (int i = 0; i < 4; ++i) {
+			q[i] = -q[i];
+		}
+	}
+	const float bias = 1.0f / SNORM16_MAX;
+	if (q[3] < bias) {
+		float scale = sqrtf(1.0f - bias * bias);
+		q[0] *= scale;
+		q[1] *= scale;
+		q[2] *= scale;
+		q[3] = bias;
+	}
+	for (int i = 0; i < 4; ++i) {
+		result[i] = toSnorm16(q[i] * handedness);
+	}
+}
+
+int packMesh(Mesh *mesh) {
+	if (!mesh->vertexCount) {
+		return 0;
+	}
+
+	float boundsMin[3], boundsMax[3];
+	memcpy(boundsMin, mesh->vertices[0].pos, sizeof(boundsMin));
+	memcpy(boundsMax, mesh->vertices[0].pos, sizeof(boundsMax));
+	for (uint32_t i = 1; i < mesh->vertexCount; ++i) {
+		for (int j = 0; j < 3; ++j) {
+			boundsMin[j] = MIN(boundsMin[j], mesh->vertices[i].pos[j]);
+			boundsMax[j] = MAX(boundsMax[j], mesh->vertices[i].pos[j]);
+		}
+	}
+	for (int j = 0; j < 3; ++j) {
+		mesh->bounds.center[j] = (boundsMin[j] + boundsMax[j]) * 0.5f;
+		mesh->bounds.extent[j] = MAX((boundsMax[j] - boundsMin[j]) * 0.5f,
+			1e-6f);
+	}
+	mesh->bounds.center[3] = 0.0f;
+	mesh->bounds.extent[3] = 1.0f;
+
+	free(mesh->packedVertices);
+	mesh->packedVertices = malloc(mesh->vertexCount * sizeof(PackedVertex));
+	if (!mesh->packedVertices) {
+		fprintf(stderr, "Failed to allocate packed vertices.\n");
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < mesh->vertexCount; ++i) {
+		const Vertex* const vertex = &mesh->vertices[i];
+		PackedVertex *packed = &mesh->packedVertices[i];
+		for (int j = 0; j < 3; ++j) {
+			packed->pos[j] = toSnorm16((vertex->pos[j] - mesh->bounds.center[j])
+				/ mesh->bounds.extent[j]);
+		}
+		packed->pos[3] = 0;
+		encodeQTangent(packed->qtangent, vertex);
+		packed->texCoord[0] = toHalf(vertex->texCoord[0]);
+		packed->texCoord[1] = toHalf(vertex->texCoord[1]);
+	}
+
+	mesh->format = VERTEX_FORMAT_PACKED;
+	return 1;
+}
+
+void getMeshBoundingSphere(const Mesh* const mesh, float *center,
+	float *radius) {
+
+	float boundsMin[3] = { 0.0f, 0.0f, 0.0f };
+	float boundsMax[3] = { 0.0f, 0.0f, 0.0f };
+	for (uint32_t i = 0; i < mesh->vertexCount; ++i) {
+		for (int j = 0; j < 3; ++j) {
+			float value = mesh->vertices[i].pos[j];
+			boundsMin[j] = i ? MIN(boundsMin[j], value) : value;
+			boundsMax[j] = i ? MAX(boundsMax[j], value) : value;
+		}
+	}
+	for (int j = 0; j < 3; ++j) {
+		center[j] = (boundsMin[j] + boundsMax[j]) * 0.5f;
+	}
+
+	float radiusSquared = 0.0f;
+	for (uint32_t i = 0; i < mesh->vertexCount; ++i) {
+		const float* const pos = mesh->vertices[i].pos;
+		float dx = pos[0] - center[0];
+		float dy = pos[1] - center[1];
+		float dz = pos[2] - center[2];
+		radiusSquared = MAX(radiusSquared, dx * dx + dy * dy + dz * dz);
+	}
+	*radius = sqrtf(radiusSquared);
+}
+
+const void* getMeshVertexData(const Mesh* const mesh, VkDeviceSize *size) {
+	if (mesh->format == VERTEX_FORMAT_PACKED) {
+		*size = mesh->vertexCount * sizeof(PackedVertex);
+		return mesh->packedVertices;
+	}
+	*size = mesh->vertexCount * sizeof(Vertex);
+	return mesh->vertices;
+}
+
+void destroyMesh(Mesh *mesh) {
+	free(mesh->vertices);
+	free(mesh->packedVertices);
+	free(mesh->indices);
+	free(mesh->meshlets);
+	memset(mesh, 0, sizeof(Mesh));
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "vulkan-types.h"
+
+int createCubeMesh(Mesh *mesh);
+
+// Unit-diameter UV sphere; rings and segments set the tessellation
+int createSphereMesh(Mesh *mesh, uint32_t rings, uint32_t segments);
+
+// Encodes the mesh into the compact vertex format. The full-precision
+// vertices are kept for CPU-side processing.
+int packMesh(Mesh *mesh);
+
+// Sphere around the center of the mesh's axis-aligned bounds
+void getMeshBoundingSphere(const Mesh* const mesh, float *center,
+	float *radius);
+
+const void* getMeshVertexData(const Mesh* const mesh, VkDeviceSize *size);
+
+void destroyMesh(Mesh *mesh);
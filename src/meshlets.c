@@ -0,0 +1,173 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "maths.h"
+#include "meshlets.h"
+
+// Meshlets whose triangles face further apart than this are never
+// backface culled, as their normal cone covers nearly half the sphere
+#define MESHLET_MIN_CONE_DOT 0.1f
+
+// Unit normal of a counter-clockwise triangle; returns 0 if degenerate
+static int triangleNormal(const Vertex* const vertices,
+	const uint32_t* const triangle, float *normal) {
+
+	const float* const p0 = vertices[triangle[0]].pos;
+	const float* const p1 = vertices[triangle[1]].pos;
+	const float* const p2 = vertices[triangle[2]].pos;
+	float e1[3], e2[3];
+	for (int c = 0; c < 3; ++c) {
+		e1[c] = p1[c] - p0[c];
+		e2[c] = p2[c] - p0[c];
+	}
+	normal[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	normal[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	normal[2] = e1[0] * e2[1] - e1[1] * e2[0];
+	float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1]
+		+ normal[2] * normal[2]);
+	if (length == 0.0f) {
+		return 0;
+	}
+	for (int c = 0; c < 3; ++c) {
+		normal[c] /= length;
+	}
+	return 1;
+}
+
+static void computeMeshletBounds(const Mesh* const mesh, Meshlet *meshlet) {
+	const uint32_t* const indices = &mesh->indices[meshlet->firstIndex];
+
+	// Sphere around the centroid of the referenced vertices
+	float center[3] = { 0.0f, 0.0f, 0.0f };
+	for (uint32_t i = 0; i < meshlet->indexCount; ++i) {
+		const float* const pos = mesh->vertices[indices[i]].pos;
+		for (int c = 0; c < 3; ++c) {
+			center[c] += pos[c] / meshlet->indexCount;
+		}
+	}
+	float radiusSquared = 0.0f;
+	for (uint32_t i = 0; i < meshlet->indexCount; ++i) {
+		const float* const pos = mesh->vertices[indices[i]].pos;
+		float dx = pos[0] - center[0], dy = pos[1] - center[1],
+			dz = pos[2] - center[2];
+		radiusSquared = MAX(radiusSquared, dx * dx + dy * dy + dz * dz);
+	}
+	memcpy(meshlet->sphere, center, sizeof(center));
+	meshlet->sphere[3] = sqrtf(radiusSquared);
+
+	// Cone around the average triangle normal, as wide as the triangle
+	// facing furthest from it
+	float axis[3] = { 0.0f, 0.0f, 0.0f }, normal[3];
+	for (uint32_t i = 0; i < meshlet->indexCount; i += 3) {
+		if (triangleNormal(mesh->vertices, &indices[i], normal)) {
+			for (int c = 0; c < 3; ++c) {
+				axis[c] += normal[c];
+			}
+		}
+	}
+	float length = sqrtf(axis[0] * axis[0] + axis[1] * axis[1]
+		+ axis[2] * axis[2]);
+	float minDot = -1.0f;
+	if (length > 0.0f) {
+		minDot = 1.0f;
+		for (int c = 0; c < 3; ++c) {
+			axis[c] /= length;
+		}
+		for (uint32_t i = 0; i < meshlet->indexCount; i += 3) {
+			if (triangleNormal(mesh->vertices, &indices[i], normal)) {
+				minDot = MIN(minDot, axis[0] * normal[0] + axis[1] * normal[1]
+					+ axis[2] * normal[2]);
+			}
+		}
+	}
+	memcpy(meshlet->cone, axis, sizeof(axis));
+
+	// The cutoff is the sine of the cone half angle, so the cluster is
+	// backfacing when the view direction is within 90 degrees minus the
+	// half angle of the axis
+	meshlet->cone[3] = minDot < MESHLET_MIN_CONE_DOT
+		? 1.0f : sqrtf(1.0f - minDot * minDot);
+}
+
+int buildMeshlets(Mesh *mesh) {
+	// Worst case is one meshlet per MESHLET_MAX_VERTICES / 3 triangles.
+	// Only the full detail LOD, at the start of the index buffer, is split.
+	uint32_t triangleCount = mesh->lods[0].indexCount / 3;
+	uint32_t maxMeshlets = triangleCount / (MESHLET_MAX_VERTICES / 3) + 1;
+	Meshlet *meshlets = calloc(maxMeshlets, sizeof(Meshlet));
+
+	// Meshlet that last referenced each vertex, offset by one
+	uint32_t *vertexMeshlet = calloc(mesh->vertexCount, sizeof(uint32_t));
+	if (!meshlets || !vertexMeshlet) {
+		fprintf(stderr, "Failed to allocate meshlet builder state.\n");
+		free(meshlets);
+		free(vertexMeshlet);
+		return 0;
+	}
+
+	// Greedily add triangles in index buffer order until a limit is hit
+	uint32_t meshletCount = 0, vertexCount = 0, totalVertices = 0;
+	Meshlet *meshlet = NULL;
+	for (uint32_t t = 0; t < triangleCount; ++t) {
+		const uint32_t* const triangle = &mesh->indices[t * 3];
+		uint32_t newVertices = 0;
+		for (int i = 0; i < 3; ++i) {
+			newVertices += vertexMeshlet[triangle[i]] != meshletCount;
+		}
+		if (!meshlet || vertexCount + newVertices > MESHLET_MAX_VERTICES
+			|| meshlet->indexCount == MESHLET_MAX_TRIANGLES * 3) {
+
+			totalVertices += vertexCount;
+			meshlet = &meshlets[meshletCount++];
+			meshlet->firstIndex = t * 3;
+			vertexCount = 0;
+		}
+		for (int i = 0; i < 3; ++i) {
+			if (vertexMeshlet[triangle[i]] != meshletCount) {
+				vertexMeshlet[triangle[i]] = meshletCount;
+				++vertexCount;
+			}
+		}
+		meshlet->indexCount += 3;
+	}
+	totalVertices += vertexCount;
+	free(vertexMeshlet);
+
+	for (uint32_t i = 0; i < meshletCount; ++i) {
+		computeMeshletBounds(mesh, &meshlets[i]);
+	}
+
+	uint32_t cullable = 0;
+	for (uint32_t i = 0; i < meshletCount; ++i) {
+		cullable += meshlets[i].cone[3] < 1.0f;
+	}
+	printf("Meshlets: %u (%.1f vertices, %.1f triangles on average, "
+		   "%u with normal cones)\n", meshletCount,
+		   meshletCount ? (float) totalVertices / meshletCount : 0.0f,
+		   meshletCount ? (float) triangleCount / meshletCount : 0.0f,
+		   cullable);
+
+	free(mesh->meshlets);
+	mesh->meshlets = meshlets;
+	mesh->meshletCount = meshletCount;
+	return 1;
+}
@@ -0,0 +1,239 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "queue-scheduler.h"
+
+static PFN_vkVoidFunction getDeviceFunction(VkDevice device,
+											const char* const coreName,
+											const char* const khrName) {
+	PFN_vkVoidFunction function = vkGetDeviceProcAddr(device, coreName);
+	return function ? function : vkGetDeviceProcAddr(device, khrName);
+}
+
+int initQueueScheduler(QueueScheduler *scheduler, VkDevice device,
+					   const VkQueue* const queues, uint32_t queueCount,
+					   int timelines) {
+
+	memset(scheduler, 0, sizeof(QueueScheduler));
+	scheduler->device = device;
+	scheduler->queueCount = queueCount;
+	memcpy(scheduler->queues, queues, queueCount * sizeof(VkQueue));
+
+	if (!timelines) {
+		VkFenceCreateInfo fenceInfo = {};
+		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		for (uint32_t i = 0; i < queueCount; ++i) {
+			if (queues[i] != queues[0]) {
+				fprintf(stderr, "Scheduling work on several queues requires "
+					"timeline semaphores.\n");
+				return 0;
+			}
+			for (uint32_t j = 0; j < SCHEDULER_FENCES; ++j) {
+				if (vkCreateFence(device, &fenceInfo, NULL,
+								  &scheduler->fences[i][j]) != VK_SUCCESS) {
+					fprintf(stderr, "Failed to create submission fence.\n");
+					return 0;
+				}
+			}
+		}
+		return 1;
+	}
+
+	// Core names resolve on 1.2 devices, the KHR ones with the extension
+	scheduler->vkWaitSemaphores = (PFN_vkWaitSemaphoresKHR)
+		getDeviceFunction(device, "vkWaitSemaphores", "vkWaitSemaphoresKHR");
+	scheduler->vkGetSemaphoreCounterValue =
+		(PFN_vkGetSemaphoreCounterValueKHR) getDeviceFunction(device,
+		"vkGetSemaphoreCounterValue", "vkGetSemaphoreCounterValueKHR");
+	if (!scheduler->vkWaitSemaphores
+		|| !scheduler->vkGetSemaphoreCounterValue) {
+		fprintf(stderr, "Failed to load timeline semaphore functions.\n");
+		return 0;
+	}
+	scheduler->timelines = 1;
+
+	VkSemaphoreTypeCreateInfoKHR typeInfo = {};
+	typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+	typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+	typeInfo.initialValue = 0;
+	VkSemaphoreCreateInfo semaphoreInfo = {};
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	semaphoreInfo.pNext = &typeInfo;
+	for (uint32_t i = 0; i < queueCount; ++i) {
+		if (vkCreateSemaphore(device, &semaphoreInfo, NULL,
+							  &scheduler->semaphores[i]) != VK_SUCCESS) {
+			fprintf(stderr, "Failed to create timeline semaphore.\n");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// The fence of a submission is reused SCHEDULER_FENCES submissions later
+static VkFence getSubmissionFence(QueueScheduler *scheduler, uint32_t queue,
+								  uint64_t value) {
+
+	VkFence fence = scheduler->fences[queue][value % SCHEDULER_FENCES];
+	if (value > SCHEDULER_FENCES) {
+		QueuePoint previous = { queue, value - SCHEDULER_FENCES };
+		if (!waitForQueuePoint(scheduler, previous)) {
+			return VK_NULL_HANDLE;
+		}
+		vkResetFences(scheduler->device, 1, &fence);
+	}
+	return fence;
+}
+
+uint64_t submitToQueue(QueueScheduler *scheduler, uint32_t queue,
+					   const QueueSubmission* const submission) {
+
+	uint64_t value = scheduler->submitted[queue] + 1;
+	VkSemaphore waitSemaphores[MAX_SCHEDULER_QUEUES + 1];
+	VkPipelineStageFlags waitStages[MAX_SCHEDULER_QUEUES + 1];
+	uint64_t waitValues[MAX_SCHEDULER_QUEUES + 1];
+	uint32_t waitCount = 0;
+	VkSemaphore signalSemaphores[2];
+	uint64_t signalValues[2];
+	uint32_t signalCount = 0;
+	VkFence fence = VK_NULL_HANDLE;
+
+	if (scheduler->timelines) {
+		for (uint32_t i = 0; i < submission->waitCount; ++i) {
+			const QueuePoint* const point = &submission->waits[i];
+			if (point->value && point->queue != queue) {
+				waitSemaphores[waitCount] = scheduler->semaphores[point->queue];
+				waitStages[waitCount] = submission->waitStages[i];
+				waitValues[waitCount++] = point->value;
+			}
+		}
+		signalSemaphores[signalCount] = scheduler->semaphores[queue];
+		signalValues[signalCount++] = value;
+	} else if (!(fence = getSubmissionFence(scheduler, queue, value))) {
+		return 0;
+	}
+	if (submission->waitSemaphore) {
+		waitSemaphores[waitCount] = submission->waitSemaphore;
+		waitStages[waitCount] = submission->semaphoreStage;
+		waitValues[waitCount++] = 0;
+	}
+	if (submission->signalSemaphore) {
+		signalSemaphores[signalCount] = submission->signalSemaphore;
+		signalValues[signalCount++] = 0;
+	}
+
+	VkSubmitInfo submitInfo = {};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.waitSemaphoreCount = waitCount;
+	submitInfo.pWaitSemaphores = waitSemaphores;
+	submitInfo.pWaitDstStageMask = waitStages;
+	submitInfo.commandBufferCount = submission->commandBufferCount;
+	submitInfo.pCommandBuffers = submission->commandBuffers;
+	submitInfo.signalSemaphoreCount = signalCount;
+	submitInfo.pSignalSemaphores = signalSemaphores;
+
+	// Binary semaphores ignore their values
+	VkTimelineSemaphoreSubmitInfoKHR timelineInfo = {};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+	timelineInfo.waitSemaphoreValueCount = waitCount;
+	timelineInfo.pWaitSemaphoreValues = waitValues;
+	timelineInfo.signalSemaphoreValueCount = signalCount;
+	timelineInfo.pSignalSemaphoreValues = signalValues;
+	if (scheduler->timelines) {
+		submitInfo.pNext = &timelineInfo;
+	}
+
+	if (vkQueueSubmit(scheduler->queues[queue], 1, &submitInfo, fence)
+		!= VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to submit to queue %u.\n", queue);
+		return 0;
+	}
+	scheduler->submitted[queue] = value;
+	return value;
+}
+
+QueuePoint getQueuePoint(const QueueScheduler* const scheduler,
+						 uint32_t queue) {
+	return (QueuePoint) { queue, scheduler->submitted[queue] };
+}
+
+int isQueuePointDone(QueueScheduler *scheduler, QueuePoint point) {
+	uint64_t *completed = &scheduler->completed[point.queue];
+	if (point.value <= *completed) {
+		return 1;
+	}
+	if (scheduler->timelines) {
+		scheduler->vkGetSemaphoreCounterValue(scheduler->device,
+			scheduler->semaphores[point.queue], completed);
+		return point.value <= *completed;
+	}
+
+	// A fence also covers the work submitted to the queue before it, so
+	// only the point's own one is checked
+	VkFence fence = scheduler->fences[point.queue][
+		point.value % SCHEDULER_FENCES];
+	if (vkGetFenceStatus(scheduler->device, fence) != VK_SUCCESS) {
+		return 0;
+	}
+	*completed = point.value;
+	return 1;
+}
+
+int waitForQueuePoint(QueueScheduler *scheduler, QueuePoint point) {
+	if (point.value <= scheduler->completed[point.queue]) {
+		return 1;
+	}
+
+	VkResult result;
+	if (scheduler->timelines) {
+		VkSemaphoreWaitInfoKHR waitInfo = {};
+		waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+		waitInfo.semaphoreCount = 1;
+		waitInfo.pSemaphores = &scheduler->semaphores[point.queue];
+		waitInfo.pValues = &point.value;
+		result = scheduler->vkWaitSemaphores(scheduler->device, &waitInfo,
+			UINT64_MAX);
+	} else {
+		result = vkWaitForFences(scheduler->device, 1,
+			&scheduler->fences[point.queue][point.value % SCHEDULER_FENCES],
+			VK_TRUE, UINT64_MAX);
+	}
+	if (result != VK_SUCCESS) {
+		fprintf(stderr, "Failed to wait for queue %u.\n", point.queue);
+		return 0;
+	}
+	scheduler->completed[point.queue] = point.value;
+	return 1;
+}
+
+void destroyQueueScheduler(QueueScheduler *scheduler) {
+	for (uint32_t i = 0; i < scheduler->queueCount; ++i) {
+		if (scheduler->semaphores[i]) {
+			vkDestroySemaphore(scheduler->device, scheduler->semaphores[i],
+				NULL);
+		}
+		for (uint32_t j = 0; j < SCHEDULER_FENCES; ++j) {
+			if (scheduler->fences[i][j]) {
+				vkDestroyFence(scheduler->device, scheduler->fences[i][j],
+					NULL);
+			}
+		}
+	}
+}
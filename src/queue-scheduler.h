@@ -0,0 +1,84 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#define MAX_SCHEDULER_QUEUES 3
+// Submissions per queue whose retirement can be checked without timeline
+// semaphores
+#define SCHEDULER_FENCES 8
+
+// The work submitted to a queue up to its value-th submission. Value 0 is
+// always done.
+typedef struct _QueuePoint {
+	uint32_t queue;
+	uint64_t value;
+} QueuePoint;
+
+// Binary semaphores are only for the swap chain, which doesn't take
+// timeline semaphores. waitSemaphore is waited for before semaphoreStage.
+typedef struct _QueueSubmission {
+	const VkCommandBuffer *commandBuffers;
+	uint32_t commandBufferCount;
+	QueuePoint waits[MAX_SCHEDULER_QUEUES];
+	VkPipelineStageFlags waitStages[MAX_SCHEDULER_QUEUES];
+	uint32_t waitCount;
+	VkSemaphore waitSemaphore, signalSemaphore;
+	VkPipelineStageFlags semaphoreStage;
+} QueueSubmission;
+
+// Counts the submissions to each queue. With timeline semaphores, each
+// queue's semaphore reaches a submission's value when it is done, so
+// other queues wait for it on the GPU and the CPU checks it without a
+// fence.
+//
+// Without them, all queues must be the same VkQueue: submission order and
+// the barriers the commands carry order the work, and a ring of fences
+// per queue tracks its last submissions.
+typedef struct _QueueScheduler {
+	VkDevice device;
+	int timelines;
+	VkQueue queues[MAX_SCHEDULER_QUEUES];
+	uint32_t queueCount;
+	uint64_t submitted[MAX_SCHEDULER_QUEUES];
+	uint64_t completed[MAX_SCHEDULER_QUEUES]; // As last seen by the CPU
+	VkSemaphore semaphores[MAX_SCHEDULER_QUEUES];
+	PFN_vkWaitSemaphoresKHR vkWaitSemaphores;
+	PFN_vkGetSemaphoreCounterValueKHR vkGetSemaphoreCounterValue;
+	VkFence fences[MAX_SCHEDULER_QUEUES][SCHEDULER_FENCES];
+} QueueScheduler;
+
+// timelines says whether timeline semaphores are enabled on the device,
+// through core 1.2 or VK_KHR_timeline_semaphore
+int initQueueScheduler(QueueScheduler *scheduler, VkDevice device,
+					   const VkQueue* const queues, uint32_t queueCount,
+					   int timelines);
+
+// Returns the value of the submission on the queue, or 0 on failure
+uint64_t submitToQueue(QueueScheduler *scheduler, uint32_t queue,
+					   const QueueSubmission* const submission);
+
+// The last submission to the queue
+QueuePoint getQueuePoint(const QueueScheduler* const scheduler,
+						 uint32_t queue);
+
+int isQueuePointDone(QueueScheduler *scheduler, QueuePoint point);
+int waitForQueuePoint(QueueScheduler *scheduler, QueuePoint point);
+
+void destroyQueueScheduler(QueueScheduler *scheduler);
@@ -0,0 +1,635 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "maths.h"
+#include "render-graph.h"
+
+#define WRITE_ACCESS (VK_ACCESS_SHADER_WRITE_BIT \
+	| VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT \
+	| VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT \
+	| VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT \
+	| VK_ACCESS_MEMORY_WRITE_BIT)
+#define ATTACHMENT_ACCESS (VK_ACCESS_COLOR_ATTACHMENT_READ_BIT \
+	| VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT \
+	| VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT \
+	| VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT)
+#define ATTACHMENT_STAGES (VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT \
+	| VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT \
+	| VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT)
+
+void initRenderGraph(RenderGraph *graph, VkDevice device,
+					 VkPhysicalDevice physicalDevice) {
+
+	memset(graph, 0, sizeof(RenderGraph));
+	graph->device = device;
+	graph->physicalDevice = physicalDevice;
+	graph->queueCount = 1;
+}
+
+static uint32_t addResource(RenderGraph *graph) {
+	uint32_t index = graph->resourceCount++;
+	GraphResource *resource = &graph->resources[index];
+	memset(resource, 0, sizeof(GraphResource));
+	resource->state = index;
+	resource->firstPass = UINT32_MAX;
+	memset(&graph->states[index], 0, sizeof(GraphState));
+	return index;
+}
+
+uint32_t addGraphImage(RenderGraph *graph, VkImage image,
+					   VkImageSubresourceRange range, VkImageLayout layout,
+					   VkPipelineStageFlags stageMask) {
+
+	uint32_t index = addResource(graph);
+	GraphResource *resource = &graph->resources[index];
+	resource->image = 1;
+	resource->range = range;
+	resource->initialLayout = layout;
+	resource->initialStages = stageMask;
+	setGraphImage(graph, index, image);
+	return index;
+}
+
+uint32_t addGraphBuffer(RenderGraph *graph) {
+	return addResource(graph);
+}
+
+uint32_t addTransientImage(RenderGraph *graph, VkFormat format,
+						   VkImageUsageFlags usage,
+						   VkImageAspectFlags aspectMask) {
+
+	uint32_t index = addResource(graph);
+	GraphResource *resource = &graph->resources[index];
+	resource->image = 1;
+	resource->transient = 1;
+	resource->format = format;
+	resource->usage = usage;
+	resource->range = (VkImageSubresourceRange) { aspectMask, 0, 1, 0, 1 };
+	return index;
+}
+
+uint32_t addGraphPass(RenderGraph *graph, const char *name,
+					  GraphRecordFunction record, void *data) {
+
+	uint32_t index = graph->passCount++;
+	GraphPass *pass = &graph->passes[index];
+	memset(pass, 0, sizeof(GraphPass));
+	pass->name = name;
+	pass->record = record;
+	pass->data = data;
+	pass->enabled = 1;
+	return index;
+}
+
+void useGraphResource(RenderGraph *graph, uint32_t pass, uint32_t resource,
+					  VkPipelineStageFlags stageMask, VkAccessFlags accessMask,
+					  VkImageLayout layout, VkImageLayout finalLayout) {
+
+	GraphPass *graphPass = &graph->passes[pass];
+	graphPass->uses[graphPass->useCount++] = (GraphUse) { resource,
+		stageMask, accessMask, layout, finalLayout };
+
+	GraphResource *graphResource = &graph->resources[resource];
+	if (graphResource->firstPass == UINT32_MAX) {
+		graphResource->firstPass = pass;
+	}
+	graphResource->lastPass = pass;
+}
+
+void setGraphOutput(RenderGraph *graph, uint32_t resource,
+					VkImageLayout layout) {
+
+	graph->resources[resource].output = 1;
+	graph->resources[resource].outputLayout = layout;
+}
+
+void setGraphImage(RenderGraph *graph, uint32_t resource, VkImage image) {
+	GraphResource *graphResource = &graph->resources[resource];
+	graphResource->handle = image;
+	graphResource->layout = graphResource->initialLayout;
+
+	// Whatever made the image available, like a semaphore wait, happens
+	// at the initial stages
+	GraphState *state = &graph->states[graphResource->state];
+	memset(state, 0, sizeof(GraphState));
+	state->readStages = graphResource->initialStages;
+}
+
+void setGraphPassEnabled(RenderGraph *graph, uint32_t pass, int enabled) {
+	graph->passes[pass].enabled = enabled;
+}
+
+void setGraphQueues(RenderGraph *graph, const uint32_t* const queueFamilies,
+					uint32_t queueCount) {
+
+	memcpy(graph->queueFamilies, queueFamilies,
+		queueCount * sizeof(uint32_t));
+	graph->queueCount = queueCount;
+}
+
+void setGraphPassQueue(RenderGraph *graph, uint32_t pass, uint32_t queue) {
+	graph->passes[pass].queue = queue;
+}
+
+// Bit i is set when a pass on queue i uses the resource
+static uint32_t getQueueMask(const RenderGraph* const graph,
+							 uint32_t resource) {
+
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < graph->passCount; ++i) {
+		const GraphPass* const pass = &graph->passes[i];
+		for (uint32_t j = 0; j < pass->useCount; ++j) {
+			if (pass->uses[j].resource == resource) {
+				mask |= 1 << pass->queue;
+			}
+		}
+	}
+	return mask;
+}
+
+// Images only ever rendered to can live in lazily allocated memory
+static int isAttachmentOnly(const RenderGraph* const graph,
+							uint32_t resource) {
+
+	// Transient attachments may not carry any other usage
+	if (graph->resources[resource].usage
+		& ~(VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+		| VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+		| VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT)) {
+
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < graph->passCount; ++i) {
+		const GraphPass* const pass = &graph->passes[i];
+		for (uint32_t j = 0; j < pass->useCount; ++j) {
+			const GraphUse* const use = &pass->uses[j];
+			if (use->resource == resource
+				&& ((use->accessMask & ~ATTACHMENT_ACCESS)
+				|| (use->stageMask & ~ATTACHMENT_STAGES))) {
+
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static int findGraphMemoryType(
+	const VkPhysicalDeviceMemoryProperties* const properties,
+	uint32_t typeBits, VkMemoryPropertyFlags flags) {
+
+	for (uint32_t i = 0; i < properties->memoryTypeCount; ++i) {
+		if ((typeBits & (1 << i))
+			&& (properties->memoryTypes[i].propertyFlags & flags) == flags) {
+
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int overlaps(const GraphResource* const a,
+					const GraphResource* const b) {
+
+	return a->firstPass <= b->lastPass && b->firstPass <= a->lastPass;
+}
+
+int allocateGraphImages(RenderGraph *graph) {
+	VkPhysicalDeviceMemoryProperties memoryProperties;
+	vkGetPhysicalDeviceMemoryProperties(graph->physicalDevice,
+		&memoryProperties);
+
+	// Each transient image joins the first memory block of its type whose
+	// images are all used by other passes, growing it if needed
+	VkDeviceSize blockSizes[MAX_GRAPH_RESOURCES];
+	int blockTypes[MAX_GRAPH_RESOURCES];
+	int blockLazy[MAX_GRAPH_RESOURCES];
+	uint32_t blockOwners[MAX_GRAPH_RESOURCES];
+	uint32_t blocks[MAX_GRAPH_RESOURCES];
+	uint32_t blockCount = 0;
+	for (uint32_t i = 0; i < graph->resourceCount; ++i) {
+		GraphResource *resource = &graph->resources[i];
+		if (!resource->transient) {
+			continue;
+		}
+		resource->lazy = isAttachmentOnly(graph, i);
+
+		VkImageCreateInfo imageInfo = {};
+		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		imageInfo.imageType = VK_IMAGE_TYPE_2D;
+		imageInfo.extent.width = graph->extent.width;
+		imageInfo.extent.height = graph->extent.height;
+		imageInfo.extent.depth = 1;
+		imageInfo.mipLevels = 1;
+		imageInfo.arrayLayers = 1;
+		imageInfo.format = resource->format;
+		imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		imageInfo.usage = resource->usage | (resource->lazy
+			? VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT : 0);
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+
+		// Images passed between queues aren't transferred between their
+		// families every frame
+		uint32_t queueMask = getQueueMask(graph, i);
+		if (queueMask & (queueMask - 1)) {
+			imageInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+			imageInfo.queueFamilyIndexCount = graph->queueCount;
+			imageInfo.pQueueFamilyIndices = graph->queueFamilies;
+		}
+		if (vkCreateImage(graph->device, &imageInfo, NULL,
+						  &resource->handle) != VK_SUCCESS) {
+
+			fprintf(stderr, "Failed to create transient image.\n");
+			return 0;
+		}
+
+		VkMemoryRequirements requirements;
+		vkGetImageMemoryRequirements(graph->device, resource->handle,
+			&requirements);
+		int type = -1;
+		if (resource->lazy) {
+			type = findGraphMemoryType(&memoryProperties,
+				requirements.memoryTypeBits,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+				| VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+			resource->lazy = type >= 0;
+		}
+		if (type < 0) {
+			type = findGraphMemoryType(&memoryProperties,
+				requirements.memoryTypeBits,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		}
+		if (type < 0) {
+			fprintf(stderr, "Failed to find memory for a transient "
+				"image.\n");
+			return 0;
+		}
+
+		// Lazy memory is never shared, as it may not be committed
+		uint32_t block = blockCount;
+		for (uint32_t j = 0; j < blockCount && !resource->lazy; ++j) {
+			if (blockLazy[j] || blockTypes[j] != type) {
+				continue;
+			}
+			int shared = 0;
+			for (uint32_t k = 0; k < i && !shared; ++k) {
+				const GraphResource* const other = &graph->resources[k];
+				shared = other->transient && blocks[k] == j
+					&& overlaps(resource, other);
+			}
+			if (!shared) {
+				block = j;
+				break;
+			}
+		}
+		if (block == blockCount) {
+			blockSizes[block] = 0;
+			blockTypes[block] = type;
+			blockLazy[block] = resource->lazy;
+			blockOwners[block] = i;
+			++blockCount;
+		}
+		blockSizes[block] = MAX(blockSizes[block], requirements.size);
+		blocks[i] = block;
+		resource->state = blockOwners[block];
+	}
+
+	for (uint32_t i = 0; i < blockCount; ++i) {
+		VkMemoryAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocInfo.allocationSize = blockSizes[i];
+		allocInfo.memoryTypeIndex = blockTypes[i];
+		if (vkAllocateMemory(graph->device, &allocInfo, NULL,
+							 &graph->memory[i]) != VK_SUCCESS) {
+
+			fprintf(stderr, "Failed to allocate transient image memory.\n");
+			return 0;
+		}
+		++graph->memoryCount;
+	}
+
+	for (uint32_t i = 0; i < graph->resourceCount; ++i) {
+		GraphResource *resource = &graph->resources[i];
+		if (!resource->transient) {
+			continue;
+		}
+		vkBindImageMemory(graph->device, resource->handle,
+			graph->memory[blocks[i]], 0);
+
+		VkImageViewCreateInfo viewInfo = {};
+		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		viewInfo.image = resource->handle;
+		viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewInfo.format = resource->format;
+		viewInfo.subresourceRange = resource->range;
+		if (vkCreateImageView(graph->device, &viewInfo, NULL,
+							  &resource->view) != VK_SUCCESS) {
+
+			fprintf(stderr, "Failed to create transient image view.\n");
+			return 0;
+		}
+		resource->layout = VK_IMAGE_LAYOUT_UNDEFINED;
+	}
+	return 1;
+}
+
+void releaseGraphImages(RenderGraph *graph) {
+	for (uint32_t i = 0; i < graph->resourceCount; ++i) {
+		GraphResource *resource = &graph->resources[i];
+		if (!resource->transient) {
+			continue;
+		}
+		if (resource->view) {
+			vkDestroyImageView(graph->device, resource->view, NULL);
+		}
+		if (resource->handle) {
+			vkDestroyImage(graph->device, resource->handle, NULL);
+		}
+		resource->view = NULL;
+		resource->handle = NULL;
+		resource->state = i;
+		memset(&graph->states[i], 0, sizeof(GraphState));
+	}
+	for (uint32_t i = 0; i < graph->memoryCount; ++i) {
+		vkFreeMemory(graph->device, graph->memory[i], NULL);
+	}
+	graph->memoryCount = 0;
+}
+
+// Walks the enabled passes back to front, keeping those that write
+// something a later pass, an output or the next frame reads
+static void findLivePasses(RenderGraph *graph) {
+	int *live = graph->live;
+	int needed[MAX_GRAPH_RESOURCES];
+	for (uint32_t i = 0; i < graph->resourceCount; ++i) {
+		needed[i] = !graph->resources[i].transient
+			|| graph->resources[i].output;
+	}
+
+	graph->livePassCount = 0;
+	for (uint32_t i = graph->passCount; i-- > 0;) {
+		const GraphPass* const pass = &graph->passes[i];
+		live[i] = 0;
+		for (uint32_t j = 0; j < pass->useCount && pass->enabled; ++j) {
+			const GraphUse* const use = &pass->uses[j];
+			live[i] |= (use->accessMask & WRITE_ACCESS)
+				&& needed[use->resource];
+		}
+		if (!live[i]) {
+			continue;
+		}
+		++graph->livePassCount;
+
+		// Transient contents this pass replaces aren't needed before it
+		for (uint32_t j = 0; j < pass->useCount; ++j) {
+			const GraphUse* const use = &pass->uses[j];
+			if (graph->resources[use->resource].transient
+				&& use->layout == VK_IMAGE_LAYOUT_UNDEFINED) {
+
+				needed[use->resource] = 0;
+			} else if (use->accessMask & ~WRITE_ACCESS) {
+				needed[use->resource] = 1;
+			}
+		}
+	}
+}
+
+uint32_t planRenderGraph(RenderGraph *graph) {
+	findLivePasses(graph);
+
+	// The outputs are transitioned by the last batch, even without passes
+	graph->batchCount = 0;
+	for (uint32_t i = 0; i < graph->passCount; ++i) {
+		uint32_t queue = graph->passes[i].queue;
+		if (!graph->live[i] || (graph->batchCount
+			&& graph->batches[graph->batchCount - 1].queue == queue)) {
+
+			continue;
+		}
+		if (graph->batchCount == MAX_GRAPH_BATCHES) {
+			fprintf(stderr, "Too many queue changes in the render graph.\n");
+			graph->batchCount = 0;
+			return 0;
+		}
+		GraphBatch *batch = &graph->batches[graph->batchCount++];
+		memset(batch, 0, sizeof(GraphBatch));
+		batch->queue = queue;
+	}
+	if (!graph->batchCount) {
+		memset(&graph->batches[0], 0, sizeof(GraphBatch));
+		graph->batchCount = 1;
+	}
+	return graph->batchCount;
+}
+
+// Work pending on another queue is waited for by the batch before the
+// given stages. The wait makes the other queue's writes visible, so like
+// for an image set with setGraphImage(), only the stages are left to
+// order layout transitions after.
+static void waitForQueue(GraphBatch *batch, GraphState *state,
+						 VkPipelineStageFlags stageMask) {
+
+	if (state->queue == batch->queue) {
+		return;
+	}
+	uint32_t queue = state->queue;
+	int pending = state->writeStages || state->readStages;
+	memset(state, 0, sizeof(GraphState));
+	state->queue = batch->queue;
+	if (pending) {
+		batch->waitStages[queue] |= stageMask;
+		state->readStages = stageMask;
+	}
+}
+
+static void recordGraphBarrier(VkCommandBuffer commandBuffer,
+							   VkPipelineStageFlags srcStageMask,
+							   VkPipelineStageFlags dstStageMask,
+							   const VkMemoryBarrier* const memoryBarrier,
+							   const VkImageMemoryBarrier* const imageBarriers,
+							   uint32_t imageBarrierCount) {
+
+	if (!dstStageMask) {
+		return;
+	}
+	int global = memoryBarrier->srcAccessMask || memoryBarrier->dstAccessMask;
+	vkCmdPipelineBarrier(commandBuffer,
+		srcStageMask ? srcStageMask : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		dstStageMask, 0, global, memoryBarrier, 0, NULL, imageBarrierCount,
+		imageBarriers);
+}
+
+static void initImageBarrier(const GraphResource* const resource,
+							 VkImageMemoryBarrier *barrier) {
+
+	memset(barrier, 0, sizeof(VkImageMemoryBarrier));
+	barrier->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier->image = resource->handle;
+	barrier->subresourceRange = resource->range;
+	barrier->oldLayout = resource->layout;
+
+	// Views only see the depth, but layouts cover the stencil too
+	switch (resource->format) {
+	case VK_FORMAT_D16_UNORM_S8_UINT:
+	case VK_FORMAT_D24_UNORM_S8_UINT:
+	case VK_FORMAT_D32_SFLOAT_S8_UINT:
+		barrier->subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+		break;
+	default:
+		break;
+	}
+}
+
+void executeRenderGraph(RenderGraph *graph,
+						const VkCommandBuffer* const commandBuffers,
+						void *frameData) {
+
+	// Transient contents don't survive the frame, but the hazards on their
+	// memory do
+	for (uint32_t i = 0; i < graph->resourceCount; ++i) {
+		if (graph->resources[i].transient) {
+			graph->resources[i].layout = VK_IMAGE_LAYOUT_UNDEFINED;
+		}
+	}
+
+	// Batches follow the live passes' queue changes, as planned
+	uint32_t batchIndex = 0;
+	int first = 1;
+	for (uint32_t i = 0; i < graph->passCount; ++i) {
+		const GraphPass* const pass = &graph->passes[i];
+		if (!graph->live[i]) {
+			continue;
+		}
+		if (!first && pass->queue != graph->batches[batchIndex].queue) {
+			++batchIndex;
+		}
+		first = 0;
+		GraphBatch *batch = &graph->batches[batchIndex];
+		VkCommandBuffer commandBuffer = commandBuffers[batchIndex];
+
+		VkPipelineStageFlags srcStageMask = 0, dstStageMask = 0;
+		VkMemoryBarrier memoryBarrier = {};
+		memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		VkImageMemoryBarrier imageBarriers[MAX_GRAPH_PASS_USES];
+		uint32_t imageBarrierCount = 0;
+		for (uint32_t j = 0; j < pass->useCount; ++j) {
+			const GraphUse* const use = &pass->uses[j];
+			GraphResource *resource = &graph->resources[use->resource];
+			GraphState *state = &graph->states[resource->state];
+			int write = (use->accessMask & WRITE_ACCESS) != 0;
+			waitForQueue(batch, state, use->stageMask);
+
+			if (resource->image && use->layout != VK_IMAGE_LAYOUT_UNDEFINED
+				&& use->layout != resource->layout) {
+
+				// The transition waits for every earlier access
+				VkImageMemoryBarrier *barrier =
+					&imageBarriers[imageBarrierCount++];
+				initImageBarrier(resource, barrier);
+				barrier->newLayout = use->layout;
+				barrier->srcAccessMask = state->writeAccess;
+				barrier->dstAccessMask = use->accessMask;
+				srcStageMask |= state->writeStages | state->readStages;
+				dstStageMask |= use->stageMask;
+				state->visibleStages |= use->stageMask;
+			} else {
+				// Read or write after write, unless already waited for
+				if (state->writeAccess
+					&& (use->stageMask & ~state->visibleStages)) {
+
+					srcStageMask |= state->writeStages;
+					dstStageMask |= use->stageMask;
+					memoryBarrier.srcAccessMask |= state->writeAccess;
+					memoryBarrier.dstAccessMask |= use->accessMask;
+					state->visibleStages |= use->stageMask;
+				}
+				// Write after read only needs the reads to be done
+				if (write && state->readStages) {
+					srcStageMask |= state->readStages;
+					dstStageMask |= use->stageMask;
+				}
+			}
+		}
+		recordGraphBarrier(commandBuffer, srcStageMask, dstStageMask,
+			&memoryBarrier, imageBarriers, imageBarrierCount);
+
+		for (uint32_t j = 0; j < pass->useCount; ++j) {
+			const GraphUse* const use = &pass->uses[j];
+			GraphResource *resource = &graph->resources[use->resource];
+			GraphState *state = &graph->states[resource->state];
+			if (use->accessMask & WRITE_ACCESS) {
+				state->writeStages = use->stageMask;
+				state->writeAccess = use->accessMask & WRITE_ACCESS;
+				state->readStages = 0;
+				state->visibleStages = 0;
+			} else {
+				state->readStages |= use->stageMask;
+			}
+			if (use->finalLayout) {
+				resource->layout = use->finalLayout;
+			} else if (use->layout != VK_IMAGE_LAYOUT_UNDEFINED) {
+				resource->layout = use->layout;
+			}
+		}
+
+		pass->record(commandBuffer, pass->data, frameData);
+	}
+
+	// Leaves the outputs in the layout their consumer expects
+	GraphBatch *lastBatch = &graph->batches[graph->batchCount - 1];
+	VkImageMemoryBarrier imageBarriers[MAX_GRAPH_RESOURCES];
+	uint32_t imageBarrierCount = 0;
+	VkPipelineStageFlags srcStageMask = 0;
+	for (uint32_t i = 0; i < graph->resourceCount; ++i) {
+		GraphResource *resource = &graph->resources[i];
+		if (!resource->output || !resource->image
+			|| resource->layout == resource->outputLayout) {
+
+			continue;
+		}
+		GraphState *state = &graph->states[resource->state];
+		waitForQueue(lastBatch, state, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+		VkImageMemoryBarrier *barrier = &imageBarriers[imageBarrierCount++];
+		initImageBarrier(resource, barrier);
+		barrier->newLayout = resource->outputLayout;
+		barrier->srcAccessMask = state->writeAccess;
+		srcStageMask |= state->writeStages | state->readStages;
+		resource->layout = resource->outputLayout;
+		memset(state, 0, sizeof(GraphState));
+		state->writeStages = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+		state->queue = lastBatch->queue;
+	}
+	VkMemoryBarrier memoryBarrier = {};
+	memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	recordGraphBarrier(commandBuffers[graph->batchCount - 1], srcStageMask,
+		imageBarrierCount ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : 0,
+		&memoryBarrier, imageBarriers, imageBarrierCount);
+}
+
+void destroyRenderGraph(RenderGraph *graph) {
+	if (graph->device) {
+		releaseGraphImages(graph);
+	}
+}
@@ -0,0 +1,180 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#define MAX_GRAPH_RESOURCES 16
+#define MAX_GRAPH_PASSES 16
+#define MAX_GRAPH_PASS_USES 8
+#define MAX_GRAPH_QUEUES 2
+#define MAX_GRAPH_BATCHES 4
+
+// Records a pass's commands. passData is given when adding the pass,
+// frameData when executing the graph.
+typedef void (*GraphRecordFunction)(VkCommandBuffer commandBuffer,
+									void *passData, void *frameData);
+
+// How a pass accesses a resource. A layout of VK_IMAGE_LAYOUT_UNDEFINED
+// means the pass doesn't need the contents, for example because its
+// render pass clears them. finalLayout is the layout the pass leaves the
+// image in, if it changes it itself like a render pass does; otherwise 0.
+typedef struct _GraphUse {
+	uint32_t resource;
+	VkPipelineStageFlags stageMask;
+	VkAccessFlags accessMask;
+	VkImageLayout layout, finalLayout;
+} GraphUse;
+
+typedef struct _GraphPass {
+	const char *name;
+	GraphRecordFunction record;
+	void *data;
+	GraphUse uses[MAX_GRAPH_PASS_USES];
+	uint32_t useCount;
+	int enabled;
+	uint32_t queue; // Index into the graph's queue families
+} GraphPass;
+
+// Pending work on a resource, or on the memory transient images share
+typedef struct _GraphState {
+	VkPipelineStageFlags writeStages, readStages;
+	VkAccessFlags writeAccess;
+	VkPipelineStageFlags visibleStages; // Already waited for the write
+	uint32_t queue; // Of the pending work
+} GraphState;
+
+// Consecutive live passes on one queue, recorded into their own command
+// buffer. The batch must wait for the work submitted to each other queue
+// before the stages in waitStages, for example through a semaphore.
+typedef struct _GraphBatch {
+	uint32_t queue;
+	VkPipelineStageFlags waitStages[MAX_GRAPH_QUEUES];
+} GraphBatch;
+
+// Buffers have no handle; their barriers are global memory barriers.
+// Imported images keep their contents across frames, transient images are
+// created by the graph and only live within a frame.
+typedef struct _GraphResource {
+	int image, transient, output;
+	VkImage handle;
+	VkImageView view;
+	VkImageSubresourceRange range;
+	VkFormat format;
+	VkImageUsageFlags usage;
+	VkImageLayout layout, initialLayout, outputLayout;
+	VkPipelineStageFlags initialStages;
+	uint32_t state; // Its own, or the first one aliasing its memory
+	uint32_t firstPass, lastPass;
+	int lazy;
+} GraphResource;
+
+// Declared passes run in the order they were added. Each execution skips
+// disabled passes and passes whose results nothing reads, and puts a
+// single barrier in front of each remaining pass for the hazards and
+// layout changes of its uses. Where the queue of the passes changes, a new
+// batch starts, and hazards with the other queue's work become waits of
+// the batch instead of barriers.
+//
+// Transient images whose passes don't overlap share memory, and images
+// only ever used as attachments get lazily allocated memory when the
+// device has it, so tiled GPUs can keep them on chip.
+typedef struct _RenderGraph {
+	VkDevice device;
+	VkPhysicalDevice physicalDevice;
+	VkExtent2D extent; // Of the transient images
+	GraphResource resources[MAX_GRAPH_RESOURCES];
+	uint32_t resourceCount;
+	GraphPass passes[MAX_GRAPH_PASSES];
+	uint32_t passCount;
+	GraphState states[MAX_GRAPH_RESOURCES]; // One per resource
+	VkDeviceMemory memory[MAX_GRAPH_RESOURCES];
+	uint32_t memoryCount;
+	uint32_t queueFamilies[MAX_GRAPH_QUEUES];
+	uint32_t queueCount;
+
+	// Planned by planRenderGraph(), and the batches' waits filled in by
+	// executeRenderGraph()
+	int live[MAX_GRAPH_PASSES];
+	uint32_t livePassCount;
+	GraphBatch batches[MAX_GRAPH_BATCHES];
+	uint32_t batchCount;
+} RenderGraph;
+
+void initRenderGraph(RenderGraph *graph, VkDevice device,
+					 VkPhysicalDevice physicalDevice);
+
+// Imports an image that stays in the given layout between frames, or
+// starts each frame in it if it is set with setGraphImage() every frame.
+// Returns the resource index.
+uint32_t addGraphImage(RenderGraph *graph, VkImage image,
+					   VkImageSubresourceRange range, VkImageLayout layout,
+					   VkPipelineStageFlags stageMask);
+
+uint32_t addGraphBuffer(RenderGraph *graph);
+
+// Declares an image created with the graph's extent by
+// allocateGraphImages()
+uint32_t addTransientImage(RenderGraph *graph, VkFormat format,
+						   VkImageUsageFlags usage,
+						   VkImageAspectFlags aspectMask);
+
+// The pass is enabled until setGraphPassEnabled() says otherwise
+uint32_t addGraphPass(RenderGraph *graph, const char *name,
+					  GraphRecordFunction record, void *data);
+
+void useGraphResource(RenderGraph *graph, uint32_t pass, uint32_t resource,
+					  VkPipelineStageFlags stageMask, VkAccessFlags accessMask,
+					  VkImageLayout layout, VkImageLayout finalLayout);
+
+// Passes writing an output are kept, and the image is left in the given
+// layout at the end of each execution
+void setGraphOutput(RenderGraph *graph, uint32_t resource,
+					VkImageLayout layout);
+
+// Replaces an imported image, which restarts in its initial layout
+void setGraphImage(RenderGraph *graph, uint32_t resource, VkImage image);
+
+void setGraphPassEnabled(RenderGraph *graph, uint32_t pass, int enabled);
+
+// Passes run on queue 0 unless set otherwise. Transient images used on
+// more than one queue are shared by their families, so the families must
+// be given before allocating the images.
+void setGraphQueues(RenderGraph *graph, const uint32_t* const queueFamilies,
+					uint32_t queueCount);
+void setGraphPassQueue(RenderGraph *graph, uint32_t pass, uint32_t queue);
+
+// Creates the transient images, their views and memory. Returns nonzero on
+// success.
+int allocateGraphImages(RenderGraph *graph);
+
+// Destroys the transient images, for example to allocate them again at
+// another extent
+void releaseGraphImages(RenderGraph *graph);
+
+// Finds the passes to run and splits them into batches. Returns the
+// number of batches, which is 0 if there are more than MAX_GRAPH_BATCHES.
+uint32_t planRenderGraph(RenderGraph *graph);
+
+// Records the planned batches, each into the command buffer of the same
+// index, which must come from a pool of the batch's queue family
+void executeRenderGraph(RenderGraph *graph,
+						const VkCommandBuffer* const commandBuffers,
+						void *frameData);
+
+void destroyRenderGraph(RenderGraph *graph);
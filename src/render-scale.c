@@ -0,0 +1,65 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+
+#include "maths.h"
+#include "render-scale.h"
+
+void initRenderScaler(RenderScaler *scaler, float budgetMs) {
+	scaler->budgetMs = budgetMs;
+	scaler->scale = RENDER_SCALE_MAX;
+	scaler->filteredMs = 0.0;
+	scaler->settleFrames = 0;
+}
+
+float updateRenderScale(RenderScaler *scaler, double gpuMs) {
+	if (scaler->budgetMs <= 0.0f || gpuMs <= 0.0) {
+		return scaler->scale;
+	}
+	scaler->filteredMs = scaler->filteredMs > 0.0
+		? scaler->filteredMs + (gpuMs - scaler->filteredMs)
+			* RENDER_SCALE_SMOOTHING
+		: gpuMs;
+	if (scaler->settleFrames) {
+		--scaler->settleFrames;
+		return scaler->scale;
+	}
+
+	double low = scaler->budgetMs * RENDER_SCALE_HEADROOM;
+	if (scaler->filteredMs <= scaler->budgetMs
+		&& scaler->filteredMs >= low) {
+		return scaler->scale;
+	}
+
+	// Solve for the scale that lands between the bounds, one step at most
+	double target = 0.5 * (scaler->budgetMs + low);
+	float scale = scaler->scale * sqrt(target / scaler->filteredMs);
+	scale = MIN(MAX(scale, scaler->scale - RENDER_SCALE_STEP),
+		scaler->scale + RENDER_SCALE_STEP);
+	scale = MIN(MAX(scale, RENDER_SCALE_MIN), RENDER_SCALE_MAX);
+	if (scale == scaler->scale) {
+		return scale;
+	}
+
+	// Expect the time to follow the pixel count rather than wait for the
+	// filter to find out
+	scaler->filteredMs *= (scale * scale) / (scaler->scale * scaler->scale);
+	scaler->scale = scale;
+	scaler->settleFrames = RENDER_SCALE_SETTLE_FRAMES;
+	return scale;
+}
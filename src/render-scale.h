@@ -0,0 +1,51 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Range of the rendering resolution, as a fraction of the swap chain's
+#define RENDER_SCALE_MIN 0.5f
+#define RENDER_SCALE_MAX 1.0f
+
+// Weight of the newest GPU frame time in the filtered one
+#define RENDER_SCALE_SMOOTHING 0.1f
+
+// The scale is lowered above the budget and raised below this fraction of
+// it, aiming between the two
+#define RENDER_SCALE_HEADROOM 0.8f
+
+// Largest change of the scale at once, and frames the filtered time gets
+// to follow a change before the next one
+#define RENDER_SCALE_STEP 0.1f
+#define RENDER_SCALE_SETTLE_FRAMES 8
+
+// Scales the rendering resolution to keep the GPU frame time within a
+// budget. GPU time is taken to grow with the pixel count, so with the
+// square of the scale.
+typedef struct _RenderScaler {
+	float budgetMs; // Disabled when zero
+	float scale;
+	double filteredMs;
+	uint32_t settleFrames;
+} RenderScaler;
+
+void initRenderScaler(RenderScaler *scaler, float budgetMs);
+
+// Takes the GPU time of the last frame and returns the scale of the next
+float updateRenderScale(RenderScaler *scaler, double gpuMs);
@@ -0,0 +1,222 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "resource-registry.h"
+
+// The registry and destruction queue only hand objects to these, so
+// recording the calls stands in for a device
+static uint32_t destroyedCount;
+static uint64_t destroyed[64];
+static uint64_t retiredValue;
+
+static void recordDestroyed(uint64_t object) {
+	if (destroyedCount < sizeof(destroyed) / sizeof(destroyed[0])) {
+		destroyed[destroyedCount] = object;
+	}
+	++destroyedCount;
+}
+
+VKAPI_ATTR void VKAPI_CALL vkDestroyBuffer(VkDevice device, VkBuffer buffer,
+	const VkAllocationCallbacks* pAllocator) {
+	recordDestroyed((uint64_t) (uintptr_t) buffer);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkDestroyImage(VkDevice device, VkImage image,
+	const VkAllocationCallbacks* pAllocator) {
+	recordDestroyed((uint64_t) (uintptr_t) image);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkDestroyImageView(VkDevice device,
+	VkImageView view, const VkAllocationCallbacks* pAllocator) {
+	recordDestroyed((uint64_t) (uintptr_t) view);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkDestroySampler(VkDevice device,
+	VkSampler sampler, const VkAllocationCallbacks* pAllocator) {
+	recordDestroyed((uint64_t) (uintptr_t) sampler);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkDestroyFramebuffer(VkDevice device,
+	VkFramebuffer framebuffer, const VkAllocationCallbacks* pAllocator) {
+	recordDestroyed((uint64_t) (uintptr_t) framebuffer);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkDestroyPipeline(VkDevice device,
+	VkPipeline pipeline, const VkAllocationCallbacks* pAllocator) {
+	recordDestroyed((uint64_t) (uintptr_t) pipeline);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkFreeMemory(VkDevice device,
+	VkDeviceMemory memory, const VkAllocationCallbacks* pAllocator) {
+	recordDestroyed((uint64_t) (uintptr_t) memory);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkFreeCommandBuffers(VkDevice device,
+	VkCommandPool commandPool, uint32_t commandBufferCount,
+	const VkCommandBuffer* pCommandBuffers) {
+	for (uint32_t i = 0; i < commandBufferCount; ++i) {
+		recordDestroyed((uint64_t) (uintptr_t) pCommandBuffers[i]);
+	}
+}
+
+// Every queue retires up to retiredValue
+int isQueuePointDone(QueueScheduler *scheduler, QueuePoint point) {
+	return point.value <= retiredValue;
+}
+
+int waitForQueuePoint(QueueScheduler *scheduler, QueuePoint point) {
+	retiredValue = point.value > retiredValue ? point.value : retiredValue;
+	return 1;
+}
+
+#define CHECK(condition) \
+	if (!(condition)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+			#condition); \
+		return 0; \
+	}
+
+// Distinct fake handles, so destruction can be traced back to them
+#define FAKE_HANDLE(type, value) ((type) (uintptr_t) (value))
+
+static BufferResource makeBuffer(uint32_t id) {
+	return (BufferResource) { FAKE_HANDLE(VkBuffer, id),
+		FAKE_HANDLE(VkDeviceMemory, id + 1000), id };
+}
+
+static int wasDestroyed(uint64_t object) {
+	for (uint32_t i = 0; i < destroyedCount; ++i) {
+		if (destroyed[i] == object) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int testBuffers(ResourceRegistry *registry, DestructionQueue *queue) {
+	BufferResource resources[] = { makeBuffer(1), makeBuffer(2),
+		makeBuffer(3) };
+	BufferHandle handles[3];
+	for (uint32_t i = 0; i < 3; ++i) {
+		handles[i] = addBuffer(registry, &resources[i]);
+		CHECK(handles[i].index == i && handles[i].generation == 1);
+	}
+	BufferHandle null = {};
+	CHECK(!getBuffer(registry, null));
+	CHECK(getBuffer(registry, handles[1])->buffer == resources[1].buffer);
+
+	// Removing the middle buffer moves the last one into its place
+	retiredValue = 4;
+	QueuePoint lastUse = { 0, 5 };
+	removeBuffer(registry, handles[1], queue, lastUse);
+	CHECK(!getBuffer(registry, handles[1]));
+	CHECK(registry->buffers.count == 2);
+	const BufferResource* const dense = registry->buffers.resources;
+	CHECK(dense[0].buffer == resources[0].buffer);
+	CHECK(dense[1].buffer == resources[2].buffer);
+	CHECK(registry->buffers.owners[1] == 2);
+	CHECK(registry->buffers.dense[2] == 1);
+	CHECK(getBuffer(registry, handles[0])->buffer == resources[0].buffer);
+	CHECK(getBuffer(registry, handles[2])->buffer == resources[2].buffer);
+
+	// Nothing is destroyed before the last use retires
+	CHECK(queue->count == 2 && !destroyedCount);
+	removeBuffer(registry, handles[1], queue, lastUse);
+	CHECK(queue->count == 2);
+	destroyRetiredObjects(queue);
+	CHECK(!destroyedCount);
+	retiredValue = 5;
+	destroyRetiredObjects(queue);
+	CHECK(destroyedCount == 2 && !queue->count);
+	CHECK(wasDestroyed((uint64_t) (uintptr_t) resources[1].buffer));
+	CHECK(wasDestroyed((uint64_t) (uintptr_t) resources[1].memory));
+
+	// The freed slot comes back under a new generation
+	BufferResource reused = makeBuffer(4);
+	BufferHandle reusedHandle = addBuffer(registry, &reused);
+	CHECK(reusedHandle.index == 1 && reusedHandle.generation == 2);
+	CHECK(!getBuffer(registry, handles[1]));
+	CHECK(getBuffer(registry, reusedHandle)->buffer == reused.buffer);
+	CHECK(registry->buffers.owners[2] == 1);
+
+	// Retired points destroy right away
+	destroyedCount = 0;
+	removeBuffer(registry, handles[0], queue, (QueuePoint) { 0, 0 });
+	CHECK(destroyedCount == 2 && !queue->count);
+	CHECK(!getBuffer(registry, handles[0]));
+	CHECK(getBuffer(registry, handles[2])->buffer == resources[2].buffer);
+	CHECK(getBuffer(registry, reusedHandle)->buffer == reused.buffer);
+	return 1;
+}
+
+static int testOtherKinds(ResourceRegistry *registry,
+						  DestructionQueue *queue) {
+	ImageResource image = { FAKE_HANDLE(VkImage, 10),
+		FAKE_HANDLE(VkDeviceMemory, 11), FAKE_HANDLE(VkImageView, 12) };
+	SamplerResource sampler = { FAKE_HANDLE(VkSampler, 20) };
+	PipelineResource pipeline = { FAKE_HANDLE(VkPipeline, 30) };
+	ImageHandle imageHandle = addImage(registry, &image);
+	SamplerHandle samplerHandle = addSampler(registry, &sampler);
+	PipelineHandle pipelineHandle = addPipeline(registry, &pipeline);
+	CHECK(getImage(registry, imageHandle)->view == image.view);
+	CHECK(getSampler(registry, samplerHandle)->sampler == sampler.sampler);
+	CHECK(getPipeline(registry, pipelineHandle)->pipeline
+		== pipeline.pipeline);
+
+	destroyedCount = 0;
+	QueuePoint lastUse = { 1, retiredValue + 1 };
+	removeImage(registry, imageHandle, queue, lastUse);
+	removeSampler(registry, samplerHandle, queue, lastUse);
+	removePipeline(registry, pipelineHandle, queue, lastUse);
+	CHECK(!getImage(registry, imageHandle));
+	CHECK(!getSampler(registry, samplerHandle));
+	CHECK(!getPipeline(registry, pipelineHandle));
+	CHECK(queue->count == 5 && !destroyedCount);
+	retiredValue = lastUse.value;
+	destroyRetiredObjects(queue);
+	CHECK(destroyedCount == 5);
+	CHECK(wasDestroyed((uint64_t) (uintptr_t) image.view));
+	CHECK(wasDestroyed((uint64_t) (uintptr_t) pipeline.pipeline));
+	return 1;
+}
+
+int main(void) {
+	QueueScheduler scheduler = {};
+	DestructionQueue queue;
+	initDestructionQueue(&queue, VK_NULL_HANDLE, &scheduler);
+	ResourceRegistry registry;
+	initResourceRegistry(&registry, VK_NULL_HANDLE);
+
+	int success = testBuffers(&registry, &queue)
+		&& testOtherKinds(&registry, &queue);
+
+	// The two buffers left are destroyed with the registry
+	destroyedCount = 0;
+	destroyResourceRegistry(&registry);
+	destroyDestructionQueue(&queue);
+	if (success && destroyedCount != 4) {
+		fprintf(stderr, "Registry destroyed %u objects instead of 4.\n",
+			destroyedCount);
+		success = 0;
+	}
+	printf("%s\n", success ? "PASS" : "FAIL");
+	return success ? 0 : 1;
+}
@@ -0,0 +1,285 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resource-registry.h"
+
+#define INITIAL_POOL_CAPACITY 16
+
+static void initPool(ResourcePool *pool, size_t resourceSize) {
+	memset(pool, 0, sizeof(ResourcePool));
+	pool->resourceSize = resourceSize;
+}
+
+// Grows by doubling, like draw lists. Arrays that did grow are kept on
+// failure, the capacity just doesn't change.
+static int growPool(ResourcePool *pool) {
+	uint32_t capacity = pool->capacity ? pool->capacity * 2
+		: INITIAL_POOL_CAPACITY;
+	void *resources = realloc(pool->resources,
+		capacity * pool->resourceSize);
+	if (resources) {
+		pool->resources = resources;
+	}
+	uint32_t *owners = realloc(pool->owners, capacity * sizeof(uint32_t));
+	if (owners) {
+		pool->owners = owners;
+	}
+	uint32_t *dense = realloc(pool->dense, capacity * sizeof(uint32_t));
+	if (dense) {
+		pool->dense = dense;
+	}
+	uint32_t *generations = realloc(pool->generations,
+		capacity * sizeof(uint32_t));
+	if (generations) {
+		pool->generations = generations;
+	}
+	uint32_t *freeSlots = realloc(pool->freeSlots,
+		capacity * sizeof(uint32_t));
+	if (freeSlots) {
+		pool->freeSlots = freeSlots;
+	}
+	if (!resources || !owners || !dense || !generations || !freeSlots) {
+		fprintf(stderr, "Failed to grow resource pool to %u resources.\n",
+			capacity);
+		return 0;
+	}
+	pool->capacity = capacity;
+	return 1;
+}
+
+// Returns the generation of the slot the resource went into, 0 on failure
+static uint32_t addToPool(ResourcePool *pool, const void* const resource,
+						  uint32_t *slot) {
+
+	if (pool->freeCount) {
+		*slot = pool->freeSlots[--pool->freeCount];
+	} else {
+		if (pool->slotCount == pool->capacity && !growPool(pool)) {
+			return 0;
+		}
+		*slot = pool->slotCount++;
+		pool->generations[*slot] = 1;
+	}
+	memcpy((char*) pool->resources + pool->count * pool->resourceSize,
+		resource, pool->resourceSize);
+	pool->owners[pool->count] = *slot;
+	pool->dense[*slot] = pool->count++;
+	return pool->generations[*slot];
+}
+
+static void *getFromPool(const ResourcePool* const pool, uint32_t slot,
+						 uint32_t generation) {
+
+	if (!generation || slot >= pool->slotCount
+		|| pool->generations[slot] != generation) {
+		return NULL;
+	}
+	return (char*) pool->resources + pool->dense[slot] * pool->resourceSize;
+}
+
+// Copies the resource out before the last one moves into its place.
+// Returns 0 for stale handles.
+static int removeFromPool(ResourcePool *pool, uint32_t slot,
+						  uint32_t generation, void *removed) {
+
+	void *resource = getFromPool(pool, slot, generation);
+	if (!resource) {
+		return 0;
+	}
+	memcpy(removed, resource, pool->resourceSize);
+	uint32_t last = --pool->count;
+	if (pool->dense[slot] != last) {
+		memcpy(resource, (char*) pool->resources + last * pool->resourceSize,
+			pool->resourceSize);
+		pool->owners[pool->dense[slot]] = pool->owners[last];
+		pool->dense[pool->owners[last]] = pool->dense[slot];
+	}
+	if (!++pool->generations[slot]) {
+		pool->generations[slot] = 1;
+	}
+	pool->freeSlots[pool->freeCount++] = slot;
+	return 1;
+}
+
+static void freePool(ResourcePool *pool) {
+	free(pool->resources);
+	free(pool->owners);
+	free(pool->dense);
+	free(pool->generations);
+	free(pool->freeSlots);
+	initPool(pool, pool->resourceSize);
+}
+
+static void destroyBufferResource(VkDevice device,
+								  const BufferResource* const buffer) {
+	vkDestroyBuffer(device, buffer->buffer, NULL);
+	vkFreeMemory(device, buffer->memory, NULL);
+}
+
+static void destroyImageResource(VkDevice device,
+								 const ImageResource* const image) {
+	vkDestroyImageView(device, image->view, NULL);
+	vkDestroyImage(device, image->image, NULL);
+	vkFreeMemory(device, image->memory, NULL);
+}
+
+void initResourceRegistry(ResourceRegistry *registry, VkDevice device) {
+	registry->device = device;
+	initPool(&registry->buffers, sizeof(BufferResource));
+	initPool(&registry->images, sizeof(ImageResource));
+	initPool(&registry->samplers, sizeof(SamplerResource));
+	initPool(&registry->pipelines, sizeof(PipelineResource));
+}
+
+BufferHandle addBuffer(ResourceRegistry *registry,
+					   const BufferResource* const buffer) {
+	BufferHandle handle = {};
+	handle.generation = addToPool(&registry->buffers, buffer, &handle.index);
+	if (IS_NULL_HANDLE(handle)) {
+		destroyBufferResource(registry->device, buffer);
+	}
+	return handle;
+}
+
+ImageHandle addImage(ResourceRegistry *registry,
+					 const ImageResource* const image) {
+	ImageHandle handle = {};
+	handle.generation = addToPool(&registry->images, image, &handle.index);
+	if (IS_NULL_HANDLE(handle)) {
+		destroyImageResource(registry->device, image);
+	}
+	return handle;
+}
+
+SamplerHandle addSampler(ResourceRegistry *registry,
+						 const SamplerResource* const sampler) {
+	SamplerHandle handle = {};
+	handle.generation = addToPool(&registry->samplers, sampler,
+		&handle.index);
+	if (IS_NULL_HANDLE(handle)) {
+		vkDestroySampler(registry->device, sampler->sampler, NULL);
+	}
+	return handle;
+}
+
+PipelineHandle addPipeline(ResourceRegistry *registry,
+						   const PipelineResource* const pipeline) {
+	PipelineHandle handle = {};
+	handle.generation = addToPool(&registry->pipelines, pipeline,
+		&handle.index);
+	if (IS_NULL_HANDLE(handle)) {
+		vkDestroyPipeline(registry->device, pipeline->pipeline, NULL);
+	}
+	return handle;
+}
+
+const BufferResource *getBuffer(const ResourceRegistry* const registry,
+								BufferHandle handle) {
+	return getFromPool(&registry->buffers, handle.index, handle.generation);
+}
+
+const ImageResource *getImage(const ResourceRegistry* const registry,
+							  ImageHandle handle) {
+	return getFromPool(&registry->images, handle.index, handle.generation);
+}
+
+const SamplerResource *getSampler(const ResourceRegistry* const registry,
+								  SamplerHandle handle) {
+	return getFromPool(&registry->samplers, handle.index, handle.generation);
+}
+
+const PipelineResource *getPipeline(const ResourceRegistry* const registry,
+									PipelineHandle handle) {
+	return getFromPool(&registry->pipelines, handle.index,
+		handle.generation);
+}
+
+void removeBuffer(ResourceRegistry *registry, BufferHandle handle,
+				  DestructionQueue *queue, QueuePoint lastUse) {
+	BufferResource buffer;
+	if (removeFromPool(&registry->buffers, handle.index, handle.generation,
+		&buffer)) {
+		deferDestruction(queue, DESTROY_BUFFER,
+			(DestroyedObject) { .buffer = buffer.buffer }, lastUse);
+		deferDestruction(queue, DESTROY_MEMORY,
+			(DestroyedObject) { .memory = buffer.memory }, lastUse);
+	}
+}
+
+void removeImage(ResourceRegistry *registry, ImageHandle handle,
+				 DestructionQueue *queue, QueuePoint lastUse) {
+	ImageResource image;
+	if (removeFromPool(&registry->images, handle.index, handle.generation,
+		&image)) {
+		if (image.view) {
+			deferDestruction(queue, DESTROY_IMAGE_VIEW,
+				(DestroyedObject) { .view = image.view }, lastUse);
+		}
+		deferDestruction(queue, DESTROY_IMAGE,
+			(DestroyedObject) { .image = image.image }, lastUse);
+		deferDestruction(queue, DESTROY_MEMORY,
+			(DestroyedObject) { .memory = image.memory }, lastUse);
+	}
+}
+
+void removeSampler(ResourceRegistry *registry, SamplerHandle handle,
+				   DestructionQueue *queue, QueuePoint lastUse) {
+	SamplerResource sampler;
+	if (removeFromPool(&registry->samplers, handle.index, handle.generation,
+		&sampler)) {
+		deferDestruction(queue, DESTROY_SAMPLER,
+			(DestroyedObject) { .sampler = sampler.sampler }, lastUse);
+	}
+}
+
+void removePipeline(ResourceRegistry *registry, PipelineHandle handle,
+					DestructionQueue *queue, QueuePoint lastUse) {
+	PipelineResource pipeline;
+	if (removeFromPool(&registry->pipelines, handle.index, handle.generation,
+		&pipeline)) {
+		deferDestruction(queue, DESTROY_PIPELINE,
+			(DestroyedObject) { .pipeline = pipeline.pipeline }, lastUse);
+	}
+}
+
+void destroyResourceRegistry(ResourceRegistry *registry) {
+	VkDevice device = registry->device;
+	const BufferResource *buffers = registry->buffers.resources;
+	for (uint32_t i = 0; i < registry->buffers.count; ++i) {
+		destroyBufferResource(device, &buffers[i]);
+	}
+	const ImageResource *images = registry->images.resources;
+	for (uint32_t i = 0; i < registry->images.count; ++i) {
+		destroyImageResource(device, &images[i]);
+	}
+	const SamplerResource *samplers = registry->samplers.resources;
+	for (uint32_t i = 0; i < registry->samplers.count; ++i) {
+		vkDestroySampler(device, samplers[i].sampler, NULL);
+	}
+	const PipelineResource *pipelines = registry->pipelines.resources;
+	for (uint32_t i = 0; i < registry->pipelines.count; ++i) {
+		vkDestroyPipeline(device, pipelines[i].pipeline, NULL);
+	}
+	freePool(&registry->buffers);
+	freePool(&registry->images);
+	freePool(&registry->samplers);
+	freePool(&registry->pipelines);
+}
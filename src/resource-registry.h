@@ -0,0 +1,123 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "destruction-queue.h"
+
+// Handles name a registry slot together with the generation the slot had
+// when the resource was added. Removing the resource bumps the generation,
+// so handles kept past the removal are caught instead of reaching whatever
+// reuses the slot. Generations start at 1, leaving the zeroed handle null.
+typedef struct _BufferHandle {
+	uint32_t index, generation;
+} BufferHandle;
+
+typedef struct _ImageHandle {
+	uint32_t index, generation;
+} ImageHandle;
+
+typedef struct _SamplerHandle {
+	uint32_t index, generation;
+} SamplerHandle;
+
+typedef struct _PipelineHandle {
+	uint32_t index, generation;
+} PipelineHandle;
+
+#define IS_NULL_HANDLE(handle) ((handle).generation == 0)
+
+typedef struct _BufferResource {
+	VkBuffer buffer;
+	VkDeviceMemory memory;
+	VkDeviceSize size;
+} BufferResource;
+
+// The view is optional
+typedef struct _ImageResource {
+	VkImage image;
+	VkDeviceMemory memory;
+	VkImageView view;
+} ImageResource;
+
+typedef struct _SamplerResource {
+	VkSampler sampler;
+} SamplerResource;
+
+typedef struct _PipelineResource {
+	VkPipeline pipeline;
+} PipelineResource;
+
+// Resources are packed at the front of a dense array, so walking all of
+// them touches no holes. Removal moves the last resource into the hole and
+// repoints its slot; slots themselves never move, which is what handles
+// refer to.
+typedef struct _ResourcePool {
+	void *resources;
+	size_t resourceSize;
+	uint32_t *owners; // Slot of each dense resource
+	uint32_t *dense; // Dense index of each slot
+	uint32_t *generations;
+	uint32_t *freeSlots;
+	uint32_t count, slotCount, freeCount, capacity;
+} ResourcePool;
+
+typedef struct _ResourceRegistry {
+	VkDevice device;
+	ResourcePool buffers, images, samplers, pipelines;
+} ResourceRegistry;
+
+void initResourceRegistry(ResourceRegistry *registry, VkDevice device);
+
+// The registry takes ownership of the objects, destroying them right away
+// and returning the null handle if it can't grow
+BufferHandle addBuffer(ResourceRegistry *registry,
+					   const BufferResource* const buffer);
+ImageHandle addImage(ResourceRegistry *registry,
+					 const ImageResource* const image);
+SamplerHandle addSampler(ResourceRegistry *registry,
+						 const SamplerResource* const sampler);
+PipelineHandle addPipeline(ResourceRegistry *registry,
+						   const PipelineResource* const pipeline);
+
+// Return NULL for null and stale handles. The pointers are good until the
+// next addition or removal of the same kind.
+const BufferResource *getBuffer(const ResourceRegistry* const registry,
+								BufferHandle handle);
+const ImageResource *getImage(const ResourceRegistry* const registry,
+							  ImageHandle handle);
+const SamplerResource *getSampler(const ResourceRegistry* const registry,
+								  SamplerHandle handle);
+const PipelineResource *getPipeline(const ResourceRegistry* const registry,
+									PipelineHandle handle);
+
+// The handle goes stale at once, while the objects are handed to the
+// destruction queue until lastUse retires
+void removeBuffer(ResourceRegistry *registry, BufferHandle handle,
+				  DestructionQueue *queue, QueuePoint lastUse);
+void removeImage(ResourceRegistry *registry, ImageHandle handle,
+				 DestructionQueue *queue, QueuePoint lastUse);
+void removeSampler(ResourceRegistry *registry, SamplerHandle handle,
+				   DestructionQueue *queue, QueuePoint lastUse);
+void removePipeline(ResourceRegistry *registry, PipelineHandle handle,
+					DestructionQueue *queue, QueuePoint lastUse);
+
+// Destroys every resource left, so the device must be idle
+void destroyResourceRegistry(ResourceRegistry *registry);
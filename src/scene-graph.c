@@ -0,0 +1,156 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "maths.h"
+#include "scene-graph.h"
+
+int createSceneGraph(SceneGraph *graph, uint32_t capacity) {
+	memset(graph, 0, sizeof(SceneGraph));
+	graph->capacity = capacity;
+	graph->parents = malloc(capacity * sizeof(uint32_t));
+	graph->subtreeEnds = malloc(capacity * sizeof(uint32_t));
+	graph->localMatrices = malloc(capacity * 16 * sizeof(float));
+	graph->worldMatrices = malloc(capacity * 16 * sizeof(float));
+	graph->dirty = calloc(capacity, sizeof(uint8_t));
+	graph->dirtyNodes = malloc(capacity * sizeof(uint32_t));
+	graph->changedNodes = malloc(capacity * sizeof(uint32_t));
+	if (!graph->parents || !graph->subtreeEnds || !graph->localMatrices
+		|| !graph->worldMatrices || !graph->dirty || !graph->dirtyNodes
+		|| !graph->changedNodes) {
+
+		fprintf(stderr, "Failed to allocate scene graph of %u nodes.\n",
+			capacity);
+		destroySceneGraph(graph);
+		return 0;
+	}
+	return 1;
+}
+
+static void markDirty(SceneGraph *graph, uint32_t node) {
+	if (!graph->dirty[node]) {
+		graph->dirty[node] = 1;
+		graph->dirtyNodes[graph->dirtyCount++] = node;
+	}
+}
+
+uint32_t addSceneNode(SceneGraph *graph, uint32_t parent,
+	const float* const local) {
+
+	if (graph->nodeCount == graph->capacity) {
+		fprintf(stderr, "Scene graph is full.\n");
+		return SCENE_NO_NODE;
+	}
+	if (parent != SCENE_NO_NODE && (parent >= graph->nodeCount
+		|| graph->subtreeEnds[parent] != graph->nodeCount)) {
+
+		fprintf(stderr, "Scene node %u can't take more children.\n", parent);
+		return SCENE_NO_NODE;
+	}
+
+	uint32_t node = graph->nodeCount++;
+	graph->parents[node] = parent;
+	graph->subtreeEnds[node] = graph->nodeCount;
+	for (uint32_t i = parent; i != SCENE_NO_NODE; i = graph->parents[i]) {
+		graph->subtreeEnds[i] = graph->nodeCount;
+	}
+	memcpy(&graph->localMatrices[node * 16], local, 16 * sizeof(float));
+	markDirty(graph, node);
+	return node;
+}
+
+void setSceneNodeTransform(SceneGraph *graph, uint32_t node,
+	const float* const local) {
+
+	memcpy(&graph->localMatrices[node * 16], local, 16 * sizeof(float));
+	markDirty(graph, node);
+}
+
+void rotateSceneNode(SceneGraph *graph, uint32_t node, float angle, float x,
+	float y, float z) {
+
+	float *local = &graph->localMatrices[node * 16];
+	float translation[3] = { local[12], local[13], local[14] };
+	local[12] = local[13] = local[14] = 0.0f;
+	rotateMatrix(local, angle, x, y, z);
+	memcpy(&local[12], translation, sizeof(translation));
+	markDirty(graph, node);
+}
+
+// parent * local for column-major matrices; result may not alias either
+static void multiplyWorld(float *restrict result,
+	const float* const restrict parent, const float* const restrict local) {
+
+	for (int c = 0; c < 4; ++c) {
+		for (int r = 0; r < 4; ++r) {
+			result[c * 4 + r] = parent[r] * local[c * 4]
+				+ parent[4 + r] * local[c * 4 + 1]
+				+ parent[8 + r] * local[c * 4 + 2]
+				+ parent[12 + r] * local[c * 4 + 3];
+		}
+	}
+}
+
+static int compareNodes(const void *a, const void *b) {
+	uint32_t nodeA = *(const uint32_t*) a, nodeB = *(const uint32_t*) b;
+	return (nodeA > nodeB) - (nodeA < nodeB);
+}
+
+uint32_t updateSceneGraph(SceneGraph *graph) {
+	// In depth-first order a dirty node inside the subtree of an earlier
+	// dirty node is updated along with it
+	qsort(graph->dirtyNodes, graph->dirtyCount, sizeof(uint32_t),
+		compareNodes);
+	graph->changedCount = 0;
+	uint32_t updatedEnd = 0;
+	for (uint32_t i = 0; i < graph->dirtyCount; ++i) {
+		uint32_t root = graph->dirtyNodes[i];
+		graph->dirty[root] = 0;
+		if (root < updatedEnd) {
+			continue;
+		}
+
+		updatedEnd = graph->subtreeEnds[root];
+		for (uint32_t node = root; node < updatedEnd; ++node) {
+			const float* const local = &graph->localMatrices[node * 16];
+			float *world = &graph->worldMatrices[node * 16];
+			uint32_t parent = graph->parents[node];
+			if (parent == SCENE_NO_NODE) {
+				memcpy(world, local, 16 * sizeof(float));
+			} else {
+				multiplyWorld(world, &graph->worldMatrices[parent * 16], local);
+			}
+			graph->changedNodes[graph->changedCount++] = node;
+		}
+	}
+	graph->dirtyCount = 0;
+	return graph->changedCount;
+}
+
+void destroySceneGraph(SceneGraph *graph) {
+	free(graph->parents);
+	free(graph->subtreeEnds);
+	free(graph->localMatrices);
+	free(graph->worldMatrices);
+	free(graph->dirty);
+	free(graph->dirtyNodes);
+	free(graph->changedNodes);
+	memset(graph, 0, sizeof(SceneGraph));
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define SCENE_NO_NODE UINT32_MAX
+
+// Transform hierarchy stored as structure-of-arrays in depth-first order,
+// so parents precede their children and the descendants of node i are the
+// nodes (i, subtreeEnds[i]). Matrices are column-major, 16 floats per node.
+typedef struct _SceneGraph {
+	uint32_t nodeCount, capacity;
+	uint32_t *parents, *subtreeEnds;
+	float *localMatrices, *worldMatrices;
+
+	// Nodes whose local matrix changed since the last update
+	uint8_t *dirty;
+	uint32_t *dirtyNodes, dirtyCount;
+
+	// Nodes whose world matrix changed in the last update, in order
+	uint32_t *changedNodes, changedCount;
+} SceneGraph;
+
+int createSceneGraph(SceneGraph *graph, uint32_t capacity);
+
+// Appends a node under parent, which must be SCENE_NO_NODE for a new root
+// or a node whose subtree is still open: the last node added or one of its
+// ancestors. Returns the new node, or SCENE_NO_NODE on failure.
+uint32_t addSceneNode(SceneGraph *graph, uint32_t parent,
+	const float* const local);
+
+void setSceneNodeTransform(SceneGraph *graph, uint32_t node,
+	const float* const local);
+
+// Rotates a node about its own origin, in its parent's axes
+void rotateSceneNode(SceneGraph *graph, uint32_t node, float angle, float x,
+	float y, float z);
+
+// Re-evaluates the world matrices of the dirty subtrees only. Returns the
+// number of nodes listed in changedNodes.
+uint32_t updateSceneGraph(SceneGraph *graph);
+
+void destroySceneGraph(SceneGraph *graph);
@@ -0,0 +1,33 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(binding = 0) uniform MVPMatrices {
+	mat4 model, view, proj;
+} ubo;
+
+struct InstanceData {
+	mat4 model;
+	uint material;
+};
+
+layout(std430, binding = 3) readonly buffer Instances {
+	InstanceData instances[];
+};
+
+layout(push_constant) uniform MeshBounds {
+	vec4 center, extent;
+} bounds;
+
+layout(location = 0) in vec4 inPosition;
+layout(location = 8) in uint instanceIndex;
+
+// Must compute gl_Position exactly as shader-packed.vert does
+out gl_PerVertex {
+	invariant vec4 gl_Position;
+};
+
+void main() {
+	vec3 position = bounds.center.xyz + inPosition.xyz * bounds.extent.xyz;
+	mat4 model = ubo.model * instances[instanceIndex].model;
+	gl_Position = ubo.proj * ubo.view * model * vec4(position, 1.0);
+}
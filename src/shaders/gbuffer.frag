@@ -0,0 +1,28 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(binding = 1) uniform sampler2DArray texSampler;
+
+layout(location = 0) in vec2 fragTexCoord;
+layout(location = 2) in mat3 tbn;
+layout(location = 5) flat in uint fragMaterial;
+
+// Diffuse tint per material index; see MATERIAL_COUNT
+const vec3 materialTints[4] = vec3[](
+	vec3(1.0, 1.0, 1.0),
+	vec3(1.0, 0.8, 0.65),
+	vec3(0.7, 0.85, 1.0),
+	vec3(0.8, 1.0, 0.75)
+);
+
+// Surface attributes lighting.frag shades the pixel with. The position
+// comes from the depth attachment.
+layout(location = 0) out vec4 outAlbedo;
+layout(location = 1) out vec4 outNormal;
+
+void main() {
+	outAlbedo = texture(texSampler, vec3(fragTexCoord, 0))
+		* vec4(materialTints[fragMaterial % 4], 1.0);
+	outNormal = vec4(tbn * normalize(texture(texSampler,
+		vec3(fragTexCoord, 1)).xyz), 0.0);
+}
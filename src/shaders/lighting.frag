@@ -0,0 +1,110 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// The lighting of shader.frag, once per pixel of the G-buffer
+layout(binding = 2) uniform SceneAttributes {
+	vec4 ambientColor, diffuseColor, specularColor, eyePos, lightPos, lightColor;
+	vec4 clusterScale;
+	uvec4 clusterCounts;
+	float specularExp;
+} ubo;
+
+struct PointLight {
+	vec3 position;
+	float radius;
+	vec4 color;
+};
+
+layout(std430, binding = 4) readonly buffer Lights {
+	PointLight lights[];
+};
+
+// Offset and count of each cluster's run in lightIndices
+layout(std430, binding = 5) readonly buffer Clusters {
+	uvec2 clusters[];
+};
+
+layout(std430, binding = 6) readonly buffer LightIndices {
+	uint lightIndices[];
+};
+
+// Distance to the scene light over shadowFar, which matches SHADOW_MAP_FAR
+layout(binding = 7) uniform samplerCube shadowMap;
+const float shadowFar = 100.0;
+const float shadowBias = 0.05;
+
+// Written by gbuffer.frag and the depth test, at the pixels of this pass
+layout(set = 1, binding = 0) uniform sampler2D albedoBuffer;
+layout(set = 1, binding = 1) uniform sampler2D normalBuffer;
+layout(set = 1, binding = 2) uniform sampler2D depthBuffer;
+
+layout(location = 0) in vec2 ndc;
+layout(location = 1) flat in mat4 invViewProj;
+layout(location = 5) flat in vec4 clipW;
+
+layout(location = 0) out vec4 outColor;
+
+uint getCluster(float depth) {
+	uvec2 tile = min(uvec2(gl_FragCoord.xy * ubo.clusterScale.xy),
+		ubo.clusterCounts.xy - 1);
+	uint slice = uint(clamp(log(depth) * ubo.clusterScale.z
+		+ ubo.clusterScale.w, 0.0, float(ubo.clusterCounts.z - 1)));
+
+	return (slice * ubo.clusterCounts.y + tile.y) * ubo.clusterCounts.x
+		+ tile.x;
+}
+
+// 0 if something is closer to the scene light along the way, 1 otherwise
+float getShadow(vec3 fragPosition, vec3 lightPosition) {
+	vec3 toFragment = fragPosition - lightPosition;
+	float occluder = texture(shadowMap, toFragment).r * shadowFar;
+	return length(toFragment) - shadowBias > occluder ? 0.0 : 1.0;
+}
+
+void main() {
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float depth = texelFetch(depthBuffer, pixel, 0).r;
+
+	// Nothing was drawn here; keep the draw passes' clear color
+	if (depth == 1.0) {
+		outColor = vec4(0.0, 0.0, 0.0, 1.0);
+		return;
+	}
+
+	vec4 position = invViewProj * vec4(ndc, depth, 1.0);
+	vec3 fragPosition = position.xyz / position.w;
+	vec3 eyeDirection = normalize(ubo.eyePos.xyz - fragPosition);
+	vec3 normal = texelFetch(normalBuffer, pixel, 0).xyz;
+	uvec2 cluster = clusters[getCluster(dot(clipW,
+		vec4(fragPosition, 1.0)))];
+	vec3 lighting = vec3(0.0);
+
+	for (uint i = 0; i < cluster.y; i++) {
+		uint lightIndex = lightIndices[cluster.x + i];
+		PointLight light = lights[lightIndex];
+		vec3 lightDirection = normalize(light.position - fragPosition);
+
+		if (dot(normal, lightDirection) <= 0)
+			continue;
+
+		// Inverse square falloff windowed to reach zero at the radius
+		float distance = length(light.position - fragPosition);
+		float window = clamp(1.0 - pow(distance / light.radius, 4.0), 0.0,
+			1.0);
+		float attenuation = window * window / (pow(distance, 2.0) + 1.0);
+		if (lightIndex == 0) {
+			attenuation *= getShadow(fragPosition, light.position);
+		}
+		vec3 reflection = reflect(-lightDirection, normal);
+		float diffuseComponent = dot(normal, lightDirection);
+		float specularComponent = pow(max(dot(reflection, eyeDirection),
+			0.0), ubo.specularExp);
+
+		lighting += (diffuseComponent * ubo.diffuseColor.rgb
+			+ specularComponent * ubo.specularColor.rgb) * attenuation
+			* light.color.rgb;
+	}
+
+	outColor = vec4(lighting + ubo.ambientColor.rgb, 1.0)
+		* texelFetch(albedoBuffer, pixel, 0);
+}
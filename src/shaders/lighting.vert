@@ -0,0 +1,22 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(binding = 0) uniform MVPMatrices {
+	mat4 model, view, proj;
+} ubo;
+
+layout(location = 0) out vec2 ndc;
+// The same for every pixel, so only worked out per vertex
+layout(location = 1) flat out mat4 invViewProj;
+layout(location = 5) flat out vec4 clipW; // Row of the clip space w
+
+// A single triangle covering the viewport
+void main() {
+	ndc = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2) * 2.0 - 1.0;
+	gl_Position = vec4(ndc, 0.0, 1.0);
+
+	mat4 viewProj = ubo.proj * ubo.view;
+	invViewProj = inverse(viewProj);
+	clipW = vec4(viewProj[0][3], viewProj[1][3], viewProj[2][3],
+		viewProj[3][3]);
+}
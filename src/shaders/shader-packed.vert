@@ -0,0 +1,56 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(binding = 0) uniform MVPMatrices {
+	mat4 model, view, proj;
+} ubo;
+
+struct InstanceData {
+	mat4 model;
+	uint material;
+};
+
+layout(std430, binding = 3) readonly buffer Instances {
+	InstanceData instances[];
+};
+
+layout(push_constant) uniform MeshBounds {
+	vec4 center, extent;
+} bounds;
+
+layout(location = 0) in vec4 inPosition;
+layout(location = 1) in vec4 qtangent;
+layout(location = 2) in vec2 inTexCoord;
+layout(location = 8) in uint instanceIndex;
+
+layout(location = 0) out vec2 fragTexCoord;
+layout(location = 1) out vec3 fragPosition;
+layout(location = 2) out mat3 tbn;
+layout(location = 5) flat out uint fragMaterial;
+
+// Invariant, so the depth prepass in depth.vert lands on the same depths
+out gl_PerVertex {
+	invariant vec4 gl_Position;
+};
+
+void main() {
+	vec3 position = bounds.center.xyz + inPosition.xyz * bounds.extent.xyz;
+
+	// Rebuild the tangent frame; the sign of w is the bitangent handedness
+	vec4 q = normalize(qtangent);
+	float handedness = q.w < 0.0 ? -1.0 : 1.0;
+	vec3 tangent = vec3(1.0 - 2.0 * (q.y * q.y + q.z * q.z),
+		2.0 * (q.x * q.y + q.w * q.z), 2.0 * (q.x * q.z - q.w * q.y));
+	vec3 normal = vec3(2.0 * (q.x * q.z + q.w * q.y),
+		2.0 * (q.y * q.z - q.w * q.x), 1.0 - 2.0 * (q.x * q.x + q.y * q.y));
+	vec3 bitangent = cross(normal, tangent) * handedness;
+
+	InstanceData instance = instances[instanceIndex];
+	mat4 model = ubo.model * instance.model;
+	gl_Position = ubo.proj * ubo.view * model * vec4(position, 1.0);
+	fragPosition = (model * vec4(position, 1.0)).xyz;
+	fragTexCoord = inTexCoord;
+	fragMaterial = instance.material;
+	tbn = mat3(mat3(model) * tangent, mat3(model) * bitangent,
+		mat3(model) * normal);
+}
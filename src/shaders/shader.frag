@@ -4,36 +4,102 @@
 layout(binding = 1) uniform sampler2DArray texSampler;
 layout(binding = 2) uniform SceneAttributes {
 	vec4 ambientColor, diffuseColor, specularColor, eyePos, lightPos, lightColor;
+	vec4 clusterScale;
+	uvec4 clusterCounts;
 	float specularExp;
 } ubo;
 
+struct PointLight {
+	vec3 position;
+	float radius;
+	vec4 color;
+};
+
+layout(std430, binding = 4) readonly buffer Lights {
+	PointLight lights[];
+};
+
+// Offset and count of each cluster's run in lightIndices
+layout(std430, binding = 5) readonly buffer Clusters {
+	uvec2 clusters[];
+};
+
+layout(std430, binding = 6) readonly buffer LightIndices {
+	uint lightIndices[];
+};
+
+// Distance to the scene light over shadowFar, which matches SHADOW_MAP_FAR
+layout(binding = 7) uniform samplerCube shadowMap;
+const float shadowFar = 100.0;
+const float shadowBias = 0.05;
+
 layout(location = 0) in vec2 fragTexCoord;
 layout(location = 1) in vec3 fragPosition;
 layout(location = 2) in mat3 tbn;
+layout(location = 5) flat in uint fragMaterial;
+
+// Diffuse tint per material index; see MATERIAL_COUNT
+const vec3 materialTints[4] = vec3[](
+	vec3(1.0, 1.0, 1.0),
+	vec3(1.0, 0.8, 0.65),
+	vec3(0.7, 0.85, 1.0),
+	vec3(0.8, 1.0, 0.75)
+);
 
 layout(location = 0) out vec4 outColor;
 
+uint getCluster() {
+	// gl_FragCoord.w is 1 / clip w, which is the view depth
+	float depth = 1.0 / gl_FragCoord.w;
+	uvec2 tile = min(uvec2(gl_FragCoord.xy * ubo.clusterScale.xy),
+		ubo.clusterCounts.xy - 1);
+	uint slice = uint(clamp(log(depth) * ubo.clusterScale.z
+		+ ubo.clusterScale.w, 0.0, float(ubo.clusterCounts.z - 1)));
+
+	return (slice * ubo.clusterCounts.y + tile.y) * ubo.clusterCounts.x
+		+ tile.x;
+}
+
+// 0 if something is closer to the scene light along the way, 1 otherwise
+float getShadow(vec3 lightPosition) {
+	vec3 toFragment = fragPosition - lightPosition;
+	float occluder = texture(shadowMap, toFragment).r * shadowFar;
+	return length(toFragment) - shadowBias > occluder ? 0.0 : 1.0;
+}
+
 void main() {
-	vec3 lightDirection = normalize(ubo.lightPos.xyz - fragPosition);
 	vec3 eyeDirection = normalize(ubo.eyePos.xyz - fragPosition);
 	vec3 normal = tbn * normalize(texture(texSampler,
 		vec3(fragTexCoord, 1)).xyz);
-	vec3 reflection = reflect(-lightDirection, normal);
-	float distance = length(ubo.lightPos.xyz - fragPosition);
-	float attenuation = 1.0 / (pow(distance, 2.0) + 1.0);
-	float diffuseComponent, specularComponent;
-
-	if (dot(normal, lightDirection) <= 0) {
-		diffuseComponent = specularComponent = 0.0;
-	} else {
-		diffuseComponent = max(dot(normal, lightDirection), 0.0);
-		specularComponent = pow(max(dot(reflection, eyeDirection), 0.0),
-			ubo.specularExp);
+	uvec2 cluster = clusters[getCluster()];
+	vec3 lighting = vec3(0.0);
+
+	for (uint i = 0; i < cluster.y; i++) {
+		uint lightIndex = lightIndices[cluster.x + i];
+		PointLight light = lights[lightIndex];
+		vec3 lightDirection = normalize(light.position - fragPosition);
+
+		if (dot(normal, lightDirection) <= 0)
+			continue;
+
+		// Inverse square falloff windowed to reach zero at the radius
+		float distance = length(light.position - fragPosition);
+		float window = clamp(1.0 - pow(distance / light.radius, 4.0), 0.0,
+			1.0);
+		float attenuation = window * window / (pow(distance, 2.0) + 1.0);
+		if (lightIndex == 0) {
+			attenuation *= getShadow(light.position);
+		}
+		vec3 reflection = reflect(-lightDirection, normal);
+		float diffuseComponent = dot(normal, lightDirection);
+		float specularComponent = pow(max(dot(reflection, eyeDirection),
+			0.0), ubo.specularExp);
+
+		lighting += (diffuseComponent * ubo.diffuseColor.rgb
+			+ specularComponent * ubo.specularColor.rgb) * attenuation
+			* light.color.rgb;
 	}
 
-	outColor = vec4((diffuseComponent * ubo.diffuseColor.rgb
-		+ specularComponent * ubo.specularColor.rgb) * attenuation
-		* ubo.lightColor.rgb + ubo.ambientColor.rgb, 1.0) * texture(texSampler,
-		vec3(fragTexCoord, 0));
+	outColor = vec4(lighting + ubo.ambientColor.rgb, 1.0) * texture(texSampler,
+		vec3(fragTexCoord, 0)) * vec4(materialTints[fragMaterial % 4], 1.0);
 }
-
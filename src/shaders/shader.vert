@@ -5,26 +5,41 @@ layout(binding = 0) uniform MVPMatrices {
 	mat4 model, view, proj;
 } ubo;
 
+struct InstanceData {
+	mat4 model;
+	uint material;
+};
+
+layout(std430, binding = 3) readonly buffer Instances {
+	InstanceData instances[];
+};
+
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 tangent;
 layout(location = 2) in vec3 bitangent;
 layout(location = 3) in vec3 normal;
 layout(location = 4) in vec2 inTexCoord;
+layout(location = 8) in uint instanceIndex;
 
 layout(location = 0) out vec2 fragTexCoord;
 layout(location = 1) out vec3 fragPosition;
 layout(location = 2) out mat3 tbn;
+layout(location = 5) flat out uint fragMaterial;
 
+// Invariant, so the depth prepass in depth.vert lands on the same depths
 out gl_PerVertex {
-	vec4 gl_Position;
+	invariant vec4 gl_Position;
 };
 
 void main() {
-	gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
-	fragPosition = (ubo.model * vec4(inPosition, 1.0)).xyz;
+	InstanceData instance = instances[instanceIndex];
+	mat4 model = ubo.model * instance.model;
+	gl_Position = ubo.proj * ubo.view * model * vec4(inPosition, 1.0);
+	fragPosition = (model * vec4(inPosition, 1.0)).xyz;
 	fragTexCoord = inTexCoord;
-	tbn = mat3(mat3(ubo.model) * normalize(tangent),
-		mat3(ubo.model) * normalize(bitangent),
-		mat3(ubo.model) * normalize(normal));
+	fragMaterial = instance.material;
+	tbn = mat3(mat3(model) * normalize(tangent),
+		mat3(model) * normalize(bitangent),
+		mat3(model) * normalize(normal));
 }
 
@@ -0,0 +1,16 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(push_constant) uniform ShadowParams {
+	vec4 center, extent;
+	mat4 face;
+	vec4 light;
+} params;
+
+layout(location = 0) in vec3 fragPosition;
+
+// Distance to the light rather than the face's depth, so the map can be
+// sampled by direction alone
+void main() {
+	gl_FragDepth = length(fragPosition - params.light.xyz) / params.light.w;
+}
@@ -0,0 +1,38 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(binding = 0) uniform MVPMatrices {
+	mat4 model, view, proj;
+} ubo;
+
+struct InstanceData {
+	mat4 model;
+	uint material;
+};
+
+layout(std430, binding = 3) readonly buffer Instances {
+	InstanceData instances[];
+};
+
+// Face takes positions relative to the light to the face's clip space.
+// light.w is the far plane distances are divided by.
+layout(push_constant) uniform ShadowParams {
+	vec4 center, extent;
+	mat4 face;
+	vec4 light;
+} params;
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 8) in uint instanceIndex;
+
+layout(location = 0) out vec3 fragPosition;
+
+out gl_PerVertex {
+	vec4 gl_Position;
+};
+
+void main() {
+	mat4 model = ubo.model * instances[instanceIndex].model;
+	fragPosition = (model * vec4(inPosition, 1.0)).xyz;
+	gl_Position = params.face * vec4(fragPosition, 1.0);
+}
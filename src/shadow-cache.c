@@ -0,0 +1,105 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shadow-cache.h"
+
+int createShadowCache(ShadowCache *cache, uint32_t instanceCount) {
+	memset(cache, 0, sizeof(ShadowCache));
+	cache->casters = malloc(instanceCount * sizeof(uint32_t));
+	cache->dynamicCasters = malloc(instanceCount * sizeof(uint32_t));
+	cache->lastMoved = malloc(instanceCount * sizeof(uint32_t));
+	cache->dynamic = calloc(instanceCount, sizeof(uint8_t));
+	if (!cache->casters || !cache->dynamicCasters || !cache->lastMoved
+		|| !cache->dynamic) {
+
+		fprintf(stderr, "Failed to allocate shadow cache.\n");
+		destroyShadowCache(cache);
+		return 0;
+	}
+	cache->instanceCount = instanceCount;
+	for (uint32_t i = 0; i < instanceCount; ++i) {
+		cache->casters[i] = i;
+	}
+	cache->staticCount = instanceCount;
+	return 1;
+}
+
+void updateShadowCache(ShadowCache *cache, const float* const lightPos,
+	const uint32_t* const changed, uint32_t changedCount) {
+
+	int hadDynamic = cache->dynamicCount > 0;
+	int staticChanged = 0;
+	int first = !cache->valid;
+	++cache->frame;
+
+	for (uint32_t i = 0; i < changedCount; ++i) {
+		uint32_t instance = changed[i];
+		cache->lastMoved[instance] = cache->frame;
+		if (!cache->dynamic[instance]) {
+			cache->dynamic[instance] = 1;
+			cache->dynamicCasters[cache->dynamicCount++] = instance;
+			staticChanged = 1;
+		}
+	}
+	for (uint32_t i = 0; i < cache->dynamicCount;) {
+		uint32_t instance = cache->dynamicCasters[i];
+		if (cache->frame - cache->lastMoved[instance] > SHADOW_SETTLE_FRAMES) {
+			cache->dynamic[instance] = 0;
+			cache->dynamicCasters[i] =
+				cache->dynamicCasters[--cache->dynamicCount];
+			staticChanged = 1;
+		} else {
+			++i;
+		}
+	}
+
+	// Promotions and demotions are the only changes to either set. Static
+	// casters keep their instance order.
+	cache->castersChanged = staticChanged || first;
+	if (staticChanged) {
+		uint32_t count = 0;
+		for (uint32_t i = 0; i < cache->instanceCount; ++i) {
+			if (!cache->dynamic[i]) {
+				cache->casters[count++] = i;
+			}
+		}
+		cache->staticCount = count;
+		memcpy(&cache->casters[cache->staticCount], cache->dynamicCasters,
+			cache->dynamicCount * sizeof(uint32_t));
+	}
+
+	int lightMoved = first
+		|| memcmp(cache->lightPos, lightPos, sizeof(cache->lightPos));
+	memcpy(cache->lightPos, lightPos, sizeof(cache->lightPos));
+	cache->valid = 1;
+
+	// Dynamic casters of the last frame must be cleared from the map too
+	cache->staticDirty = staticChanged || lightMoved;
+	cache->mapDirty = cache->staticDirty || cache->dynamicCount || hadDynamic;
+}
+
+void destroyShadowCache(ShadowCache *cache) {
+	free(cache->casters);
+	free(cache->dynamicCasters);
+	free(cache->lastMoved);
+	free(cache->dynamic);
+	memset(cache, 0, sizeof(ShadowCache));
+}
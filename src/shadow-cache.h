@@ -0,0 +1,57 @@
+/*
+ * This file is part of Hello Vulkan.
+ *
+ * Hello Vulkan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hello Vulkan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hello Vulkan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Cube shadow map of the scene light. Faces store the distance to the
+// light over SHADOW_MAP_FAR.
+#define SHADOW_MAP_SIZE 1024
+#define SHADOW_MAP_NEAR 0.05f
+#define SHADOW_MAP_FAR 100.0f
+
+// Frames an instance must stay still before it goes back into the cached
+// static shadow map
+#define SHADOW_SETTLE_FRAMES 60
+
+// Splits the instances casting shadows into static ones, drawn into a
+// cached map only when the light or the static set changes, and dynamic
+// ones, drawn over a copy of it every frame. Instances turn dynamic when
+// they move and static again once they settle.
+typedef struct _ShadowCache {
+	uint32_t *casters; // Static casters, then dynamic ones
+	uint32_t *dynamicCasters, *lastMoved;
+	uint8_t *dynamic;
+	uint32_t instanceCount, staticCount, dynamicCount, frame;
+	float lightPos[3];
+	int valid;
+
+	// Set by the last update
+	int staticDirty; // The cached map must be redrawn
+	int mapDirty; // The shadow map must be rebuilt from the cached map
+	int castersChanged; // casters must be uploaded again
+} ShadowCache;
+
+int createShadowCache(ShadowCache *cache, uint32_t instanceCount);
+
+// Moves the listed instances into the dynamic set, settles the ones that
+// stopped moving and checks whether the light moved
+void updateShadowCache(ShadowCache *cache, const float* const lightPos,
+	const uint32_t* const changed, uint32_t changedCount);
+
+void destroyShadowCache(ShadowCache *cache);
@@ -17,45 +17,154 @@
 
 #include <limits.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <GLFW/glfw3.h>
 
 #include "glfw-controls.h"
+#include "light-grid.h"
 #include "maths.h"
 #include "scene.h"
+#include "shadow-cache.h"
+#include "vulkan-lifecycle.h"
 
-void drawFrame(const VkContext* const context) {
+// Times averaged over this many recordings per thread count
+#define RECORD_SCALING_REPEATS 32
+
+static double nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Returns the number of batches recorded, 0 on failure
+static uint32_t recordFrameCommands(const VkContext* const context,
+									const FrameResources* const frame,
+									uint32_t imageIndex,
+									const DrawList* const drawList) {
+
+	// All passes' secondaries come from the thread pools, so they are
+	// reset once for the whole frame
+	for (uint32_t q = 0; q < MAX_GRAPH_QUEUES; ++q) {
+		if (frame->commandPools[q]) {
+			vkResetCommandPool(context->device, frame->commandPools[q], 0);
+		}
+	}
+	for (uint32_t t = 0; t < context->recordThreadCount; ++t) {
+		vkResetCommandPool(context->device, frame->threadPools[t], 0);
+	}
+	return recordFrame(context, frame, imageIndex, drawList);
+}
+
+// Takes the GPU time of the frame from its timestamps, once it retired.
+// The time between the ends of consecutive frames shows how much of a
+// frame overlapped the previous one.
+static void readGpuTime(VkContext *context, FrameResources *frame) {
+	uint64_t timestamps[2];
+	if (!frame->timed) {
+		return;
+	}
+	frame->timed = 0;
+	if (vkGetQueryPoolResults(context->device, context->timestampPool,
+			frame->timestampQuery, 2, sizeof(timestamps), timestamps,
+			sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+		return;
+	}
+	context->gpuMs = (timestamps[1] - timestamps[0])
+		* context->timestampPeriod * 0.000001;
+	if (context->lastGpuEnd) {
+		context->gpuIntervalMs = (timestamps[1] - context->lastGpuEnd)
+			* context->timestampPeriod * 0.000001;
+	}
+	context->lastGpuEnd = timestamps[1];
+}
+
+// Submits a batch of the frame graph to its queue, waiting for the work
+// it depends on by the other queues' points. The first batch also waits
+// for the uploads, which may run on a queue of their own. The last batch
+// presents, so it also waits for the swap chain image.
+static QueuePoint submitBatch(VkContext *context,
+							  const FrameResources* const frame,
+							  uint32_t index, int last) {
+
+	const GraphBatch* const batch = &context->frameGraph->batches[index];
+	QueueSubmission submission = {};
+	submission.commandBuffers = &frame->commandBuffers[batch->queue][index];
+	submission.commandBufferCount = 1;
+	for (uint32_t q = 0; q < MAX_GRAPH_QUEUES; ++q) {
+		if (batch->waitStages[q]) {
+			submission.waits[submission.waitCount] =
+				getQueuePoint(context->scheduler, q);
+			submission.waitStages[submission.waitCount++] =
+				batch->waitStages[q];
+		}
+	}
+	if (index == 0) {
+		submission.waits[submission.waitCount] =
+			getQueuePoint(context->scheduler, FRAME_QUEUE_TRANSFER);
+		submission.waitStages[submission.waitCount++] =
+			VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+	}
+	if (last) {
+		// Only the blit at the end of the frame writes the swap chain image
+		submission.waitSemaphore = frame->imageAvailableSemaphore;
+		submission.semaphoreStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+		submission.signalSemaphore = frame->renderFinishedSemaphore;
+	}
+	return (QueuePoint) { batch->queue,
+		submitToQueue(context->scheduler, batch->queue, &submission) };
+}
+
+void drawFrame(VkContext *context, const DrawList* const drawList) {
+	FrameResources *frame = &context->frames[context->frameIndex];
+	context->frameIndex = (context->frameIndex + 1) % MAX_FRAMES_IN_FLIGHT;
+
+	// The pools can only be reset once the frame's last use of them is done
+	if (!waitForQueuePoint(context->scheduler, frame->retirePoint)) {
+		return;
+	}
+	readGpuTime(context, frame);
+	destroyRetiredObjects(context->destructionQueue);
 	uint32_t imageIndex;
-	vkAcquireNextImageKHR(context->device, context->swapChain, ULLONG_MAX,
-		context->imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
-
-	VkSubmitInfo submitInfo = {};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-
-	VkSemaphore waitSemaphores[] = { context->imageAvailableSemaphore };
-	VkPipelineStageFlags waitStages[] =
-		{ VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = waitSemaphores;
-	submitInfo.pWaitDstStageMask = waitStages;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &context->commandBuffers[imageIndex];
-
-	VkSemaphore signalSemaphores[] = { context->renderFinishedSemaphore };
-	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = signalSemaphores;
-
-	if (vkQueueSubmit(context->graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
-		fprintf(stderr, "Failed to submit draw command buffer.\n");
+	VkResult result = vkAcquireNextImageKHR(context->device,
+		context->swapChain, ULLONG_MAX, frame->imageAvailableSemaphore,
+		VK_NULL_HANDLE, &imageIndex);
+	// Nothing was acquired, so the frame is skipped until the swap chain
+	// is recreated. A suboptimal image can still be presented.
+	if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+		context->swapChainOutOfDate = 1;
+		return;
+	}
+	context->swapChainOutOfDate = result == VK_SUBOPTIMAL_KHR;
+
+	double recordStart = nowMs();
+	uint32_t batchCount = recordFrameCommands(context, frame, imageIndex,
+		drawList);
+	if (!batchCount) {
 		return;
 	}
+	context->recordMs = nowMs() - recordStart;
+
+	// The last batch waits for the others, so it retires the frame
+	QueuePoint firstPoint = {};
+	for (uint32_t i = 0; i < batchCount; ++i) {
+		frame->retirePoint = submitBatch(context, frame, i,
+			i == batchCount - 1);
+		if (!frame->retirePoint.value) {
+			return;
+		}
+		firstPoint = i ? firstPoint : frame->retirePoint;
+	}
+	frame->timed = context->timestampPool != NULL;
 
 	VkPresentInfoKHR presentInfo = {};
 	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = signalSemaphores;
+	presentInfo.pWaitSemaphores = &frame->renderFinishedSemaphore;
 
 	VkSwapchainKHR swapChains[] = { context->swapChain };
 	presentInfo.swapchainCount = 1;
@@ -63,16 +172,67 @@ void drawFrame(const VkContext* const context) {
 	presentInfo.pImageIndices = &imageIndex;
 	presentInfo.pResults = NULL; // Optional
 
-	vkQueuePresentKHR(context->presentQueue, &presentInfo);
+	result = vkQueuePresentKHR(context->presentQueue, &presentInfo);
+	if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+		context->swapChainOutOfDate = 1;
+	}
+
+	// Uniforms, visible instance lists and culling stats are single
+	// buffered, so the next frame can't start writing them until this one
+	// is done with them. Only the first batch uses them, so with async
+	// compute the post-processing of this frame keeps running while the
+	// next one is recorded and submitted.
+	waitForQueuePoint(context->scheduler, firstPoint);
+}
+
+void setRenderScale(VkContext *context, float scale) {
+	context->renderExtent.width = MIN(MAX((uint32_t) (context->extent.width
+		* scale + 0.5f), 1), context->extent.width);
+	context->renderExtent.height = MIN(MAX((uint32_t) (context->extent.height
+		* scale + 0.5f), 1), context->extent.height);
+}
+
+int reportRecordScaling(VkContext *context, const DrawList* const drawList) {
+	// Nothing is submitted, so only the idle device has to be waited for
+	vkDeviceWaitIdle(context->device);
+	const FrameResources* const frame = &context->frames[0];
+	uint32_t maxThreads = context->recordThreadCount;
+	printf("%u draws\n%10s %12s %10s\n", drawList->count, "threads",
+		"record ms", "speedup");
+
+	double singleMs = 0.0;
+	for (uint32_t threads = 1; threads <= maxThreads; ++threads) {
+		context->recordThreadCount = threads;
+		double start = nowMs();
+		for (uint32_t i = 0; i < RECORD_SCALING_REPEATS; ++i) {
+			if (!recordFrameCommands(context, frame, 0, drawList)) {
+				context->recordThreadCount = maxThreads;
+				return 0;
+			}
+		}
+		double ms = (nowMs() - start) / RECORD_SCALING_REPEATS;
+		if (threads == 1) {
+			singleMs = ms;
+		}
+		printf("%10u %12.4f %10.2f\n", threads, ms, singleMs / ms);
+	}
+	context->recordThreadCount = maxThreads;
+	return 1;
+}
+
+void resizeUBOAttributes(UBOAttributes *uboAttributes, float width,
+						 float height) {
 
-	vkQueueWaitIdle(context->presentQueue);
+	perspectiveMatrix(uboAttributes->mvp.proj, 45.0f, width / height, 0.1f,
+		100000.0f);
+	getLightGridParams(uboAttributes->sceneAttributes.clusterScale,
+		uboAttributes->sceneAttributes.clusterCounts, width, height);
 }
 
 UBOAttributes initializeUBOAttributes(float width, float height) {
 	UBOAttributes uboAttributes;
 
 	identityMatrix(uboAttributes.mvp.model);
-	identityMatrix(uboAttributes.mvp.proj);
 
 	memcpy(uboAttributes.sceneAttributes.eyePos, EYE, sizeof(EYE));
 	uboAttributes.yaw = 90.0f;
@@ -80,9 +240,6 @@ UBOAttributes initializeUBOAttributes(float width, float height) {
 	eulerView(uboAttributes.mvp.view, uboAttributes.sceneAttributes.eyePos,
 		uboAttributes.pitch, uboAttributes.yaw);
 
-	perspectiveMatrix(uboAttributes.mvp.proj, 45.0f, width / height, 0.1f,
-		100000.0f);
-
 	memcpy(uboAttributes.sceneAttributes.ambientColor, CUBE_AMBIENT,
 		sizeof(CUBE_AMBIENT));
 	memcpy(uboAttributes.sceneAttributes.diffuseColor, CUBE_DIFFUSE,
@@ -95,6 +252,12 @@ UBOAttributes initializeUBOAttributes(float width, float height) {
 	memcpy(uboAttributes.sceneAttributes.lightColor, LIGHT_COLOR,
 		sizeof(LIGHT_COLOR));
 	uboAttributes.sceneAttributes.specularExp = CUBE_SPECULAR_EXP;
+	resizeUBOAttributes(&uboAttributes, width, height);
+	uboAttributes.sceneGraph = NULL;
+	uboAttributes.modelNode = SCENE_NO_NODE;
+	uboAttributes.firstInstanceNode = SCENE_NO_NODE;
+	uboAttributes.pickedNode = SCENE_NO_NODE;
+	uboAttributes.bvh = NULL;
 
 	return uboAttributes;
 }
@@ -103,15 +266,187 @@ void updateUniformBuffer(GLFWwindow *window, UBOAttributes *uboAttributes,
 						 const VkContext* const context) {
 	applyUBOControls(window, uboAttributes);
 
+	VkDeviceMemory mvpMemory = getBuffer(context->registry,
+		context->mvpUniformBuffer)->memory;
+	VkDeviceMemory sceneAttributesMemory = getBuffer(context->registry,
+		context->sceneAttributesUniformBuffer)->memory;
+
 	void *data;
-	vkMapMemory(context->device, context->mvpUniformBufferMemory, 0,
-		sizeof(MVPMatrices), 0, &data);
+	vkMapMemory(context->device, mvpMemory, 0, sizeof(MVPMatrices), 0, &data);
 	memcpy(data, &uboAttributes->mvp, sizeof(MVPMatrices));
-	vkUnmapMemory(context->device, context->mvpUniformBufferMemory);
+	vkUnmapMemory(context->device, mvpMemory);
 
-	vkMapMemory(context->device, context->sceneAttributesUniformBufferMemory, 0,
+	vkMapMemory(context->device, sceneAttributesMemory, 0,
 		sizeof(SceneAttributes), 0, &data);
 	memcpy(data, &uboAttributes->sceneAttributes, sizeof(SceneAttributes));
-	vkUnmapMemory(context->device, context->sceneAttributesUniformBufferMemory);
+	vkUnmapMemory(context->device, sceneAttributesMemory);
+}
+
+
+void updateInstances(const VkContext* const context,
+					 const uint32_t* const changed, uint32_t changedCount) {
+	if (!changedCount) {
+		return;
+	}
+
+	// Uploads don't wait for themselves, so the last one may still read the
+	// staging buffer. Frames wait for it, so it is usually done.
+	waitForQueuePoint(context->scheduler, getQueuePoint(context->scheduler,
+		FRAME_QUEUE_TRANSFER));
+	InstanceData *staging;
+	vkMapMemory(context->device, context->instanceStagingBufferMemory, 0,
+		context->instanceCount * sizeof(InstanceData), 0, (void**) &staging);
+	for (uint32_t i = 0; i < changedCount; ++i) {
+		staging[changed[i]] = context->instances[changed[i]];
+	}
+	vkUnmapMemory(context->device, context->instanceStagingBufferMemory);
+
+	// Runs of consecutive instances are copied as one region
+	VkBufferCopy *regions = malloc(changedCount * sizeof(VkBufferCopy));
+	if (!regions) {
+		fprintf(stderr, "Failed to allocate instance copy regions.\n");
+		return;
+	}
+	uint32_t regionCount = 0;
+	for (uint32_t i = 0; i < changedCount; ++i) {
+		VkDeviceSize offset = changed[i] * sizeof(InstanceData);
+		VkBufferCopy *last = regionCount ? &regions[regionCount - 1] : NULL;
+		if (last && last->srcOffset + last->size == offset) {
+			last->size += sizeof(InstanceData);
+		} else {
+			regions[regionCount++] = (VkBufferCopy) { offset, offset,
+				sizeof(InstanceData) };
+		}
+	}
+
+	VkCommandBuffer commandBuffer = beginSingleTimeCommands(context->device,
+		context->commandPool);
+	if (commandBuffer) {
+		vkCmdCopyBuffer(commandBuffer, context->instanceStagingBuffer,
+			context->instanceBuffer, regionCount, regions);
+
+		VkMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_VERTEX_SHADER_BIT
+			| VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, NULL, 0,
+			NULL);
+		endSingleTimeCommands(commandBuffer, context->commandPool,
+			context->destructionQueue);
+	}
+	free(regions);
+}
+
+void updateVisibleInstances(const VkContext* const context,
+							const uint32_t* const visible,
+							const uint32_t* const visibleCounts) {
+	uint32_t lodCount = context->mesh->lodCount;
+	uint32_t *instances;
+	vkMapMemory(context->device, context->visibleInstanceBufferMemory, 0,
+		lodCount * context->instanceCount * sizeof(uint32_t), 0,
+		(void**) &instances);
+	for (uint32_t i = 0; i < lodCount; ++i) {
+		memcpy(&instances[i * context->instanceCount],
+			&visible[i * context->instanceCount],
+			visibleCounts[i] * sizeof(uint32_t));
+	}
+	vkUnmapMemory(context->device, context->visibleInstanceBufferMemory);
+
+	VkDrawIndexedIndirectCommand *commands;
+	vkMapMemory(context->device, context->indirectBufferMemory, 0,
+		lodCount * sizeof(VkDrawIndexedIndirectCommand), 0,
+		(void**) &commands);
+	for (uint32_t i = 0; i < lodCount; ++i) {
+		commands[i].instanceCount = visibleCounts[i];
+	}
+	vkUnmapMemory(context->device, context->indirectBufferMemory);
+}
+
+void updateLights(const VkContext* const context,
+				  const PointLight* const lights, uint32_t count,
+				  const LightGrid* const grid) {
+	count = MIN(count, context->maxLights);
+	void *data;
+	if (count) {
+		vkMapMemory(context->device, context->lightBufferMemory, 0,
+			count * sizeof(PointLight), 0, &data);
+		memcpy(data, lights, count * sizeof(PointLight));
+		vkUnmapMemory(context->device, context->lightBufferMemory);
+	}
+
+	vkMapMemory(context->device, context->clusterBufferMemory, 0,
+		LIGHT_GRID_CLUSTERS * sizeof(uint32_t[2]), 0, &data);
+	memcpy(data, grid->clusters, LIGHT_GRID_CLUSTERS * sizeof(uint32_t[2]));
+	vkUnmapMemory(context->device, context->clusterBufferMemory);
+
+	if (grid->indexCount) {
+		vkMapMemory(context->device, context->lightIndexBufferMemory, 0,
+			grid->indexCount * sizeof(uint32_t), 0, &data);
+		memcpy(data, grid->indices, grid->indexCount * sizeof(uint32_t));
+		vkUnmapMemory(context->device, context->lightIndexBufferMemory);
+	}
+}
+
+void updateShadowCasters(VkContext *context, const ShadowCache* const cache) {
+	if (cache->castersChanged) {
+		void *data;
+		vkMapMemory(context->device, context->shadowCasterBufferMemory, 0,
+			cache->instanceCount * sizeof(uint32_t), 0, &data);
+		memcpy(data, cache->casters, cache->instanceCount * sizeof(uint32_t));
+		vkUnmapMemory(context->device, context->shadowCasterBufferMemory);
+	}
+	memcpy(context->shadowLightPos, cache->lightPos,
+		sizeof(context->shadowLightPos));
+	context->shadowStaticCount = cache->staticCount;
+	context->shadowDynamicCount = cache->dynamicCount;
+	context->shadowStaticDirty = cache->staticDirty;
+	context->shadowMapDirty = cache->mapDirty;
 }
 
+void readCullStats(const VkContext* const context, FrameStats *stats) {
+	// drawFrame() waits for the frame's culling to be done, so the counts
+	// are complete
+	void *data;
+	if (context->cullingMode == CULLING_MESHLETS) {
+		CullCounts counts;
+		vkMapMemory(context->device, context->drawCountBufferMemory, 0,
+			sizeof(CullCounts), 0, &data);
+		memcpy(&counts, data, sizeof(CullCounts));
+		vkUnmapMemory(context->device, context->drawCountBufferMemory);
+		stats->visibleInstances = counts.visibleInstanceCount;
+		stats->visibleMeshlets = counts.drawCount;
+		stats->triangleCount = counts.triangleCount;
+		return;
+	}
+
+	if (context->cullingMode == CULLING_OCCLUSION) {
+		VkDrawIndexedIndirectCommand commands[2];
+		vkMapMemory(context->device, context->indirectBufferMemory, 0,
+			sizeof(commands), 0, &data);
+		memcpy(commands, data, sizeof(commands));
+		vkUnmapMemory(context->device, context->indirectBufferMemory);
+
+		CullCounts counts;
+		vkMapMemory(context->device, context->drawCountBufferMemory, 0,
+			sizeof(CullCounts), 0, &data);
+		memcpy(&counts, data, sizeof(CullCounts));
+		vkUnmapMemory(context->device, context->drawCountBufferMemory);
+
+		stats->visibleInstances = commands[0].instanceCount
+			+ commands[1].instanceCount;
+		stats->lateInstances = commands[1].instanceCount;
+		stats->occludedInstances = counts.occludedInstanceCount;
+	} else {
+		vkMapMemory(context->device, context->indirectBufferMemory,
+			offsetof(VkDrawIndexedIndirectCommand, instanceCount),
+			sizeof(uint32_t), 0, &data);
+		memcpy(&stats->visibleInstances, data, sizeof(uint32_t));
+		vkUnmapMemory(context->device, context->indirectBufferMemory);
+	}
+
+	// Instance culling on the GPU always draws LOD 0
+	stats->triangleCount = (uint64_t) stats->visibleInstances
+		* (context->mesh->lods[0].indexCount / 3);
+}
@@ -19,12 +19,55 @@
 
 #include <GLFW/glfw3.h>
 
+#include "draw-list.h"
+#include "light-grid.h"
+#include "shadow-cache.h"
 #include "vulkan-types.h"
 
-void drawFrame(const VkContext* const context);
+// Records the draw list into the current frame's command buffer, then
+// submits and presents it
+void drawFrame(VkContext *context, const DrawList* const drawList);
+
+// Renders the next frames at the scale of the swap chain's size, between
+// RENDER_SCALE_MIN and RENDER_SCALE_MAX
+void setRenderScale(VkContext *context, float scale);
+
+// Prints the time to record the draw list with 1 to the context's number
+// of recording threads, without submitting anything. Returns nonzero on
+// success.
+int reportRecordScaling(VkContext *context, const DrawList* const drawList);
 
 UBOAttributes initializeUBOAttributes(float width, float height);
 
+// Matches the projection's aspect ratio and the light clusters to a new
+// render size
+void resizeUBOAttributes(UBOAttributes *uboAttributes, float width,
+						 float height);
+
 void updateUniformBuffer(GLFWwindow *window, UBOAttributes *uboAttributes,
 						 const VkContext* const context);
 
+// Uploads the listed instances, in increasing order, from the array the
+// context was initialized with
+void updateInstances(const VkContext* const context,
+					 const uint32_t* const changed, uint32_t changedCount);
+
+// Uploads one list of visible instances per LOD of the mesh. The list of
+// LOD i starts at visible[i * instanceCount].
+void updateVisibleInstances(const VkContext* const context,
+							const uint32_t* const visible,
+							const uint32_t* const visibleCounts);
+
+// Uploads the lights and the cluster light lists built from them. The
+// lights keep their order, so the grid's indices stay valid.
+void updateLights(const VkContext* const context,
+				  const PointLight* const lights, uint32_t count,
+				  const LightGrid* const grid);
+
+// Uploads the shadow casters if they changed and tells the next frame
+// which shadow maps to redraw
+void updateShadowCasters(VkContext *context, const ShadowCache* const cache);
+
+// Reads back the visible counts of the last frame culled on the GPU
+void readCullStats(const VkContext* const context, FrameStats *stats);
+
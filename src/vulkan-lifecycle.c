@@ -18,6 +18,7 @@
 #include <libgen.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,14 +28,23 @@
 #include <GLFW/glfw3.h>
 
 #include "config.h"
+#include "draw-list.h"
+#include "light-grid.h"
 #include "maths.h"
-#include "scene.h"
+#include "mesh.h"
+#include "shadow-cache.h"
 
 #define VK_CHECK_ERROR(x) if(!(x)) return 0
 #define VK_DESTROY(device, object, function) if(device && object) \
 	function(device, object, NULL)
 
 const static char* const REQUIRED_EXTENSION = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+const static char* const DRAW_INDIRECT_COUNT_EXTENSION =
+	VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME;
+const static char* const TIMELINE_SEMAPHORE_EXTENSION =
+	VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME;
+const static char* const PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION =
+	VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME;
 const static char* const SHADER_SEARCH_PATHS[] = {
 	"./src/shaders/",
 	"./shaders/"
@@ -45,20 +55,222 @@ const static char* const TEXTURE_SEARCH_PATHS[] = {
 };
 const static char* const INSTALL_DATA_SEARCH_PATH = "/../share/" PACKAGE "/";
 
+// Vertex shader location of the per-instance visible instance index
+#define INSTANCE_ATTRIBUTE_LOCATION 8
+
+// Must match local_size_x in the culling compute shaders
+#define CULL_WORKGROUP_SIZE 64
+
+// One indirect command per visible instance meshlet, bounded by the
+// minimum guaranteed compute dispatch size
+#define MAX_MESHLET_DRAWS (65535 * CULL_WORKGROUP_SIZE)
+
+// Must match local_size_x and local_size_y in depth-reduce.comp
+#define REDUCE_WORKGROUP_SIZE 8
+
+// Must match local_size_x and local_size_y in bloom-downsample.comp and
+// tonemap.comp
+#define POST_WORKGROUP_SIZE 8
+
+// Of the color image the frame is rendered and post-processed in
+#define HDR_FORMAT VK_FORMAT_R16G16B16A16_SFLOAT
+
+// Colors brighter than the threshold bloom. The exposure scales the scene
+// before tonemapping.
+#define BLOOM_THRESHOLD 1.0f
+#define BLOOM_STRENGTH 0.3f
+#define EXPOSURE 1.0f
+
+#define MAX_CULL_DESCRIPTORS 7
+
+// Minimum capacity of a geometry pool, grown to fit a larger first mesh
+#define GEOMETRY_POOL_VERTICES (1 << 18)
+#define GEOMETRY_POOL_INDICES (1 << 20)
+
+// Below this many draws per secondary command buffer, splitting costs more
+// than the recording it spreads out
+#define MIN_DRAWS_PER_SECONDARY 256
+
 #pragma pack(0)
 typedef struct _TexHdr {
 	uint32_t width, height;
 	uint32_t format, type;
 } TexHdr;
 
-static VkInstance createInstance() {
+// Pushed to the culling compute shader
+typedef struct _CullParams {
+	float sphere[4];
+	uint32_t instanceCount, meshletCount, phase;
+	uint32_t firstIndex; // Of the mesh in its geometry pool
+	int32_t vertexOffset;
+} CullParams;
+
+// Pushed to the depth pyramid reduction compute shader
+typedef struct _ReduceParams {
+	int32_t inputSize[2], outputSize[2];
+	int32_t scale;
+} ReduceParams;
+
+// Pushed to the bloom and tonemapping compute shaders. level is the bloom
+// level to write, or the number of levels when tonemapping.
+typedef struct _PostParams {
+	int32_t imageSize[2], renderSize[2]; // Of the color image
+	int32_t level;
+	float threshold, exposure, bloomStrength;
+} PostParams;
+
+// Pushed to the shadow shaders. Face takes world positions to the clip
+// space of a cube face around the light. The light's w is the far plane
+// distances are divided by.
+typedef struct _ShadowParams {
+	MeshBounds bounds;
+	float face[16], light[4];
+} ShadowParams;
+
+// Major axis, s and t axes of each cube face, in the order of the cube's
+// layers. Matches the face selection of cube map sampling.
+const static float CUBE_FACE_AXES[CUBE_FACES][3][3] = {
+	{ {  1.0f,  0.0f,  0.0f }, {  0.0f,  0.0f, -1.0f }, {  0.0f, -1.0f,  0.0f } },
+	{ { -1.0f,  0.0f,  0.0f }, {  0.0f,  0.0f,  1.0f }, {  0.0f, -1.0f,  0.0f } },
+	{ {  0.0f,  1.0f,  0.0f }, {  1.0f,  0.0f,  0.0f }, {  0.0f,  0.0f,  1.0f } },
+	{ {  0.0f, -1.0f,  0.0f }, {  1.0f,  0.0f,  0.0f }, {  0.0f,  0.0f, -1.0f } },
+	{ {  0.0f,  0.0f,  1.0f }, {  1.0f,  0.0f,  0.0f }, {  0.0f, -1.0f,  0.0f } },
+	{ {  0.0f,  0.0f, -1.0f }, { -1.0f,  0.0f,  0.0f }, {  0.0f, -1.0f,  0.0f } }
+};
+
+// Attachments of the G-buffer, in the order of gbuffer.frag's outputs
+#define GBUFFER_ATTACHMENTS 2
+const static VkFormat GBUFFER_FORMATS[GBUFFER_ATTACHMENTS] = {
+	VK_FORMAT_R8G8B8A8_UNORM, // Albedo
+	VK_FORMAT_R16G16B16A16_SFLOAT // World space normal
+};
+
+// How a graphics pipeline tests and writes depth
+typedef enum _DepthMode {
+	DEPTH_MODE_LESS, // Without a depth prepass
+	DEPTH_MODE_PREPASS, // Depth only, from the position streams
+	DEPTH_MODE_EQUAL // Shades only what the prepass left visible
+} DepthMode;
+
+// A consecutive range of a render pass's draws, recorded into a secondary
+// command buffer allocated from the range's own pool
+typedef struct _RecordJob {
+	const VkContext *context;
+	VkCommandBuffer commandBuffer;
+	VkRenderPass renderPass;
+	VkFramebuffer framebuffer;
+	const VkPipeline *pipelines;
+	const DrawItem *items;
+	uint32_t count;
+} RecordJob;
+
+// Resources and passes of the frame graph, in the order they are added.
+// Passes a culling mode doesn't use stay disabled.
+typedef enum _FrameResource {
+	FRAME_COLOR,
+	FRAME_DEPTH,
+	FRAME_SWAP_CHAIN_IMAGE,
+	FRAME_SHADOW_CACHE,
+	FRAME_SHADOW_MAP,
+	FRAME_DEPTH_PYRAMID,
+	FRAME_CULL_RESULTS, // Visible instances, draw commands and counts
+	FRAME_BLOOM,
+	FRAME_GBUFFER_ALBEDO, // Only with deferred shading
+	FRAME_GBUFFER_NORMAL
+} FrameResource;
+
+typedef enum _FramePass {
+	FRAME_PASS_CULL,
+	FRAME_PASS_SHADOW_CACHE,
+	FRAME_PASS_SHADOW_COPY,
+	FRAME_PASS_SHADOW,
+	FRAME_PASS_PREPASS,
+	FRAME_PASS_MAIN,
+	FRAME_PASS_PREPASSED, // The main pass after a depth prepass
+	FRAME_PASS_DEPTH_PYRAMID,
+	FRAME_PASS_LATE_CULL,
+	FRAME_PASS_LATE,
+	FRAME_PASS_LIGHTING, // Deferred shading of the G-buffer
+	FRAME_PASS_BLOOM,
+	FRAME_PASS_TONEMAP,
+	FRAME_PASS_PRESENT
+} FramePass;
+
+// What the frame graph's passes record from
+typedef struct _FrameRecording {
+	const VkContext *context;
+	const FrameResources *frame;
+	uint32_t imageIndex;
+	const DrawList *drawList;
+} FrameRecording;
+
+static int isGpuCulling(const VkContext* const context) {
+	return context->cullingMode == CULLING_GPU
+		|| context->cullingMode == CULLING_MESHLETS
+		|| context->cullingMode == CULLING_OCCLUSION;
+}
+
+// Attachments the draw passes write besides depth: the color image, or the
+// G-buffer with deferred shading
+static uint32_t getColorAttachmentCount(const VkContext* const context) {
+	return context->shadingMode == SHADING_DEFERRED ? GBUFFER_ATTACHMENTS
+		: 1;
+}
+
+// Indirect draws recorded for the mesh, each with its own range of the
+// visible instance buffer; meshlet draws all come from one call
+static uint32_t getDrawCommandCount(const VkContext* const context) {
+	switch (context->cullingMode) {
+		case CULLING_MESHLETS:
+		case CULLING_GPU:
+			return 1;
+		case CULLING_OCCLUSION:
+			return 2;
+		default:
+			return context->mesh->lodCount;
+	}
+}
+
+static int checkInstanceExtensionSupport(const char* const extensionName) {
+	uint32_t extensionCount;
+	vkEnumerateInstanceExtensionProperties(NULL, &extensionCount, NULL);
+
+	VkExtensionProperties *availableExtensions =
+		malloc(sizeof(VkExtensionProperties) * extensionCount);
+	vkEnumerateInstanceExtensionProperties(NULL, &extensionCount,
+		availableExtensions);
+
+	for (uint32_t i = 0; i < extensionCount; ++i) {
+		VkExtensionProperties extension = availableExtensions[i];
+		if (!strcmp(extensionName, extension.extensionName)) {
+			free(availableExtensions);
+			return 1;
+		}
+	}
+
+	free(availableExtensions);
+	return 0;
+}
+
+static VkInstance createInstance(VkContext *context) {
 	VkApplicationInfo appInfo = {};
 	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
 	appInfo.pApplicationName = "Hello Vulkan";
 	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
 	appInfo.pEngineName = "No Engine";
 	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-	appInfo.apiVersion = VK_API_VERSION_1_0;
+
+	// 1.0 loaders don't have vkEnumerateInstanceVersion
+	PFN_vkEnumerateInstanceVersion enumerateInstanceVersion =
+		(PFN_vkEnumerateInstanceVersion) vkGetInstanceProcAddr(NULL,
+		"vkEnumerateInstanceVersion");
+	uint32_t loaderVersion = VK_API_VERSION_1_0;
+	if (enumerateInstanceVersion) {
+		enumerateInstanceVersion(&loaderVersion);
+	}
+	context->apiVersion = loaderVersion >= VK_API_VERSION_1_2
+		? VK_API_VERSION_1_2 : VK_API_VERSION_1_0;
+	appInfo.apiVersion = context->apiVersion;
 
 	VkInstanceCreateInfo createInfo = {};
 	createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -73,12 +285,31 @@ static VkInstance createInstance() {
 
 	glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
 
-	createInfo.enabledExtensionCount = glfwExtensionCount;
-	createInfo.ppEnabledExtensionNames = glfwExtensions;
+	// Without 1.2, the timeline semaphore feature is queried and enabled
+	// through this extension
+	const char **extensions = malloc((glfwExtensionCount + 1)
+		* sizeof(const char*));
+	if (!extensions) {
+		fprintf(stderr, "Failed to allocate instance extensions.\n");
+		return NULL;
+	}
+	memcpy(extensions, glfwExtensions,
+		glfwExtensionCount * sizeof(const char*));
+	uint32_t extensionCount = glfwExtensionCount;
+	context->physicalDeviceProperties2 = checkInstanceExtensionSupport(
+		PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION);
+	if (context->physicalDeviceProperties2) {
+		extensions[extensionCount++] = PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION;
+	}
+
+	createInfo.enabledExtensionCount = extensionCount;
+	createInfo.ppEnabledExtensionNames = extensions;
 	createInfo.enabledLayerCount = 0;
 
 	VkInstance instance;
-	if (vkCreateInstance(&createInfo, NULL, &instance) != VK_SUCCESS) {
+	VkResult result = vkCreateInstance(&createInfo, NULL, &instance);
+	free(extensions);
+	if (result != VK_SUCCESS) {
 		fprintf(stderr, "Could not create Vulkan instance.\n");
 		return NULL;
 	}
@@ -99,8 +330,10 @@ static int findQueueFamilies(VkPhysicalDevice device, VkSurfaceKHR surface) {
 		vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
 			&presentSupport);
 		VkQueueFamilyProperties queueFamily = queueFamilies[i];
+		VkQueueFlags requiredFlags = VK_QUEUE_GRAPHICS_BIT
+			| VK_QUEUE_COMPUTE_BIT;
 		if (queueFamily.queueCount > 0 && presentSupport
-			&& queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+			&& (queueFamily.queueFlags & requiredFlags) == requiredFlags) {
 			free(queueFamilies);
 			return i;
 		}
@@ -109,7 +342,55 @@ static int findQueueFamilies(VkPhysicalDevice device, VkSurfaceKHR surface) {
 	return -1;
 }
 
-static int checkDeviceExtensionSupport(VkPhysicalDevice device) {
+// A family without graphics, whose queue can run beside the graphics one.
+// Returns -1 if there is none.
+static int findComputeQueueFamily(VkPhysicalDevice device) {
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, NULL);
+
+	VkQueueFamilyProperties *queueFamilies =
+		malloc(sizeof(VkQueueFamilyProperties) * queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
+		queueFamilies);
+
+	int family = -1;
+	for (uint32_t i = 0; i < queueFamilyCount && family < 0; ++i) {
+		VkQueueFlags flags = queueFamilies[i].queueFlags;
+		if (queueFamilies[i].queueCount > 0 && (flags & VK_QUEUE_COMPUTE_BIT)
+			&& !(flags & VK_QUEUE_GRAPHICS_BIT)) {
+
+			family = i;
+		}
+	}
+	free(queueFamilies);
+	return family;
+}
+
+static uint32_t getQueueCount(VkPhysicalDevice device, uint32_t family) {
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, NULL);
+
+	VkQueueFamilyProperties *queueFamilies =
+		malloc(sizeof(VkQueueFamilyProperties) * queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
+		queueFamilies);
+	uint32_t queueCount = queueFamilies[family].queueCount;
+	free(queueFamilies);
+	return queueCount;
+}
+
+// Uploads get a second queue of the graphics family, so what they write
+// stays owned by the family without ownership transfers. Without timeline
+// semaphores, the scheduler keeps all work on one queue.
+static uint32_t getGraphicsQueueCount(const VkContext* const context) {
+	return context->timelineSemaphores && getQueueCount(
+		context->physicalDevice, context->queueFamilies[FRAME_QUEUE_GRAPHICS])
+		> 1 ? 2 : 1;
+}
+
+static int checkDeviceExtensionSupport(VkPhysicalDevice device,
+	const char* const extensionName) {
+
 	uint32_t extensionCount;
 	vkEnumerateDeviceExtensionProperties(device, NULL, &extensionCount, NULL);
 
@@ -120,7 +401,7 @@ static int checkDeviceExtensionSupport(VkPhysicalDevice device) {
 
 	for (uint32_t i = 0; i < extensionCount; ++i) {
 		VkExtensionProperties extension = availableExtensions[i];
-		if (!strcmp(REQUIRED_EXTENSION, extension.extensionName)) {
+		if (!strcmp(extensionName, extension.extensionName)) {
 			free(availableExtensions);
 			return 1;
 		}
@@ -186,7 +467,7 @@ static int rateDeviceSuitability(VkPhysicalDevice device,
 		return 0;
 	}
 
-	if (!checkDeviceExtensionSupport(device)) {
+	if (!checkDeviceExtensionSupport(device, REQUIRED_EXTENSION)) {
 		return 0;
 	}
 
@@ -241,35 +522,153 @@ static VkSurfaceKHR createSurface(VkInstance instance, GLFWwindow *window) {
 	return surface;
 }
 
-static VkDevice createDevice(const VkContext* const context,
-							 int *queueFamilyIndex) {
+// Core 1.2 needs it from both the instance and the device
+static int hasVulkan12(const VkContext* const context) {
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(context->physicalDevice, &properties);
+	return context->apiVersion >= VK_API_VERSION_1_2
+		&& properties.apiVersion >= VK_API_VERSION_1_2;
+}
+
+// Prefers core 1.2 over the extension. Devices may offer the extension
+// without the feature.
+static int checkTimelineSemaphoreSupport(const VkContext* const context) {
+	if (hasVulkan12(context)) {
+		VkPhysicalDeviceVulkan12Features vulkan12Features = {};
+		vulkan12Features.sType =
+			VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+		VkPhysicalDeviceFeatures2 features = {};
+		features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		features.pNext = &vulkan12Features;
+		vkGetPhysicalDeviceFeatures2(context->physicalDevice, &features);
+		return vulkan12Features.timelineSemaphore;
+	}
+	if (!context->physicalDeviceProperties2
+		|| !checkDeviceExtensionSupport(context->physicalDevice,
+										TIMELINE_SEMAPHORE_EXTENSION)) {
+		return 0;
+	}
+	PFN_vkGetPhysicalDeviceFeatures2KHR getFeatures2 =
+		(PFN_vkGetPhysicalDeviceFeatures2KHR) vkGetInstanceProcAddr(
+		context->instance, "vkGetPhysicalDeviceFeatures2KHR");
+	if (!getFeatures2) {
+		return 0;
+	}
+
+	VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures = {};
+	timelineFeatures.sType =
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+	VkPhysicalDeviceFeatures2KHR features = {};
+	features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+	features.pNext = &timelineFeatures;
+	getFeatures2(context->physicalDevice, &features);
+	return timelineFeatures.timelineSemaphore;
+}
+
+static VkDevice createDevice(VkContext *context, int *queueFamilyIndex) {
 
 	*queueFamilyIndex = findQueueFamilies(context->physicalDevice,
 		context->surface);
 
-	VkDeviceQueueCreateInfo queueCreateInfo = {};
-	queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-	queueCreateInfo.queueFamilyIndex = *queueFamilyIndex;
-	queueCreateInfo.queueCount = 1;
-
-	float queuePriority = 1.0f;
-	queueCreateInfo.pQueuePriorities = &queuePriority;
+	// Timeline semaphores order work across queues without a fence per
+	// submission. Async compute needs a second queue besides.
+	context->timelineSemaphores = checkTimelineSemaphoreSupport(context);
+	int computeFamily = context->asyncCompute
+		? findComputeQueueFamily(context->physicalDevice) : -1;
+	if (context->asyncCompute && (computeFamily < 0
+		|| !context->timelineSemaphores)) {
+
+		fprintf(stderr, "Async compute requires a compute-only queue and "
+			"timeline semaphores; post-processing runs on the graphics "
+			"queue.\n");
+		context->asyncCompute = 0;
+	}
+	context->queueFamilies[FRAME_QUEUE_GRAPHICS] = *queueFamilyIndex;
+	context->queueFamilies[FRAME_QUEUE_COMPUTE] = context->asyncCompute
+		? computeFamily : *queueFamilyIndex;
+	context->queueFamilies[FRAME_QUEUE_TRANSFER] = *queueFamilyIndex;
+
+	VkDeviceQueueCreateInfo queueCreateInfos[MAX_GRAPH_QUEUES] = {};
+	float queuePriorities[] = { 1.0f, 1.0f };
+	for (uint32_t i = 0; i < MAX_GRAPH_QUEUES; ++i) {
+		queueCreateInfos[i].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+		queueCreateInfos[i].queueFamilyIndex = context->queueFamilies[i];
+		queueCreateInfos[i].queueCount = 1;
+		queueCreateInfos[i].pQueuePriorities = queuePriorities;
+	}
+	queueCreateInfos[FRAME_QUEUE_GRAPHICS].queueCount =
+		getGraphicsQueueCount(context);
 
 	VkPhysicalDeviceFeatures deviceFeatures = {};
+	VkPhysicalDeviceFeatures supportedFeatures;
+	vkGetPhysicalDeviceFeatures(context->physicalDevice, &supportedFeatures);
+
+	// Meshlet culling emits one draw per visible meshlet, each selecting its
+	// instance through firstInstance
+	if (context->cullingMode == CULLING_MESHLETS) {
+		if (!supportedFeatures.multiDrawIndirect
+			|| !supportedFeatures.drawIndirectFirstInstance) {
+
+			fprintf(stderr, "Meshlet culling requires multi-draw indirect "
+				"support.\n");
+			return NULL;
+		}
+		deviceFeatures.multiDrawIndirect = VK_TRUE;
+	}
+
+	// Lets every draw share one binding of the visible instance stream
+	deviceFeatures.drawIndirectFirstInstance =
+		supportedFeatures.drawIndirectFirstInstance;
+	context->firstInstanceDraws = supportedFeatures.drawIndirectFirstInstance;
+
+	// GPU culling can skip culled draws entirely when the draw count is read
+	// from a buffer
+	const char* extensions[] = { REQUIRED_EXTENSION, NULL, NULL };
+	uint32_t extensionCount = 1;
+	int drawIndirectCount = (context->cullingMode == CULLING_GPU
+		|| context->cullingMode == CULLING_MESHLETS)
+		&& checkDeviceExtensionSupport(context->physicalDevice,
+									   DRAW_INDIRECT_COUNT_EXTENSION);
+	if (drawIndirectCount) {
+		extensions[extensionCount++] = DRAW_INDIRECT_COUNT_EXTENSION;
+	}
+
+	VkPhysicalDeviceVulkan12Features vulkan12Features = {};
+	vulkan12Features.sType =
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	vulkan12Features.timelineSemaphore = VK_TRUE;
+	// Chaining these features requires them to match the promoted
+	// extensions that are enabled
+	vulkan12Features.drawIndirectCount = drawIndirectCount;
+	VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures = {};
+	timelineFeatures.sType =
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+	timelineFeatures.timelineSemaphore = VK_TRUE;
 
 	VkDeviceCreateInfo createInfo = {};
 	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-	createInfo.pQueueCreateInfos = &queueCreateInfo;
-	createInfo.queueCreateInfoCount = 1;
+	createInfo.pQueueCreateInfos = queueCreateInfos;
+	createInfo.queueCreateInfoCount = context->asyncCompute ? 2 : 1;
 	createInfo.pEnabledFeatures = &deviceFeatures;
-	createInfo.enabledExtensionCount = 1;
-	createInfo.ppEnabledExtensionNames = &REQUIRED_EXTENSION;
+	if (context->timelineSemaphores && hasVulkan12(context)) {
+		createInfo.pNext = &vulkan12Features;
+	} else if (context->timelineSemaphores) {
+		extensions[extensionCount++] = TIMELINE_SEMAPHORE_EXTENSION;
+		createInfo.pNext = &timelineFeatures;
+	}
+	createInfo.enabledExtensionCount = extensionCount;
+	createInfo.ppEnabledExtensionNames = extensions;
 
 	VkDevice device;
 	if (vkCreateDevice(context->physicalDevice, &createInfo, NULL, &device) != VK_SUCCESS) {
 		fprintf(stderr, "Could not create logical device.\n");
 		return NULL;
 	}
+	if (drawIndirectCount) {
+		context->vkCmdDrawIndexedIndirectCount =
+			(PFN_vkCmdDrawIndexedIndirectCountKHR) vkGetDeviceProcAddr(device,
+			"vkCmdDrawIndexedIndirectCountKHR");
+	}
 	return device;
 }
 
@@ -335,8 +734,9 @@ static VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR* const capabil
 	}
 }
 
-static int createSwapChain(VkContext* context, uint32_t width, uint32_t height,
-						   int vsync) {
+// Replaces the context's swap chain, if any, with one for the given size
+static int createSwapChain(VkContext* context, uint32_t width,
+						   uint32_t height) {
 
 	uint32_t formatCount, presentModeCount;
 	VkSurfaceFormatKHR *formats;
@@ -350,7 +750,7 @@ static int createSwapChain(VkContext* context, uint32_t width, uint32_t height,
 	context->surfaceFormat = chooseSwapSurfaceFormat(formatCount,
 		formats);
 	VkPresentModeKHR presentMode = chooseSwapPresentMode(presentModeCount,
-		presentModes, vsync);
+		presentModes, context->vsync);
 	context->extent = chooseSwapExtent(&capabilities, width, height);
 
 	uint32_t imageCount = capabilities.minImageCount + 1;
@@ -366,7 +766,16 @@ static int createSwapChain(VkContext* context, uint32_t width, uint32_t height,
 	createInfo.imageColorSpace = context->surfaceFormat.colorSpace;
 	createInfo.imageExtent = context->extent;
 	createInfo.imageArrayLayers = 1;
-	createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+	// Frames are only blitted into swap chain images
+	if (!(capabilities.supportedUsageFlags
+		& VK_IMAGE_USAGE_TRANSFER_DST_BIT)) {
+
+		fprintf(stderr, "Swap chain images can't be blitted to.\n");
+		free(formats);
+		free(presentModes);
+		return 0;
+	}
+	createInfo.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 
 	int queueIndex = findQueueFamilies(context->physicalDevice,
 		context->surface);
@@ -379,16 +788,19 @@ static int createSwapChain(VkContext* context, uint32_t width, uint32_t height,
 	createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 	createInfo.presentMode = presentMode;
 	createInfo.clipped = VK_TRUE;
-	createInfo.oldSwapchain = VK_NULL_HANDLE;
+	createInfo.oldSwapchain = context->swapChain;
 
+	VkSwapchainKHR swapChain;
 	if (vkCreateSwapchainKHR(context->device, &createInfo, NULL,
-							 &context->swapChain) != VK_SUCCESS) {
+							 &swapChain) != VK_SUCCESS) {
 
 		fprintf(stderr, "Failed to create swap chain.\n");
 		free(formats);
 		free(presentModes);
 		return 0;
 	}
+	VK_DESTROY(context->device, context->swapChain, vkDestroySwapchainKHR);
+	context->swapChain = swapChain;
 
 	free(formats);
 	free(presentModes);
@@ -424,27 +836,20 @@ static VkImageView createImageView(const VkContext* const context,
 	return textureImageView;
 }
 
-static int createImageViews(VkContext* context) {
+static int getSwapChainImages(VkContext* context) {
 	if (vkGetSwapchainImagesKHR(context->device, context->swapChain,
-								&context->imageViewCount, NULL) != VK_SUCCESS) {
+								&context->swapChainImageCount,
+								NULL) != VK_SUCCESS) {
 		return 0;
 	}
-	VkImage *swapChainImages = malloc(context->imageViewCount * sizeof(VkImage));
-	context->swapChainImageViews =
-		malloc(context->imageViewCount * sizeof(VkImageView));
+	free(context->swapChainImages);
+	context->swapChainImages =
+		malloc(context->swapChainImageCount * sizeof(VkImage));
 	if (vkGetSwapchainImagesKHR(context->device, context->swapChain,
-								&context->imageViewCount,
-								swapChainImages) != VK_SUCCESS) {
+								&context->swapChainImageCount,
+								context->swapChainImages) != VK_SUCCESS) {
 		return 0;
 	};
-
-	for (uint32_t i = 0; i < context->imageViewCount; i++) {
-		context->swapChainImageViews[i] = createImageView(context,
-			swapChainImages[i], context->surfaceFormat.format,
-			VK_IMAGE_ASPECT_COLOR_BIT, 1);
-	}
-
-	free(swapChainImages);
 	return 1;
 }
 
@@ -559,26 +964,142 @@ static VkFormat findDepthFormat(const VkContext* const context) {
 	VkFormat candidates[] = { VK_FORMAT_D32_SFLOAT,
 		VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT };
 	size_t numCandidates = sizeof(candidates) / sizeof(VkFormat);
+	// Occlusion culling samples depth to build the depth pyramid
+	VkFormatFeatureFlags features = VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT;
+	if (context->cullingMode == CULLING_OCCLUSION) {
+		features |= VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+	}
     return findSupportedFormat(context, candidates, numCandidates,
-		VK_IMAGE_TILING_OPTIMAL, VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+		VK_IMAGE_TILING_OPTIMAL, features);
 }
 
-static VkRenderPass createRenderPass(const VkContext* const context) {
+// Shadow maps are depth attachments sampled by shader.frag and copied from
+// the cached map
+static VkFormat findShadowFormat(const VkContext* const context) {
+	VkFormat candidates[] = { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D16_UNORM };
+	size_t numCandidates = sizeof(candidates) / sizeof(VkFormat);
+	return findSupportedFormat(context, candidates, numCandidates,
+		VK_IMAGE_TILING_OPTIMAL, VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT
+		| VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT);
+}
 
+// The first pass of a frame clears its attachments and the last leaves the
+// HDR color to post-processing. Passes in between keep both
+// attachments for the next pass. After a depth prepass, the first pass
+// keeps the depth it laid down.
+static VkRenderPass createRenderPass(const VkContext* const context,
+									 int first, int last, int prepassed) {
+
+	// With deferred shading the lighting pass reads the G-buffer, instead
+	// of post-processing reading the color image
+	int deferred = context->shadingMode == SHADING_DEFERRED;
+	uint32_t colorCount = getColorAttachmentCount(context);
 	VkAttachmentDescription colorAttachment = {};
-	colorAttachment.format = context->surfaceFormat.format;
+	colorAttachment.format = HDR_FORMAT;
 	colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-	colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	colorAttachment.loadOp = first ? VK_ATTACHMENT_LOAD_OP_CLEAR
+		: VK_ATTACHMENT_LOAD_OP_LOAD;
 	colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 	colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-	colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	colorAttachment.initialLayout = first ? VK_IMAGE_LAYOUT_UNDEFINED
+		: VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	colorAttachment.finalLayout = !last
+		? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : deferred
+		? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+
+	VkAttachmentDescription attachments[GBUFFER_ATTACHMENTS + 1];
+	VkAttachmentReference colorAttachmentRefs[GBUFFER_ATTACHMENTS] = {};
+	for (uint32_t i = 0; i < colorCount; ++i) {
+		attachments[i] = colorAttachment;
+		if (deferred) {
+			attachments[i].format = GBUFFER_FORMATS[i];
+		}
+		colorAttachmentRefs[i].attachment = i;
+		colorAttachmentRefs[i].layout =
+			VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	}
 
-	VkAttachmentReference colorAttachmentRef = {};
-	colorAttachmentRef.attachment = 0;
-	colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	VkAttachmentDescription depthAttachment = {};
+	depthAttachment.format = findDepthFormat(context);
+	if (depthAttachment.format == VK_FORMAT_UNDEFINED) {
+		return NULL;
+	}
+	depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	int clearDepth = first && !prepassed;
+	depthAttachment.loadOp = clearDepth ? VK_ATTACHMENT_LOAD_OP_CLEAR
+		: VK_ATTACHMENT_LOAD_OP_LOAD;
+	depthAttachment.storeOp = last && !deferred
+		? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
+	depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachment.initialLayout = clearDepth ? VK_IMAGE_LAYOUT_UNDEFINED
+		: VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+	attachments[colorCount] = depthAttachment;
+
+	VkAttachmentReference depthAttachmentRef = {};
+	depthAttachmentRef.attachment = colorCount;
+	depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+	VkSubpassDescription subpass = {};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.colorAttachmentCount = colorCount;
+	subpass.pColorAttachments = colorAttachmentRefs;
+	subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+	// The last frame's blit, or lighting pass, reads the color attachments
+	// before they are drawn over, and the last pass's are written before
+	// this frame's
+	VkSubpassDependency dependencies[2] = {};
+	dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[0].dstSubpass = 0;
+	dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+		| (deferred ? VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
+		: VK_PIPELINE_STAGE_TRANSFER_BIT);
+	dependencies[0].srcAccessMask = 0;
+	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT
+		| VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependencies[1].srcSubpass = 0;
+	dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	if (deferred) {
+		dependencies[1].srcStageMask |=
+			VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+		dependencies[1].srcAccessMask |=
+			VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+		dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+		dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	}
+
+	VkRenderPassCreateInfo renderPassInfo = {};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	renderPassInfo.attachmentCount = colorCount + 1;
+	renderPassInfo.pAttachments = attachments;
+	renderPassInfo.subpassCount = 1;
+	renderPassInfo.pSubpasses = &subpass;
+	renderPassInfo.dependencyCount = last ? 2 : 1;
+	renderPassInfo.pDependencies = dependencies;
+
+	VkRenderPass renderPass;
+	if (vkCreateRenderPass(context->device, &renderPassInfo, NULL,
+						   &renderPass) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create render pass.\n");
+		return NULL;
+	}
+
+	return renderPass;
+}
 
+// Depth-only pass over the main pass's depth attachment. Its depth writes
+// finish before the main pass tests against them.
+static VkRenderPass createPrepassRenderPass(const VkContext* const context) {
 	VkAttachmentDescription depthAttachment = {};
 	depthAttachment.format = findDepthFormat(context);
 	if (depthAttachment.format == VK_FORMAT_UNDEFINED) {
@@ -586,47 +1107,184 @@ static VkRenderPass createRenderPass(const VkContext* const context) {
 	}
 	depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
 	depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-	depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 	depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 	depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 	depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
 	VkAttachmentReference depthAttachmentRef = {};
-	depthAttachmentRef.attachment = 1;
+	depthAttachmentRef.attachment = 0;
 	depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
+	VkSubpassDescription subpass = {};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+	VkSubpassDependency dependencies[2] = {};
+	dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[0].dstSubpass = 0;
+	dependencies[0].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[0].srcAccessMask =
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+		| VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[0].dstAccessMask =
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[1].srcSubpass = 0;
+	dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[1].srcAccessMask =
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+		| VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[1].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+
+	VkRenderPassCreateInfo renderPassInfo = {};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	renderPassInfo.attachmentCount = 1;
+	renderPassInfo.pAttachments = &depthAttachment;
+	renderPassInfo.subpassCount = 1;
+	renderPassInfo.pSubpasses = &subpass;
+	renderPassInfo.dependencyCount = 2;
+	renderPassInfo.pDependencies = dependencies;
+
+	VkRenderPass renderPass;
+	if (vkCreateRenderPass(context->device, &renderPassInfo, NULL,
+						   &renderPass) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create depth prepass render pass.\n");
+		return NULL;
+	}
+
+	return renderPass;
+}
+
+// Fullscreen pass of deferred shading, writing every pixel of the render
+// area of the color image for post-processing. It reads the G-buffer and
+// depth the draw passes left.
+static VkRenderPass createLightingRenderPass(const VkContext* const context) {
+	VkAttachmentDescription colorAttachment = {};
+	colorAttachment.format = HDR_FORMAT;
+	colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	colorAttachment.finalLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+	VkAttachmentReference colorAttachmentRef = {};
+	colorAttachmentRef.attachment = 0;
+	colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
 	VkSubpassDescription subpass = {};
 	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
 	subpass.colorAttachmentCount = 1;
 	subpass.pColorAttachments = &colorAttachmentRef;
-	subpass.pDepthStencilAttachment = &depthAttachmentRef;
 
-	VkSubpassDependency dependency = {};
-	dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-	dependency.dstSubpass = 0;
-	dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependency.srcAccessMask = 0;
-	dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT
-		| VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	VkSubpassDependency dependencies[2] = {};
+	dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[0].dstSubpass = 0;
+	dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+		| VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+		| VK_PIPELINE_STAGE_TRANSFER_BIT;
+	dependencies[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+		| VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+		| VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+		| VK_ACCESS_SHADER_READ_BIT;
+	dependencies[1].srcSubpass = 0;
+	dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+	VkRenderPassCreateInfo renderPassInfo = {};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	renderPassInfo.attachmentCount = 1;
+	renderPassInfo.pAttachments = &colorAttachment;
+	renderPassInfo.subpassCount = 1;
+	renderPassInfo.pSubpasses = &subpass;
+	renderPassInfo.dependencyCount = 2;
+	renderPassInfo.pDependencies = dependencies;
+
+	VkRenderPass renderPass;
+	if (vkCreateRenderPass(context->device, &renderPassInfo, NULL,
+						   &renderPass) != VK_SUCCESS) {
 
-	VkAttachmentDescription attachments[] = { colorAttachment, depthAttachment };
+		fprintf(stderr, "Failed to create lighting render pass.\n");
+		return NULL;
+	}
+
+	return renderPass;
+}
+
+// Draws one face of a shadow cube. The cached map's pass clears it and
+// leaves it to be copied from. The shadow map's pass draws over the copy
+// and leaves it for shader.frag.
+static VkRenderPass createShadowRenderPass(const VkContext* const context,
+										   int cache) {
+
+	VkAttachmentDescription depthAttachment = {};
+	depthAttachment.format = context->shadowFormat;
+	depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	depthAttachment.loadOp = cache ? VK_ATTACHMENT_LOAD_OP_CLEAR
+		: VK_ATTACHMENT_LOAD_OP_LOAD;
+	depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachment.initialLayout = cache ? VK_IMAGE_LAYOUT_UNDEFINED
+		: VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	depthAttachment.finalLayout = cache ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+		: VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+	VkAttachmentReference depthAttachmentRef = {};
+	depthAttachmentRef.attachment = 0;
+	depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+	VkSubpassDescription subpass = {};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+	// The copy between the maps and the sampling of the last frame come
+	// before, and the copy or this frame's sampling after
+	VkSubpassDependency dependencies[2] = {};
+	dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[0].dstSubpass = 0;
+	dependencies[0].srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT
+		| VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	dependencies[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+		| VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+		| VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[1].srcSubpass = 0;
+	dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[1].srcAccessMask =
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT
+		| VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	dependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT
+		| VK_ACCESS_SHADER_READ_BIT;
 
 	VkRenderPassCreateInfo renderPassInfo = {};
 	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-	renderPassInfo.attachmentCount = sizeof(attachments) / sizeof(VkAttachmentDescription);
-	renderPassInfo.pAttachments = attachments;
+	renderPassInfo.attachmentCount = 1;
+	renderPassInfo.pAttachments = &depthAttachment;
 	renderPassInfo.subpassCount = 1;
 	renderPassInfo.pSubpasses = &subpass;
-	renderPassInfo.dependencyCount = 1;
-	renderPassInfo.pDependencies = &dependency;
+	renderPassInfo.dependencyCount = 2;
+	renderPassInfo.pDependencies = dependencies;
 
 	VkRenderPass renderPass;
 	if (vkCreateRenderPass(context->device, &renderPassInfo, NULL,
 						   &renderPass) != VK_SUCCESS) {
 
-		fprintf(stderr, "Failed to create render pass.\n");
+		fprintf(stderr, "Failed to create shadow render pass.\n");
 		return NULL;
 	}
 
@@ -655,8 +1313,35 @@ static VkDescriptorSetLayout createDescriptorSetLayout(const VkContext *const co
 	sceneAttributesUBOLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 	sceneAttributesUBOLayoutBinding.pImmutableSamplers = NULL; // Optional
 
+	VkDescriptorSetLayoutBinding instanceSSBOLayoutBinding = {};
+	instanceSSBOLayoutBinding.binding = 3;
+	instanceSSBOLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	instanceSSBOLayoutBinding.descriptorCount = 1;
+	instanceSSBOLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	instanceSSBOLayoutBinding.pImmutableSamplers = NULL; // Optional
+
+	// Lights, the cluster list ranges and the light lists they index
+	VkDescriptorSetLayoutBinding lightSSBOLayoutBindings[3] = {};
+	for (uint32_t i = 0; i < 3; ++i) {
+		lightSSBOLayoutBindings[i].binding = 4 + i;
+		lightSSBOLayoutBindings[i].descriptorType =
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		lightSSBOLayoutBindings[i].descriptorCount = 1;
+		lightSSBOLayoutBindings[i].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	}
+
+	VkDescriptorSetLayoutBinding shadowSamplerLayoutBinding = {};
+	shadowSamplerLayoutBinding.binding = 7;
+	shadowSamplerLayoutBinding.descriptorType =
+		VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	shadowSamplerLayoutBinding.descriptorCount = 1;
+	shadowSamplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
 	VkDescriptorSetLayoutBinding bindings[] = { mvpUBOLayoutBinding,
-		samplerLayoutBinding, sceneAttributesUBOLayoutBinding };
+		samplerLayoutBinding, sceneAttributesUBOLayoutBinding,
+		instanceSSBOLayoutBinding, lightSSBOLayoutBindings[0],
+		lightSSBOLayoutBindings[1], lightSSBOLayoutBindings[2],
+		shadowSamplerLayoutBinding };
 
 	VkDescriptorSetLayoutCreateInfo layoutInfo = {};
 	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -673,44 +1358,73 @@ static VkDescriptorSetLayout createDescriptorSetLayout(const VkContext *const co
 	return descriptorSetLayout;
 }
 
-static VkVertexInputAttributeDescription getAttributeDescriptions() {
+// Size of a vertex in a geometry pool's position stream
+static VkDeviceSize getPositionStride(VertexFormat format) {
+	return format == VERTEX_FORMAT_PACKED ? sizeof(((PackedVertex*) 0)->pos)
+		: sizeof(((Vertex*) 0)->pos);
+}
+
+// Depth-only pipelines read the position stream in place of the vertices
+static uint32_t getBindingDescriptions(VertexFormat format, int positionsOnly,
+	VkVertexInputBindingDescription *bindingDescriptions) {
+
+	bindingDescriptions[0].binding = 0;
+	bindingDescriptions[0].stride = positionsOnly ? getPositionStride(format)
+		: format == VERTEX_FORMAT_PACKED ? sizeof(PackedVertex)
+		: sizeof(Vertex);
+	bindingDescriptions[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+	bindingDescriptions[1].binding = 1;
+	bindingDescriptions[1].stride = sizeof(uint32_t);
+	bindingDescriptions[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
 
+	return 2;
 }
 
-static int createGraphicsPipeline(VkContext* context) {
+// The visible instance index is at the same location for every vertex format
+static uint32_t getInstanceAttributeDescriptions(
+	VkVertexInputAttributeDescription *attributeDescriptions) {
 
-	uint32_t *vertShaderCode, *fragShaderCode;
-	long vertShaderLength = readShaderFile("vert.spv", &vertShaderCode);
-	long fragShaderLength = readShaderFile("frag.spv", &fragShaderCode);
+	attributeDescriptions[0].binding = 1;
+	attributeDescriptions[0].location = INSTANCE_ATTRIBUTE_LOCATION;
+	attributeDescriptions[0].format = VK_FORMAT_R32_UINT;
+	attributeDescriptions[0].offset = 0;
 
-	context->vertShaderModule = createShaderModule(context->device, vertShaderCode,
-		vertShaderLength);
-	context->fragShaderModule = createShaderModule(context->device, fragShaderCode,
-		fragShaderLength);
-	free(vertShaderCode);
-	free(fragShaderCode);
+	return 1;
+}
 
-	VkPipelineShaderStageCreateInfo vertShaderStageInfo = {};
-	vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-	vertShaderStageInfo.module = context->vertShaderModule;
-	vertShaderStageInfo.pName = "main";
+static uint32_t getAttributeDescriptions(VertexFormat format,
+	int positionsOnly,
+	VkVertexInputAttributeDescription *attributeDescriptions) {
 
-	VkPipelineShaderStageCreateInfo fragShaderStageInfo = {};
-	fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-	fragShaderStageInfo.module = context->fragShaderModule;
-	fragShaderStageInfo.pName = "main";
+	if (positionsOnly) {
+		attributeDescriptions[0].binding = 0;
+		attributeDescriptions[0].location = 0;
+		attributeDescriptions[0].format = format == VERTEX_FORMAT_PACKED
+			? VK_FORMAT_R16G16B16A16_SNORM : VK_FORMAT_R32G32B32_SFLOAT;
+		attributeDescriptions[0].offset = 0;
 
-	VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo,
-		fragShaderStageInfo };
+		return 1 + getInstanceAttributeDescriptions(&attributeDescriptions[1]);
+	}
+
+	if (format == VERTEX_FORMAT_PACKED) {
+		attributeDescriptions[0].binding = 0;
+		attributeDescriptions[0].location = 0;
+		attributeDescriptions[0].format = VK_FORMAT_R16G16B16A16_SNORM;
+		attributeDescriptions[0].offset = offsetof(PackedVertex, pos);
+
+		attributeDescriptions[1].binding = 0;
+		attributeDescriptions[1].location = 1;
+		attributeDescriptions[1].format = VK_FORMAT_R16G16B16A16_SNORM;
+		attributeDescriptions[1].offset = offsetof(PackedVertex, qtangent);
 
-	VkVertexInputBindingDescription bindingDescription = {};
-	bindingDescription.binding = 0;
-	bindingDescription.stride = sizeof(Vertex);
-	bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+		attributeDescriptions[2].binding = 0;
+		attributeDescriptions[2].location = 2;
+		attributeDescriptions[2].format = VK_FORMAT_R16G16_SFLOAT;
+		attributeDescriptions[2].offset = offsetof(PackedVertex, texCoord);
 
-	VkVertexInputAttributeDescription attributeDescriptions[5] = {};
+		return 3 + getInstanceAttributeDescriptions(&attributeDescriptions[3]);
+	}
 
 	attributeDescriptions[0].binding = 0;
 	attributeDescriptions[0].location = 0;
@@ -737,37 +1451,152 @@ static int createGraphicsPipeline(VkContext* context) {
 	attributeDescriptions[4].format = VK_FORMAT_R32G32_SFLOAT;
 	attributeDescriptions[4].offset = offsetof(Vertex, texCoord);
 
-	VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
-	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-	vertexInputInfo.vertexAttributeDescriptionCount =
-		sizeof(attributeDescriptions) / sizeof(VkVertexInputAttributeDescription);
-	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions;
+	return 5 + getInstanceAttributeDescriptions(&attributeDescriptions[5]);
+}
 
-	VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
-	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-	inputAssembly.primitiveRestartEnable = VK_FALSE;
+static int createPipelineLayout(VkContext *context) {
+	VkDescriptorSetLayout setLayouts[] = { context->descriptorSetLayout };
 
-	VkViewport viewport = {};
-	viewport.x = 0.0f;
-	viewport.y = 0.0f;
-	viewport.width = context->extent.width;
-	viewport.height = context->extent.height;
-	viewport.minDepth = 0.0f;
-	viewport.maxDepth = 1.0f;
+	VkPushConstantRange pushConstantRange = {};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(MeshBounds);
 
-	VkRect2D scissor = {};
-	scissor.offset = (VkOffset2D) { 0, 0 };
-	scissor.extent = context->extent;
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = setLayouts;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
 
-	VkPipelineViewportStateCreateInfo viewportState = {};
-	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-	viewportState.viewportCount = 1;
-	viewportState.pViewports = &viewport;
-	viewportState.scissorCount = 1;
-	viewportState.pScissors = &scissor;
+	if (vkCreatePipelineLayout(context->device, &pipelineLayoutInfo, NULL,
+							   &context->pipelineLayout) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create pipeline layout.\n");
+		return 0;
+	}
+	return 1;
+}
+
+static int createShaderModules(VkContext *context) {
+	const char* const vertShaderFiles[VERTEX_FORMAT_COUNT] = {
+		"vert.spv",
+		"vert-packed.spv"
+	};
+	uint32_t *shaderCode;
+	long shaderLength;
+
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i) {
+		VK_CHECK_ERROR(shaderLength = readShaderFile(vertShaderFiles[i],
+			&shaderCode));
+		context->vertShaderModules[i] = createShaderModule(context->device,
+			shaderCode, shaderLength);
+		free(shaderCode);
+		VK_CHECK_ERROR(context->vertShaderModules[i]);
+	}
+
+	// Deferred shading's draw passes only fill the G-buffer
+	VK_CHECK_ERROR(shaderLength = readShaderFile(
+		context->shadingMode == SHADING_DEFERRED ? "gbuffer-frag.spv"
+		: "frag.spv", &shaderCode));
+	context->fragShaderModule = createShaderModule(context->device, shaderCode,
+		shaderLength);
+	free(shaderCode);
+	VK_CHECK_ERROR(context->fragShaderModule);
+
+	const char* const depthVertShaderFiles[VERTEX_FORMAT_COUNT] = {
+		"depth-vert.spv",
+		"depth-vert-packed.spv"
+	};
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i) {
+		VK_CHECK_ERROR(shaderLength = readShaderFile(depthVertShaderFiles[i],
+			&shaderCode));
+		context->depthVertShaderModules[i] = createShaderModule(
+			context->device, shaderCode, shaderLength);
+		free(shaderCode);
+		VK_CHECK_ERROR(context->depthVertShaderModules[i]);
+	}
+
+	const char* const shadowVertShaderFiles[VERTEX_FORMAT_COUNT] = {
+		"shadow-vert.spv",
+		"shadow-vert-packed.spv"
+	};
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i) {
+		VK_CHECK_ERROR(shaderLength = readShaderFile(shadowVertShaderFiles[i],
+			&shaderCode));
+		context->shadowVertShaderModules[i] = createShaderModule(
+			context->device, shaderCode, shaderLength);
+		free(shaderCode);
+		VK_CHECK_ERROR(context->shadowVertShaderModules[i]);
+	}
+
+	VK_CHECK_ERROR(shaderLength = readShaderFile("shadow-frag.spv",
+		&shaderCode));
+	context->shadowFragShaderModule = createShaderModule(context->device,
+		shaderCode, shaderLength);
+	free(shaderCode);
+	VK_CHECK_ERROR(context->shadowFragShaderModule);
+	return 1;
+}
+
+// The depth prepass has no fragment shader or color attachment. The other
+// modes draw in the main pass, whose render passes are all compatible.
+static VkPipeline createGraphicsPipeline(const VkContext* const context,
+										 VertexFormat format,
+										 DepthMode depthMode) {
+
+	int prepass = depthMode == DEPTH_MODE_PREPASS;
+	VkPipelineShaderStageCreateInfo vertShaderStageInfo = {};
+	vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+	vertShaderStageInfo.module = prepass
+		? context->depthVertShaderModules[format]
+		: context->vertShaderModules[format];
+	vertShaderStageInfo.pName = "main";
+
+	VkPipelineShaderStageCreateInfo fragShaderStageInfo = {};
+	fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	fragShaderStageInfo.module = context->fragShaderModule;
+	fragShaderStageInfo.pName = "main";
+
+	VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo,
+		fragShaderStageInfo };
+
+	VkVertexInputBindingDescription bindingDescriptions[2] = {};
+	uint32_t bindingCount = getBindingDescriptions(format, prepass,
+		bindingDescriptions);
+
+	VkVertexInputAttributeDescription attributeDescriptions[6] = {};
+	uint32_t attributeCount = getAttributeDescriptions(format, prepass,
+		attributeDescriptions);
+
+	VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
+	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	vertexInputInfo.vertexBindingDescriptionCount = bindingCount;
+	vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions;
+	vertexInputInfo.vertexAttributeDescriptionCount = attributeCount;
+	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions;
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+	// Set in recordDrawItems() to the render extent, which changes with
+	// the render scale
+	VkPipelineViewportStateCreateInfo viewportState = {};
+	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewportState.viewportCount = 1;
+	viewportState.scissorCount = 1;
+
+	VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT,
+		VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicState = {};
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicState.dynamicStateCount =
+		sizeof(dynamicStates) / sizeof(VkDynamicState);
+	dynamicState.pDynamicStates = dynamicStates;
 
 	VkPipelineRasterizationStateCreateInfo rasterizer = {};
 	rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
@@ -803,38 +1632,33 @@ static int createGraphicsPipeline(VkContext* context) {
 	colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
 	colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
 
+	// Surface attributes in the G-buffer are written as they are
+	VkPipelineColorBlendAttachmentState gBufferBlendAttachments[
+		GBUFFER_ATTACHMENTS] = {};
+	for (uint32_t i = 0; i < GBUFFER_ATTACHMENTS; ++i) {
+		gBufferBlendAttachments[i].colorWriteMask =
+			colorBlendAttachment.colorWriteMask;
+	}
+
 	VkPipelineColorBlendStateCreateInfo colorBlending = {};
 	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
 	colorBlending.logicOpEnable = VK_FALSE;
 	colorBlending.logicOp = VK_LOGIC_OP_COPY; // Optional
-	colorBlending.attachmentCount = 1;
-	colorBlending.pAttachments = &colorBlendAttachment;
+	colorBlending.attachmentCount = prepass ? 0
+		: getColorAttachmentCount(context);
+	colorBlending.pAttachments = context->shadingMode == SHADING_DEFERRED
+		? gBufferBlendAttachments : &colorBlendAttachment;
 	colorBlending.blendConstants[0] = 0.0f; // Optional
 	colorBlending.blendConstants[1] = 0.0f; // Optional
 	colorBlending.blendConstants[2] = 0.0f; // Optional
 	colorBlending.blendConstants[3] = 0.0f; // Optional
 
-	VkDescriptorSetLayout setLayouts[] = { context->descriptorSetLayout };
-
-	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
-	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-	pipelineLayoutInfo.setLayoutCount = 1;
-	pipelineLayoutInfo.pSetLayouts = setLayouts;
-	pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-	pipelineLayoutInfo.pPushConstantRanges = 0; // Optional
-
-	if (vkCreatePipelineLayout(context->device, &pipelineLayoutInfo, NULL,
-							   &context->pipelineLayout) != VK_SUCCESS) {
-
-		fprintf(stderr, "Failed to create pipeline layout.\n");
-		return 0;
-	}
-
 	VkPipelineDepthStencilStateCreateInfo depthStencil = {};
 	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
 	depthStencil.depthTestEnable = VK_TRUE;
-	depthStencil.depthWriteEnable = VK_TRUE;
-	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+	depthStencil.depthWriteEnable = depthMode != DEPTH_MODE_EQUAL;
+	depthStencil.depthCompareOp = depthMode == DEPTH_MODE_EQUAL
+		? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_LESS;
 	depthStencil.depthBoundsTestEnable = VK_FALSE;
 	depthStencil.minDepthBounds = 0.0f; // Optional
 	depthStencil.maxDepthBounds = 1.0f; // Optional
@@ -844,7 +1668,7 @@ static int createGraphicsPipeline(VkContext* context) {
 
 	VkGraphicsPipelineCreateInfo pipelineInfo = {};
 	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-	pipelineInfo.stageCount = 2;
+	pipelineInfo.stageCount = prepass ? 1 : 2;
 	pipelineInfo.pStages = shaderStages;
 	pipelineInfo.pVertexInputState = &vertexInputInfo;
 	pipelineInfo.pInputAssemblyState = &inputAssembly;
@@ -853,802 +1677,3465 @@ static int createGraphicsPipeline(VkContext* context) {
 	pipelineInfo.pMultisampleState = &multisampling;
 	pipelineInfo.pDepthStencilState = &depthStencil;
 	pipelineInfo.pColorBlendState = &colorBlending;
-	pipelineInfo.pDynamicState = NULL; // Optional
+	pipelineInfo.pDynamicState = &dynamicState;
 	pipelineInfo.layout = context->pipelineLayout;
-	pipelineInfo.renderPass = context->renderPass;
+	pipelineInfo.renderPass = prepass ? context->prepassRenderPass
+		: context->renderPass;
 	pipelineInfo.subpass = 0;
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 	pipelineInfo.basePipelineIndex = -1; // Optional
 
+	VkPipeline graphicsPipeline;
 	if (vkCreateGraphicsPipelines(context->device, VK_NULL_HANDLE, 1, &pipelineInfo,
-		NULL, &context->graphicsPipeline) != VK_SUCCESS) {
+		NULL, &graphicsPipeline) != VK_SUCCESS) {
 		fprintf(stderr, "Failed to create graphics pipeline.\n");
+		return NULL;
+	}
+	return graphicsPipeline;
+}
+
+// Shares the scene's descriptor set for the MVP matrices and instances
+static int createShadowPipelineLayout(VkContext *context) {
+	VkPushConstantRange pushConstantRange = {};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT
+		| VK_SHADER_STAGE_FRAGMENT_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(ShadowParams);
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &context->descriptorSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+	if (vkCreatePipelineLayout(context->device, &pipelineLayoutInfo, NULL,
+							   &context->shadowPipelineLayout) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create shadow pipeline layout.\n");
 		return 0;
 	}
 	return 1;
 }
 
-static int createFramebuffers(VkContext *context) {
+// Depth only, from the position streams, without culling, since the cube
+// faces don't keep the winding of the triangles they see
+static VkPipeline createShadowPipeline(const VkContext* const context,
+									   VertexFormat format) {
+
+	VkPipelineShaderStageCreateInfo shaderStages[2] = {};
+	shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+	shaderStages[0].module = context->shadowVertShaderModules[format];
+	shaderStages[0].pName = "main";
+	shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	shaderStages[1].module = context->shadowFragShaderModule;
+	shaderStages[1].pName = "main";
+
+	VkVertexInputBindingDescription bindingDescriptions[2] = {};
+	uint32_t bindingCount = getBindingDescriptions(format, 1,
+		bindingDescriptions);
+
+	VkVertexInputAttributeDescription attributeDescriptions[2] = {};
+	uint32_t attributeCount = getAttributeDescriptions(format, 1,
+		attributeDescriptions);
 
-	context->swapChainFramebuffers =
-		malloc(context->imageViewCount * sizeof(VkFramebuffer));
+	VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
+	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	vertexInputInfo.vertexBindingDescriptionCount = bindingCount;
+	vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions;
+	vertexInputInfo.vertexAttributeDescriptionCount = attributeCount;
+	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions;
 
-	for (uint32_t i = 0; i < context->imageViewCount; ++i) {
-		VkImageView attachments[] = {
-			context->swapChainImageViews[i],
-			context->depthImageView
-		};
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
 
-		VkFramebufferCreateInfo framebufferInfo = {};
-		framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-		framebufferInfo.renderPass = context->renderPass;
-		framebufferInfo.attachmentCount = sizeof(attachments) / sizeof(VkImageView);
-		framebufferInfo.pAttachments = attachments;
-		framebufferInfo.width = context->extent.width;
-		framebufferInfo.height = context->extent.height;
-		framebufferInfo.layers = 1;
+	// Set in recordShadowFaces(), like the main pipelines
+	VkPipelineViewportStateCreateInfo viewportState = {};
+	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewportState.viewportCount = 1;
+	viewportState.scissorCount = 1;
 
-		if (vkCreateFramebuffer(context->device, &framebufferInfo, NULL,
-								&context->swapChainFramebuffers[i]) != VK_SUCCESS) {
+	VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT,
+		VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicState = {};
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicState.dynamicStateCount =
+		sizeof(dynamicStates) / sizeof(VkDynamicState);
+	dynamicState.pDynamicStates = dynamicStates;
 
-			fprintf(stderr, "Failed to create framebuffer.\n");
-			return 0;
-		}
-	}
-	return 1;
-}
+	VkPipelineRasterizationStateCreateInfo rasterizer = {};
+	rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+	rasterizer.lineWidth = 1.0f;
+	rasterizer.cullMode = VK_CULL_MODE_NONE;
+	rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
 
-static VkCommandPool createCommandPool(const VkContext* const context) {
+	VkPipelineMultisampleStateCreateInfo multisampling = {};
+	multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
 
-	int queueFamilyIndex = findQueueFamilies(context->physicalDevice,
-		context->surface);
+	VkPipelineDepthStencilStateCreateInfo depthStencil = {};
+	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+	depthStencil.depthTestEnable = VK_TRUE;
+	depthStencil.depthWriteEnable = VK_TRUE;
+	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
 
-	VkCommandPoolCreateInfo poolInfo = {};
-	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	poolInfo.queueFamilyIndex = queueFamilyIndex;
-	poolInfo.flags = 0; // Optional
+	VkPipelineColorBlendStateCreateInfo colorBlending = {};
+	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
 
-	VkCommandPool commandPool;
-	if (vkCreateCommandPool(context->device, &poolInfo, NULL, &commandPool) != VK_SUCCESS) {
-		fprintf(stderr, "Failed to create command pool.\n");
+	// Both shadow passes have compatible render passes
+	VkGraphicsPipelineCreateInfo pipelineInfo = {};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	pipelineInfo.stageCount = 2;
+	pipelineInfo.pStages = shaderStages;
+	pipelineInfo.pVertexInputState = &vertexInputInfo;
+	pipelineInfo.pInputAssemblyState = &inputAssembly;
+	pipelineInfo.pViewportState = &viewportState;
+	pipelineInfo.pRasterizationState = &rasterizer;
+	pipelineInfo.pMultisampleState = &multisampling;
+	pipelineInfo.pDepthStencilState = &depthStencil;
+	pipelineInfo.pColorBlendState = &colorBlending;
+	pipelineInfo.pDynamicState = &dynamicState;
+	pipelineInfo.layout = context->shadowPipelineLayout;
+	pipelineInfo.renderPass = context->shadowCacheRenderPass;
+	pipelineInfo.subpass = 0;
+	pipelineInfo.basePipelineIndex = -1;
+
+	VkPipeline pipeline;
+	if (vkCreateGraphicsPipelines(context->device, VK_NULL_HANDLE, 1,
+		&pipelineInfo, NULL, &pipeline) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create shadow pipeline.\n");
 		return NULL;
 	}
-	return commandPool;
+	return pipeline;
 }
 
-static int hasStencilComponent(VkFormat format) {
-    return format == VK_FORMAT_D32_SFLOAT_S8_UINT
-		|| format == VK_FORMAT_D24_UNORM_S8_UINT;
+static VkBuffer getRegisteredBuffer(const VkContext* const context,
+									BufferHandle handle) {
+	return getBuffer(context->registry, handle)->buffer;
 }
 
-static uint32_t findMemoryType(VkPhysicalDevice physicalDevice,
-	uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-
-	VkPhysicalDeviceMemoryProperties memProperties;
-	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
-
-	for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-		if ((typeFilter & (1 << i))
-			&& (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-
-			return i;
-		}
+// Descriptors of the culling compute shaders: MVP matrices, instances,
+// visible instances, draw commands and counts, followed by the meshlets or
+// by the visibility buffer and depth pyramid. Returns the binding count.
+static uint32_t getCullDescriptors(const VkContext* const context,
+	VkDescriptorType *types, VkBuffer *buffers) {
+
+	uint32_t count = 0;
+	types[count] = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	buffers[count++] = getRegisteredBuffer(context,
+		context->mvpUniformBuffer);
+	types[count] = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	buffers[count++] = context->instanceBuffer;
+	types[count] = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	buffers[count++] = context->visibleInstanceBuffer;
+	types[count] = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	buffers[count++] = context->indirectBuffer;
+	types[count] = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	buffers[count++] = context->drawCountBuffer;
+	if (context->cullingMode == CULLING_MESHLETS) {
+		types[count] = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		buffers[count++] = context->meshletBuffer;
+	} else if (context->cullingMode == CULLING_OCCLUSION) {
+		types[count] = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		buffers[count++] = context->visibilityBuffer;
+		types[count] = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		buffers[count++] = NULL;
 	}
-
-	fprintf(stderr, "Failed to find suitable memory type.\n");
-	return 0;
+	return count;
 }
 
-static VkImage createImage(const VkContext* const context, uint32_t width,
-						   uint32_t height, uint32_t arrayLayers,
-						   VkFormat format, VkImageTiling tiling,
-						   VkImageUsageFlags usage,
-						   VkMemoryPropertyFlags properties,
-						   VkDeviceMemory *imageMemory) {
+static VkDescriptorSetLayout createCullDescriptorSetLayout(
+	const VkContext* const context) {
 
-	VkImageCreateInfo imageInfo = {};
-	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-	imageInfo.imageType = VK_IMAGE_TYPE_2D;
-	imageInfo.extent.width = width;
-	imageInfo.extent.height = height;
-	imageInfo.extent.depth = 1;
-	imageInfo.mipLevels = 1;
-	imageInfo.arrayLayers = arrayLayers;
-	imageInfo.format = format;
-	imageInfo.tiling = tiling;
-	imageInfo.initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED;
-	imageInfo.usage = usage;
-	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-	imageInfo.flags = 0; // Optional
+	VkDescriptorType types[MAX_CULL_DESCRIPTORS];
+	VkBuffer buffers[MAX_CULL_DESCRIPTORS];
+	uint32_t bindingCount = getCullDescriptors(context, types, buffers);
 
-	VkImage image;
-	if (vkCreateImage(context->device, &imageInfo, NULL, &image) != VK_SUCCESS) {
-		fprintf(stderr, "Failed to create texture image.\n");
-		return NULL;
+	VkDescriptorSetLayoutBinding bindings[MAX_CULL_DESCRIPTORS] = {};
+	for (uint32_t i = 0; i < bindingCount; ++i) {
+		bindings[i].binding = i;
+		bindings[i].descriptorType = types[i];
+		bindings[i].descriptorCount = 1;
+		bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 	}
 
-	VkMemoryRequirements memRequirements;
-	vkGetImageMemoryRequirements(context->device, image, &memRequirements);
+	VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = bindingCount;
+	layoutInfo.pBindings = bindings;
 
-	VkMemoryAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(context->physicalDevice,
-		memRequirements.memoryTypeBits, properties);
+	VkDescriptorSetLayout descriptorSetLayout;
+	if (vkCreateDescriptorSetLayout(context->device, &layoutInfo, NULL,
+		&descriptorSetLayout) != VK_SUCCESS) {
 
-	if (vkAllocateMemory(context->device, &allocInfo, NULL, imageMemory) != VK_SUCCESS) {
-		fprintf(stderr, "Failed to allocate texture image memory.\n");
-		vkDestroyImage(context->device, image, NULL);
+		fprintf(stderr, "Failed to create culling descriptor set layout.\n");
 		return NULL;
 	}
-
-	vkBindImageMemory(context->device, image, *imageMemory, 0);
-
-	return image;
+	return descriptorSetLayout;
 }
 
-static VkCommandBuffer beginSingleTimeCommands(VkDevice device,
-										VkCommandPool commandPool) {
+static int createCullPipeline(VkContext *context) {
+	VK_CHECK_ERROR(context->cullDescriptorSetLayout =
+		createCullDescriptorSetLayout(context));
 
-	VkCommandBufferAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	allocInfo.commandPool = commandPool;
-	allocInfo.commandBufferCount = 1;
+	VkPushConstantRange pushConstantRange = {};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(CullParams);
 
-	VkCommandBuffer commandBuffer;
-	if (vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer) != VK_SUCCESS) {
-		fprintf(stderr, "Could not allocate command buffer.\n");
-		return NULL;
-	};
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &context->cullDescriptorSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
 
-	VkCommandBufferBeginInfo beginInfo = {};
-	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	if (vkCreatePipelineLayout(context->device, &pipelineLayoutInfo, NULL,
+							   &context->cullPipelineLayout) != VK_SUCCESS) {
 
-	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
-		fprintf(stderr, "Could not begin command buffer.\n");
-		return NULL;
-	};
+		fprintf(stderr, "Failed to create culling pipeline layout.\n");
+		return 0;
+	}
 
-	return commandBuffer;
+	uint32_t *shaderCode;
+	long shaderLength;
+	const char* shaderFile = "cull.spv";
+	if (context->cullingMode == CULLING_MESHLETS) {
+		shaderFile = "cull-meshlets.spv";
+	} else if (context->cullingMode == CULLING_OCCLUSION) {
+		shaderFile = "cull-occlusion.spv";
+	}
+	VK_CHECK_ERROR(shaderLength = readShaderFile(shaderFile, &shaderCode));
+	context->cullShaderModule = createShaderModule(context->device,
+		shaderCode, shaderLength);
+	free(shaderCode);
+	VK_CHECK_ERROR(context->cullShaderModule);
+
+	VkComputePipelineCreateInfo pipelineInfo = {};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipelineInfo.stage.module = context->cullShaderModule;
+	pipelineInfo.stage.pName = "main";
+	pipelineInfo.layout = context->cullPipelineLayout;
+
+	if (vkCreateComputePipelines(context->device, VK_NULL_HANDLE, 1,
+		&pipelineInfo, NULL, &context->cullPipeline) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create culling pipeline.\n");
+		return 0;
+	}
+	return 1;
 }
 
-static int endSingleTimeCommands(VkDevice device, VkCommandBuffer commandBuffer,
-						   VkCommandPool commandPool, VkQueue graphicsQueue) {
+static int createDepthReducePipeline(VkContext *context) {
+	VkDescriptorSetLayoutBinding bindings[2] = {};
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[0].descriptorCount = 1;
+	bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[1].binding = 1;
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	bindings[1].descriptorCount = 1;
+	bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 
-	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
-		fprintf(stderr, "Could not end command buffer.\n");
-		return 0;
-	};
+	VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = sizeof(bindings) / sizeof(VkDescriptorSetLayoutBinding);
+	layoutInfo.pBindings = bindings;
 
-	VkSubmitInfo submitInfo = {};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &commandBuffer;
+	if (vkCreateDescriptorSetLayout(context->device, &layoutInfo, NULL,
+		&context->depthReduceDescriptorSetLayout) != VK_SUCCESS) {
 
-	if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
-		fprintf(stderr, "Could not submit commands to queue.\n");
+		fprintf(stderr, "Failed to create depth reduction descriptor set "
+			"layout.\n");
 		return 0;
-	};
-	if (vkQueueWaitIdle(graphicsQueue) != VK_SUCCESS) {
-		fprintf(stderr, "Could not wait for graphics queue to become idle.\n");
+	}
+
+	VkPushConstantRange pushConstantRange = {};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(ReduceParams);
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &context->depthReduceDescriptorSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+	if (vkCreatePipelineLayout(context->device, &pipelineLayoutInfo, NULL,
+							   &context->depthReducePipelineLayout) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create depth reduction pipeline layout.\n");
 		return 0;
-	};
+	}
 
-	vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+	uint32_t *shaderCode;
+	long shaderLength;
+	VK_CHECK_ERROR(shaderLength = readShaderFile("depth-reduce.spv",
+		&shaderCode));
+	context->depthReduceShaderModule = createShaderModule(context->device,
+		shaderCode, shaderLength);
+	free(shaderCode);
+	VK_CHECK_ERROR(context->depthReduceShaderModule);
+
+	VkComputePipelineCreateInfo pipelineInfo = {};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipelineInfo.stage.module = context->depthReduceShaderModule;
+	pipelineInfo.stage.pName = "main";
+	pipelineInfo.layout = context->depthReducePipelineLayout;
+
+	if (vkCreateComputePipelines(context->device, VK_NULL_HANDLE, 1,
+		&pipelineInfo, NULL, &context->depthReducePipeline) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create depth reduction pipeline.\n");
+		return 0;
+	}
+	return 1;
 }
 
-static int copyBuffer(VkDevice device, VkCommandPool commandPool,
-	VkQueue graphicsQueue, VkBuffer srcBuffer, VkBuffer dstBuffer,
-	VkDeviceSize size) {
+// Fullscreen triangle lighting the G-buffer with the scene's descriptor
+// set, plus a set of the G-buffer and depth attachments
+static int createLightingPipeline(VkContext *context) {
+	VkDescriptorSetLayoutBinding bindings[GBUFFER_ATTACHMENTS + 1] = {};
+	for (uint32_t i = 0; i < GBUFFER_ATTACHMENTS + 1; ++i) {
+		bindings[i].binding = i;
+		bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		bindings[i].descriptorCount = 1;
+		bindings[i].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	}
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = sizeof(bindings) / sizeof(VkDescriptorSetLayoutBinding);
+	layoutInfo.pBindings = bindings;
+
+	if (vkCreateDescriptorSetLayout(context->device, &layoutInfo, NULL,
+		&context->gBufferDescriptorSetLayout) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create G-buffer descriptor set layout.\n");
+		return 0;
+	}
+
+	VkDescriptorSetLayout setLayouts[] = { context->descriptorSetLayout,
+		context->gBufferDescriptorSetLayout };
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount =
+		sizeof(setLayouts) / sizeof(VkDescriptorSetLayout);
+	pipelineLayoutInfo.pSetLayouts = setLayouts;
+
+	if (vkCreatePipelineLayout(context->device, &pipelineLayoutInfo, NULL,
+							   &context->lightingPipelineLayout) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create lighting pipeline layout.\n");
+		return 0;
+	}
+
+	uint32_t *shaderCode;
+	long shaderLength;
+	VK_CHECK_ERROR(shaderLength = readShaderFile("lighting-vert.spv",
+		&shaderCode));
+	context->lightingVertShaderModule = createShaderModule(context->device,
+		shaderCode, shaderLength);
+	free(shaderCode);
+	VK_CHECK_ERROR(context->lightingVertShaderModule);
+
+	VK_CHECK_ERROR(shaderLength = readShaderFile("lighting-frag.spv",
+		&shaderCode));
+	context->lightingFragShaderModule = createShaderModule(context->device,
+		shaderCode, shaderLength);
+	free(shaderCode);
+	VK_CHECK_ERROR(context->lightingFragShaderModule);
+
+	VkPipelineShaderStageCreateInfo shaderStages[2] = {};
+	shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+	shaderStages[0].module = context->lightingVertShaderModule;
+	shaderStages[0].pName = "main";
+	shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	shaderStages[1].module = context->lightingFragShaderModule;
+	shaderStages[1].pName = "main";
+
+	// The vertices come from the vertex index
+	VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
+	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+	// Set in recordLightingPass() to the render extent
+	VkPipelineViewportStateCreateInfo viewportState = {};
+	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewportState.viewportCount = 1;
+	viewportState.scissorCount = 1;
+
+	VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT,
+		VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicState = {};
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicState.dynamicStateCount =
+		sizeof(dynamicStates) / sizeof(VkDynamicState);
+	dynamicState.pDynamicStates = dynamicStates;
+
+	VkPipelineRasterizationStateCreateInfo rasterizer = {};
+	rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+	rasterizer.lineWidth = 1.0f;
+	rasterizer.cullMode = VK_CULL_MODE_NONE;
+	rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+
+	VkPipelineMultisampleStateCreateInfo multisampling = {};
+	multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+	VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
+	colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT
+		| VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT
+		| VK_COLOR_COMPONENT_A_BIT;
+
+	VkPipelineColorBlendStateCreateInfo colorBlending = {};
+	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	colorBlending.attachmentCount = 1;
+	colorBlending.pAttachments = &colorBlendAttachment;
+
+	VkGraphicsPipelineCreateInfo pipelineInfo = {};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	pipelineInfo.stageCount = 2;
+	pipelineInfo.pStages = shaderStages;
+	pipelineInfo.pVertexInputState = &vertexInputInfo;
+	pipelineInfo.pInputAssemblyState = &inputAssembly;
+	pipelineInfo.pViewportState = &viewportState;
+	pipelineInfo.pRasterizationState = &rasterizer;
+	pipelineInfo.pMultisampleState = &multisampling;
+	pipelineInfo.pColorBlendState = &colorBlending;
+	pipelineInfo.pDynamicState = &dynamicState;
+	pipelineInfo.layout = context->lightingPipelineLayout;
+	pipelineInfo.renderPass = context->lightingRenderPass;
+	pipelineInfo.subpass = 0;
+	pipelineInfo.basePipelineIndex = -1;
+
+	if (vkCreateGraphicsPipelines(context->device, VK_NULL_HANDLE, 1,
+		&pipelineInfo, NULL, &context->lightingPipeline) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create lighting pipeline.\n");
+		return 0;
+	}
+	return 1;
+}
+
+// Both post-processing shaders sample one image and store to another, with
+// the same push constants, so they share their layouts. Bloom levels are
+// sampled with filtering, which averages texels for the downsampling.
+static int createPostPipelines(VkContext *context) {
+	VkDescriptorSetLayoutBinding bindings[2] = {};
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[0].descriptorCount = 1;
+	bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[1].binding = 1;
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	bindings[1].descriptorCount = 1;
+	bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = sizeof(bindings) / sizeof(VkDescriptorSetLayoutBinding);
+	layoutInfo.pBindings = bindings;
+
+	if (vkCreateDescriptorSetLayout(context->device, &layoutInfo, NULL,
+		&context->postDescriptorSetLayout) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create post-processing descriptor set "
+			"layout.\n");
+		return 0;
+	}
+
+	VkPushConstantRange pushConstantRange = {};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(PostParams);
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &context->postDescriptorSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+	if (vkCreatePipelineLayout(context->device, &pipelineLayoutInfo, NULL,
+							   &context->postPipelineLayout) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create post-processing pipeline "
+			"layout.\n");
+		return 0;
+	}
+
+	const char* const shaderFiles[] = { "bloom-downsample.spv",
+		"tonemap.spv" };
+	VkShaderModule *shaderModules[] = { &context->bloomShaderModule,
+		&context->tonemapShaderModule };
+	VkPipeline *pipelines[] = { &context->bloomPipeline,
+		&context->tonemapPipeline };
+	for (uint32_t i = 0; i < 2; ++i) {
+		uint32_t *shaderCode;
+		long shaderLength;
+		VK_CHECK_ERROR(shaderLength = readShaderFile(shaderFiles[i],
+			&shaderCode));
+		*shaderModules[i] = createShaderModule(context->device, shaderCode,
+			shaderLength);
+		free(shaderCode);
+		VK_CHECK_ERROR(*shaderModules[i]);
+
+		VkComputePipelineCreateInfo pipelineInfo = {};
+		pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+		pipelineInfo.stage.sType =
+			VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+		pipelineInfo.stage.module = *shaderModules[i];
+		pipelineInfo.stage.pName = "main";
+		pipelineInfo.layout = context->postPipelineLayout;
+
+		if (vkCreateComputePipelines(context->device, VK_NULL_HANDLE, 1,
+			&pipelineInfo, NULL, pipelines[i]) != VK_SUCCESS) {
+
+			fprintf(stderr, "Failed to create post-processing pipeline.\n");
+			return 0;
+		}
+	}
+
+	VkSamplerCreateInfo samplerInfo = {};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_LINEAR;
+	samplerInfo.minFilter = VK_FILTER_LINEAR;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.maxLod = MAX_BLOOM_LEVELS;
+	if (vkCreateSampler(context->device, &samplerInfo, NULL,
+						&context->postSampler) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create post-processing sampler.\n");
+		return 0;
+	}
+	return 1;
+}
+
+// Every frame draws into the color image, whatever the swap chain image it
+// is blitted to, so one framebuffer serves all of them
+static int createFramebuffers(VkContext *context) {
+	// Deferred shading draws into the G-buffer, and only its lighting pass
+	// into the color image
+	const RenderGraph* const graph = context->frameGraph;
+	int deferred = context->shadingMode == SHADING_DEFERRED;
+	uint32_t colorCount = getColorAttachmentCount(context);
+	VkImageView attachments[GBUFFER_ATTACHMENTS + 1];
+	for (uint32_t i = 0; i < colorCount; ++i) {
+		attachments[i] = deferred
+			? graph->resources[FRAME_GBUFFER_ALBEDO + i].view
+			: context->colorImageView;
+	}
+	attachments[colorCount] = context->depthImageView;
+
+	VkFramebufferCreateInfo framebufferInfo = {};
+	framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+	framebufferInfo.renderPass = context->renderPass;
+	framebufferInfo.attachmentCount = colorCount + 1;
+	framebufferInfo.pAttachments = attachments;
+	framebufferInfo.width = context->extent.width;
+	framebufferInfo.height = context->extent.height;
+	framebufferInfo.layers = 1;
+
+	if (vkCreateFramebuffer(context->device, &framebufferInfo, NULL,
+							&context->framebuffer) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create framebuffer.\n");
+		return 0;
+	}
+
+	// The depth prepass only needs the depth attachment
+	framebufferInfo.renderPass = context->prepassRenderPass;
+	framebufferInfo.attachmentCount = 1;
+	framebufferInfo.pAttachments = &context->depthImageView;
+
+	if (vkCreateFramebuffer(context->device, &framebufferInfo, NULL,
+							&context->prepassFramebuffer) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create depth prepass framebuffer.\n");
+		return 0;
+	}
+
+	if (deferred) {
+		framebufferInfo.renderPass = context->lightingRenderPass;
+		framebufferInfo.pAttachments = &context->colorImageView;
+		if (vkCreateFramebuffer(context->device, &framebufferInfo, NULL,
+								&context->lightingFramebuffer) != VK_SUCCESS) {
+
+			fprintf(stderr, "Failed to create lighting framebuffer.\n");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Two timestamps per frame in flight. Without timestamp support on the
+// graphics queue, frames aren't timed and the pool stays null.
+static int createTimestampPool(VkContext *context) {
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(context->physicalDevice, &properties);
+	if (!properties.limits.timestampComputeAndGraphics) {
+		return 1;
+	}
+	context->timestampPeriod = properties.limits.timestampPeriod;
+
+	VkQueryPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	poolInfo.queryCount = 2 * MAX_FRAMES_IN_FLIGHT;
+	if (vkCreateQueryPool(context->device, &poolInfo, NULL,
+						  &context->timestampPool) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create timestamp query pool.\n");
+		return 0;
+	}
+	return 1;
+}
+
+static VkCommandPool createCommandPool(const VkContext* const context) {
+
+	int queueFamilyIndex = findQueueFamilies(context->physicalDevice,
+		context->surface);
+
+	VkCommandPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.queueFamilyIndex = queueFamilyIndex;
+	poolInfo.flags = 0; // Optional
+
+	VkCommandPool commandPool;
+	if (vkCreateCommandPool(context->device, &poolInfo, NULL, &commandPool) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create command pool.\n");
+		return NULL;
+	}
+	return commandPool;
+}
+
+static int hasStencilComponent(VkFormat format) {
+    return format == VK_FORMAT_D32_SFLOAT_S8_UINT
+		|| format == VK_FORMAT_D24_UNORM_S8_UINT;
+}
+
+static uint32_t findMemoryType(VkPhysicalDevice physicalDevice,
+	uint32_t typeFilter, VkMemoryPropertyFlags properties) {
+
+	VkPhysicalDeviceMemoryProperties memProperties;
+	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+
+	for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+		if ((typeFilter & (1 << i))
+			&& (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+
+			return i;
+		}
+	}
+
+	fprintf(stderr, "Failed to find suitable memory type.\n");
+	return 0;
+}
+
+static VkImage createImage(const VkContext* const context, uint32_t width,
+						   uint32_t height, uint32_t arrayLayers,
+						   uint32_t mipLevels, VkImageCreateFlags flags,
+						   VkFormat format, VkImageTiling tiling,
+						   VkImageUsageFlags usage,
+						   VkMemoryPropertyFlags properties,
+						   VkDeviceMemory *imageMemory) {
+
+	VkImageCreateInfo imageInfo = {};
+	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	imageInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageInfo.extent.width = width;
+	imageInfo.extent.height = height;
+	imageInfo.extent.depth = 1;
+	imageInfo.mipLevels = mipLevels;
+	imageInfo.arrayLayers = arrayLayers;
+	imageInfo.format = format;
+	imageInfo.tiling = tiling;
+	imageInfo.initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED;
+	imageInfo.usage = usage;
+	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageInfo.flags = flags;
+
+	VkImage image;
+	if (vkCreateImage(context->device, &imageInfo, NULL, &image) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create texture image.\n");
+		return NULL;
+	}
+
+	VkMemoryRequirements memRequirements;
+	vkGetImageMemoryRequirements(context->device, image, &memRequirements);
+
+	VkMemoryAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = memRequirements.size;
+	allocInfo.memoryTypeIndex = findMemoryType(context->physicalDevice,
+		memRequirements.memoryTypeBits, properties);
+
+	if (vkAllocateMemory(context->device, &allocInfo, NULL, imageMemory) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to allocate texture image memory.\n");
+		vkDestroyImage(context->device, image, NULL);
+		return NULL;
+	}
+
+	vkBindImageMemory(context->device, image, *imageMemory, 0);
+
+	return image;
+}
+
+VkCommandBuffer beginSingleTimeCommands(VkDevice device,
+										VkCommandPool commandPool) {
+
+	VkCommandBufferAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandPool = commandPool;
+	allocInfo.commandBufferCount = 1;
+
+	VkCommandBuffer commandBuffer;
+	if (vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer) != VK_SUCCESS) {
+		fprintf(stderr, "Could not allocate command buffer.\n");
+		return NULL;
+	};
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+		fprintf(stderr, "Could not begin command buffer.\n");
+		return NULL;
+	};
+
+	return commandBuffer;
+}
+
+// Returns the point of the submission, with a value of 0 on failure. When
+// afterFrames is set, the commands wait for the frame work submitted so
+// far, so the submission retiring also retires every frame that may still
+// read what the commands replace.
+static QueuePoint submitSingleTimeCommands(VkCommandBuffer commandBuffer,
+	VkCommandPool commandPool, DestructionQueue *destructionQueue,
+	int afterFrames) {
+
+	QueuePoint point = { FRAME_QUEUE_TRANSFER, 0 };
+	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+		fprintf(stderr, "Could not end command buffer.\n");
+		return point;
+	};
+
+	QueueSubmission submission = {};
+	submission.commandBuffers = &commandBuffer;
+	submission.commandBufferCount = 1;
+	if (afterFrames) {
+		for (uint32_t q = 0; q < FRAME_QUEUE_TRANSFER; ++q) {
+			submission.waits[submission.waitCount] =
+				getQueuePoint(destructionQueue->scheduler, q);
+			submission.waitStages[submission.waitCount++] =
+				VK_PIPELINE_STAGE_TRANSFER_BIT;
+		}
+	}
+	point.value = submitToQueue(destructionQueue->scheduler,
+		FRAME_QUEUE_TRANSFER, &submission);
+	if (!point.value) {
+		fprintf(stderr, "Could not submit commands to the transfer "
+			"queue.\n");
+		return point;
+	};
+
+	DestroyedObject object = {};
+	object.commandBuffer.pool = commandPool;
+	object.commandBuffer.buffer = commandBuffer;
+	deferDestruction(destructionQueue, DESTROY_COMMAND_BUFFER, object,
+		point);
+	return point;
+}
+
+int endSingleTimeCommands(VkCommandBuffer commandBuffer,
+						  VkCommandPool commandPool,
+						  DestructionQueue *destructionQueue) {
+	return submitSingleTimeCommands(commandBuffer, commandPool,
+		destructionQueue, 0).value != 0;
+}
+
+// Frees a staging buffer once the uploads submitted so far are done
+static void deferStagingBuffer(const VkContext* const context,
+							   VkBuffer buffer, VkDeviceMemory memory) {
+
+	QueuePoint upload = getQueuePoint(context->scheduler,
+		FRAME_QUEUE_TRANSFER);
+	deferDestruction(context->destructionQueue, DESTROY_BUFFER,
+		(DestroyedObject) { .buffer = buffer }, upload);
+	deferDestruction(context->destructionQueue, DESTROY_MEMORY,
+		(DestroyedObject) { .memory = memory }, upload);
+}
+
+static int copyBuffer(VkDevice device, VkCommandPool commandPool,
+	DestructionQueue *destructionQueue, VkBuffer srcBuffer, VkBuffer dstBuffer,
+	VkDeviceSize size) {
+
+	VkCommandBuffer commandBuffer;
+	VK_CHECK_ERROR(commandBuffer = beginSingleTimeCommands(device, commandPool));
+
+	VkBufferCopy copyRegion = {};
+	copyRegion.srcOffset = 0; // Optional
+	copyRegion.dstOffset = 0; // Optional
+	copyRegion.size = size;
+	vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+
+	VK_CHECK_ERROR(endSingleTimeCommands(commandBuffer, commandPool,
+		destructionQueue));
+	return 1;
+}
+
+static int transitionImageLayout(const VkContext* const context, VkImage image,
+								  VkFormat format, VkImageLayout oldLayout,
+								  VkImageLayout newLayout, uint32_t layerCount) {
+
+	VkCommandBuffer commandBuffer;
+	VK_CHECK_ERROR(commandBuffer = beginSingleTimeCommands(context->device,
+		context->commandPool));
+
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = oldLayout;
+	barrier.newLayout = newLayout;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = 1;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = layerCount;
+
+	if (oldLayout == VK_IMAGE_LAYOUT_PREINITIALIZED
+		&& newLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
+
+		barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	} else if (oldLayout == VK_IMAGE_LAYOUT_PREINITIALIZED
+			   && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
+
+		barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	} else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
+			   && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	} else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED
+			   && newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
+
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+			| VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	} else {
+		fprintf(stderr, "Unsupported layout transition.\n");
+		endSingleTimeCommands(commandBuffer,
+			context->commandPool, context->destructionQueue);
+		return 0;
+	}
+
+	if (newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
+		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+
+		if (hasStencilComponent(format)) {
+		    barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+		}
+	} else {
+		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	}
+
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+
+	VK_CHECK_ERROR(endSingleTimeCommands(commandBuffer,
+		context->commandPool, context->destructionQueue));
+	return 1;
+}
+
+// Rendered at up to the swap chain's size, then blitted into the swap
+// chain image with filtering
+static VkImageView createDepthPyramidView(const VkContext* const context,
+										  uint32_t baseLevel,
+										  uint32_t levelCount) {
+
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = context->depthPyramid;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewInfo.format = VK_FORMAT_R32_SFLOAT;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	viewInfo.subresourceRange.baseMipLevel = baseLevel;
+	viewInfo.subresourceRange.levelCount = levelCount;
+	viewInfo.subresourceRange.baseArrayLayer = 0;
+	viewInfo.subresourceRange.layerCount = 1;
+
+	VkImageView imageView;
+	if (vkCreateImageView(context->device, &viewInfo, NULL, &imageView) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create depth pyramid view.\n");
+		return NULL;
+	}
+	return imageView;
+}
+
+// Mip chain of the depth attachment, each texel holding the farthest depth
+// of the texels it covers. Level 0 matches the attachment size and stays in
+// the general layout for compute writes and sampling.
+static int createDepthPyramid(VkContext *context) {
+	uint32_t width = context->extent.width, height = context->extent.height;
+	uint32_t levels = 1;
+	while (levels < MAX_DEPTH_PYRAMID_LEVELS
+		   && (width >> levels || height >> levels)) {
+		++levels;
+	}
+	context->depthPyramidLevels = levels;
+
+	VK_CHECK_ERROR(context->depthPyramid = createImage(context, width, height,
+		1, levels, 0, VK_FORMAT_R32_SFLOAT, VK_IMAGE_TILING_OPTIMAL,
+		VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &context->depthPyramidMemory));
+	VK_CHECK_ERROR(context->depthPyramidView = createDepthPyramidView(context,
+		0, levels));
+	for (uint32_t i = 0; i < levels; ++i) {
+		VK_CHECK_ERROR(context->depthPyramidMipViews[i] =
+			createDepthPyramidView(context, i, 1));
+	}
+
+	VkSamplerCreateInfo samplerInfo = {};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_NEAREST;
+	samplerInfo.minFilter = VK_FILTER_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.maxLod = levels;
+	if (vkCreateSampler(context->device, &samplerInfo, NULL,
+						&context->depthPyramidSampler) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create depth pyramid sampler.\n");
+		return 0;
+	}
+
+	VkCommandBuffer commandBuffer;
+	VK_CHECK_ERROR(commandBuffer = beginSingleTimeCommands(context->device,
+		context->commandPool));
+
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = context->depthPyramid;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.levelCount = levels;
+	barrier.subresourceRange.layerCount = 1;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT
+		| VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 0, NULL, 1,
+		&barrier);
+
+	VK_CHECK_ERROR(endSingleTimeCommands(commandBuffer,
+		context->commandPool, context->destructionQueue));
+	return 1;
+}
+
+static VkImageView createBloomView(const VkContext* const context,
+								   uint32_t baseLevel, uint32_t levelCount) {
+
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = context->bloomImage;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewInfo.format = HDR_FORMAT;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	viewInfo.subresourceRange.baseMipLevel = baseLevel;
+	viewInfo.subresourceRange.levelCount = levelCount;
+	viewInfo.subresourceRange.baseArrayLayer = 0;
+	viewInfo.subresourceRange.layerCount = 1;
+
+	VkImageView imageView;
+	if (vkCreateImageView(context->device, &viewInfo, NULL, &imageView) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create bloom view.\n");
+		return NULL;
+	}
+	return imageView;
+}
+
+// Mip chain starting at half the color image's size, only ever used by
+// the post-processing passes. It is left undefined, so the frame graph
+// moves it to the general layout on their queue.
+static int createBloomImage(VkContext *context) {
+	uint32_t width = MAX(context->extent.width / 2, 1u);
+	uint32_t height = MAX(context->extent.height / 2, 1u);
+	uint32_t levels = 1;
+	while (levels < MAX_BLOOM_LEVELS
+		   && (width >> levels || height >> levels)) {
+		++levels;
+	}
+	context->bloomLevels = levels;
+
+	VK_CHECK_ERROR(context->bloomImage = createImage(context, width, height,
+		1, levels, 0, HDR_FORMAT, VK_IMAGE_TILING_OPTIMAL,
+		VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &context->bloomImageMemory));
+	VK_CHECK_ERROR(context->bloomImageView = createBloomView(context, 0,
+		levels));
+	for (uint32_t i = 0; i < levels; ++i) {
+		VK_CHECK_ERROR(context->bloomMipViews[i] = createBloomView(context,
+			i, 1));
+	}
+	return 1;
+}
+
+static VkImageView createShadowView(const VkContext* const context,
+									VkImage image, VkImageViewType viewType,
+									uint32_t baseLayer, uint32_t layerCount) {
+
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = image;
+	viewInfo.viewType = viewType;
+	viewInfo.format = context->shadowFormat;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+	viewInfo.subresourceRange.baseMipLevel = 0;
+	viewInfo.subresourceRange.levelCount = 1;
+	viewInfo.subresourceRange.baseArrayLayer = baseLayer;
+	viewInfo.subresourceRange.layerCount = layerCount;
+
+	VkImageView imageView;
+	if (vkCreateImageView(context->device, &viewInfo, NULL, &imageView) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create shadow map view.\n");
+		return NULL;
+	}
+	return imageView;
+}
+
+static VkFramebuffer createShadowFramebuffer(const VkContext* const context,
+											 VkRenderPass renderPass,
+											 VkImageView faceView) {
+
+	VkFramebufferCreateInfo framebufferInfo = {};
+	framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+	framebufferInfo.renderPass = renderPass;
+	framebufferInfo.attachmentCount = 1;
+	framebufferInfo.pAttachments = &faceView;
+	framebufferInfo.width = SHADOW_MAP_SIZE;
+	framebufferInfo.height = SHADOW_MAP_SIZE;
+	framebufferInfo.layers = 1;
+
+	VkFramebuffer framebuffer;
+	if (vkCreateFramebuffer(context->device, &framebufferInfo, NULL,
+							&framebuffer) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create shadow framebuffer.\n");
+		return NULL;
+	}
+	return framebuffer;
+}
+
+// Cube of the static casters' depths, copied into the sampled shadow map
+// before the dynamic casters are drawn over it. Faces are drawn one layer
+// at a time.
+static int createShadowMaps(VkContext *context) {
+	VK_CHECK_ERROR(context->shadowCache = createImage(context,
+		SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, CUBE_FACES, 1, 0,
+		context->shadowFormat, VK_IMAGE_TILING_OPTIMAL,
+		VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+		| VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		&context->shadowCacheMemory));
+	VK_CHECK_ERROR(context->shadowMap = createImage(context,
+		SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, CUBE_FACES, 1,
+		VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT, context->shadowFormat,
+		VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+		| VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &context->shadowMapMemory));
+	VK_CHECK_ERROR(context->shadowMapView = createShadowView(context,
+		context->shadowMap, VK_IMAGE_VIEW_TYPE_CUBE, 0, CUBE_FACES));
+
+	for (uint32_t i = 0; i < CUBE_FACES; ++i) {
+		VK_CHECK_ERROR(context->shadowCacheFaceViews[i] = createShadowView(
+			context, context->shadowCache, VK_IMAGE_VIEW_TYPE_2D, i, 1));
+		VK_CHECK_ERROR(context->shadowMapFaceViews[i] = createShadowView(
+			context, context->shadowMap, VK_IMAGE_VIEW_TYPE_2D, i, 1));
+		VK_CHECK_ERROR(context->shadowCacheFramebuffers[i] =
+			createShadowFramebuffer(context, context->shadowCacheRenderPass,
+			context->shadowCacheFaceViews[i]));
+		VK_CHECK_ERROR(context->shadowFramebuffers[i] =
+			createShadowFramebuffer(context, context->shadowRenderPass,
+			context->shadowMapFaceViews[i]));
+	}
+
+	// Stored distances are compared in shader.frag, not by the sampler
+	VkSamplerCreateInfo samplerInfo = {};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_NEAREST;
+	samplerInfo.minFilter = VK_FILTER_NEAREST;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+	samplerInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+	if (vkCreateSampler(context->device, &samplerInfo, NULL,
+						&context->shadowSampler) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create shadow map sampler.\n");
+		return 0;
+	}
+
+	// Sampled before the first frame draws into it
+	VkCommandBuffer commandBuffer;
+	VK_CHECK_ERROR(commandBuffer = beginSingleTimeCommands(context->device,
+		context->commandPool));
+	VkClearDepthStencilValue clearValue = { 1.0f, 0 };
+	VkImageSubresourceRange range = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0,
+		CUBE_FACES };
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = context->shadowMap;
+	barrier.subresourceRange = range;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+	vkCmdClearDepthStencilImage(commandBuffer, context->shadowMap,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearValue, 1, &range);
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0, NULL, 1,
+		&barrier);
+	VK_CHECK_ERROR(endSingleTimeCommands(commandBuffer,
+		context->commandPool, context->destructionQueue));
+	return 1;
+}
+
+static int copyBufferToImage(const VkContext* const context, VkBuffer srcBuffer,
+							  VkImage dstImage, uint32_t width, uint32_t height,
+							  uint32_t layerCount) {
+
+	VkCommandBuffer commandBuffer;
+	VK_CHECK_ERROR(commandBuffer = beginSingleTimeCommands(context->device,
+		context->commandPool));
+
+	size_t bufferCopyRegionsSize = layerCount * sizeof(VkBufferImageCopy);
+	VkBufferImageCopy *bufferCopyRegions = malloc(bufferCopyRegionsSize);
+	memset(bufferCopyRegions, 0, bufferCopyRegionsSize);
+
+	VkDeviceSize offset = 0;
+	for (uint32_t i = 0; i < layerCount; ++i) {
+		bufferCopyRegions[i].imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		bufferCopyRegions[i].imageSubresource.mipLevel = 0;
+		bufferCopyRegions[i].imageSubresource.baseArrayLayer = i;
+		bufferCopyRegions[i].imageSubresource.layerCount = 1;
+		bufferCopyRegions[i].imageExtent.width = width;
+		bufferCopyRegions[i].imageExtent.height = height;
+		bufferCopyRegions[i].imageExtent.depth = 1;
+		bufferCopyRegions[i].bufferOffset = offset;
+
+		offset += width * height * 4;
+	}
+
+	vkCmdCopyBufferToImage(commandBuffer, srcBuffer, dstImage,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, layerCount, bufferCopyRegions);
+
+	free(bufferCopyRegions);
+
+	VK_CHECK_ERROR(endSingleTimeCommands(commandBuffer,
+		context->commandPool, context->destructionQueue));
+	return 1;
+}
+
+static VkBuffer createBuffer(const VkContext* const context,
+	VkDeviceSize size, VkBufferUsageFlags usage,
+	VkMemoryPropertyFlags properties, VkDeviceMemory *bufferMemory) {
+
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = size;
+	bufferInfo.usage = usage;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	VkBuffer buffer;
+	if (vkCreateBuffer(context->device, &bufferInfo, NULL, &buffer) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to create buffer.\n");
+		return NULL;
+	}
+
+	VkMemoryRequirements memRequirements;
+	vkGetBufferMemoryRequirements(context->device, buffer, &memRequirements);
+
+	VkMemoryAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = memRequirements.size;
+	allocInfo.memoryTypeIndex = findMemoryType(context->physicalDevice,
+		memRequirements.memoryTypeBits, properties);
+
+	if (vkAllocateMemory(context->device, &allocInfo, NULL, bufferMemory) != VK_SUCCESS) {
+		fprintf(stderr, "Failed to allocate buffer memory.\n");
+		vkDestroyBuffer(context->device, buffer, NULL);
+		return NULL;
+	}
+
+	vkBindBufferMemory(context->device, buffer, *bufferMemory, 0);
+
+	return buffer;
+}
+
+// Creates a buffer owned by the registry. Returns 0 on failure.
+static int createRegisteredBuffer(const VkContext* const context,
+	VkDeviceSize size, VkBufferUsageFlags usage,
+	VkMemoryPropertyFlags properties, BufferHandle *handle) {
+
+	BufferResource buffer = { NULL, NULL, size };
+	VK_CHECK_ERROR(buffer.buffer = createBuffer(context, size, usage,
+		properties, &buffer.memory));
+	*handle = addBuffer(context->registry, &buffer);
+	return !IS_NULL_HANDLE(*handle);
+}
+
+static VkDeviceSize readTextureFile(const char* const filename, TexHdr *textureHeader,
+							uint8_t **pixels) {
+
+	size_t numSearchPaths = sizeof(TEXTURE_SEARCH_PATHS) / sizeof(char*);
+	FILE *file = openFile(filename, TEXTURE_SEARCH_PATHS, numSearchPaths);
+
+	fread(textureHeader, sizeof(TexHdr), 1, file);
+	if (textureHeader->type != 0x1401) { // GL_UNSIGNED_BYTE
+		fprintf(stderr, "Texture has unsupported type: %u\n",
+			textureHeader->type);
+		fclose(file);
+		return 0;
+	}
+	VkDeviceSize dataSize = textureHeader->width * textureHeader->height;
+	VkDeviceSize pixelSize;
+	switch(textureHeader->format) {
+		case 0x1907: // GL_RGB
+			pixelSize = 3;
+			break;
+		case 0x1908: // GL_RGBA
+			pixelSize = 4;
+			break;
+		default:
+			fprintf(stderr, "Texture has unsupported format: %u\n",
+				textureHeader->format);
+			fclose(file);
+			return 0;
+	}
+	dataSize *= pixelSize;
+	*pixels = malloc(dataSize);
+	fread(*pixels, sizeof(uint8_t), dataSize, file);
+	fclose(file);
+
+	// If the format is RGB, convert it to RGBA
+	if (pixelSize == 3) {
+		uint8_t *newPixels = malloc(dataSize / 3 * 4);
+		uint8_t *ptr = newPixels;
+		for (size_t i = 0; i < dataSize; i += 3) {
+			memcpy(ptr, &(*pixels)[i], 3);
+			ptr[3] = 255; // Alpha
+			ptr += 4;
+		}
+		free(*pixels);
+		*pixels = newPixels;
+		dataSize /= 3;
+		dataSize *= 4;
+	}
+
+	return dataSize;
+}
+
+static int createTextureImage(VkContext *context) {
+	TexHdr diffuseTextureHeader, normalTextureHeader;
+	uint8_t *diffusePixels, *normalPixels;
+	VkDeviceSize diffuseDataSize = readTextureFile("brick.tex",
+		&diffuseTextureHeader, &diffusePixels);
+	VkDeviceSize normalDataSize = readTextureFile("normal.tex",
+		&normalTextureHeader, &normalPixels);
+
+	if (memcmp(&diffuseTextureHeader, &normalTextureHeader, sizeof(TexHdr))
+		|| diffuseDataSize != normalDataSize) {
+
+		fprintf(stderr, "Diffuse and normal textures are incompatible.\n");
+		free(diffusePixels);
+		free(normalPixels);
+		return 0;
+	}
+
+	VkDeviceMemory stagingBufferMemory;
+	VkBuffer stagingBuffer = createBuffer(context,
+		diffuseDataSize + normalDataSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stagingBufferMemory);
+	if (stagingBuffer == NULL) {
+		fprintf(stderr, "Could not create staging buffer.\n");
+		free(diffusePixels);
+		free(normalPixels);
+		return 0;
+	}
+
+	void* data;
+	vkMapMemory(context->device, stagingBufferMemory, 0,
+		diffuseDataSize + normalDataSize, 0, &data);
+	memcpy(data, diffusePixels, diffuseDataSize);
+	memcpy(data + diffuseDataSize, normalPixels, normalDataSize);
+	vkUnmapMemory(context->device, stagingBufferMemory);
+	free(diffusePixels);
+	free(normalPixels);
+
+	ImageResource texture = {};
+	VK_CHECK_ERROR(texture.image = createImage(context,
+		diffuseTextureHeader.width, diffuseTextureHeader.height, 2, 1, 0,
+		VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL,
+		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+    	VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &texture.memory));
+	VK_CHECK_ERROR(texture.view = createImageView(context, texture.image,
+		VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_ASPECT_COLOR_BIT, 2));
+	context->texture = addImage(context->registry, &texture);
+	VK_CHECK_ERROR(!IS_NULL_HANDLE(context->texture));
+
+	VK_CHECK_ERROR(transitionImageLayout(context, texture.image,
+		VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_PREINITIALIZED,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 2));
+	VK_CHECK_ERROR(copyBufferToImage(context, stagingBuffer, texture.image,
+		diffuseTextureHeader.width, diffuseTextureHeader.height, 2));
+	VK_CHECK_ERROR(transitionImageLayout(context, texture.image,
+		VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 2));
+
+	deferStagingBuffer(context, stagingBuffer, stagingBufferMemory);
+	return 1;
+}
+
+static int createTextureSampler(VkContext *context) {
+	VkSamplerCreateInfo samplerInfo = {};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_LINEAR;
+	samplerInfo.minFilter = VK_FILTER_LINEAR;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+	samplerInfo.anisotropyEnable = VK_TRUE;
+	samplerInfo.maxAnisotropy = 16;
+	samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+	samplerInfo.unnormalizedCoordinates = VK_FALSE;
+	samplerInfo.compareEnable = VK_FALSE;
+	samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+	samplerInfo.mipLodBias = 0.0f;
+	samplerInfo.minLod = 0.0f;
+	samplerInfo.maxLod = 0.0f;
+
+	SamplerResource textureSampler;
+	if (vkCreateSampler(context->device, &samplerInfo, NULL,
+		&textureSampler.sampler) != VK_SUCCESS) {
+    	fprintf(stderr, "Failed to create texture sampler.\n");
+		return 0;
+    }
+	context->textureSampler = addSampler(context->registry, &textureSampler);
+	return !IS_NULL_HANDLE(context->textureSampler);
+}
+
+// Creates the pool's buffers for its capacities. They are also copied
+// from when the pool grows.
+static int createGeometryPoolBuffers(const VkContext* const context,
+									 GeometryPool *pool) {
+
+	VK_CHECK_ERROR(createRegisteredBuffer(context,
+		pool->vertexCapacity * pool->vertexStride,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
+		| VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &pool->vertexBuffer));
+	VK_CHECK_ERROR(createRegisteredBuffer(context,
+		pool->vertexCapacity * pool->positionStride,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
+		| VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &pool->positionBuffer));
+	VK_CHECK_ERROR(createRegisteredBuffer(context,
+		pool->indexCapacity * sizeof(uint32_t),
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
+		| VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &pool->indexBuffer));
+	return 1;
+}
+
+static int createGeometryPool(const VkContext* const context,
+	GeometryPool *pool, VkDeviceSize vertexStride,
+	VkDeviceSize positionStride, uint32_t vertexCount, uint32_t indexCount) {
+
+	pool->vertexStride = vertexStride;
+	pool->positionStride = positionStride;
+	pool->vertexCapacity = MAX(GEOMETRY_POOL_VERTICES, vertexCount);
+	pool->indexCapacity = MAX(GEOMETRY_POOL_INDICES, indexCount);
+	pool->vertexCount = 0;
+	pool->indexCount = 0;
+	return createGeometryPoolBuffers(context, pool);
+}
+
+// Moves the pool into buffers with room for the extra vertices and
+// indices, doubling like draw lists. Meshes keep their offsets. The old
+// buffers leave the registry right away and are destroyed once the copy,
+// which waits for the frames that may still draw from them, retires.
+static int growGeometryPool(const VkContext* const context,
+	GeometryPool *pool, uint32_t vertexCount, uint32_t indexCount) {
+
+	GeometryPool grown = *pool;
+	grown.vertexCapacity = MAX(pool->vertexCapacity * 2,
+		pool->vertexCount + vertexCount);
+	grown.indexCapacity = MAX(pool->indexCapacity * 2,
+		pool->indexCount + indexCount);
+	VK_CHECK_ERROR(createGeometryPoolBuffers(context, &grown));
 
 	VkCommandBuffer commandBuffer;
-	VK_CHECK_ERROR(commandBuffer = beginSingleTimeCommands(device, commandPool));
+	VK_CHECK_ERROR(commandBuffer = beginSingleTimeCommands(context->device,
+		context->commandPool));
+	if (pool->vertexCount) {
+		VkBufferCopy vertexRegion = { 0, 0,
+			pool->vertexCount * pool->vertexStride };
+		VkBufferCopy positionRegion = { 0, 0,
+			pool->vertexCount * pool->positionStride };
+		vkCmdCopyBuffer(commandBuffer,
+			getRegisteredBuffer(context, pool->vertexBuffer),
+			getRegisteredBuffer(context, grown.vertexBuffer), 1,
+			&vertexRegion);
+		vkCmdCopyBuffer(commandBuffer,
+			getRegisteredBuffer(context, pool->positionBuffer),
+			getRegisteredBuffer(context, grown.positionBuffer), 1,
+			&positionRegion);
+	}
+	if (pool->indexCount) {
+		VkBufferCopy indexRegion = { 0, 0,
+			pool->indexCount * sizeof(uint32_t) };
+		vkCmdCopyBuffer(commandBuffer,
+			getRegisteredBuffer(context, pool->indexBuffer),
+			getRegisteredBuffer(context, grown.indexBuffer), 1, &indexRegion);
+	}
+	QueuePoint copied = submitSingleTimeCommands(commandBuffer,
+		context->commandPool, context->destructionQueue, 1);
+	VK_CHECK_ERROR(copied.value);
+
+	removeBuffer(context->registry, pool->vertexBuffer,
+		context->destructionQueue, copied);
+	removeBuffer(context->registry, pool->positionBuffer,
+		context->destructionQueue, copied);
+	removeBuffer(context->registry, pool->indexBuffer,
+		context->destructionQueue, copied);
+	*pool = grown;
+	return 1;
+}
 
-	VkBufferCopy copyRegion = {};
-	copyRegion.srcOffset = 0; // Optional
-	copyRegion.dstOffset = 0; // Optional
-	copyRegion.size = size;
-	vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+// Appends the mesh to the pool of its vertex format, creating the pool on
+// first use, and uploads its vertices, positions and indices in one
+// submission
+static int addPoolMesh(VkContext *context, const Mesh* const mesh,
+	GeometryRange *range) {
+
+	VkDeviceSize vertexSize;
+	const void* const vertexData = getMeshVertexData(mesh, &vertexSize);
+	VkDeviceSize vertexStride = vertexSize / mesh->vertexCount;
+	VkDeviceSize positionStride = getPositionStride(mesh->format);
+	VkDeviceSize positionSize = mesh->vertexCount * positionStride;
+	VkDeviceSize indexSize = mesh->indexCount * sizeof(uint32_t);
+	GeometryPool *pool = &context->geometryPools[mesh->format];
+	if (IS_NULL_HANDLE(pool->vertexBuffer)) {
+		VK_CHECK_ERROR(createGeometryPool(context, pool, vertexStride,
+			positionStride, mesh->vertexCount, mesh->indexCount));
+	}
+	if (pool->vertexCount + mesh->vertexCount > pool->vertexCapacity
+		|| pool->indexCount + mesh->indexCount > pool->indexCapacity) {
+
+		VK_CHECK_ERROR(growGeometryPool(context, pool, mesh->vertexCount,
+			mesh->indexCount));
+	}
+
+	VkBuffer stagingBuffer;
+	VkDeviceMemory stagingBufferMemory;
+	VkDeviceSize stagingSize = vertexSize + positionSize + indexSize;
+	VK_CHECK_ERROR(stagingBuffer = createBuffer(context, stagingSize,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stagingBufferMemory));
+
+	// Positions come first in both vertex formats
+	void* data;
+	vkMapMemory(context->device, stagingBufferMemory, 0, stagingSize, 0,
+		&data);
+	memcpy(data, vertexData, vertexSize);
+	for (uint32_t i = 0; i < mesh->vertexCount; ++i) {
+		memcpy(data + vertexSize + i * positionStride,
+			vertexData + i * vertexStride, positionStride);
+	}
+	memcpy(data + vertexSize + positionSize, mesh->indices, indexSize);
+	vkUnmapMemory(context->device, stagingBufferMemory);
+
+	VkCommandBuffer commandBuffer;
+	VK_CHECK_ERROR(commandBuffer = beginSingleTimeCommands(context->device,
+		context->commandPool));
+	VkBufferCopy vertexRegion = { 0, pool->vertexCount * pool->vertexStride,
+		vertexSize };
+	VkBufferCopy positionRegion = { vertexSize,
+		pool->vertexCount * pool->positionStride, positionSize };
+	VkBufferCopy indexRegion = { vertexSize + positionSize,
+		pool->indexCount * sizeof(uint32_t), indexSize };
+	vkCmdCopyBuffer(commandBuffer, stagingBuffer,
+		getRegisteredBuffer(context, pool->vertexBuffer), 1, &vertexRegion);
+	vkCmdCopyBuffer(commandBuffer, stagingBuffer,
+		getRegisteredBuffer(context, pool->positionBuffer), 1,
+		&positionRegion);
+	vkCmdCopyBuffer(commandBuffer, stagingBuffer,
+		getRegisteredBuffer(context, pool->indexBuffer), 1, &indexRegion);
+	VK_CHECK_ERROR(endSingleTimeCommands(commandBuffer,
+		context->commandPool, context->destructionQueue));
+
+	deferStagingBuffer(context, stagingBuffer, stagingBufferMemory);
+
+	range->vertexOffset = pool->vertexCount;
+	range->firstIndex = pool->indexCount;
+	pool->vertexCount += mesh->vertexCount;
+	pool->indexCount += mesh->indexCount;
+	return 1;
+}
+
+// The staging buffer is kept to upload instances that move
+static int createInstanceBuffer(VkContext *context) {
+	VkDeviceSize bufferSize = context->instanceCount * sizeof(InstanceData);
+
+	VK_CHECK_ERROR(context->instanceStagingBuffer = createBuffer(context,
+		bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&context->instanceStagingBufferMemory));
+
+	void* data;
+	vkMapMemory(context->device, context->instanceStagingBufferMemory, 0,
+		bufferSize, 0, &data);
+	memcpy(data, context->instances, bufferSize);
+	vkUnmapMemory(context->device, context->instanceStagingBufferMemory);
+
+	VK_CHECK_ERROR(context->instanceBuffer = createBuffer(context, bufferSize,
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &context->instanceBufferMemory));
+
+	VK_CHECK_ERROR(copyBuffer(context->device, context->commandPool,
+		context->destructionQueue, context->instanceStagingBuffer,
+		context->instanceBuffer, bufferSize));
+	return 1;
+}
+
+// Written by the host every frame, or by the culling compute shader with GPU
+// culling. Starts out with every instance visible.
+static int createVisibleInstanceBuffers(VkContext *context) {
+	if (context->cullingMode == CULLING_MESHLETS) {
+		uint64_t maxDrawCount = (uint64_t) context->instanceCount
+			* context->mesh->meshletCount;
+		if (!maxDrawCount || maxDrawCount > MAX_MESHLET_DRAWS) {
+			fprintf(stderr, "Meshlet culling supports up to %u instance "
+				"meshlets.\n", MAX_MESHLET_DRAWS);
+			return 0;
+		}
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(context->physicalDevice, &properties);
+		if (maxDrawCount > properties.limits.maxDrawIndirectCount) {
+			fprintf(stderr, "Meshlet culling exceeds the device limit of %u "
+				"indirect draws.\n", properties.limits.maxDrawIndirectCount);
+			return 0;
+		}
+		context->maxDrawCount = maxDrawCount;
+	} else {
+		context->maxDrawCount = 1;
+	}
+
+	// Occlusion culling lists the early and late draws separately, and
+	// culling on the CPU lists the instances of each LOD separately. Culling
+	// on the GPU always draws LOD 0.
+	VkDeviceSize bufferSize = context->instanceCount * sizeof(uint32_t);
+	uint32_t drawCommandCount = getDrawCommandCount(context);
+	if (context->cullingMode == CULLING_MESHLETS) {
+		bufferSize = context->maxDrawCount * sizeof(uint32_t);
+	} else {
+		bufferSize *= drawCommandCount;
+	}
+
+	if (isGpuCulling(context)) {
+		VK_CHECK_ERROR(context->visibleInstanceBuffer = createBuffer(context,
+			bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT
+			| VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			&context->visibleInstanceBufferMemory));
+
+		// Host visible so the counts can be read back for stats
+		VK_CHECK_ERROR(context->drawCountBuffer = createBuffer(context,
+			sizeof(CullCounts), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+			| VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+			| VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+			| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			&context->drawCountBufferMemory));
+	} else {
+		VK_CHECK_ERROR(context->visibleInstanceBuffer = createBuffer(context,
+			bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+			| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			&context->visibleInstanceBufferMemory));
+
+		uint32_t *indices;
+		vkMapMemory(context->device, context->visibleInstanceBufferMemory, 0,
+			bufferSize, 0, (void**) &indices);
+		for (uint32_t i = 0; i < context->instanceCount; ++i) {
+			indices[i] = i;
+		}
+		vkUnmapMemory(context->device, context->visibleInstanceBufferMemory);
+	}
+
+	// Meshlet draw commands are all written by the culling pass
+	if (context->cullingMode == CULLING_MESHLETS) {
+		VK_CHECK_ERROR(context->indirectBuffer = createBuffer(context,
+			context->maxDrawCount * sizeof(VkDrawIndexedIndirectCommand),
+			VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+			| VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+			| VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			&context->indirectBufferMemory));
+		return 1;
+	}
+
+	// Stays host visible so the visible count can be read back for stats
+	VK_CHECK_ERROR(context->indirectBuffer = createBuffer(context,
+		drawCommandCount * sizeof(VkDrawIndexedIndirectCommand),
+		VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+		| VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+		| VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&context->indirectBufferMemory));
+
+	VkDrawIndexedIndirectCommand *commands;
+	vkMapMemory(context->device, context->indirectBufferMemory, 0,
+		drawCommandCount * sizeof(VkDrawIndexedIndirectCommand), 0,
+		(void**) &commands);
+	memset(commands, 0, drawCommandCount * sizeof(VkDrawIndexedIndirectCommand));
+	for (uint32_t i = 0; i < drawCommandCount; ++i) {
+		const MeshLod* const lod =
+			&context->mesh->lods[isGpuCulling(context) ? 0 : i];
+		commands[i].indexCount = lod->indexCount;
+		commands[i].firstIndex = context->meshGeometry.firstIndex
+			+ lod->firstIndex;
+		commands[i].vertexOffset = context->meshGeometry.vertexOffset;
+		commands[i].firstInstance = context->firstInstanceDraws
+			? i * context->instanceCount : 0;
+	}
+	commands[0].instanceCount = context->instanceCount;
+	vkUnmapMemory(context->device, context->indirectBufferMemory);
+	return 1;
+}
+
+// Whether each instance passed the occlusion test in the previous frame.
+// Starts out all hidden, so the first frame draws everything late.
+static int createVisibilityBuffer(VkContext *context) {
+	VkDeviceSize bufferSize = context->instanceCount * sizeof(uint32_t);
+	VK_CHECK_ERROR(context->visibilityBuffer = createBuffer(context,
+		bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+		| VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		&context->visibilityBufferMemory));
+
+	VkCommandBuffer commandBuffer;
+	VK_CHECK_ERROR(commandBuffer = beginSingleTimeCommands(context->device,
+		context->commandPool));
+	vkCmdFillBuffer(commandBuffer, context->visibilityBuffer, 0, bufferSize,
+		0);
+	VK_CHECK_ERROR(endSingleTimeCommands(commandBuffer,
+		context->commandPool, context->destructionQueue));
+	return 1;
+}
+
+static int createMeshletBuffer(VkContext *context) {
+	VkDeviceSize bufferSize = context->mesh->meshletCount * sizeof(Meshlet);
+
+	VkBuffer stagingBuffer;
+	VkDeviceMemory stagingBufferMemory;
+	VK_CHECK_ERROR(stagingBuffer = createBuffer(context, bufferSize,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stagingBufferMemory));
+
+	void* data;
+	vkMapMemory(context->device, stagingBufferMemory, 0, bufferSize, 0, &data);
+	memcpy(data, context->mesh->meshlets, bufferSize);
+	vkUnmapMemory(context->device, stagingBufferMemory);
+
+	VK_CHECK_ERROR(context->meshletBuffer = createBuffer(context, bufferSize,
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &context->meshletBufferMemory));
+
+	VK_CHECK_ERROR(copyBuffer(context->device, context->commandPool,
+		context->destructionQueue, stagingBuffer, context->meshletBuffer,
+		bufferSize));
+
+	deferStagingBuffer(context, stagingBuffer, stagingBufferMemory);
+	return 1;
+}
+
+static int createMVPUniformBuffer(VkContext *context) {
+	VkDeviceSize bufferSize = sizeof(MVPMatrices);
+
+	VK_CHECK_ERROR(createRegisteredBuffer(context, bufferSize,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&context->mvpUniformBuffer));
+	return 1;
+}
+
+static int createSceneAttributesUniformBuffer(VkContext *context) {
+	VkDeviceSize bufferSize = sizeof(SceneAttributes);
+
+	VK_CHECK_ERROR(createRegisteredBuffer(context, bufferSize,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&context->sceneAttributesUniformBuffer));
+	return 1;
+}
+
+// Rewritten every frame from the light grid built on the CPU
+static int createLightBuffers(VkContext *context) {
+	VK_CHECK_ERROR(context->lightBuffer = createBuffer(context,
+		MAX(context->maxLights, 1) * sizeof(PointLight),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &context->lightBufferMemory));
+	VK_CHECK_ERROR(context->clusterBuffer = createBuffer(context,
+		LIGHT_GRID_CLUSTERS * sizeof(uint32_t[2]),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &context->clusterBufferMemory));
+	VK_CHECK_ERROR(context->lightIndexBuffer = createBuffer(context,
+		LIGHT_GRID_MAX_INDICES * sizeof(uint32_t),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&context->lightIndexBufferMemory));
+	return 1;
+}
+
+// Indices of the instances casting shadows, static ones first, streamed
+// like the visible instances
+static int createShadowCasterBuffer(VkContext *context) {
+	VK_CHECK_ERROR(context->shadowCasterBuffer = createBuffer(context,
+		context->instanceCount * sizeof(uint32_t),
+		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&context->shadowCasterBufferMemory));
+	return 1;
+}
+
+static VkDescriptorPool createDescriptorPool(const VkContext* const context) {
+	// Sized for the graphics set, the culling set, one depth reduction set
+	// per depth pyramid level, the G-buffer set, one set per bloom level
+	// and the tonemapping set
+	VkDescriptorPoolSize poolSizes[4] = {};
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	poolSizes[0].descriptorCount = 3;
+	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSizes[1].descriptorCount = 3 + MAX_DEPTH_PYRAMID_LEVELS
+		+ GBUFFER_ATTACHMENTS + 1 + MAX_BLOOM_LEVELS + 1;
+	poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	poolSizes[2].descriptorCount = 9;
+	poolSizes[3].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	poolSizes[3].descriptorCount = MAX_DEPTH_PYRAMID_LEVELS
+		+ MAX_BLOOM_LEVELS + 1;
+
+	VkDescriptorPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = sizeof(poolSizes) / sizeof(VkDescriptorPoolSize);
+	poolInfo.pPoolSizes = poolSizes;
+	poolInfo.maxSets = 3 + MAX_DEPTH_PYRAMID_LEVELS + MAX_BLOOM_LEVELS + 1;
+
+	VkDescriptorPool descriptorPool;
+	if (vkCreateDescriptorPool(context->device, &poolInfo, NULL,
+							   &descriptorPool) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create descriptor pool.\n");
+		return NULL;
+	}
+	return descriptorPool;
+}
+
+static VkDescriptorSet createDescriptorSet(const VkContext* const context) {
+
+	VkDescriptorSetLayout layouts[] = { context->descriptorSetLayout };
+	VkDescriptorSetAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = context->descriptorPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = layouts;
+
+	VkDescriptorSet descriptorSet;
+	if (vkAllocateDescriptorSets(context->device, &allocInfo,
+								 &descriptorSet) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to allocate descriptor set.\n");
+		return NULL;
+	}
+
+	VkDescriptorBufferInfo mvpBufferInfo = {};
+	mvpBufferInfo.buffer = getRegisteredBuffer(context,
+		context->mvpUniformBuffer);
+	mvpBufferInfo.offset = 0;
+	mvpBufferInfo.range = sizeof(MVPMatrices);
+
+	VkDescriptorBufferInfo sceneAttributesBufferInfo = {};
+	sceneAttributesBufferInfo.buffer = getRegisteredBuffer(context,
+		context->sceneAttributesUniformBuffer);
+	sceneAttributesBufferInfo.offset = 0;
+	sceneAttributesBufferInfo.range = sizeof(SceneAttributes);
+
+	VkDescriptorBufferInfo instanceBufferInfo = {};
+	instanceBufferInfo.buffer = context->instanceBuffer;
+	instanceBufferInfo.offset = 0;
+	instanceBufferInfo.range = VK_WHOLE_SIZE;
+
+	VkDescriptorBufferInfo lightBufferInfos[3] = {};
+	lightBufferInfos[0].buffer = context->lightBuffer;
+	lightBufferInfos[1].buffer = context->clusterBuffer;
+	lightBufferInfos[2].buffer = context->lightIndexBuffer;
+	for (uint32_t i = 0; i < 3; ++i) {
+		lightBufferInfos[i].offset = 0;
+		lightBufferInfos[i].range = VK_WHOLE_SIZE;
+	}
+
+	VkDescriptorImageInfo imageInfo = {};
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	imageInfo.imageView = getImage(context->registry, context->texture)->view;
+	imageInfo.sampler = getSampler(context->registry,
+		context->textureSampler)->sampler;
+
+	VkDescriptorImageInfo shadowImageInfo = {};
+	shadowImageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	shadowImageInfo.imageView = context->shadowMapView;
+	shadowImageInfo.sampler = context->shadowSampler;
+
+	VkWriteDescriptorSet descriptorWrites[8] = {};
+	descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrites[0].dstSet = descriptorSet;
+	descriptorWrites[0].dstBinding = 0;
+	descriptorWrites[0].dstArrayElement = 0;
+	descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	descriptorWrites[0].descriptorCount = 1;
+	descriptorWrites[0].pBufferInfo = &mvpBufferInfo;
+
+	descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrites[1].dstSet = descriptorSet;
+	descriptorWrites[1].dstBinding = 1;
+	descriptorWrites[1].dstArrayElement = 0;
+	descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrites[1].descriptorCount = 1;
+	descriptorWrites[1].pImageInfo = &imageInfo;
+
+	descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrites[2].dstSet = descriptorSet;
+	descriptorWrites[2].dstBinding = 2;
+	descriptorWrites[2].dstArrayElement = 0;
+	descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	descriptorWrites[2].descriptorCount = 1;
+	descriptorWrites[2].pBufferInfo = &sceneAttributesBufferInfo;
+
+	descriptorWrites[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrites[3].dstSet = descriptorSet;
+	descriptorWrites[3].dstBinding = 3;
+	descriptorWrites[3].dstArrayElement = 0;
+	descriptorWrites[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	descriptorWrites[3].descriptorCount = 1;
+	descriptorWrites[3].pBufferInfo = &instanceBufferInfo;
+
+	for (uint32_t i = 0; i < 3; ++i) {
+		VkWriteDescriptorSet *write = &descriptorWrites[4 + i];
+		write->sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write->dstSet = descriptorSet;
+		write->dstBinding = 4 + i;
+		write->dstArrayElement = 0;
+		write->descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		write->descriptorCount = 1;
+		write->pBufferInfo = &lightBufferInfos[i];
+	}
+
+	descriptorWrites[7].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrites[7].dstSet = descriptorSet;
+	descriptorWrites[7].dstBinding = 7;
+	descriptorWrites[7].dstArrayElement = 0;
+	descriptorWrites[7].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrites[7].descriptorCount = 1;
+	descriptorWrites[7].pImageInfo = &shadowImageInfo;
+
+	uint32_t descriptorWriteCount =
+		sizeof(descriptorWrites) / sizeof(VkWriteDescriptorSet);
+	vkUpdateDescriptorSets(context->device, descriptorWriteCount,
+		descriptorWrites, 0, NULL);
 
-	VK_CHECK_ERROR(endSingleTimeCommands(device, commandBuffer, commandPool,
-		graphicsQueue));
-	return 1;
+	return descriptorSet;
 }
 
-static int transitionImageLayout(const VkContext* const context, VkImage image,
-								  VkFormat format, VkImageLayout oldLayout,
-								  VkImageLayout newLayout, uint32_t layerCount) {
+static VkDescriptorSet createCullDescriptorSet(
+	const VkContext* const context) {
 
-	VkCommandBuffer commandBuffer;
-	VK_CHECK_ERROR(commandBuffer = beginSingleTimeCommands(context->device,
-		context->commandPool));
+	VkDescriptorSetAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = context->descriptorPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &context->cullDescriptorSetLayout;
 
-	VkImageMemoryBarrier barrier = {};
-	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-	barrier.oldLayout = oldLayout;
-	barrier.newLayout = newLayout;
-	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	barrier.image = image;
-	barrier.subresourceRange.baseMipLevel = 0;
-	barrier.subresourceRange.levelCount = 1;
-	barrier.subresourceRange.baseArrayLayer = 0;
-	barrier.subresourceRange.layerCount = layerCount;
+	VkDescriptorSet descriptorSet;
+	if (vkAllocateDescriptorSets(context->device, &allocInfo,
+								 &descriptorSet) != VK_SUCCESS) {
 
-	if (oldLayout == VK_IMAGE_LAYOUT_PREINITIALIZED
-		&& newLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
+		fprintf(stderr, "Failed to allocate culling descriptor set.\n");
+		return NULL;
+	}
 
-		barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-		barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-	} else if (oldLayout == VK_IMAGE_LAYOUT_PREINITIALIZED
-			   && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
+	VkDescriptorType types[MAX_CULL_DESCRIPTORS];
+	VkBuffer buffers[MAX_CULL_DESCRIPTORS];
+	uint32_t descriptorCount = getCullDescriptors(context, types, buffers);
 
-		barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-	} else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
-			   && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+	VkDescriptorImageInfo imageInfo = {};
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	imageInfo.imageView = context->depthPyramidView;
+	imageInfo.sampler = context->depthPyramidSampler;
+
+	VkDescriptorBufferInfo bufferInfos[MAX_CULL_DESCRIPTORS] = {};
+	VkWriteDescriptorSet descriptorWrites[MAX_CULL_DESCRIPTORS] = {};
+	for (uint32_t i = 0; i < descriptorCount; ++i) {
+		bufferInfos[i].buffer = buffers[i];
+		bufferInfos[i].offset = 0;
+		bufferInfos[i].range = VK_WHOLE_SIZE;
+
+		descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[i].dstSet = descriptorSet;
+		descriptorWrites[i].dstBinding = i;
+		descriptorWrites[i].dstArrayElement = 0;
+		descriptorWrites[i].descriptorType = types[i];
+		descriptorWrites[i].descriptorCount = 1;
+		if (types[i] == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER) {
+			descriptorWrites[i].pImageInfo = &imageInfo;
+		} else {
+			descriptorWrites[i].pBufferInfo = &bufferInfos[i];
+		}
+	}
+	vkUpdateDescriptorSets(context->device, descriptorCount, descriptorWrites,
+		0, NULL);
 
-		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-	} else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED
-			   && newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
+	return descriptorSet;
+}
 
-		barrier.srcAccessMask = 0;
-		barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
-			| VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-	} else {
-		fprintf(stderr, "Unsupported layout transition.\n");
-		endSingleTimeCommands(context->device, commandBuffer,
-			context->commandPool, context->graphicsQueue);
-		return 0;
+// Points the depth reduction sets at the current depth attachment and
+// pyramid levels, and the culling set at the whole pyramid
+static void writeDepthPyramidDescriptors(const VkContext* const context) {
+	// Level 0 copies the depth attachment, every other level halves the
+	// level before it
+	for (uint32_t i = 0; i < context->depthPyramidLevels; ++i) {
+		VkDescriptorImageInfo inputInfo = {};
+		inputInfo.sampler = context->depthPyramidSampler;
+		if (i) {
+			inputInfo.imageView = context->depthPyramidMipViews[i - 1];
+			inputInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+		} else {
+			inputInfo.imageView = context->depthImageView;
+			inputInfo.imageLayout =
+				VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+		}
+
+		VkDescriptorImageInfo outputInfo = {};
+		outputInfo.imageView = context->depthPyramidMipViews[i];
+		outputInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+		VkWriteDescriptorSet descriptorWrites[2] = {};
+		descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[0].dstSet = context->depthReduceDescriptorSets[i];
+		descriptorWrites[0].dstBinding = 0;
+		descriptorWrites[0].descriptorType =
+			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		descriptorWrites[0].descriptorCount = 1;
+		descriptorWrites[0].pImageInfo = &inputInfo;
+
+		descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[1].dstSet = context->depthReduceDescriptorSets[i];
+		descriptorWrites[1].dstBinding = 1;
+		descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		descriptorWrites[1].descriptorCount = 1;
+		descriptorWrites[1].pImageInfo = &outputInfo;
+
+		vkUpdateDescriptorSets(context->device, 2, descriptorWrites, 0, NULL);
 	}
 
-	if (newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
-		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+	// The pyramid is the culling set's last binding
+	VkDescriptorType types[MAX_CULL_DESCRIPTORS];
+	VkBuffer buffers[MAX_CULL_DESCRIPTORS];
+	uint32_t descriptorCount = getCullDescriptors(context, types, buffers);
 
-		if (hasStencilComponent(format)) {
-		    barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
-		}
-	} else {
-		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	VkDescriptorImageInfo imageInfo = {};
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	imageInfo.imageView = context->depthPyramidView;
+	imageInfo.sampler = context->depthPyramidSampler;
+
+	VkWriteDescriptorSet descriptorWrite = {};
+	descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrite.dstSet = context->cullDescriptorSet;
+	descriptorWrite.dstBinding = descriptorCount - 1;
+	descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrite.descriptorCount = 1;
+	descriptorWrite.pImageInfo = &imageInfo;
+	vkUpdateDescriptorSets(context->device, 1, &descriptorWrite, 0, NULL);
+}
+
+// Allocates a set for every level the pyramid could have, so a resized
+// pyramid only has to rewrite them
+static int createDepthReduceDescriptorSets(VkContext *context) {
+	VkDescriptorSetLayout layouts[MAX_DEPTH_PYRAMID_LEVELS];
+	for (uint32_t i = 0; i < MAX_DEPTH_PYRAMID_LEVELS; ++i) {
+		layouts[i] = context->depthReduceDescriptorSetLayout;
 	}
 
-	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+	VkDescriptorSetAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = context->descriptorPool;
+	allocInfo.descriptorSetCount = MAX_DEPTH_PYRAMID_LEVELS;
+	allocInfo.pSetLayouts = layouts;
+
+	if (vkAllocateDescriptorSets(context->device, &allocInfo,
+								 context->depthReduceDescriptorSets) != VK_SUCCESS) {
 
-	VK_CHECK_ERROR(endSingleTimeCommands(context->device, commandBuffer,
-		context->commandPool, context->graphicsQueue));
+		fprintf(stderr, "Failed to allocate depth reduction descriptor sets.\n");
+		return 0;
+	}
+	writeDepthPyramidDescriptors(context);
 	return 1;
 }
 
-static int createDepthResources(VkContext *context) {
-	VkFormat depthFormat = findDepthFormat(context);
-	if (depthFormat == VK_FORMAT_UNDEFINED) {
-		return 0;
+// Points the lighting pass at the G-buffer and depth attachments, which
+// are recreated with the swap chain
+static void writeGBufferDescriptors(const VkContext* const context) {
+	const RenderGraph* const graph = context->frameGraph;
+	VkDescriptorImageInfo imageInfos[GBUFFER_ATTACHMENTS + 1] = {};
+	VkWriteDescriptorSet descriptorWrites[GBUFFER_ATTACHMENTS + 1] = {};
+	for (uint32_t i = 0; i < GBUFFER_ATTACHMENTS + 1; ++i) {
+		int depth = i == GBUFFER_ATTACHMENTS;
+		imageInfos[i].sampler = context->gBufferSampler;
+		imageInfos[i].imageView = depth ? context->depthImageView
+			: graph->resources[FRAME_GBUFFER_ALBEDO + i].view;
+		imageInfos[i].imageLayout = depth
+			? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL
+			: VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+		descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[i].dstSet = context->gBufferDescriptorSet;
+		descriptorWrites[i].dstBinding = i;
+		descriptorWrites[i].descriptorType =
+			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		descriptorWrites[i].descriptorCount = 1;
+		descriptorWrites[i].pImageInfo = &imageInfos[i];
 	}
-	context->depthImage = createImage(context, context->extent.width,
-		context->extent.height, 1, depthFormat, VK_IMAGE_TILING_OPTIMAL,
-		VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &context->depthImageMemory);
-	if (!context->depthImage) {
+	vkUpdateDescriptorSets(context->device, GBUFFER_ATTACHMENTS + 1,
+		descriptorWrites, 0, NULL);
+}
+
+// lighting.frag fetches texels, so the sampler never filters
+static int createGBufferDescriptorSet(VkContext *context) {
+	VkSamplerCreateInfo samplerInfo = {};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_NEAREST;
+	samplerInfo.minFilter = VK_FILTER_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	if (vkCreateSampler(context->device, &samplerInfo, NULL,
+						&context->gBufferSampler) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to create G-buffer sampler.\n");
 		return 0;
 	}
-	context->depthImageView = createImageView(context, context->depthImage,
-		depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT, 1);
-	if (!context->depthImageView) {
+
+	VkDescriptorSetAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = context->descriptorPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &context->gBufferDescriptorSetLayout;
+
+	if (vkAllocateDescriptorSets(context->device, &allocInfo,
+								 &context->gBufferDescriptorSet) != VK_SUCCESS) {
+
+		fprintf(stderr, "Failed to allocate G-buffer descriptor set.\n");
 		return 0;
 	}
-	if (!transitionImageLayout(context, context->depthImage, depthFormat,
-							   VK_IMAGE_LAYOUT_UNDEFINED,
-							   VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-							   1)) {
-		return 0;
-	};
+	writeGBufferDescriptors(context);
 	return 1;
 }
 
-static int copyBufferToImage(const VkContext* const context, VkBuffer srcBuffer,
-							  VkImage dstImage, uint32_t width, uint32_t height,
-							  uint32_t layerCount) {
-
-	VkCommandBuffer commandBuffer;
-	VK_CHECK_ERROR(commandBuffer = beginSingleTimeCommands(context->device,
-		context->commandPool));
-
-	size_t bufferCopyRegionsSize = layerCount * sizeof(VkBufferImageCopy);
-	VkBufferImageCopy *bufferCopyRegions = malloc(bufferCopyRegionsSize);
-	memset(bufferCopyRegions, 0, bufferCopyRegionsSize);
-
-	VkDeviceSize offset = 0;
-	for (uint32_t i = 0; i < layerCount; ++i) {
-		bufferCopyRegions[i].imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		bufferCopyRegions[i].imageSubresource.mipLevel = 0;
-		bufferCopyRegions[i].imageSubresource.baseArrayLayer = i;
-		bufferCopyRegions[i].imageSubresource.layerCount = 1;
-		bufferCopyRegions[i].imageExtent.width = width;
-		bufferCopyRegions[i].imageExtent.height = height;
-		bufferCopyRegions[i].imageExtent.depth = 1;
-		bufferCopyRegions[i].bufferOffset = offset;
+// Points the bloom sets at the color image and the bloom levels, and the
+// tonemapping set at the whole chain and the color image, which are
+// recreated with the swap chain
+static void writePostDescriptors(const VkContext* const context) {
+	// Level 0 keeps the bright part of the color image, every other level
+	// halves the level before it. Tonemapping comes after the last level.
+	for (uint32_t i = 0; i <= context->bloomLevels; ++i) {
+		int tonemap = i == context->bloomLevels;
+		VkDescriptorImageInfo inputInfo = {};
+		inputInfo.sampler = context->postSampler;
+		inputInfo.imageView = tonemap ? context->bloomImageView
+			: i ? context->bloomMipViews[i - 1] : context->colorImageView;
+		inputInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+		VkDescriptorImageInfo outputInfo = {};
+		outputInfo.imageView = tonemap ? context->colorImageView
+			: context->bloomMipViews[i];
+		outputInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+		VkDescriptorSet descriptorSet = tonemap
+			? context->tonemapDescriptorSet : context->bloomDescriptorSets[i];
+		VkWriteDescriptorSet descriptorWrites[2] = {};
+		descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[0].dstSet = descriptorSet;
+		descriptorWrites[0].dstBinding = 0;
+		descriptorWrites[0].descriptorType =
+			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		descriptorWrites[0].descriptorCount = 1;
+		descriptorWrites[0].pImageInfo = &inputInfo;
+
+		descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[1].dstSet = descriptorSet;
+		descriptorWrites[1].dstBinding = 1;
+		descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		descriptorWrites[1].descriptorCount = 1;
+		descriptorWrites[1].pImageInfo = &outputInfo;
+
+		vkUpdateDescriptorSets(context->device, 2, descriptorWrites, 0, NULL);
+	}
+}
 
-		offset += width * height * 4;
+// Allocates a set for every level the bloom chain could have, so a resized
+// chain only has to rewrite them
+static int createPostDescriptorSets(VkContext *context) {
+	VkDescriptorSetLayout layouts[MAX_BLOOM_LEVELS + 1];
+	for (uint32_t i = 0; i < MAX_BLOOM_LEVELS + 1; ++i) {
+		layouts[i] = context->postDescriptorSetLayout;
 	}
 
-	vkCmdCopyBufferToImage(commandBuffer, srcBuffer, dstImage,
-		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, layerCount, bufferCopyRegions);
+	VkDescriptorSetAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = context->descriptorPool;
+	allocInfo.descriptorSetCount = MAX_BLOOM_LEVELS + 1;
+	allocInfo.pSetLayouts = layouts;
 
-	free(bufferCopyRegions);
+	VkDescriptorSet descriptorSets[MAX_BLOOM_LEVELS + 1];
+	if (vkAllocateDescriptorSets(context->device, &allocInfo,
+								 descriptorSets) != VK_SUCCESS) {
 
-	VK_CHECK_ERROR(endSingleTimeCommands(context->device, commandBuffer,
-		context->commandPool, context->graphicsQueue));
+		fprintf(stderr, "Failed to allocate post-processing descriptor "
+			"sets.\n");
+		return 0;
+	}
+	memcpy(context->bloomDescriptorSets, descriptorSets,
+		sizeof(context->bloomDescriptorSets));
+	context->tonemapDescriptorSet = descriptorSets[MAX_BLOOM_LEVELS];
+	writePostDescriptors(context);
 	return 1;
 }
 
-static VkBuffer createBuffer(const VkContext* const context,
-	VkDeviceSize size, VkBufferUsageFlags usage,
-	VkMemoryPropertyFlags properties, VkDeviceMemory *bufferMemory) {
-
-	VkBufferCreateInfo bufferInfo = {};
-	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferInfo.size = size;
-	bufferInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+// Resets the visible counts and culls the instances or their meshlets.
+// Occlusion culling runs phase 1 after the depth pyramid is built, adding
+// to the counts of phase 0.
+static void recordCullCommands(const VkContext* const context,
+							   VkCommandBuffer commandBuffer, uint32_t phase) {
+
+	if (!phase) {
+		if (context->cullingMode == CULLING_MESHLETS) {
+			// Without a draw count every command is drawn, so unused ones
+			// must draw nothing
+			if (!context->vkCmdDrawIndexedIndirectCount) {
+				vkCmdFillBuffer(commandBuffer, context->indirectBuffer, 0,
+					VK_WHOLE_SIZE, 0);
+			}
+		} else {
+			uint32_t drawCommandCount =
+				context->cullingMode == CULLING_OCCLUSION ? 2 : 1;
+			for (uint32_t i = 0; i < drawCommandCount; ++i) {
+				vkCmdFillBuffer(commandBuffer, context->indirectBuffer,
+					i * sizeof(VkDrawIndexedIndirectCommand)
+					+ offsetof(VkDrawIndexedIndirectCommand, instanceCount),
+					sizeof(uint32_t), 0);
+			}
+		}
+		vkCmdFillBuffer(commandBuffer, context->drawCountBuffer, 0,
+			sizeof(CullCounts), 0);
 
-	VkBuffer buffer;
-	if (vkCreateBuffer(context->device, &bufferInfo, NULL, &buffer) != VK_SUCCESS) {
-		fprintf(stderr, "Failed to create vertex buffer.\n");
-		return NULL;
+		// Cleared commands may be drawn without being written by the shader
+		VkMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT
+			| VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+			| VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1, &barrier, 0, NULL, 0,
+			NULL);
 	}
 
-	VkMemoryRequirements memRequirements;
-	vkGetBufferMemoryRequirements(context->device, buffer, &memRequirements);
+	CullParams params = {};
+	float radius;
+	getMeshBoundingSphere(context->mesh, params.sphere, &radius);
+	params.sphere[3] = radius;
+	params.instanceCount = context->instanceCount;
+	params.meshletCount = context->mesh->meshletCount;
+	params.phase = phase;
+	params.firstIndex = context->meshGeometry.firstIndex;
+	params.vertexOffset = context->meshGeometry.vertexOffset;
+	uint32_t invocationCount = context->cullingMode == CULLING_MESHLETS
+		? context->maxDrawCount : context->instanceCount;
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+		context->cullPipeline);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+		context->cullPipelineLayout, 0, 1, &context->cullDescriptorSet, 0,
+		NULL);
+	vkCmdPushConstants(commandBuffer, context->cullPipelineLayout,
+		VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullParams), &params);
+	vkCmdDispatch(commandBuffer, (invocationCount + CULL_WORKGROUP_SIZE - 1)
+		/ CULL_WORKGROUP_SIZE, 1, 1);
+}
 
-	VkMemoryAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(context->physicalDevice,
-		memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+// Builds the depth pyramid from the depth written by the early pass. Each
+// level waits for the one before it.
+static void recordDepthPyramid(const VkContext* const context,
+							   VkCommandBuffer commandBuffer) {
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+		context->depthReducePipeline);
+
+	ReduceParams params = {};
+	params.inputSize[0] = context->extent.width;
+	params.inputSize[1] = context->extent.height;
+	for (uint32_t i = 0; i < context->depthPyramidLevels; ++i) {
+		params.outputSize[0] = MAX(context->extent.width >> i, 1u);
+		params.outputSize[1] = MAX(context->extent.height >> i, 1u);
+		params.scale = i ? 2 : 1;
+
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+			context->depthReducePipelineLayout, 0, 1,
+			&context->depthReduceDescriptorSets[i], 0, NULL);
+		vkCmdPushConstants(commandBuffer, context->depthReducePipelineLayout,
+			VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ReduceParams), &params);
+		vkCmdDispatch(commandBuffer,
+			(params.outputSize[0] + REDUCE_WORKGROUP_SIZE - 1)
+			/ REDUCE_WORKGROUP_SIZE,
+			(params.outputSize[1] + REDUCE_WORKGROUP_SIZE - 1)
+			/ REDUCE_WORKGROUP_SIZE, 1);
+
+		VkMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, NULL, 0,
+			NULL);
 
-	if (vkAllocateMemory(context->device, &allocInfo, NULL, bufferMemory) != VK_SUCCESS) {
-		fprintf(stderr, "Failed to allocate vertex buffer memory.\n");
-		vkDestroyBuffer(context->device, buffer, NULL);
-		return NULL;
+		params.inputSize[0] = params.outputSize[0];
+		params.inputSize[1] = params.outputSize[1];
 	}
-
-	vkBindBufferMemory(context->device, buffer, *bufferMemory, 0);
-
-	return buffer;
 }
 
-static VkDeviceSize readTextureFile(const char* const filename, TexHdr *textureHeader,
-							uint8_t **pixels) {
+static PostParams getPostParams(const VkContext* const context) {
+	PostParams params = {};
+	params.imageSize[0] = context->extent.width;
+	params.imageSize[1] = context->extent.height;
+	params.renderSize[0] = context->renderExtent.width;
+	params.renderSize[1] = context->renderExtent.height;
+	params.threshold = BLOOM_THRESHOLD;
+	params.exposure = EXPOSURE;
+	params.bloomStrength = BLOOM_STRENGTH;
+	return params;
+}
 
-	size_t numSearchPaths = sizeof(TEXTURE_SEARCH_PATHS) / sizeof(char*);
-	FILE *file = openFile(filename, TEXTURE_SEARCH_PATHS, numSearchPaths);
+// Downsamples the bright parts of the rendered area into the bloom chain.
+// Each level waits for the one before it.
+static void recordBloom(const VkContext* const context,
+						VkCommandBuffer commandBuffer) {
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+		context->bloomPipeline);
+
+	PostParams params = getPostParams(context);
+	for (uint32_t i = 0; i < context->bloomLevels; ++i) {
+		if (i) {
+			VkMemoryBarrier barrier = {};
+			barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+			barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+			vkCmdPipelineBarrier(commandBuffer,
+				VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, NULL,
+				0, NULL);
+		}
 
-	fread(textureHeader, sizeof(TexHdr), 1, file);
-	if (textureHeader->type != 0x1401) { // GL_UNSIGNED_BYTE
-		fprintf(stderr, "Texture has unsupported type: %u\n",
-			textureHeader->type);
-		fclose(file);
-		return 0;
-	}
-	VkDeviceSize dataSize = textureHeader->width * textureHeader->height;
-	VkDeviceSize pixelSize;
-	switch(textureHeader->format) {
-		case 0x1907: // GL_RGB
-			pixelSize = 3;
-			break;
-		case 0x1908: // GL_RGBA
-			pixelSize = 4;
-			break;
-		default:
-			fprintf(stderr, "Texture has unsupported format: %u\n",
-				textureHeader->format);
-			fclose(file);
-			return 0;
+		params.level = i;
+		uint32_t width = MAX(context->renderExtent.width >> (i + 1), 1u);
+		uint32_t height = MAX(context->renderExtent.height >> (i + 1), 1u);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+			context->postPipelineLayout, 0, 1,
+			&context->bloomDescriptorSets[i], 0, NULL);
+		vkCmdPushConstants(commandBuffer, context->postPipelineLayout,
+			VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PostParams), &params);
+		vkCmdDispatch(commandBuffer,
+			(width + POST_WORKGROUP_SIZE - 1) / POST_WORKGROUP_SIZE,
+			(height + POST_WORKGROUP_SIZE - 1) / POST_WORKGROUP_SIZE, 1);
 	}
-	dataSize *= pixelSize;
-	*pixels = malloc(dataSize);
-	fread(*pixels, sizeof(uint8_t), dataSize, file);
-	fclose(file);
+}
 
-	// If the format is RGB, convert it to RGBA
-	if (pixelSize == 3) {
-		uint8_t *newPixels = malloc(dataSize / 3 * 4);
-		uint8_t *ptr = newPixels;
-		for (size_t i = 0; i < dataSize; i += 3) {
-			memcpy(ptr, &(*pixels)[i], 3);
-			ptr[3] = 255; // Alpha
-			ptr += 4;
+// Rows take positions relative to the light to the face's s and t, a depth
+// of 0 at SHADOW_MAP_NEAR tending to 1, and the distance along the face's
+// major axis
+static void getShadowFaceMatrix(float *matrix, uint32_t face,
+								const float* const lightPos) {
+
+	const float* const rows[4] = { CUBE_FACE_AXES[face][1],
+		CUBE_FACE_AXES[face][2], CUBE_FACE_AXES[face][0],
+		CUBE_FACE_AXES[face][0] };
+	for (uint32_t row = 0; row < 4; ++row) {
+		float translation = row == 2 ? -SHADOW_MAP_NEAR : 0.0f;
+		for (uint32_t column = 0; column < 3; ++column) {
+			matrix[column * 4 + row] = rows[row][column];
+			translation -= rows[row][column] * lightPos[column];
 		}
-		free(*pixels);
-		*pixels = newPixels;
-		dataSize /= 3;
-		dataSize *= 4;
+		matrix[12 + row] = translation;
 	}
-
-	return dataSize;
 }
 
-static int createTextureImage(VkContext *context) {
-	TexHdr diffuseTextureHeader, normalTextureHeader;
-	uint8_t *diffusePixels, *normalPixels;
-	VkDeviceSize diffuseDataSize = readTextureFile("brick.tex",
-		&diffuseTextureHeader, &diffusePixels);
-	VkDeviceSize normalDataSize = readTextureFile("normal.tex",
-		&normalTextureHeader, &normalPixels);
-
-	if (memcmp(&diffuseTextureHeader, &normalTextureHeader, sizeof(TexHdr))
-		|| diffuseDataSize != normalDataSize) {
-
-		fprintf(stderr, "Diffuse and normal textures are incompatible.\n");
-		free(diffusePixels);
-		free(normalPixels);
-		return 0;
-	}
-
-	VkDeviceMemory stagingBufferMemory;
-	VkBuffer stagingBuffer = createBuffer(context,
-		diffuseDataSize + normalDataSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stagingBufferMemory);
-	if (stagingBuffer == NULL) {
-		fprintf(stderr, "Could not create staging buffer.\n");
-		free(diffusePixels);
-		free(normalPixels);
-		return 0;
+// Draws count casters from the given one of the caster list into every
+// face of a shadow cube
+static void recordShadowFaces(const VkContext* const context,
+							  VkCommandBuffer commandBuffer,
+							  VkRenderPass renderPass,
+							  const VkFramebuffer* const framebuffers,
+							  uint32_t firstCaster, uint32_t count) {
+
+	const Mesh* const mesh = context->mesh;
+	const GeometryPool* const pool = &context->geometryPools[mesh->format];
+	VkBuffer vertexBuffers[] = {
+		getRegisteredBuffer(context, pool->positionBuffer),
+		context->shadowCasterBuffer };
+	VkDeviceSize offsets[] = { 0, firstCaster * sizeof(uint32_t) };
+
+	ShadowParams params = {};
+	params.bounds = mesh->bounds;
+	memcpy(params.light, context->shadowLightPos,
+		sizeof(context->shadowLightPos));
+	params.light[3] = SHADOW_MAP_FAR;
+
+	VkClearValue clearValue = {};
+	clearValue.depthStencil = (VkClearDepthStencilValue) { 1.0f, 0 };
+	VkViewport viewport = { 0.0f, 0.0f, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE,
+		0.0f, 1.0f };
+	VkRect2D scissor = { { 0, 0 }, { SHADOW_MAP_SIZE, SHADOW_MAP_SIZE } };
+
+	for (uint32_t i = 0; i < CUBE_FACES; ++i) {
+		VkRenderPassBeginInfo renderPassInfo = {};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = renderPass;
+		renderPassInfo.framebuffer = framebuffers[i];
+		renderPassInfo.renderArea.extent =
+			(VkExtent2D) { SHADOW_MAP_SIZE, SHADOW_MAP_SIZE };
+		renderPassInfo.clearValueCount = 1;
+		renderPassInfo.pClearValues = &clearValue;
+
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+			VK_SUBPASS_CONTENTS_INLINE);
+		if (count) {
+			getShadowFaceMatrix(params.face, i, context->shadowLightPos);
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				context->shadowPipelines[mesh->format]);
+			vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+			vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+			vkCmdBindDescriptorSets(commandBuffer,
+				VK_PIPELINE_BIND_POINT_GRAPHICS, context->shadowPipelineLayout,
+				0, 1, &context->descriptorSet, 0, NULL);
+			vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers,
+				offsets);
+			vkCmdBindIndexBuffer(commandBuffer,
+				getRegisteredBuffer(context, pool->indexBuffer), 0,
+				VK_INDEX_TYPE_UINT32);
+			vkCmdPushConstants(commandBuffer, context->shadowPipelineLayout,
+				VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+				sizeof(ShadowParams), &params);
+			vkCmdDrawIndexed(commandBuffer, mesh->lods[0].indexCount, count,
+				context->meshGeometry.firstIndex + mesh->lods[0].firstIndex,
+				context->meshGeometry.vertexOffset, 0);
+		}
+		vkCmdEndRenderPass(commandBuffer);
 	}
+}
 
-	void* data;
-	vkMapMemory(context->device, stagingBufferMemory, 0,
-		diffuseDataSize + normalDataSize, 0, &data);
-	memcpy(data, diffusePixels, diffuseDataSize);
-	memcpy(data + diffuseDataSize, normalPixels, normalDataSize);
-	vkUnmapMemory(context->device, stagingBufferMemory);
-	free(diffusePixels);
-	free(normalPixels);
+// Records the items in order, only rebinding what changes between
+// neighbours. Without firstInstance in indirect draws, each indirect item
+// selects its range of the visible instance stream by rebinding it. The
+// depth prepass pipelines draw from the position streams.
+static void recordDrawItems(const VkContext* const context,
+							VkCommandBuffer commandBuffer,
+							const VkPipeline* const pipelines,
+							const DrawItem* const items, uint32_t count) {
+
+	// Secondaries don't inherit dynamic state, so every buffer sets it
+	VkViewport viewport = { 0.0f, 0.0f, context->renderExtent.width,
+		context->renderExtent.height, 0.0f, 1.0f };
+	VkRect2D scissor = { { 0, 0 }, context->renderExtent };
+	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+	int positionsOnly = pipelines == context->prepassPipelines;
+	const DrawItem *previous = NULL;
+	VkDeviceSize instanceOffset = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		const DrawItem* const item = &items[i];
+		if (!previous || item->format != previous->format) {
+			const GeometryPool* const pool =
+				&context->geometryPools[item->format];
+			VkBuffer vertexBuffers[] = { getRegisteredBuffer(context,
+				positionsOnly ? pool->positionBuffer : pool->vertexBuffer),
+				context->visibleInstanceBuffer };
+			VkDeviceSize offsets[] = { 0, 0 };
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				pipelines[item->format]);
+			vkCmdBindIndexBuffer(commandBuffer,
+				getRegisteredBuffer(context, pool->indexBuffer), 0,
+				VK_INDEX_TYPE_UINT32);
+			vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers,
+				offsets);
+			instanceOffset = 0;
+		}
+		if (!previous || item->bounds != previous->bounds) {
+			vkCmdPushConstants(commandBuffer, context->pipelineLayout,
+				VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(MeshBounds),
+				item->bounds);
+		}
+		previous = item;
 
-	VK_CHECK_ERROR(context->textureImage = createImage(context,
-		diffuseTextureHeader.width, diffuseTextureHeader.height, 2,
-		VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL,
-		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-    	VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &context->textureImageMemory));
+		VkDeviceSize wantedOffset = 0;
+		if (item->indirectCommand != DRAW_DIRECT
+			&& !context->firstInstanceDraws) {
+			wantedOffset = (VkDeviceSize) item->indirectCommand
+				* context->instanceCount * sizeof(uint32_t);
+		}
+		if (wantedOffset != instanceOffset) {
+			vkCmdBindVertexBuffers(commandBuffer, 1, 1,
+				&context->visibleInstanceBuffer, &wantedOffset);
+			instanceOffset = wantedOffset;
+		}
 
-	VK_CHECK_ERROR(transitionImageLayout(context, context->textureImage,
-		VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_PREINITIALIZED,
-		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 2));
-	VK_CHECK_ERROR(copyBufferToImage(context, stagingBuffer, context->textureImage,
-		diffuseTextureHeader.width, diffuseTextureHeader.height, 2));
-	VK_CHECK_ERROR(transitionImageLayout(context, context->textureImage,
-		VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 2));
+		if (item->indirectCommand == DRAW_DIRECT) {
+			vkCmdDrawIndexed(commandBuffer, item->indexCount,
+				item->instanceCount, item->firstIndex, item->vertexOffset,
+				item->firstInstance);
+			continue;
+		}
+		VkDeviceSize commandOffset =
+			item->indirectCommand * sizeof(VkDrawIndexedIndirectCommand);
+		if (context->vkCmdDrawIndexedIndirectCount) {
+			context->vkCmdDrawIndexedIndirectCount(commandBuffer,
+				context->indirectBuffer, commandOffset,
+				context->drawCountBuffer, offsetof(CullCounts, drawCount),
+				context->maxDrawCount, sizeof(VkDrawIndexedIndirectCommand));
+		} else {
+			vkCmdDrawIndexedIndirect(commandBuffer, context->indirectBuffer,
+				commandOffset, context->maxDrawCount,
+				sizeof(VkDrawIndexedIndirectCommand));
+		}
+	}
+}
 
-	vkFreeMemory(context->device, stagingBufferMemory, NULL);
-	vkDestroyBuffer(context->device, stagingBuffer, NULL);
-	return 1;
+// The thread pools were reset for the frame in recordFrameCommands()
+static void recordSecondary(void *data) {
+	const RecordJob* const job = data;
+	VkCommandBufferInheritanceInfo inheritanceInfo = {};
+	inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritanceInfo.renderPass = job->renderPass;
+	inheritanceInfo.subpass = 0;
+	inheritanceInfo.framebuffer = job->framebuffer;
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT
+		| VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+	// Secondary command buffers inherit no state from the primary
+	vkBeginCommandBuffer(job->commandBuffer, &beginInfo);
+	vkCmdBindDescriptorSets(job->commandBuffer,
+		VK_PIPELINE_BIND_POINT_GRAPHICS, job->context->pipelineLayout, 0, 1,
+		&job->context->descriptorSet, 0, NULL);
+	recordDrawItems(job->context, job->commandBuffer, job->pipelines,
+		job->items, job->count);
+	vkEndCommandBuffer(job->commandBuffer);
 }
 
-static VkImageView createTextureImageView(const VkContext* const context) {
-	return createImageView(context, context->textureImage,
-		VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_ASPECT_COLOR_BIT, 2);
+// Splits the draws into one secondary command buffer per range, recorded
+// as concurrent jobs. Returns the number of secondary command buffers.
+static uint32_t recordSecondaries(const VkContext* const context,
+								  const VkCommandBuffer* const secondaries,
+								  uint32_t rangeCount,
+								  VkRenderPass renderPass,
+								  VkFramebuffer framebuffer,
+								  const VkPipeline* const pipelines,
+								  const DrawItem* const items,
+								  uint32_t count) {
+
+	RecordJob recordJobs[MAX_RECORD_THREADS];
+	Job jobs[MAX_RECORD_THREADS];
+	JobCounter counter = { 0 };
+	uint32_t chunk = (count + rangeCount - 1) / rangeCount;
+	for (uint32_t r = 0; r < rangeCount; ++r) {
+		uint32_t first = r * chunk;
+		recordJobs[r] = (RecordJob) { context, secondaries[r], renderPass,
+			framebuffer, pipelines, &items[first], MIN(chunk, count - first) };
+		jobs[r] = (Job) { recordSecondary, &recordJobs[r], &counter };
+	}
+	submitJobs(context->jobSystem, jobs, rangeCount);
+	waitForJobs(context->jobSystem, &counter);
+	return rangeCount;
 }
 
-static VkSampler createTextureSampler(const VkContext* const context) {
-	VkSamplerCreateInfo samplerInfo = {};
-	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-	samplerInfo.magFilter = VK_FILTER_LINEAR;
-	samplerInfo.minFilter = VK_FILTER_LINEAR;
-	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	samplerInfo.anisotropyEnable = VK_TRUE;
-	samplerInfo.maxAnisotropy = 16;
-	samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
-	samplerInfo.unnormalizedCoordinates = VK_FALSE;
-	samplerInfo.compareEnable = VK_FALSE;
-	samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
-	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-	samplerInfo.mipLodBias = 0.0f;
-	samplerInfo.minLod = 0.0f;
-	samplerInfo.maxLod = 0.0f;
+// Records the draws inline, or spread over the frame's recording threads
+// when given one secondary command buffer per thread and enough draws to
+// split. The depth prepass's only attachment is depth.
+static void recordRenderPass(const VkContext* const context,
+							 VkCommandBuffer commandBuffer,
+							 const VkCommandBuffer* const secondaries,
+							 VkRenderPass renderPass,
+							 VkFramebuffer framebuffer,
+							 const VkPipeline* const pipelines,
+							 const DrawItem* const items, uint32_t count) {
+
+	VkRenderPassBeginInfo renderPassInfo = {};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	renderPassInfo.renderPass = renderPass;
+	renderPassInfo.framebuffer = framebuffer;
+	renderPassInfo.renderArea.offset = (VkOffset2D) { 0, 0 };
+	renderPassInfo.renderArea.extent = context->renderExtent;
+
+	// Depth follows the color attachments
+	uint32_t colorCount = getColorAttachmentCount(context);
+	VkClearValue clearValues[GBUFFER_ATTACHMENTS + 1] = {};
+	for (uint32_t i = 0; i < colorCount; ++i) {
+		clearValues[i].color = (VkClearColorValue) { { 0.0f, 0.0f, 0.0f,
+			1.0f } };
+	}
+	clearValues[colorCount].depthStencil =
+		(VkClearDepthStencilValue) { 1.0f, 0 };
+
+	int depthOnly = renderPass == context->prepassRenderPass;
+	renderPassInfo.clearValueCount = depthOnly ? 1 : colorCount + 1;
+	renderPassInfo.pClearValues = depthOnly ? &clearValues[colorCount]
+		: clearValues;
+
+	uint32_t rangeCount = MIN(context->recordThreadCount,
+		count / MIN_DRAWS_PER_SECONDARY);
+	if (!secondaries || rangeCount <= 1) {
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+			VK_SUBPASS_CONTENTS_INLINE);
+		vkCmdBindDescriptorSets(commandBuffer,
+			VK_PIPELINE_BIND_POINT_GRAPHICS, context->pipelineLayout, 0, 1,
+			&context->descriptorSet, 0, NULL);
+		recordDrawItems(context, commandBuffer, pipelines, items, count);
+		vkCmdEndRenderPass(commandBuffer);
+		return;
+	}
 
-	VkSampler textureSampler;
-	if (vkCreateSampler(context->device, &samplerInfo, NULL, &textureSampler) != VK_SUCCESS) {
-    	fprintf(stderr, "Failed to create texture sampler.\n");
-		return NULL;
-    }
-	return textureSampler;
+	// Secondaries only need the render pass and framebuffer, so they are
+	// recorded before the pass begins in the primary
+	uint32_t secondaryCount = recordSecondaries(context, secondaries,
+		rangeCount, renderPass, framebuffer, pipelines, items, count);
+	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+		VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+	vkCmdExecuteCommands(commandBuffer, secondaryCount, secondaries);
+	vkCmdEndRenderPass(commandBuffer);
 }
 
-static int createVertexBuffer(VkContext *context) {
-	VkDeviceSize bufferSize = sizeof(CUBE_VERTICES);
-
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-	VK_CHECK_ERROR(stagingBuffer = createBuffer(context, bufferSize,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stagingBufferMemory));
+void addSceneDraws(const VkContext* const context, DrawList *drawList) {
+	// The late occlusion command is drawn by its own pass in recordFrame()
+	uint32_t drawCount = context->cullingMode == CULLING_OCCLUSION ? 1
+		: getDrawCommandCount(context);
+	for (uint32_t i = 0; i < drawCount; ++i) {
+		addIndirectDraw(drawList, context->mesh, i);
+	}
+}
 
-	void* data;
-	vkMapMemory(context->device, stagingBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, CUBE_VERTICES, bufferSize);
-	vkUnmapMemory(context->device, stagingBufferMemory);
+void addInstanceDraws(const VkContext* const context, DrawList *drawList,
+					  const uint32_t* const visibleCounts) {
+	const Mesh* const mesh = context->mesh;
+	for (uint32_t i = 0; i < mesh->lodCount; ++i) {
+		const MeshLod* const lod = &mesh->lods[i];
+		uint32_t count = visibleCounts ? visibleCounts[i]
+			: i ? 0 : context->instanceCount;
+		DrawItem item = { mesh->format, &mesh->bounds, DRAW_DIRECT,
+			lod->indexCount, 1, context->meshGeometry.firstIndex
+			+ lod->firstIndex, 0, context->meshGeometry.vertexOffset };
+		for (uint32_t j = 0; j < count; ++j) {
+			item.firstInstance = i * context->instanceCount + j;
+			if (!addDraw(drawList, &item)) {
+				return;
+			}
+		}
+	}
+}
 
-	VK_CHECK_ERROR(context->vertexBuffer = createBuffer(context, bufferSize,
-		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &context->vertexBufferMemory));
+// Scales the rendered part of the color image up to the whole swap chain
+// image
+static void recordPresentBlit(const VkContext* const context,
+							  VkCommandBuffer commandBuffer,
+							  uint32_t imageIndex) {
+
+	VkImageBlit region = {};
+	region.srcSubresource = (VkImageSubresourceLayers) {
+		VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+	region.srcOffsets[1] = (VkOffset3D) { context->renderExtent.width,
+		context->renderExtent.height, 1 };
+	region.dstSubresource = region.srcSubresource;
+	region.dstOffsets[1] = (VkOffset3D) { context->extent.width,
+		context->extent.height, 1 };
+	vkCmdBlitImage(commandBuffer, context->colorImage,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		context->swapChainImages[imageIndex],
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region, VK_FILTER_LINEAR);
+}
 
-	VK_CHECK_ERROR(copyBuffer(context->device, context->commandPool,
-		context->graphicsQueue, stagingBuffer, context->vertexBuffer,
-		bufferSize));
+static void recordCullPass(VkCommandBuffer commandBuffer, void *passData,
+						   void *frameData) {
 
-	vkFreeMemory(context->device, stagingBufferMemory, NULL);
-	vkDestroyBuffer(context->device, stagingBuffer, NULL);
-	return 1;
+	const FrameRecording* const recording = frameData;
+	recordCullCommands(recording->context, commandBuffer, 0);
 }
 
-static int createIndexBuffer(VkContext *context) {
-	VkDeviceSize bufferSize = sizeof(CUBE_INDICES);
+// Draws the static casters into the cached shadow map
+static void recordShadowCachePass(VkCommandBuffer commandBuffer,
+								  void *passData, void *frameData) {
 
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-	VK_CHECK_ERROR(stagingBuffer = createBuffer(context, bufferSize,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stagingBufferMemory));
+	const VkContext* const context =
+		((const FrameRecording*) frameData)->context;
+	recordShadowFaces(context, commandBuffer, context->shadowCacheRenderPass,
+		context->shadowCacheFramebuffers, 0, context->shadowStaticCount);
+}
 
-	void* data;
-	vkMapMemory(context->device, stagingBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, CUBE_INDICES, bufferSize);
-	vkUnmapMemory(context->device, stagingBufferMemory);
+// Overwrites the whole shadow map with the cached one
+static void recordShadowCopyPass(VkCommandBuffer commandBuffer,
+								 void *passData, void *frameData) {
+
+	const VkContext* const context =
+		((const FrameRecording*) frameData)->context;
+	VkImageCopy region = {};
+	region.srcSubresource = (VkImageSubresourceLayers) {
+		VK_IMAGE_ASPECT_DEPTH_BIT, 0, 0, CUBE_FACES };
+	region.dstSubresource = region.srcSubresource;
+	region.extent = (VkExtent3D) { SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 1 };
+	vkCmdCopyImage(commandBuffer, context->shadowCache,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, context->shadowMap,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+}
 
-	VK_CHECK_ERROR(context->indexBuffer = createBuffer(context, bufferSize,
-		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &context->indexBufferMemory));
+// Adds the dynamic casters on top of the copied static ones
+static void recordShadowPass(VkCommandBuffer commandBuffer, void *passData,
+							 void *frameData) {
 
-	VK_CHECK_ERROR(copyBuffer(context->device, context->commandPool,
-		context->graphicsQueue, stagingBuffer, context->indexBuffer, bufferSize));
+	const VkContext* const context =
+		((const FrameRecording*) frameData)->context;
+	recordShadowFaces(context, commandBuffer, context->shadowRenderPass,
+		context->shadowFramebuffers, context->shadowStaticCount,
+		context->shadowDynamicCount);
+}
 
-	vkFreeMemory(context->device, stagingBufferMemory, NULL);
-	vkDestroyBuffer(context->device, stagingBuffer, NULL);
-	return 1;
+// The prepass draws the same items as the main pass, which then only
+// shades the fragments left at the depth it laid down
+static void recordPrepass(VkCommandBuffer commandBuffer, void *passData,
+						  void *frameData) {
+
+	const FrameRecording* const recording = frameData;
+	const VkContext* const context = recording->context;
+	recordRenderPass(context, commandBuffer, recording->frame->prepassBuffers,
+		context->prepassRenderPass, context->prepassFramebuffer,
+		context->prepassPipelines, recording->drawList->items,
+		recording->drawList->count);
 }
 
-static int createMVPUniformBuffer(VkContext *context) {
-	VkDeviceSize bufferSize = sizeof(MVPMatrices);
+// Looked up once per pass, so the draws index a plain array
+static void getGraphicsPipelines(const VkContext* const context,
+								 VkPipeline *pipelines) {
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i) {
+		pipelines[i] = getPipeline(context->registry,
+			context->graphicsPipelines[i])->pipeline;
+	}
+}
 
-	VK_CHECK_ERROR(context->mvpUniformBuffer = createBuffer(context, bufferSize,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		&context->mvpUniformBufferMemory));
-	return 1;
+static void recordMainPass(VkCommandBuffer commandBuffer, void *passData,
+						   void *frameData) {
+
+	const FrameRecording* const recording = frameData;
+	const VkContext* const context = recording->context;
+	VkPipeline pipelines[VERTEX_FORMAT_COUNT];
+	getGraphicsPipelines(context, pipelines);
+	recordRenderPass(context, commandBuffer,
+		recording->frame->secondaryBuffers, context->renderPass,
+		context->framebuffer, pipelines, recording->drawList->items,
+		recording->drawList->count);
 }
 
-static int createSceneAttributesUniformBuffer(VkContext *context) {
-	VkDeviceSize bufferSize = sizeof(SceneAttributes);
+static void recordPrepassedPass(VkCommandBuffer commandBuffer,
+								void *passData, void *frameData) {
 
-	VK_CHECK_ERROR(context->sceneAttributesUniformBuffer = createBuffer(context,
-		bufferSize,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		&context->sceneAttributesUniformBufferMemory));
-	return 1;
+	const FrameRecording* const recording = frameData;
+	const VkContext* const context = recording->context;
+	recordRenderPass(context, commandBuffer,
+		recording->frame->secondaryBuffers, context->prepassedRenderPass,
+		context->framebuffer, context->equalPipelines,
+		recording->drawList->items, recording->drawList->count);
 }
 
-static VkDescriptorPool createDescriptorPool(const VkContext* const context) {
-	VkDescriptorPoolSize poolSizes[2] = {};
-	poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	poolSizes[0].descriptorCount = 1;
-	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-	poolSizes[1].descriptorCount = 1;
+static void recordDepthPyramidPass(VkCommandBuffer commandBuffer,
+								   void *passData, void *frameData) {
 
-	VkDescriptorPoolCreateInfo poolInfo = {};
-	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	poolInfo.poolSizeCount = sizeof(poolSizes) / sizeof(VkDescriptorPoolSize);
-	poolInfo.pPoolSizes = poolSizes;
-	poolInfo.maxSets = 1;
+	const FrameRecording* const recording = frameData;
+	recordDepthPyramid(recording->context, commandBuffer);
+}
 
-	VkDescriptorPool descriptorPool;
-	if (vkCreateDescriptorPool(context->device, &poolInfo, NULL,
-							   &descriptorPool) != VK_SUCCESS) {
+// Instances visible last frame were drawn by the main pass; the late cull
+// tests the rest against their depth and the late pass draws the ones that
+// became visible
+static void recordLateCullPass(VkCommandBuffer commandBuffer,
+							   void *passData, void *frameData) {
 
-		fprintf(stderr, "Failed to create descriptor pool.\n");
-		return NULL;
-	}
-	return descriptorPool;
+	const FrameRecording* const recording = frameData;
+	recordCullCommands(recording->context, commandBuffer, 1);
 }
 
-static VkDescriptorSet createDescriptorSet(const VkContext* const context) {
+static void recordLatePass(VkCommandBuffer commandBuffer, void *passData,
+						   void *frameData) {
+
+	const VkContext* const context =
+		((const FrameRecording*) frameData)->context;
+	DrawItem lateDraw = {};
+	lateDraw.format = context->mesh->format;
+	lateDraw.bounds = &context->mesh->bounds;
+	lateDraw.indirectCommand = 1;
+	VkPipeline pipelines[VERTEX_FORMAT_COUNT];
+	getGraphicsPipelines(context, pipelines);
+	recordRenderPass(context, commandBuffer, NULL, context->lateRenderPass,
+		context->framebuffer, pipelines, &lateDraw, 1);
+}
 
-	VkDescriptorSetLayout layouts[] = { context->descriptorSetLayout };
-	VkDescriptorSetAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	allocInfo.descriptorPool = context->descriptorPool;
-	allocInfo.descriptorSetCount = 1;
-	allocInfo.pSetLayouts = layouts;
+// Lights each pixel the draw passes left in the G-buffer
+static void recordLightingPass(VkCommandBuffer commandBuffer, void *passData,
+							   void *frameData) {
+
+	const VkContext* const context =
+		((const FrameRecording*) frameData)->context;
+	VkRenderPassBeginInfo renderPassInfo = {};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	renderPassInfo.renderPass = context->lightingRenderPass;
+	renderPassInfo.framebuffer = context->lightingFramebuffer;
+	renderPassInfo.renderArea.offset = (VkOffset2D) { 0, 0 };
+	renderPassInfo.renderArea.extent = context->renderExtent;
+	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+		VK_SUBPASS_CONTENTS_INLINE);
+
+	VkViewport viewport = { 0.0f, 0.0f, context->renderExtent.width,
+		context->renderExtent.height, 0.0f, 1.0f };
+	VkRect2D scissor = { { 0, 0 }, context->renderExtent };
+	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+	VkDescriptorSet descriptorSets[] = { context->descriptorSet,
+		context->gBufferDescriptorSet };
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+		context->lightingPipeline);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+		context->lightingPipelineLayout, 0,
+		sizeof(descriptorSets) / sizeof(VkDescriptorSet), descriptorSets, 0,
+		NULL);
+	vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+	vkCmdEndRenderPass(commandBuffer);
+}
 
-	VkDescriptorSet descriptorSet;
-	if (vkAllocateDescriptorSets(context->device, &allocInfo,
-								 &descriptorSet) != VK_SUCCESS) {
+static void recordBloomPass(VkCommandBuffer commandBuffer, void *passData,
+							void *frameData) {
 
-		fprintf(stderr, "Failed to allocate descriptor set.\n");
-		return NULL;
-	}
+	const FrameRecording* const recording = frameData;
+	recordBloom(recording->context, commandBuffer);
+}
 
-	VkDescriptorBufferInfo mvpBufferInfo = {};
-	mvpBufferInfo.buffer = context->mvpUniformBuffer;
-	mvpBufferInfo.offset = 0;
-	mvpBufferInfo.range = sizeof(MVPMatrices);
+// Adds the bloom to the rendered area and maps it to displayable colors,
+// in place
+static void recordTonemapPass(VkCommandBuffer commandBuffer, void *passData,
+							  void *frameData) {
+
+	const VkContext* const context =
+		((const FrameRecording*) frameData)->context;
+	PostParams params = getPostParams(context);
+	params.level = context->bloomLevels;
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+		context->tonemapPipeline);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+		context->postPipelineLayout, 0, 1, &context->tonemapDescriptorSet, 0,
+		NULL);
+	vkCmdPushConstants(commandBuffer, context->postPipelineLayout,
+		VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PostParams), &params);
+	vkCmdDispatch(commandBuffer,
+		(context->renderExtent.width + POST_WORKGROUP_SIZE - 1)
+		/ POST_WORKGROUP_SIZE,
+		(context->renderExtent.height + POST_WORKGROUP_SIZE - 1)
+		/ POST_WORKGROUP_SIZE, 1);
+}
 
-	VkDescriptorBufferInfo sceneAttributesBufferInfo = {};
-	sceneAttributesBufferInfo.buffer = context->sceneAttributesUniformBuffer;
-	sceneAttributesBufferInfo.offset = 0;
-	sceneAttributesBufferInfo.range = sizeof(SceneAttributes);
+static void recordPresentPass(VkCommandBuffer commandBuffer, void *passData,
+							  void *frameData) {
 
-	VkDescriptorImageInfo imageInfo = {};
-	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	imageInfo.imageView = context->textureImageView;
-	imageInfo.sampler = context->textureSampler;
+	const FrameRecording* const recording = frameData;
+	recordPresentBlit(recording->context, commandBuffer,
+		recording->imageIndex);
+}
 
-	VkWriteDescriptorSet descriptorWrites[3] = {};
-	descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	descriptorWrites[0].dstSet = descriptorSet;
-	descriptorWrites[0].dstBinding = 0;
-	descriptorWrites[0].dstArrayElement = 0;
-	descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	descriptorWrites[0].descriptorCount = 1;
-	descriptorWrites[0].pBufferInfo = &mvpBufferInfo;
+uint32_t recordFrame(const VkContext* const context,
+					 const FrameResources* const frame, uint32_t imageIndex,
+					 const DrawList* const drawList) {
+	// An unchanged shadow map is left as it is
+	RenderGraph *graph = context->frameGraph;
+	int shadows = context->shadowMapDirty;
+	setGraphPassEnabled(graph, FRAME_PASS_SHADOW_CACHE,
+		shadows && context->shadowStaticDirty);
+	setGraphPassEnabled(graph, FRAME_PASS_SHADOW_COPY, shadows);
+	setGraphPassEnabled(graph, FRAME_PASS_SHADOW, shadows);
+	setGraphPassEnabled(graph, FRAME_PASS_PREPASS, context->depthPrepass);
+	setGraphPassEnabled(graph, FRAME_PASS_MAIN, !context->depthPrepass);
+	setGraphPassEnabled(graph, FRAME_PASS_PREPASSED, context->depthPrepass);
+	setGraphImage(graph, FRAME_SWAP_CHAIN_IMAGE,
+		context->swapChainImages[imageIndex]);
+
+	// Each batch gets the next command buffer of its queue's pool
+	uint32_t batchCount = planRenderGraph(graph);
+	VkCommandBuffer commandBuffers[MAX_GRAPH_BATCHES];
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	for (uint32_t i = 0; i < batchCount; ++i) {
+		commandBuffers[i] = frame->commandBuffers[graph->batches[i].queue][i];
+		vkBeginCommandBuffer(commandBuffers[i], &beginInfo);
+	}
+	if (!batchCount) {
+		return 0;
+	}
 
-	descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	descriptorWrites[1].dstSet = descriptorSet;
-	descriptorWrites[1].dstBinding = 1;
-	descriptorWrites[1].dstArrayElement = 0;
-	descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-	descriptorWrites[1].descriptorCount = 1;
-	descriptorWrites[1].pImageInfo = &imageInfo;
+	// The frame is timed from the start of its first batch to the end of
+	// its last
+	if (context->timestampPool) {
+		vkCmdResetQueryPool(commandBuffers[0], context->timestampPool,
+			frame->timestampQuery, 2);
+		vkCmdWriteTimestamp(commandBuffers[0],
+			VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, context->timestampPool,
+			frame->timestampQuery);
+	}
 
-	descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	descriptorWrites[2].dstSet = descriptorSet;
-	descriptorWrites[2].dstBinding = 2;
-	descriptorWrites[2].dstArrayElement = 0;
-	descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	descriptorWrites[2].descriptorCount = 1;
-	descriptorWrites[2].pBufferInfo = &sceneAttributesBufferInfo;
+	FrameRecording recording = { context, frame, imageIndex, drawList };
+	executeRenderGraph(graph, commandBuffers, &recording);
 
-	uint32_t descriptorWriteCount =
-		sizeof(descriptorWrites) / sizeof(VkWriteDescriptorSet);
-	vkUpdateDescriptorSets(context->device, descriptorWriteCount,
-		descriptorWrites, 0, NULL);
+	if (context->timestampPool) {
+		vkCmdWriteTimestamp(commandBuffers[batchCount - 1],
+			VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, context->timestampPool,
+			frame->timestampQuery + 1);
+	}
+	for (uint32_t i = 0; i < batchCount; ++i) {
+		if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
+			fprintf(stderr, "Failed to record command buffer.\n");
+			return 0;
+		}
+	}
+	return batchCount;
+}
 
-	return descriptorSet;
+// Points the context at the graph's attachments
+static void getFrameGraphImages(VkContext *context) {
+	const RenderGraph* const graph = context->frameGraph;
+	context->colorImage = graph->resources[FRAME_COLOR].handle;
+	context->colorImageView = graph->resources[FRAME_COLOR].view;
+	context->depthImage = graph->resources[FRAME_DEPTH].handle;
+	context->depthImageView = graph->resources[FRAME_DEPTH].view;
 }
 
-static int createCommandBuffers(VkContext *context) {
+// Declares the frame's passes and what they access, then creates the
+// color and depth attachments, and the G-buffer of deferred shading.
+// Passes a culling or shading mode doesn't run access nothing, so they are
+// never recorded.
+static int createFrameGraph(VkContext *context) {
+	// The color image is rendered to, post-processed in place, then
+	// blitted with filtering into the swap chain image
+	VkFormatProperties properties;
+	vkGetPhysicalDeviceFormatProperties(context->physicalDevice, HDR_FORMAT,
+		&properties);
+	VkFormatFeatureFlags colorFeatures =
+		VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT
+		| VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT | VK_FORMAT_FEATURE_BLIT_SRC_BIT
+		| VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+	if ((properties.optimalTilingFeatures & colorFeatures) != colorFeatures) {
+		fprintf(stderr, "The HDR color format can't be post-processed and "
+			"blitted.\n");
+		return 0;
+	}
+	vkGetPhysicalDeviceFormatProperties(context->physicalDevice,
+		context->surfaceFormat.format, &properties);
+	if (!(properties.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_DST_BIT)) {
+		fprintf(stderr, "The swap chain format can't be blitted to.\n");
+		return 0;
+	}
+	VkFormat depthFormat = findDepthFormat(context);
+	if (depthFormat == VK_FORMAT_UNDEFINED) {
+		return 0;
+	}
+
+	RenderGraph *graph = malloc(sizeof(RenderGraph));
+	if (!graph) {
+		fprintf(stderr, "Failed to allocate the frame graph.\n");
+		return 0;
+	}
+	context->frameGraph = graph;
+	initRenderGraph(graph, context->device, context->physicalDevice);
+	graph->extent = context->extent;
+
+	int occlusion = context->cullingMode == CULLING_OCCLUSION;
+	int deferred = context->shadingMode == SHADING_DEFERRED;
+	addTransientImage(graph, HDR_FORMAT,
+		VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT
+		| VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+		VK_IMAGE_ASPECT_COLOR_BIT);
+	addTransientImage(graph, depthFormat,
+		VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+		| (occlusion || deferred ? VK_IMAGE_USAGE_SAMPLED_BIT : 0),
+		VK_IMAGE_ASPECT_DEPTH_BIT);
+	// The acquire semaphore is waited for at the transfer stage
+	VkImageSubresourceRange range = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0,
+		1 };
+	addGraphImage(graph, NULL, range, VK_IMAGE_LAYOUT_UNDEFINED,
+		VK_PIPELINE_STAGE_TRANSFER_BIT);
+	range = (VkImageSubresourceRange) { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0,
+		CUBE_FACES };
+	addGraphImage(graph, context->shadowCache, range,
+		VK_IMAGE_LAYOUT_UNDEFINED, 0);
+	addGraphImage(graph, context->shadowMap, range,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+	range = (VkImageSubresourceRange) { VK_IMAGE_ASPECT_COLOR_BIT, 0,
+		context->depthPyramidLevels, 0, 1 };
+	addGraphImage(graph, context->depthPyramid, range,
+		VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+	addGraphBuffer(graph);
+	range.levelCount = context->bloomLevels;
+	addGraphImage(graph, context->bloomImage, range,
+		VK_IMAGE_LAYOUT_UNDEFINED, 0);
+	if (deferred) {
+		for (uint32_t i = 0; i < GBUFFER_ATTACHMENTS; ++i) {
+			addTransientImage(graph, GBUFFER_FORMATS[i],
+				VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+				| VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
+		}
+	}
 
-	VkCommandBufferAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	allocInfo.commandPool = context->commandPool;
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	allocInfo.commandBufferCount = context->imageViewCount;
+	addGraphPass(graph, "cull", recordCullPass, NULL);
+	addGraphPass(graph, "shadow cache", recordShadowCachePass, NULL);
+	addGraphPass(graph, "shadow copy", recordShadowCopyPass, NULL);
+	addGraphPass(graph, "shadow", recordShadowPass, NULL);
+	addGraphPass(graph, "depth prepass", recordPrepass, NULL);
+	addGraphPass(graph, "main", recordMainPass, NULL);
+	addGraphPass(graph, "prepassed main", recordPrepassedPass, NULL);
+	addGraphPass(graph, "depth pyramid", recordDepthPyramidPass, NULL);
+	addGraphPass(graph, "late cull", recordLateCullPass, NULL);
+	addGraphPass(graph, "late", recordLatePass, NULL);
+	addGraphPass(graph, "lighting", recordLightingPass, NULL);
+	addGraphPass(graph, "bloom", recordBloomPass, NULL);
+	addGraphPass(graph, "tonemap", recordTonemapPass, NULL);
+	addGraphPass(graph, "present", recordPresentPass, NULL);
+
+	// The frame's post-processing can then overlap the next frame's
+	// passes up to its first use of the color image
+	if (context->asyncCompute) {
+		setGraphQueues(graph, context->queueFamilies, MAX_GRAPH_QUEUES);
+		setGraphPassQueue(graph, FRAME_PASS_BLOOM, FRAME_QUEUE_COMPUTE);
+		setGraphPassQueue(graph, FRAME_PASS_TONEMAP, FRAME_QUEUE_COMPUTE);
+	}
 
-	context->commandBuffers = malloc(context->imageViewCount * sizeof(VkCommandBuffer));
-	if (vkAllocateCommandBuffers(context->device, &allocInfo,
-								 context->commandBuffers) != VK_SUCCESS) {
+	VkPipelineStageFlags fragmentTests =
+		VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+		| VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	VkAccessFlags depthAccess = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+		| VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	VkAccessFlags colorAccess = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT
+		| VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	VkAccessFlags cullAccess = VK_ACCESS_SHADER_READ_BIT
+		| VK_ACCESS_SHADER_WRITE_BIT;
+	int gpuCulling = isGpuCulling(context);
+	if (gpuCulling) {
+		useGraphResource(graph, FRAME_PASS_CULL, FRAME_CULL_RESULTS,
+			VK_PIPELINE_STAGE_TRANSFER_BIT
+			| VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_ACCESS_TRANSFER_WRITE_BIT | cullAccess, 0, 0);
+	}
 
-		fprintf(stderr, "Failed to allocate command buffers.\n");
-		free(context->commandBuffers);
-		context->commandBuffers = NULL;
-		return 0;
+	useGraphResource(graph, FRAME_PASS_SHADOW_CACHE, FRAME_SHADOW_CACHE,
+		fragmentTests, depthAccess, VK_IMAGE_LAYOUT_UNDEFINED,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+	useGraphResource(graph, FRAME_PASS_SHADOW_COPY, FRAME_SHADOW_CACHE,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 0);
+	useGraphResource(graph, FRAME_PASS_SHADOW_COPY, FRAME_SHADOW_MAP,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0);
+	useGraphResource(graph, FRAME_PASS_SHADOW, FRAME_SHADOW_MAP,
+		fragmentTests, depthAccess, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+	// Without occlusion culling the main pass is the last to draw, and
+	// leaves the color attachments for post-processing or the lighting
+	// pass
+	uint32_t colorCount = getColorAttachmentCount(context);
+	VkImageLayout drawnLayout = deferred
+		? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+	VkImageLayout colorLayout = occlusion
+		? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : drawnLayout;
+	FramePass drawPasses[] = { FRAME_PASS_PREPASS, FRAME_PASS_MAIN,
+		FRAME_PASS_PREPASSED, FRAME_PASS_LATE };
+	for (uint32_t i = 0; i < sizeof(drawPasses) / sizeof(FramePass); ++i) {
+		FramePass pass = drawPasses[i];
+		if (pass == FRAME_PASS_LATE && !occlusion) {
+			continue;
+		}
+		int loadDepth = pass == FRAME_PASS_PREPASSED
+			|| pass == FRAME_PASS_LATE;
+		useGraphResource(graph, pass, FRAME_DEPTH, fragmentTests,
+			depthAccess, loadDepth
+			? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+			: VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+		if (gpuCulling) {
+			useGraphResource(graph, pass, FRAME_CULL_RESULTS,
+				VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT
+				| VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+				VK_ACCESS_INDIRECT_COMMAND_READ_BIT
+				| VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, 0, 0);
+		}
+		if (pass == FRAME_PASS_PREPASS) {
+			continue;
+		}
+		int late = pass == FRAME_PASS_LATE;
+		for (uint32_t j = 0; j < colorCount; ++j) {
+			useGraphResource(graph, pass,
+				deferred ? FRAME_GBUFFER_ALBEDO + j : FRAME_COLOR,
+				VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, colorAccess,
+				late ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+				: VK_IMAGE_LAYOUT_UNDEFINED,
+				late ? drawnLayout : colorLayout);
+		}
+		if (!deferred) {
+			useGraphResource(graph, pass, FRAME_SHADOW_MAP,
+				VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+				VK_ACCESS_SHADER_READ_BIT,
+				VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 0);
+		}
 	}
 
-	for (uint32_t i = 0; i < context->imageViewCount; i++) {
-		VkCommandBufferBeginInfo beginInfo = {};
-		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-		beginInfo.pInheritanceInfo = NULL; // Optional
+	// Phase 0 tests against last frame's pyramid, phase 1 against this
+	// frame's
+	if (occlusion) {
+		useGraphResource(graph, FRAME_PASS_CULL, FRAME_DEPTH_PYRAMID,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+			VK_IMAGE_LAYOUT_GENERAL, 0);
+		useGraphResource(graph, FRAME_PASS_DEPTH_PYRAMID, FRAME_DEPTH,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+			VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, 0);
+		useGraphResource(graph, FRAME_PASS_DEPTH_PYRAMID, FRAME_DEPTH_PYRAMID,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, cullAccess,
+			VK_IMAGE_LAYOUT_GENERAL, 0);
+		useGraphResource(graph, FRAME_PASS_LATE_CULL, FRAME_DEPTH_PYRAMID,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+			VK_IMAGE_LAYOUT_GENERAL, 0);
+		useGraphResource(graph, FRAME_PASS_LATE_CULL, FRAME_CULL_RESULTS,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, cullAccess, 0, 0);
+	}
 
-		vkBeginCommandBuffer(context->commandBuffers[i], &beginInfo);
+	// Lights the G-buffer into the color image, in place of the main pass
+	if (deferred) {
+		for (uint32_t i = 0; i < GBUFFER_ATTACHMENTS; ++i) {
+			useGraphResource(graph, FRAME_PASS_LIGHTING,
+				FRAME_GBUFFER_ALBEDO + i,
+				VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+				VK_ACCESS_SHADER_READ_BIT,
+				VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 0);
+		}
+		useGraphResource(graph, FRAME_PASS_LIGHTING, FRAME_DEPTH,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+			VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, 0);
+		useGraphResource(graph, FRAME_PASS_LIGHTING, FRAME_SHADOW_MAP,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 0);
+		useGraphResource(graph, FRAME_PASS_LIGHTING, FRAME_COLOR,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_GENERAL);
+	}
 
-		VkRenderPassBeginInfo renderPassInfo = {};
-		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-		renderPassInfo.renderPass = context->renderPass;
-		renderPassInfo.framebuffer = context->swapChainFramebuffers[i];
-		renderPassInfo.renderArea.offset = (VkOffset2D) { 0, 0 };
-		renderPassInfo.renderArea.extent = context->extent;
+	useGraphResource(graph, FRAME_PASS_BLOOM, FRAME_COLOR,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+		VK_IMAGE_LAYOUT_GENERAL, 0);
+	useGraphResource(graph, FRAME_PASS_BLOOM, FRAME_BLOOM,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, cullAccess,
+		VK_IMAGE_LAYOUT_GENERAL, 0);
+	useGraphResource(graph, FRAME_PASS_TONEMAP, FRAME_BLOOM,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+		VK_IMAGE_LAYOUT_GENERAL, 0);
+	useGraphResource(graph, FRAME_PASS_TONEMAP, FRAME_COLOR,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, cullAccess,
+		VK_IMAGE_LAYOUT_GENERAL, 0);
+
+	useGraphResource(graph, FRAME_PASS_PRESENT, FRAME_COLOR,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 0);
+	useGraphResource(graph, FRAME_PASS_PRESENT, FRAME_SWAP_CHAIN_IMAGE,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0);
+	setGraphOutput(graph, FRAME_SWAP_CHAIN_IMAGE,
+		VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+
+	VK_CHECK_ERROR(allocateGraphImages(graph));
+	getFrameGraphImages(context);
+	return 1;
+}
 
-		VkClearValue clearValues[] = { {}, {} };
-		clearValues[0].color = (VkClearColorValue) { 0.0f, 0.0f, 0.0f, 1.0f };
-		clearValues[1].depthStencil = (VkClearDepthStencilValue) { 1.0f, 0 };
+// Command buffers are recorded every frame, so each frame in flight gets
+// transient pools that are reset as a whole before recording. Any batch
+// of the frame graph may run on the compute queue with async compute.
+static int createFrameResources(VkContext *context) {
+	uint32_t queueCount = context->asyncCompute ? MAX_GRAPH_QUEUES : 1;
+	for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+		FrameResources *frame = &context->frames[i];
+		frame->timestampQuery = 2 * i;
+
+		VkCommandPoolCreateInfo poolInfo = {};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		VkCommandBufferAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = MAX_GRAPH_BATCHES;
+		for (uint32_t q = 0; q < queueCount; ++q) {
+			poolInfo.queueFamilyIndex = context->queueFamilies[q];
+			if (vkCreateCommandPool(context->device, &poolInfo, NULL,
+									&frame->commandPools[q]) != VK_SUCCESS) {
+				fprintf(stderr, "Failed to create frame command pool.\n");
+				return 0;
+			}
+			allocInfo.commandPool = frame->commandPools[q];
+			if (vkAllocateCommandBuffers(context->device, &allocInfo,
+					frame->commandBuffers[q]) != VK_SUCCESS) {
+				fprintf(stderr, "Failed to allocate frame command "
+					"buffers.\n");
+				return 0;
+			}
+		}
 
-		renderPassInfo.clearValueCount = sizeof(clearValues) / sizeof(VkClearValue);
-		renderPassInfo.pClearValues = clearValues;
+		// Recording threads only record the graphics passes' draws
+		poolInfo.queueFamilyIndex = context->queueFamilies[FRAME_QUEUE_GRAPHICS];
+		allocInfo.commandBufferCount = 1;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		for (uint32_t t = 0; t < context->recordThreadCount; ++t) {
+			if (vkCreateCommandPool(context->device, &poolInfo, NULL,
+									&frame->threadPools[t]) != VK_SUCCESS) {
+				fprintf(stderr, "Failed to create thread command pool.\n");
+				return 0;
+			}
+			allocInfo.commandPool = frame->threadPools[t];
+			if (vkAllocateCommandBuffers(context->device, &allocInfo,
+					&frame->secondaryBuffers[t]) != VK_SUCCESS
+				|| vkAllocateCommandBuffers(context->device, &allocInfo,
+					&frame->prepassBuffers[t]) != VK_SUCCESS) {
+				fprintf(stderr, "Failed to allocate secondary command "
+					"buffer.\n");
+				return 0;
+			}
+		}
 
-		vkCmdBeginRenderPass(context->commandBuffers[i], &renderPassInfo,
-			VK_SUBPASS_CONTENTS_INLINE);
-		vkCmdBindPipeline(context->commandBuffers[i],
-			VK_PIPELINE_BIND_POINT_GRAPHICS, context->graphicsPipeline);
-
-		VkBuffer vertexBuffers[] = { context->vertexBuffer };
-		VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(context->commandBuffers[i], 0, 1, vertexBuffers,
-			offsets);
-		vkCmdBindIndexBuffer(context->commandBuffers[i], context->indexBuffer,
-			0, VK_INDEX_TYPE_UINT16);
-		vkCmdBindDescriptorSets(context->commandBuffers[i],
-			VK_PIPELINE_BIND_POINT_GRAPHICS, context->pipelineLayout, 0, 1,
-			&context->descriptorSet, 0, NULL);
-		vkCmdDrawIndexed(context->commandBuffers[i],
-			sizeof(CUBE_INDICES) / sizeof(uint16_t), 1, 0, 0, 0);
+		// The swap chain only takes binary semaphores
+		VkSemaphoreCreateInfo semaphoreInfo = {};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		if (vkCreateSemaphore(context->device, &semaphoreInfo, NULL,
+				&frame->imageAvailableSemaphore) != VK_SUCCESS
+			|| vkCreateSemaphore(context->device, &semaphoreInfo, NULL,
+				&frame->renderFinishedSemaphore) != VK_SUCCESS) {
 
-		vkCmdEndRenderPass(context->commandBuffers[i]);
-		if (vkEndCommandBuffer(context->commandBuffers[i]) != VK_SUCCESS) {
-			fprintf(stderr, "Failed to record command buffer.\n");
+			fprintf(stderr, "Failed to create frame synchronization "
+				"objects.\n");
 			return 0;
 		}
 	}
 	return 1;
 }
 
-static int createSemaphores(VkContext *context) {
-	VkSemaphoreCreateInfo semaphoreInfo = {};
-	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-	if (vkCreateSemaphore(context->device, &semaphoreInfo, NULL,
-						  &context->imageAvailableSemaphore) != VK_SUCCESS ||
-		vkCreateSemaphore(context->device, &semaphoreInfo, NULL,
-						  &context->renderFinishedSemaphore) != VK_SUCCESS) {
-
-		fprintf(stderr, "Failed to create semaphores.\n");
+static int createScheduler(VkContext *context) {
+	VkQueue queues[FRAME_QUEUE_COUNT];
+	for (uint32_t i = 0; i < FRAME_QUEUE_COUNT; ++i) {
+		vkGetDeviceQueue(context->device, context->queueFamilies[i], 0,
+			&queues[i]);
+	}
+	vkGetDeviceQueue(context->device,
+		context->queueFamilies[FRAME_QUEUE_TRANSFER],
+		getGraphicsQueueCount(context) - 1, &queues[FRAME_QUEUE_TRANSFER]);
+
+	context->scheduler = malloc(sizeof(QueueScheduler));
+	context->destructionQueue = malloc(sizeof(DestructionQueue));
+	if (context->destructionQueue) {
+		initDestructionQueue(context->destructionQueue, context->device,
+			context->scheduler);
+	}
+	if (!context->scheduler || !context->destructionQueue) {
+		fprintf(stderr, "Failed to allocate the queue scheduler.\n");
 		return 0;
 	}
-	return 1;
+	return initQueueScheduler(context->scheduler, context->device, queues,
+		FRAME_QUEUE_COUNT, context->timelineSemaphores);
+}
+
+// Destroys the attachments and everything else sized to the swap chain.
+// The frame graph keeps its passes for new attachments.
+static void destroySizedResources(const VkContext* const context) {
+	VK_DESTROY(context->device, context->framebuffer, vkDestroyFramebuffer);
+	VK_DESTROY(context->device, context->prepassFramebuffer,
+		vkDestroyFramebuffer);
+	VK_DESTROY(context->device, context->lightingFramebuffer,
+		vkDestroyFramebuffer);
+
+	VK_DESTROY(context->device, context->depthPyramidSampler, vkDestroySampler);
+	for (uint32_t i = 0; i < context->depthPyramidLevels; ++i) {
+		VK_DESTROY(context->device, context->depthPyramidMipViews[i],
+			vkDestroyImageView);
+	}
+	VK_DESTROY(context->device, context->depthPyramidView, vkDestroyImageView);
+	VK_DESTROY(context->device, context->depthPyramidMemory, vkFreeMemory);
+	VK_DESTROY(context->device, context->depthPyramid, vkDestroyImage);
+
+	for (uint32_t i = 0; i < context->bloomLevels; ++i) {
+		VK_DESTROY(context->device, context->bloomMipViews[i],
+			vkDestroyImageView);
+	}
+	VK_DESTROY(context->device, context->bloomImageView, vkDestroyImageView);
+	VK_DESTROY(context->device, context->bloomImageMemory, vkFreeMemory);
+	VK_DESTROY(context->device, context->bloomImage, vkDestroyImage);
+
+	if (context->frameGraph) {
+		releaseGraphImages(context->frameGraph);
+	}
 }
 
-int initVulkan(GLFWwindow *window, VkContext *context, int vsync) {
-	VK_CHECK_ERROR(context->instance = createInstance());
+int initVulkan(GLFWwindow *window, VkContext *context, const Mesh* const mesh,
+			   const InstanceData* const instances, uint32_t instanceCount,
+			   CullingMode cullingMode, ShadingMode shadingMode,
+			   int asyncCompute, int vsync, JobSystem *jobSystem,
+			   uint32_t recordThreads, uint32_t maxLights) {
+
+	context->mesh = mesh;
+	context->instances = instances;
+	context->instanceCount = instanceCount;
+	context->cullingMode = cullingMode;
+	context->shadingMode = shadingMode;
+	context->asyncCompute = asyncCompute;
+	context->vsync = vsync;
+	context->jobSystem = jobSystem;
+	context->maxLights = maxLights;
+	context->recordThreadCount = MIN(MAX(recordThreads, 1),
+		MAX_RECORD_THREADS);
+	VK_CHECK_ERROR(context->instance = createInstance(context));
 	VK_CHECK_ERROR(context->surface = createSurface(context->instance, window));
 	VK_CHECK_ERROR(context->physicalDevice = pickPhysicalDevice(context));
 
 	int queueFamilyIndex;
 	VK_CHECK_ERROR(context->device = createDevice(context, &queueFamilyIndex));
+	VK_CHECK_ERROR(context->registry = malloc(sizeof(ResourceRegistry)));
+	initResourceRegistry(context->registry, context->device);
 
 	int width, height;
 	glfwGetWindowSize(window, &width, &height);
-	VK_CHECK_ERROR(createSwapChain(context, width, height, vsync));
-
-	VK_CHECK_ERROR(createImageViews(context));
-	VK_CHECK_ERROR(context->renderPass = createRenderPass(context));
+	VK_CHECK_ERROR(createSwapChain(context, width, height));
+
+	VK_CHECK_ERROR(getSwapChainImages(context));
+	context->renderExtent = context->extent;
+	// Occlusion culling's late pass draws after the first pass, which the
+	// depth prepass doesn't cover
+	int last = cullingMode != CULLING_OCCLUSION;
+	VK_CHECK_ERROR(context->renderPass = createRenderPass(context, 1, last,
+		0));
+	VK_CHECK_ERROR(context->prepassedRenderPass = createRenderPass(context, 1,
+		last, 1));
+	if (!last) {
+		VK_CHECK_ERROR(context->lateRenderPass = createRenderPass(context, 0,
+			1, 0));
+	}
+	VK_CHECK_ERROR(context->prepassRenderPass =
+		createPrepassRenderPass(context));
+	int deferred = shadingMode == SHADING_DEFERRED;
+	if (deferred) {
+		VK_CHECK_ERROR(context->lightingRenderPass =
+			createLightingRenderPass(context));
+	}
+	VK_CHECK_ERROR(context->shadowFormat = findShadowFormat(context));
+	VK_CHECK_ERROR(context->shadowCacheRenderPass = createShadowRenderPass(
+		context, 1));
+	VK_CHECK_ERROR(context->shadowRenderPass = createShadowRenderPass(context,
+		0));
 	VK_CHECK_ERROR(context->descriptorSetLayout = createDescriptorSetLayout(context));
-	VK_CHECK_ERROR(createGraphicsPipeline(context));
+	VK_CHECK_ERROR(createPipelineLayout(context));
+	VK_CHECK_ERROR(createShadowPipelineLayout(context));
+	VK_CHECK_ERROR(createShaderModules(context));
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i) {
+		PipelineResource pipeline;
+		VK_CHECK_ERROR(pipeline.pipeline = createGraphicsPipeline(context, i,
+			DEPTH_MODE_LESS));
+		context->graphicsPipelines[i] = addPipeline(context->registry,
+			&pipeline);
+		VK_CHECK_ERROR(!IS_NULL_HANDLE(context->graphicsPipelines[i]));
+		VK_CHECK_ERROR(context->prepassPipelines[i] =
+			createGraphicsPipeline(context, i, DEPTH_MODE_PREPASS));
+		VK_CHECK_ERROR(context->equalPipelines[i] =
+			createGraphicsPipeline(context, i, DEPTH_MODE_EQUAL));
+		VK_CHECK_ERROR(context->shadowPipelines[i] =
+			createShadowPipeline(context, i));
+	}
+	if (isGpuCulling(context)) {
+		VK_CHECK_ERROR(createCullPipeline(context));
+	}
+	if (cullingMode == CULLING_OCCLUSION) {
+		VK_CHECK_ERROR(createDepthReducePipeline(context));
+	}
+	if (deferred) {
+		VK_CHECK_ERROR(createLightingPipeline(context));
+	}
+	VK_CHECK_ERROR(createPostPipelines(context));
 	VK_CHECK_ERROR(context->commandPool = createCommandPool(context));
 
 	vkGetDeviceQueue(context->device, queueFamilyIndex, 0,
 		&context->presentQueue);
-	vkGetDeviceQueue(context->device, queueFamilyIndex, 0,
-		&context->graphicsQueue);
+	VK_CHECK_ERROR(createScheduler(context));
 
-	VK_CHECK_ERROR(createDepthResources(context));
+	VK_CHECK_ERROR(createTimestampPool(context));
+	if (cullingMode == CULLING_OCCLUSION) {
+		VK_CHECK_ERROR(createDepthPyramid(context));
+	}
+	VK_CHECK_ERROR(createBloomImage(context));
+	VK_CHECK_ERROR(createShadowMaps(context));
+	VK_CHECK_ERROR(createFrameGraph(context));
 	VK_CHECK_ERROR(createFramebuffers(context));
 
 	VK_CHECK_ERROR(createTextureImage(context));
-	VK_CHECK_ERROR(context->textureImageView = createTextureImageView(context));
-	VK_CHECK_ERROR(context->textureSampler = createTextureSampler(context));
-
-	VK_CHECK_ERROR(createVertexBuffer(context));
-	VK_CHECK_ERROR(createIndexBuffer(context));
+	VK_CHECK_ERROR(createTextureSampler(context));
+
+	VK_CHECK_ERROR(addPoolMesh(context, mesh, &context->meshGeometry));
+	VK_CHECK_ERROR(createInstanceBuffer(context));
+	VK_CHECK_ERROR(createVisibleInstanceBuffers(context));
+	if (cullingMode == CULLING_MESHLETS) {
+		VK_CHECK_ERROR(createMeshletBuffer(context));
+	} else if (cullingMode == CULLING_OCCLUSION) {
+		VK_CHECK_ERROR(createVisibilityBuffer(context));
+	}
 	VK_CHECK_ERROR(createMVPUniformBuffer(context));
 	VK_CHECK_ERROR(createSceneAttributesUniformBuffer(context));
+	VK_CHECK_ERROR(createLightBuffers(context));
+	VK_CHECK_ERROR(createShadowCasterBuffer(context));
 
 	VK_CHECK_ERROR(context->descriptorPool = createDescriptorPool(context));
 	VK_CHECK_ERROR(context->descriptorSet = createDescriptorSet(context));
+	if (isGpuCulling(context)) {
+		VK_CHECK_ERROR(context->cullDescriptorSet =
+			createCullDescriptorSet(context));
+	}
+	if (cullingMode == CULLING_OCCLUSION) {
+		VK_CHECK_ERROR(createDepthReduceDescriptorSets(context));
+	}
+	if (deferred) {
+		VK_CHECK_ERROR(createGBufferDescriptorSet(context));
+	}
+	VK_CHECK_ERROR(createPostDescriptorSets(context));
 
-	VK_CHECK_ERROR(createCommandBuffers(context));
-	VK_CHECK_ERROR(createSemaphores(context));
+	VK_CHECK_ERROR(createFrameResources(context));
+
+	return 1;
+}
 
+int resizeSwapChain(GLFWwindow *window, VkContext *context) {
+	int width, height;
+	glfwGetFramebufferSize(window, &width, &height);
+
+	// Pipelines take their viewport and scissor at record time, so only
+	// the swap chain and what is sized to it are recreated
+	vkDeviceWaitIdle(context->device);
+	destroySizedResources(context);
+	context->framebuffer = NULL;
+	context->prepassFramebuffer = NULL;
+	context->lightingFramebuffer = NULL;
+	context->depthPyramidSampler = NULL;
+	context->depthPyramidLevels = 0;
+	context->depthPyramidView = NULL;
+	context->depthPyramidMemory = NULL;
+	context->depthPyramid = NULL;
+	memset(context->bloomMipViews, 0, sizeof(context->bloomMipViews));
+	context->bloomLevels = 0;
+	context->bloomImageView = NULL;
+	context->bloomImageMemory = NULL;
+	context->bloomImage = NULL;
+
+	VK_CHECK_ERROR(createSwapChain(context, width, height));
+	VK_CHECK_ERROR(getSwapChainImages(context));
+	context->renderExtent = context->extent;
+	RenderGraph *graph = context->frameGraph;
+	graph->extent = context->extent;
+	VK_CHECK_ERROR(allocateGraphImages(graph));
+	getFrameGraphImages(context);
+	if (context->cullingMode == CULLING_OCCLUSION) {
+		VK_CHECK_ERROR(createDepthPyramid(context));
+		graph->resources[FRAME_DEPTH_PYRAMID].range.levelCount =
+			context->depthPyramidLevels;
+		setGraphImage(graph, FRAME_DEPTH_PYRAMID, context->depthPyramid);
+		writeDepthPyramidDescriptors(context);
+	}
+	if (context->shadingMode == SHADING_DEFERRED) {
+		writeGBufferDescriptors(context);
+	}
+	VK_CHECK_ERROR(createBloomImage(context));
+	graph->resources[FRAME_BLOOM].range.levelCount = context->bloomLevels;
+	setGraphImage(graph, FRAME_BLOOM, context->bloomImage);
+	writePostDescriptors(context);
+	VK_CHECK_ERROR(createFramebuffers(context));
+	context->swapChainOutOfDate = 0;
 	return 1;
 }
 
@@ -1656,67 +5143,185 @@ void destroyVulkan(const VkContext* const context) {
 	if (context->device) {
 		vkDeviceWaitIdle(context->device);
 	}
+	// Before the pools its command buffers come from
+	if (context->destructionQueue) {
+		destroyDestructionQueue(context->destructionQueue);
+		free(context->destructionQueue);
+	}
+	if (context->registry) {
+		destroyResourceRegistry(context->registry);
+		free(context->registry);
+	}
 
-	VK_DESTROY(context->device, context->imageAvailableSemaphore,
-		vkDestroySemaphore);
-	VK_DESTROY(context->device, context->renderFinishedSemaphore,
-		vkDestroySemaphore);
-
-	if (context->device && context->commandPool && context->imageViewCount
-		&& context->commandBuffers) {
-
-		vkFreeCommandBuffers(context->device, context->commandPool,
-			context->imageViewCount, context->commandBuffers);
+	// Destroying the pools frees their command buffers
+	for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+		const FrameResources* const frame = &context->frames[i];
+		VK_DESTROY(context->device, frame->imageAvailableSemaphore,
+			vkDestroySemaphore);
+		VK_DESTROY(context->device, frame->renderFinishedSemaphore,
+			vkDestroySemaphore);
+		for (uint32_t q = 0; q < MAX_GRAPH_QUEUES; ++q) {
+			VK_DESTROY(context->device, frame->commandPools[q],
+				vkDestroyCommandPool);
+		}
+		for (uint32_t t = 0; t < MAX_RECORD_THREADS; ++t) {
+			VK_DESTROY(context->device, frame->threadPools[t],
+				vkDestroyCommandPool);
+		}
 	}
-	free(context->commandBuffers);
 
 	VK_DESTROY(context->device, context->descriptorPool, vkDestroyDescriptorPool);
 
-	VK_DESTROY(context->device, context->sceneAttributesUniformBufferMemory, vkFreeMemory);
-	VK_DESTROY(context->device, context->sceneAttributesUniformBuffer, vkDestroyBuffer);
+	VK_DESTROY(context->device, context->lightBufferMemory, vkFreeMemory);
+	VK_DESTROY(context->device, context->lightBuffer, vkDestroyBuffer);
+	VK_DESTROY(context->device, context->clusterBufferMemory, vkFreeMemory);
+	VK_DESTROY(context->device, context->clusterBuffer, vkDestroyBuffer);
+	VK_DESTROY(context->device, context->lightIndexBufferMemory, vkFreeMemory);
+	VK_DESTROY(context->device, context->lightIndexBuffer, vkDestroyBuffer);
+	VK_DESTROY(context->device, context->shadowCasterBufferMemory,
+		vkFreeMemory);
+	VK_DESTROY(context->device, context->shadowCasterBuffer, vkDestroyBuffer);
 
-	VK_DESTROY(context->device, context->mvpUniformBufferMemory, vkFreeMemory);
-	VK_DESTROY(context->device, context->mvpUniformBuffer, vkDestroyBuffer);
+	VK_DESTROY(context->device, context->visibilityBufferMemory, vkFreeMemory);
+	VK_DESTROY(context->device, context->visibilityBuffer, vkDestroyBuffer);
 
-	VK_DESTROY(context->device, context->indexBufferMemory, vkFreeMemory);
-	VK_DESTROY(context->device, context->indexBuffer, vkDestroyBuffer);
+	VK_DESTROY(context->device, context->meshletBufferMemory, vkFreeMemory);
+	VK_DESTROY(context->device, context->meshletBuffer, vkDestroyBuffer);
 
-	VK_DESTROY(context->device, context->vertexBufferMemory, vkFreeMemory);
-	VK_DESTROY(context->device, context->vertexBuffer, vkDestroyBuffer);
+	VK_DESTROY(context->device, context->drawCountBufferMemory, vkFreeMemory);
+	VK_DESTROY(context->device, context->drawCountBuffer, vkDestroyBuffer);
 
-	VK_DESTROY(context->device, context->textureSampler, vkDestroySampler);
+	VK_DESTROY(context->device, context->indirectBufferMemory, vkFreeMemory);
+	VK_DESTROY(context->device, context->indirectBuffer, vkDestroyBuffer);
 
-	VK_DESTROY(context->device, context->textureImageView, vkDestroyImageView);
-	VK_DESTROY(context->device, context->textureImageMemory, vkFreeMemory);
-	VK_DESTROY(context->device, context->textureImage, vkDestroyImage);
+	VK_DESTROY(context->device, context->visibleInstanceBufferMemory,
+		vkFreeMemory);
+	VK_DESTROY(context->device, context->visibleInstanceBuffer,
+		vkDestroyBuffer);
 
-	VK_DESTROY(context->device, context->depthImageView, vkDestroyImageView);
-	VK_DESTROY(context->device, context->depthImageMemory, vkFreeMemory);
-	VK_DESTROY(context->device, context->depthImage, vkDestroyImage);
+	VK_DESTROY(context->device, context->instanceBufferMemory, vkFreeMemory);
+	VK_DESTROY(context->device, context->instanceBuffer, vkDestroyBuffer);
+	VK_DESTROY(context->device, context->instanceStagingBufferMemory,
+		vkFreeMemory);
+	VK_DESTROY(context->device, context->instanceStagingBuffer,
+		vkDestroyBuffer);
 
-	VK_DESTROY(context->device, context->commandPool, vkDestroyCommandPool);
 
-	for (uint32_t i = 0; i < context->imageViewCount; ++i) {
-		VK_DESTROY(context->device, context->swapChainFramebuffers[i],
+	VK_DESTROY(context->device, context->shadowSampler, vkDestroySampler);
+	for (uint32_t i = 0; i < CUBE_FACES; ++i) {
+		VK_DESTROY(context->device, context->shadowCacheFramebuffers[i],
 			vkDestroyFramebuffer);
+		VK_DESTROY(context->device, context->shadowFramebuffers[i],
+			vkDestroyFramebuffer);
+		VK_DESTROY(context->device, context->shadowCacheFaceViews[i],
+			vkDestroyImageView);
+		VK_DESTROY(context->device, context->shadowMapFaceViews[i],
+			vkDestroyImageView);
+	}
+	VK_DESTROY(context->device, context->shadowMapView, vkDestroyImageView);
+	VK_DESTROY(context->device, context->shadowMapMemory, vkFreeMemory);
+	VK_DESTROY(context->device, context->shadowMap, vkDestroyImage);
+	VK_DESTROY(context->device, context->shadowCacheMemory, vkFreeMemory);
+	VK_DESTROY(context->device, context->shadowCache, vkDestroyImage);
+
+	destroySizedResources(context);
+	if (context->frameGraph) {
+		destroyRenderGraph(context->frameGraph);
+		free(context->frameGraph);
+	}
+
+	VK_DESTROY(context->device, context->commandPool, vkDestroyCommandPool);
+	VK_DESTROY(context->device, context->timestampPool, vkDestroyQueryPool);
+	if (context->scheduler) {
+		destroyQueueScheduler(context->scheduler);
+		free(context->scheduler);
 	}
-	free(context->swapChainFramebuffers);
 
-	VK_DESTROY(context->device, context->graphicsPipeline, vkDestroyPipeline);
+	VK_DESTROY(context->device, context->bloomPipeline, vkDestroyPipeline);
+	VK_DESTROY(context->device, context->tonemapPipeline, vkDestroyPipeline);
+	VK_DESTROY(context->device, context->postPipelineLayout,
+		vkDestroyPipelineLayout);
+	VK_DESTROY(context->device, context->postDescriptorSetLayout,
+		vkDestroyDescriptorSetLayout);
+	VK_DESTROY(context->device, context->bloomShaderModule,
+		vkDestroyShaderModule);
+	VK_DESTROY(context->device, context->tonemapShaderModule,
+		vkDestroyShaderModule);
+	VK_DESTROY(context->device, context->postSampler, vkDestroySampler);
+
+	VK_DESTROY(context->device, context->depthReducePipeline,
+		vkDestroyPipeline);
+	VK_DESTROY(context->device, context->depthReducePipelineLayout,
+		vkDestroyPipelineLayout);
+	VK_DESTROY(context->device, context->depthReduceDescriptorSetLayout,
+		vkDestroyDescriptorSetLayout);
+	VK_DESTROY(context->device, context->depthReduceShaderModule,
+		vkDestroyShaderModule);
+
+	VK_DESTROY(context->device, context->lightingPipeline, vkDestroyPipeline);
+	VK_DESTROY(context->device, context->lightingPipelineLayout,
+		vkDestroyPipelineLayout);
+	VK_DESTROY(context->device, context->gBufferDescriptorSetLayout,
+		vkDestroyDescriptorSetLayout);
+	VK_DESTROY(context->device, context->lightingVertShaderModule,
+		vkDestroyShaderModule);
+	VK_DESTROY(context->device, context->lightingFragShaderModule,
+		vkDestroyShaderModule);
+	VK_DESTROY(context->device, context->gBufferSampler, vkDestroySampler);
+
+	VK_DESTROY(context->device, context->cullPipeline, vkDestroyPipeline);
+	VK_DESTROY(context->device, context->cullPipelineLayout,
+		vkDestroyPipelineLayout);
+	VK_DESTROY(context->device, context->cullDescriptorSetLayout,
+		vkDestroyDescriptorSetLayout);
+	VK_DESTROY(context->device, context->cullShaderModule,
+		vkDestroyShaderModule);
+
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i) {
+		VK_DESTROY(context->device, context->prepassPipelines[i],
+			vkDestroyPipeline);
+		VK_DESTROY(context->device, context->equalPipelines[i],
+			vkDestroyPipeline);
+	}
 	VK_DESTROY(context->device, context->pipelineLayout, vkDestroyPipelineLayout);
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i) {
+		VK_DESTROY(context->device, context->shadowPipelines[i],
+			vkDestroyPipeline);
+	}
+	VK_DESTROY(context->device, context->shadowPipelineLayout,
+		vkDestroyPipelineLayout);
 
 	VK_DESTROY(context->device, context->descriptorSetLayout,
 		vkDestroyDescriptorSetLayout);
 
+	VK_DESTROY(context->device, context->lateRenderPass, vkDestroyRenderPass);
 	VK_DESTROY(context->device, context->renderPass, vkDestroyRenderPass);
-
-	VK_DESTROY(context->device, context->vertShaderModule, vkDestroyShaderModule);
+	VK_DESTROY(context->device, context->prepassedRenderPass,
+		vkDestroyRenderPass);
+	VK_DESTROY(context->device, context->prepassRenderPass,
+		vkDestroyRenderPass);
+	VK_DESTROY(context->device, context->lightingRenderPass,
+		vkDestroyRenderPass);
+	VK_DESTROY(context->device, context->shadowCacheRenderPass,
+		vkDestroyRenderPass);
+	VK_DESTROY(context->device, context->shadowRenderPass,
+		vkDestroyRenderPass);
+
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i) {
+		VK_DESTROY(context->device, context->vertShaderModules[i],
+			vkDestroyShaderModule);
+		VK_DESTROY(context->device, context->depthVertShaderModules[i],
+			vkDestroyShaderModule);
+	}
 	VK_DESTROY(context->device, context->fragShaderModule, vkDestroyShaderModule);
-
-	for (uint32_t i = 0; i < context->imageViewCount; ++i) {
-		VK_DESTROY(context->device, context->swapChainImageViews[i], vkDestroyImageView);
+	for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i) {
+		VK_DESTROY(context->device, context->shadowVertShaderModules[i],
+			vkDestroyShaderModule);
 	}
-	free(context->swapChainImageViews);
+	VK_DESTROY(context->device, context->shadowFragShaderModule,
+		vkDestroyShaderModule);
+
+	free(context->swapChainImages);
 
 	VK_DESTROY(context->device, context->swapChain, vkDestroySwapchainKHR);
 
@@ -17,9 +17,47 @@
 
 #pragma once
 
+#include "draw-list.h"
 #include "vulkan-types.h"
 
-int initVulkan(GLFWwindow *window, VkContext *context, int vsync);
+int initVulkan(GLFWwindow *window, VkContext *context, const Mesh* const mesh,
+			   const InstanceData* const instances, uint32_t instanceCount,
+			   CullingMode cullingMode, ShadingMode shadingMode,
+			   int asyncCompute, int vsync, JobSystem *jobSystem,
+			   uint32_t recordThreads, uint32_t maxLights);
 void destroyVulkan(const VkContext* const context);
-void drawFrame(const VkContext* const context);
+
+// Recreates the swap chain and the attachments for the window's current
+// framebuffer size, which must not be empty, and renders at full scale
+// again. Pipelines are kept. Returns nonzero on success.
+int resizeSwapChain(GLFWwindow *window, VkContext *context);
+
+// Adds the indirect draws of the context's mesh
+void addSceneDraws(const VkContext* const context, DrawList *drawList);
+
+// Adds one direct draw per visible instance of each LOD, as listed by
+// updateVisibleInstances(), or per instance when visibleCounts is NULL.
+// Only meant for culling on the CPU or no culling.
+void addInstanceDraws(const VkContext* const context, DrawList *drawList,
+					  const uint32_t* const visibleCounts);
+
+// Records culling, the render passes drawing the list and post-processing
+// into the frame's command buffers, targeting the given swapchain image.
+// Each batch of the frame graph gets a command buffer of its queue, see
+// frameGraph->batches. Render passes with enough draws are split over the
+// frame's recording threads. Returns the number of batches, or 0 on failure.
+uint32_t recordFrame(const VkContext* const context,
+					 const FrameResources* const frame, uint32_t imageIndex,
+					 const DrawList* const drawList);
+
+// Records commands into a temporary command buffer, then submits them to
+// the transfer queue without waiting. Frames wait for the transfer queue
+// before their first batch, and the command buffer is freed once the
+// submission retires. Whatever the commands read must outlive them the same
+// way, see getQueuePoint().
+VkCommandBuffer beginSingleTimeCommands(VkDevice device,
+										VkCommandPool commandPool);
+int endSingleTimeCommands(VkCommandBuffer commandBuffer,
+						  VkCommandPool commandPool,
+						  DestructionQueue *destructionQueue);
 
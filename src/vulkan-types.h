@@ -19,45 +19,340 @@
 
 #include <vulkan/vulkan.h>
 
+#include "bvh.h"
+#include "destruction-queue.h"
+#include "jobs.h"
+#include "queue-scheduler.h"
+#include "render-graph.h"
+#include "resource-registry.h"
+#include "scene-graph.h"
+
+// Enough for a 65536 pixel wide depth attachment
+#define MAX_DEPTH_PYRAMID_LEVELS 16
+#define MAX_BLOOM_LEVELS 5
+#define MAX_MESH_LODS 4
+#define MAX_FRAMES_IN_FLIGHT 2
+#define MAX_RECORD_THREADS 8
+#define CUBE_FACES 6
+
+typedef enum _VertexFormat {
+	VERTEX_FORMAT_FULL,
+	VERTEX_FORMAT_PACKED,
+	VERTEX_FORMAT_COUNT
+} VertexFormat;
+
+typedef enum _CullingMode {
+	CULLING_NONE,
+	CULLING_CPU,
+	CULLING_GPU,
+	CULLING_MESHLETS,
+	CULLING_OCCLUSION
+} CullingMode;
+
+typedef enum _ShadingMode {
+	SHADING_FORWARD, // Lights each fragment as it is drawn
+	SHADING_DEFERRED // Lights each pixel once, from a G-buffer
+} ShadingMode;
+
+// Queues of the scheduler. The frame graph's passes run on the first
+// MAX_GRAPH_QUEUES, one-time uploads on the transfer queue. Without async
+// compute, the compute passes run on the graphics queue too.
+typedef enum _FrameQueue {
+	FRAME_QUEUE_GRAPHICS,
+	FRAME_QUEUE_COMPUTE,
+	FRAME_QUEUE_TRANSFER,
+	FRAME_QUEUE_COUNT
+} FrameQueue;
+
+typedef struct _FrameStats {
+	CullingMode cullingMode;
+	uint32_t instanceCount, visibleInstances, meshletCount, visibleMeshlets;
+	uint32_t lateInstances, occludedInstances;
+	uint64_t triangleCount; // Submitted for drawing
+	double cullMs, recordMs;
+	uint32_t drawCount, recordThreadCount;
+	uint32_t lightCount, lightEntries; // Entries over all cluster lists
+	double lightGridMs;
+	uint32_t dynamicCasters, shadowCacheRenders;
+	int depthPrepass;
+	double gpuMs, gpuIntervalMs;
+	uint32_t renderWidth, renderHeight;
+	ShadingMode shadingMode;
+	int asyncCompute;
+} FrameStats;
+
+// Written by the culling compute shaders. Only meshlet culling counts the
+// triangles it submits.
+typedef struct _CullCounts {
+	uint32_t drawCount, visibleInstanceCount, occludedInstanceCount;
+	uint32_t triangleCount;
+} CullCounts;
+
+typedef struct _Vertex {
+	float pos[3], tangent[3], bitangent[3], normal[3], texCoord[2];
+} Vertex;
+
+// Compact 20-byte vertex. Positions are snorm16 relative to the mesh bounds,
+// the tangent frame is a snorm16 QTangent whose w sign holds the bitangent
+// handedness, and texture coordinates are half floats.
+typedef struct _PackedVertex {
+	int16_t pos[4], qtangent[4];
+	uint16_t texCoord[2];
+} PackedVertex;
+
+// Pushed to the packed vertex shader to decode positions
+typedef struct _MeshBounds {
+	float center[4], extent[4];
+} MeshBounds;
+
+// Per-instance data, read from a storage buffer by the vertex shaders. The
+// per-instance vertex stream only carries indices of visible instances.
+typedef struct _InstanceData {
+	float model[16];
+	uint32_t material, padding[3];
+} InstanceData;
+
+// Lights shade the pixels within radius of their position, falling off to
+// zero at the radius. Matches the std430 layout in shader.frag.
+typedef struct _PointLight {
+	float position[3], radius;
+	float color[4];
+} PointLight;
+
+// Cluster of up to MESHLET_MAX_VERTICES vertices and MESHLET_MAX_TRIANGLES
+// triangles, stored as a contiguous range of the index buffer. The normal
+// cone cutoff is 1 when the cluster can't be backface culled. Matches the
+// std430 layout in cull-meshlets.comp.
+typedef struct _Meshlet {
+	float sphere[4]; // Center and radius
+	float cone[4]; // Axis and cutoff
+	uint32_t firstIndex, indexCount, padding[2];
+} Meshlet;
+
+// Range of the shared index buffer drawn at a level of detail. The error
+// bounds its deviation from the full mesh, in mesh units.
+typedef struct _MeshLod {
+	uint32_t firstIndex, indexCount;
+	float error;
+} MeshLod;
+
+// Where a mesh landed in a geometry pool. Draws of the mesh add
+// firstIndex to their own index ranges and pass vertexOffset.
+typedef struct _GeometryRange {
+	int32_t vertexOffset;
+	uint32_t firstIndex;
+} GeometryRange;
+
+// Device-local vertex and index buffers shared by every mesh of a vertex
+// format, so any number of meshes draw with a single bind. Meshes are
+// appended and stay until the pool is destroyed, and a full pool moves to
+// larger buffers. The position buffer holds just the vertex positions, in
+// the same order, for depth-only passes.
+typedef struct _GeometryPool {
+	BufferHandle vertexBuffer, positionBuffer, indexBuffer;
+	VkDeviceSize vertexStride, positionStride;
+	uint32_t vertexCapacity, indexCapacity, vertexCount, indexCount;
+} GeometryPool;
+
+// The index buffer holds every LOD, so indexCount covers all of them
+typedef struct _Mesh {
+	VertexFormat format;
+	uint32_t vertexCount, indexCount;
+	Vertex *vertices;
+	PackedVertex *packedVertices;
+	uint32_t *indices;
+	MeshBounds bounds;
+	Meshlet *meshlets;
+	uint32_t meshletCount;
+	MeshLod lods[MAX_MESH_LODS];
+	uint32_t lodCount;
+} Mesh;
+
+// Recording state of one frame in flight. The command pools are reset as a
+// whole once the frame's last submission is done; it waits for the
+// frame's other batches, so it retires the whole frame. Each
+// batch of the frame graph is recorded into a primary command buffer from
+// the pool of its queue. Each range of draws recorded in parallel gets a
+// pool, since pools can't be used concurrently. The depth prepass has its
+// own secondaries, since the main pass's are recorded before the frame is
+// submitted.
+typedef struct _FrameResources {
+	VkCommandPool commandPools[MAX_GRAPH_QUEUES];
+	VkCommandBuffer commandBuffers[MAX_GRAPH_QUEUES][MAX_GRAPH_BATCHES];
+	VkCommandPool threadPools[MAX_RECORD_THREADS];
+	VkCommandBuffer secondaryBuffers[MAX_RECORD_THREADS],
+		prepassBuffers[MAX_RECORD_THREADS];
+	uint32_t timestampQuery; // First of the frame's two timestamps
+	int timed; // Its timestamps are written once the frame retires
+	QueuePoint retirePoint;
+	VkSemaphore imageAvailableSemaphore, renderFinishedSemaphore;
+} FrameResources;
+
 typedef struct _VkContext {
 	VkInstance instance;
+	uint32_t apiVersion; // 1.2 when the loader supports it
+	// VK_KHR_get_physical_device_properties2 is enabled on the instance
+	int physicalDeviceProperties2;
 	VkPhysicalDevice physicalDevice;
 	VkDevice device;
 	VkSurfaceFormatKHR surfaceFormat;
 	VkSurfaceKHR surface;
 	VkSwapchainKHR swapChain;
-	uint32_t imageViewCount;
-	VkImageView *swapChainImageViews;
-	VkShaderModule vertShaderModule, fragShaderModule;
-	VkRenderPass renderPass;
+	uint32_t swapChainImageCount;
+	VkImage *swapChainImages; // Blitted to from the color image
+	int vsync;
+	// Set when presenting reports the swap chain no longer matches the
+	// surface, until resizeSwapChain() recreates it
+	int swapChainOutOfDate;
+	VkShaderModule vertShaderModules[VERTEX_FORMAT_COUNT], fragShaderModule;
+	VkRenderPass renderPass, lateRenderPass;
 	VkPipelineLayout pipelineLayout;
 	VkDescriptorSetLayout descriptorSetLayout;
-	VkPipeline graphicsPipeline;
-	VkFramebuffer *swapChainFramebuffers;
-	VkCommandPool commandPool;
-	VkCommandBuffer *commandBuffers;
-	VkSemaphore imageAvailableSemaphore, renderFinishedSemaphore;
-	VkQueue presentQueue, graphicsQueue;
-	VkBuffer vertexBuffer, indexBuffer, mvpUniformBuffer,
-		sceneAttributesUniformBuffer;
-	VkDeviceMemory vertexBufferMemory, indexBufferMemory,
-		mvpUniformBufferMemory, sceneAttributesUniformBufferMemory,
-		textureImageMemory, depthImageMemory;
+	PipelineHandle graphicsPipelines[VERTEX_FORMAT_COUNT];
+	VkShaderModule depthVertShaderModules[VERTEX_FORMAT_COUNT];
+	VkRenderPass prepassRenderPass, prepassedRenderPass;
+	VkPipeline prepassPipelines[VERTEX_FORMAT_COUNT],
+		equalPipelines[VERTEX_FORMAT_COUNT];
+	VkFramebuffer prepassFramebuffer;
+	VkShaderModule cullShaderModule;
+	VkDescriptorSetLayout cullDescriptorSetLayout;
+	VkPipelineLayout cullPipelineLayout;
+	VkPipeline cullPipeline;
+	VkDescriptorSet cullDescriptorSet;
+	VkShaderModule depthReduceShaderModule;
+	VkDescriptorSetLayout depthReduceDescriptorSetLayout;
+	VkPipelineLayout depthReducePipelineLayout;
+	VkPipeline depthReducePipeline;
+	VkDescriptorSet depthReduceDescriptorSets[MAX_DEPTH_PYRAMID_LEVELS];
+	VkShaderModule shadowVertShaderModules[VERTEX_FORMAT_COUNT],
+		shadowFragShaderModule;
+	VkRenderPass shadowCacheRenderPass, shadowRenderPass;
+	VkPipelineLayout shadowPipelineLayout;
+	VkPipeline shadowPipelines[VERTEX_FORMAT_COUNT];
+	VkFramebuffer shadowCacheFramebuffers[CUBE_FACES],
+		shadowFramebuffers[CUBE_FACES];
+	// Deferred shading draws albedo and normals into the G-buffer, then
+	// lights each pixel once in a fullscreen pass into the color image
+	ShadingMode shadingMode;
+	VkShaderModule lightingVertShaderModule, lightingFragShaderModule;
+	VkRenderPass lightingRenderPass;
+	VkDescriptorSetLayout gBufferDescriptorSetLayout;
+	VkPipelineLayout lightingPipelineLayout;
+	VkPipeline lightingPipeline;
+	VkDescriptorSet gBufferDescriptorSet;
+	VkSampler gBufferSampler;
+	VkFramebuffer lightingFramebuffer;
+	// Frames render in HDR. The bloom chain is downsampled from the
+	// brightest parts of the color image, then added back by tonemapping,
+	// which leaves displayable colors in the color image for the blit.
+	VkShaderModule bloomShaderModule, tonemapShaderModule;
+	VkDescriptorSetLayout postDescriptorSetLayout;
+	VkPipelineLayout postPipelineLayout;
+	VkPipeline bloomPipeline, tonemapPipeline;
+	VkDescriptorSet bloomDescriptorSets[MAX_BLOOM_LEVELS],
+		tonemapDescriptorSet;
+	VkImage bloomImage;
+	VkDeviceMemory bloomImageMemory;
+	VkImageView bloomImageView, bloomMipViews[MAX_BLOOM_LEVELS];
+	uint32_t bloomLevels;
+	VkSampler postSampler;
+	PFN_vkCmdDrawIndexedIndirectCountKHR vkCmdDrawIndexedIndirectCount;
+	VkFramebuffer framebuffer;
+	// Orders the frame's passes and synchronizes them, and owns the color
+	// and depth attachments
+	RenderGraph *frameGraph;
+	VkCommandPool commandPool; // For one-time uploads
+	FrameResources frames[MAX_FRAMES_IN_FLIGHT];
+	uint32_t frameIndex;
+	JobSystem *jobSystem; // Records command buffers
+	uint32_t recordThreadCount; // Most secondaries a render pass is split in
+	double recordMs; // CPU time spent recording the last frame
+	VkQueue presentQueue; // Submissions go through the scheduler
+
+	// Async compute runs the post-processing passes on a compute-only
+	// queue, overlapping the next frame's first passes. Uploads get a queue
+	// of the graphics family of their own when it has one. Both need
+	// timeline semaphores.
+	int asyncCompute, timelineSemaphores;
+	uint32_t queueFamilies[FRAME_QUEUE_COUNT];
+	QueueScheduler *scheduler;
+	DestructionQueue *destructionQueue; // Collected every frame
+	// Owns the cube's buffers, texture, sampler and pipelines
+	ResourceRegistry *registry;
+	GeometryPool geometryPools[VERTEX_FORMAT_COUNT];
+	GeometryRange meshGeometry;
+	VkBuffer instanceBuffer, instanceStagingBuffer, visibleInstanceBuffer,
+		indirectBuffer, drawCountBuffer, meshletBuffer, visibilityBuffer,
+		lightBuffer, clusterBuffer, lightIndexBuffer, shadowCasterBuffer;
+	VkDeviceMemory instanceBufferMemory, instanceStagingBufferMemory,
+		visibleInstanceBufferMemory, indirectBufferMemory,
+		drawCountBufferMemory, meshletBufferMemory, visibilityBufferMemory,
+		lightBufferMemory, clusterBufferMemory, lightIndexBufferMemory,
+		shadowCasterBufferMemory, depthPyramidMemory, shadowCacheMemory,
+		shadowMapMemory;
+	BufferHandle mvpUniformBuffer, sceneAttributesUniformBuffer;
 	VkDescriptorPool descriptorPool;
 	VkDescriptorSet descriptorSet;
-	VkImage textureImage, depthImage;
-	VkImageView textureImageView, depthImageView;
-	VkSampler textureSampler;
+	ImageHandle texture;
+	VkImage depthPyramid, shadowCache, shadowMap;
+	// Transient images of the frame graph
+	VkImage colorImage, depthImage;
+	VkImageView depthPyramidView, colorImageView, depthImageView,
+		depthPyramidMipViews[MAX_DEPTH_PYRAMID_LEVELS],
+		shadowCacheFaceViews[CUBE_FACES], shadowMapFaceViews[CUBE_FACES],
+		shadowMapView;
+	uint32_t depthPyramidLevels;
+	VkFormat shadowFormat;
+	SamplerHandle textureSampler;
+	VkSampler depthPyramidSampler, shadowSampler;
 	VkExtent2D extent;
+
+	// Frames render into the top left renderExtent of the color and depth
+	// images, sized to extent, and are scaled up into the swap chain
+	VkExtent2D renderExtent;
+
+	// Brackets each frame's commands with timestamps when the queue
+	// supports them. gpuMs is the time between them in the last frame
+	// read, and gpuIntervalMs the time since the end of the frame before,
+	// which is what overlapping frames shortens.
+	VkQueryPool timestampPool;
+	float timestampPeriod; // Nanoseconds per tick
+	double gpuMs, gpuIntervalMs;
+	uint64_t lastGpuEnd;
+
+	const Mesh *mesh;
+	const InstanceData *instances;
+	uint32_t instanceCount, maxLights;
+	CullingMode cullingMode;
+	uint32_t maxDrawCount; // Indirect commands the culling pass may emit
+
+	// Lays down depth before the main pass, which then only shades the
+	// fragments with an equal depth. Can change between frames.
+	int depthPrepass;
+
+	// Shadow casters of the scene light, set by updateShadowCasters(). The
+	// cached map of static casters is redrawn when staticDirty, and the
+	// shadow map rebuilt from it when mapDirty.
+	float shadowLightPos[3];
+	uint32_t shadowStaticCount, shadowDynamicCount;
+	int shadowStaticDirty, shadowMapDirty;
+
+	// Indirect draws select their visible instance range through
+	// firstInstance rather than a rebind of the instance stream
+	VkBool32 firstInstanceDraws;
 } VkContext;
 
 typedef struct _MVPMatrices {
 	float model[16], view[16], proj[16];
 } MVPMatrices;
 
+// lightPos and lightColor set the first light of the light grid. The
+// cluster scale and counts come from getLightGridParams().
 typedef struct _SceneAttributes {
 	float ambientColor[4], diffuseColor[4], specularColor[4], eyePos[4],
-		lightPos[4], lightColor[4], specularExp;
+		lightPos[4], lightColor[4], clusterScale[4];
+	uint32_t clusterCounts[4];
+	float specularExp;
 } SceneAttributes;
 
 typedef struct _UBOAttributes {
@@ -65,9 +360,13 @@ typedef struct _UBOAttributes {
 	SceneAttributes sceneAttributes;
 	float pitch, yaw;
 	double lastCursorX, lastCursorY;
-} UBOAttributes;
 
-typedef struct _Vertex {
-	const float pos[3], tangent[3], bitangent[3], normal[3], texCoord[2];
-} Vertex;
+	// Node rotated by the mouse; the model matrix stays identity. Dragging
+	// over an instance found in the BVH rotates instance i's node,
+	// firstInstanceNode + i, instead. pickedNode is the node being dragged.
+	SceneGraph *sceneGraph;
+	uint32_t modelNode, firstInstanceNode, pickedNode;
+	const Bvh *bvh;
+	int depthPrepass; // Toggled from the console
+} UBOAttributes;
 